@@ -41,17 +41,107 @@
  * <https://www.gnu.org/licenses/>. 
  */
 
+/*
+ * The stage timings use the POSIX monotonic clock where there is one,
+ * and server mode uses open_memstream(); glibc hides them from strict
+ * C99 builds unless they are asked for.
+ */
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+/*
+ * Compiling with -DMOODY_MCU leaves only the fixed-point computation
+ * of moody_fixed_compute(), for a microcontroller next to the level:
+ * it needs no C library at all, not even for floating point.
+ */
+#ifdef MOODY_MCU
+#define MOODY_LIBRARY
+#endif
+
+/* the library interface, see moody_compute() and moody_fixed_compute() */
+#include "moody.h"
+
+#ifndef MOODY_MCU
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/*
+ * stat(), for --incremental, is POSIX and also in the Windows C runtime;
+ * mkdir(), for -G, is POSIX
+ */
+#include <sys/stat.h>
+
+/*
+ * Batch mode (see run_batch) can process plates on a pool of worker
+ * threads. This needs POSIX threads, so it is only enabled when
+ * compiling with
+ *   cc -DMOODY_THREADS -o moody moody.c -lm -lpthread
+ * Without MOODY_THREADS the plates of a batch are processed one after
+ * the other, and the code remains plain standard C. Server mode (see
+ * run_server) also needs POSIX sockets, and is only available with
+ * MOODY_THREADS.
+ */
+#ifdef MOODY_THREADS
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#endif
 
-/* maximum number of stations along any of the 8 lines */
-#define MAX_STATIONS 128
+/*
+ * Number of plates, or Monte Carlo trials, computed together by the
+ * batched worksheet kernel (see correct_lanes), one per SIMD lane.
+ * The kernel is standard C whose innermost loops run over the lanes,
+ * so that the compiler vectorizes them: 8 lanes suit AVX2 and NEON
+ * (two registers), and -DMOODY_LANES=16 with -O3 -march=native suits
+ * AVX-512.
+ */
+#ifndef MOODY_LANES
+#define MOODY_LANES 8
+#endif
+
+/*
+ * Scalar type of the worksheets, chosen when compiling with
+ *   -DMOODY_PRECISION=MOODY_FLOAT    float, as Moody's tables (default)
+ *   -DMOODY_PRECISION=MOODY_DOUBLE   double
+ *   -DMOODY_PRECISION=MOODY_KAHAN    float, with compensated sums
+ * The compensated variant costs little over float, but keeps the
+ * running sums of columns 4 and 5 accurate on long lines. Readings,
+ * foot spacing and binary output remain single precision.
+ */
+#define MOODY_FLOAT 0
+#define MOODY_DOUBLE 1
+#define MOODY_KAHAN 2
+#ifndef MOODY_PRECISION
+#define MOODY_PRECISION MOODY_FLOAT
+#endif
+#if MOODY_PRECISION == MOODY_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#endif
 
-/* maximum number of charcters on any of the input data files */
+/* maximum number of characters on a line of streamed input */
 #define MAX_LINELEN 1024
 
+/* maximum length of a path to any input or output file */
+#define MAX_PATHLEN 4096
+
 /* labels for the 8 different worksheets */
 /* the two diagonals */
 #define NW_SE 0
@@ -67,92 +157,858 @@
 #define E_W 6
 #define N_S 7
 
+/* output formats: Moody's tables, or machine-readable results */
+#define OUTPUT_TEXT 0
+#define OUTPUT_CSV 1
+#define OUTPUT_JSON 2
+#define OUTPUT_BINARY 3
+
+/* warnings raised by the consistency checks, see warning_text[] */
+#define WARN_DIAGONALS MOODY_WARN_DIAGONALS
+#define WARN_LINES_EW MOODY_WARN_LINES_EW
+#define WARN_LINES_NS MOODY_WARN_LINES_NS
+#define WARN_PYTHAGORAS_NW_SE MOODY_WARN_PYTHAGORAS_NW_SE
+#define WARN_PYTHAGORAS_NE_SW MOODY_WARN_PYTHAGORAS_NE_SW
+#define WARN_CENTER MOODY_WARN_CENTER
+#define NUM_WARNINGS 6
+
+/* labels for the four corners of the plate */
+#define NE 0
+#define SE 1
+#define SW 2
+#define NW 3
+
 /* Input data file names */
 const char *filenames[]={"NW_SE.txt", "NE_SW.txt",
 			 "NE_NW.txt", "NE_SE.txt",
 			 "SE_SW.txt", "NW_SW.txt",
 			 "E_W.txt", "N_S.txt"};
-/* 
- * Main data structure, contains worksheets as done by Moody.
- * First index is which table (0-7)
- * Second index is which column (0-8)
- * Third index is which station (0-max)
- *
- * For center line tables, Moody column 6a is stored in column 6
- * and Moody column 6 is stored in column 9.
- * Other tables do not use column 9.
- * Note that we index from zero, so column 1 has index 0.
-*/
-float ws[8][9][MAX_STATIONS];
+/* Short descriptions of the WARN_ flags, for machine-readable output */
+const char *warning_text[NUM_WARNINGS]={
+   "diagonals have different numbers of stations",
+   "lines NE_NW, SE_SW and E_W have different numbers of stations",
+   "lines NE_SE, NW_SW and N_S have different numbers of stations",
+   "NE_NW, NE_SE and NW_SE station counts deviate from Pythagoras",
+   "SE_SW, NW_SW and NE_SW station counts deviate from Pythagoras",
+   "center line heights exceed Moody's limit of 2.54 microns"
+};
+
+/* Names of the worksheet columns ws[i][0] to ws[i][8] in machine-readable output */
+const char *column_names[9]={
+   "station", "auto_corr", "angle_displ", "sum_displ", "cumul_corr",
+   "delta_datum", "delta_base_arcsec", "delta_base_height", "error_shift_out"
+};
+
+/*
+ * One arc second in radians. The float build keeps the value of pi
+ * that this program always used, so that its output does not change.
+ */
+#if MOODY_PRECISION == MOODY_FLOAT
+const real arcsec = 2.0*3.141592/(360.0*60*60);
+#else
+const real arcsec = 2.0*3.14159265358979323846/(360.0*60*60);
+#endif
+
+/* Stages of the computation of a plate, timed for --timings and --stats */
+#define STAGE_CONFIG 0   /* Config.txt */
+#define STAGE_READ 1     /* the eight data files, or the bundle */
+#define STAGE_SOLVE 2    /* columns 1 to 8, checks, height map, Monte Carlo */
+#define STAGE_TABLES 3   /* Moody's tables */
+#define STAGE_RESULTS 4  /* machine-readable results */
+#define STAGE_GNUPLOT 5  /* gnuplot files */
+#define NUM_STAGES 6
+
+const char *stage_names[NUM_STAGES]={
+   "config", "read", "solve", "tables", "results", "gnuplot"
+};
+
+/* Where the time of a plate went, and how much it read and wrote */
+struct moody_stats {
+   double seconds[NUM_STAGES];
+   long lines_parsed, comment_lines;
+   long bytes_read, bytes_written;
+   int warnings;
+   /* 1 if the results came from the --cache directory */
+   int cache_hits;
+};
+
+struct text_file {
+   char *buf;
+   size_t len;
+};
+
+/*
+ * Everything known about one plate. The stages of the computation
+ * only touch the plate they are given, so several plates can be
+ * processed at the same time, for example by the batch workers.
+ */
+struct moody_plate {
+   /*
+    * Main data structure, contains worksheets as done by Moody.
+    * First index is which table (0-7)
+    * Second index is which column (0-8)
+    * Third index is which station (0-num_dat)
+    *
+    * For center line tables, Moody column 6a is stored in column 6
+    * and Moody column 6 is stored in column 9.
+    * Other tables do not use column 9, and their ws[i][8] is NULL.
+    * Note that we index from zero, so column 1 has index 0.
+    *
+    * The columns point into a single allocation (arena), sized from
+    * the data that was read, with the columns of each worksheet
+    * stored one after the other.
+    */
+   real *ws[8][9];
+   real *arena;
+
+   /* Number of input data entries in each of the 8 worksheets */
+   int num_dat[8];
+
+   /*
+    * Angles read from the input files, before the worksheets are
+    * allocated: input[i][k] is station k+1 of line i, and room has
+    * been allocated for input_size[i] of them
+    */
+   float *input[8];
+   int input_size[8];
+
+   /*
+    * Stations may be measured by several samples, reduced to their
+    * reading by the method reduce (REDUCE_MEAN etc.), clipping at clip
+    * standard deviations, and taking samples of them per station if
+    * that is not zero, see read_angles(). input_sigma[i][k] is the
+    * standard error of input[i][k], from the scatter of its samples,
+    * with room for input_sigma_size[i]; NULL if the plate was read
+    * from a bundle.
+    */
+   int reduce, samples;
+   float clip;
+   float *input_sigma[8];
+   int input_sigma_size[8];
+
+   /*
+    * Stations need not be evenly spaced, see station_positions().
+    * spacing[i] is the foot spacing of line i from Config.txt, or zero
+    * for that of the plate. at[i][k] is the distance from the start of
+    * line i to the end of the step of reading input[i][k], from an "at"
+    * line of its data file, or negative if not given there; at[i] is
+    * NULL if the file has none, and has room for at_size[i]. pos[i][j] is
+    * the position of station index j along line i, in foot spacings
+    * of the plate, with room for pos_size[i]; pos[i] is NULL when
+    * station index j is at j, as in Moody's worksheets.
+    */
+   float spacing[8];
+   float *at[8];
+   int at_size[8];
+   real *pos[8];
+   int pos_size[8];
+
+   /*
+    * In streaming mode the worksheets grow as readings arrive, so
+    * each one has its own allocation lines[i], with room for
+    * capacity[i] stations in every column, instead of using the arena.
+    * carry[i] is the rounding error of its column 4 so far, see
+    * accumulate().
+    */
+   real *lines[8];
+   int capacity[8];
+   real carry[8];
+
+   /* Set to 1 for metric, 0 for imperial (inches) */
+   int metric;
+
+   /* Reflector foot spacing in either inches or mm */
+   float foot_spacing;
+
+   /*
+    * Foot spacing in the output units of column 8: microns for
+    * metric, 1/100,000 of an inch for imperial
+    */
+   real out_spacing;
+
+   /*
+    * Directory holding the input files of the plate, and where its
+    * output files are written. NULL means the current directory.
+    */
+   const char *dir;
+
+   /*
+    * If not NULL, the plate is read from this bundle file instead of
+    * Config.txt and the eight data files, and the names of its output
+    * files start with prefix (the bundle name without extension and a
+    * dot), so that several bundles can share a directory
+    */
+   const char *bundle_name;
+   struct text_file bundle;
+   const char *prefix;
+   char *names;
+
+   /*
+    * Set no_plot to 1 to skip the gnuplot files (server mode); they are
+    * written as plot_format (PLOT_TEXT or PLOT_BINARY) through
+    * plot_buffer, and as an image if image is not IMAGE_NONE
+    */
+   int no_plot;
+   int plot_format, image;
+   char *plot_buffer;
+   /* and as meshes if mesh is not MESH_NONE, heights exaggerated exaggerate times (0: to fit) */
+   int mesh;
+   float exaggerate;
+   /* and as a contour map if contours is not CONTOUR_NONE, see output_contours() (0: by default) */
+   int contours;
+   float contour_step, high_spot;
+   /* Moody's tables are formatted here, table_size bytes, see print_table() */
+   char *table_buffer;
+   size_t table_size;
+
+   /*
+    * Stream for the tables and commentary of the plate, or NULL if
+    * they are not wanted
+    */
+   FILE *report;
+
+   /* Machine-readable results (OUTPUT_CSV etc.) go to stream out */
+   int format;
+   FILE *out;
+
+   /*
+    * Summary of the results: the computed heights at the middle of the
+    * two center lines, the height of the highest point above the lowest
+    * one (in the output units of column 8), and the WARN_ flags raised
+    */
+   real center[2];
+   real flatness;
+   int warnings;
+
+   /*
+    * With zone set, the flatness by the minimum zone and by the
+    * least-squares plane, see plate_zone()
+    */
+   int zone;
+   float zone_flatness, lsq_flatness;
+
+   /*
+    * With diagnose set, the line to measure again: the one whose
+    * leaving out explains clearly more of the closure error than any
+    * other, if the closure is not acceptable (or -1). Also the
+    * fraction the best line explains, see diagnose_lines()
+    */
+   int diagnose;
+   int suspect;
+   float explained;
+
+   /*
+    * Dense height map interpolated from the eight lines, if grid_size
+    * is not zero: grid_ny rows of grid_nx heights, see build_height_map()
+    */
+   int grid_size;
+   int grid_nx, grid_ny;
+   float *grid;
+
+   /*
+    * If least_squares is set, columns 5 and 6 come from a network
+    * adjustment of all eight lines (solve_network) instead of Moody's
+    * sequential corrections, and residual[i][j] is the adjusted minus
+    * the measured height step from station j-1 to station j of line
+    * i, in the output units of column 8 (zero for j=0). The residual
+    * columns share one allocation, residuals.
+    */
+   int least_squares;
+   float *residual[8];
+   float *residuals;
+   float rms_residual, max_residual;
+
+   /*
+    * Monte Carlo uncertainty, if mc_trials is not zero: the whole
+    * computation is repeated mc_trials times by mc_workers threads
+    * (0 for one per core), with Gaussian noise of mc_sigma arc seconds
+    * (or if it is negative, of the standard error of each reading, from
+    * its samples) added to every reading and of mc_foot_sigma (in the units of the
+    * foot spacing) to the foot spacing, starting from seed mc_seed.
+    * mc_mean[i][j] and mc_spread[i][j] are the mean and standard
+    * deviation of column 8; the columns share one allocation, mc. The
+    * flatness has mean flat_mean and standard deviation flat_sigma, and
+    * 2.5%, 50% and 97.5% quantiles flat_quantile[].
+    */
+   int mc_trials, mc_workers;
+   float mc_sigma, mc_foot_sigma;
+   unsigned long long mc_seed;
+   float *mc_mean[8], *mc_spread[8];
+   float *mc;
+   float flat_mean, flat_sigma, flat_quantile[3];
+
+   /* Timings and counters, for --timings and --stats */
+   struct moody_stats stats;
+
+   /*
+    * With incremental set, the readings are kept in a state file for
+    * the next run, see keep_data(): state is its contents from the
+    * last run, if they can be used. file_size[i] and file_mtime[i]
+    * are those of the data file of line i when it was read, at time
+    * read_time, or -1 if unknown; bit i of kept is set if that file
+    * was not read because the state has its readings.
+    */
+   int incremental;
+   struct text_file state;
+   long long file_size[8], file_mtime[8], read_time;
+   int kept;
+
+   /*
+    * Directory of the result cache, or NULL for none, and 1 in cached
+    * once the results have been found there, see lookup_cache()
+    */
+   const char *cache_dir;
+   int cached;
+
+   /*
+    * History file of the calibrations, or NULL for none, and the id
+    * and date (yyyymmdd) under which the plate is recorded there, see
+    * record_history()
+    */
+   const char *history;
+   const char *plate_id;
+   long date;
+
+   /*
+    * In batch mode an error in one plate must not stop the others,
+    * so fail() jumps back to start_plate() or end_plate() instead of
+    * exiting.
+    */
+   jmp_buf *fail_jmp;
+   /* if set, plate_error() prints nothing, for the library interface */
+   int silent;
+};
+
+/*
+ * Allocate an empty plate whose files are in directory dir (NULL for
+ * the current directory), reporting to stream report. Returns NULL if
+ * out of memory.
+ */
+struct moody_plate *new_plate(const char *dir, FILE *report) {
+   struct moody_plate *p = calloc(1, sizeof(struct moody_plate));
+   if (p) {
+      p->metric = -1;
+      p->dir = dir;
+      p->report = report;
+   }
+   return p;
+}
+
+/* Command line options that apply to every plate */
+struct moody_options {
+   /* OUTPUT_TEXT for Moody's tables, or a machine-readable format */
+   int format;
+   /* skip the tables and commentary */
+   int quiet;
+   /* number of batch worker threads, 0 for one per core */
+   int num_workers;
+   /* points along the longer side of the height map, 0 for none */
+   int grid_size;
+   /* adjust the network of lines by least squares, see solve_network() */
+   int least_squares;
+   /* Monte Carlo trials, threads, noise and seed, see run_monte_carlo() */
+   int mc_trials, mc_workers;
+   float mc_sigma, mc_foot_sigma;
+   unsigned long long mc_seed;
+   /* reduction of several samples per station, see read_angles() */
+   int reduce, samples;
+   float clip;
+   /* print the timings and counters of each plate, and write them to stats */
+   int timings;
+   FILE *stats;
+   /* directory of the result cache, or NULL */
+   const char *cache;
+   /* calibration history file or NULL, plate id (NULL for the plate's name) and date */
+   const char *history;
+   const char *plate_id;
+   long date;
+   /* PLOT_TEXT or PLOT_BINARY gnuplot files, and an image (IMAGE_PNG etc.) */
+   int plot_format, image;
+   /* and meshes (MESH_GLTF or MESH_PLY), see output_mesh(), and a contour map (CONTOUR_SVG etc.) */
+   int mesh;
+   float exaggerate;
+   int contours;
+   float contour_step, high_spot;
+   /* also compute the minimum-zone flatness, see plate_zone() */
+   int zone;
+   /* look for the line and stations behind a closure error, see diagnose_lines() */
+   int diagnose;
+   /* take unchanged data files from the last run, see keep_data() */
+   int incremental;
+   /* in streaming mode, the instrument to read and its baud rate (0 to leave it), see acquire_stream() */
+   const char *device;
+   int baud;
+};
+
+/*
+ * Send the results of plate p to stream fp: Moody's tables and
+ * commentary, or in quiet mode a one-line summary, or the selected
+ * machine-readable format.
+ */
+void set_output(struct moody_plate *p, const struct moody_options *o, FILE *fp) {
+   p->format = o->format;
+   p->grid_size = o->grid_size;
+   p->least_squares = o->least_squares;
+   p->mc_trials = o->mc_trials;
+   p->mc_workers = o->mc_workers;
+   p->mc_sigma = o->mc_sigma;
+   p->reduce = o->reduce;
+   p->samples = o->samples;
+   p->clip = o->clip;
+   p->mc_foot_sigma = o->mc_foot_sigma;
+   p->mc_seed = o->mc_seed;
+   p->cache_dir = o->cache;
+   p->history = o->history;
+   p->plate_id = o->plate_id;
+   p->date = o->date;
+   p->plot_format = o->plot_format;
+   p->image = o->image;
+   p->mesh = o->mesh;
+   p->exaggerate = o->exaggerate;
+   p->contours = o->contours;
+   p->contour_step = o->contour_step;
+   p->high_spot = o->high_spot;
+   p->zone = o->zone;
+   p->diagnose = o->diagnose;
+   p->incremental = o->incremental;
+   if (o->format==OUTPUT_TEXT && !o->quiet) {
+      p->report = fp;
+      p->out = NULL;
+   } else {
+      p->report = NULL;
+      p->out = fp;
+   }
+   return;
+}
+
+/* Release a plate and everything it owns */
+void free_plate(struct moody_plate *p) {
+   int i;
+   if (!p) return;
+   for (i=0; i<8; i++) {
+      free(p->input[i]);
+      free(p->input_sigma[i]);
+      free(p->at[i]);
+      free(p->pos[i]);
+      free(p->lines[i]);
+   }
+   free(p->bundle.buf);
+   free(p->names);
+   free(p->grid);
+   free(p->residuals);
+   free(p->mc);
+   free(p->arena);
+   free(p->plot_buffer);
+   free(p->table_buffer);
+   free(p->state.buf);
+   free(p);
+   return;
+}
+
+/* Number of worksheet columns in use: the center lines also have 6a */
+int num_columns(int which_sheet) {
+   return which_sheet>5 ? 9 : 8;
+}
+
+/*
+ * Print tables or commentary for plate p, unless they are not wanted
+ * (quiet mode, or machine-readable output only)
+ */
+void report(struct moody_plate *p, const char *format, ...) {
+   va_list ap;
+   int n;
+   if (!p->report) return;
+   va_start(ap, format);
+   n = vfprintf(p->report, format, ap);
+   va_end(ap);
+   if (n > 0) p->stats.bytes_written += n;
+   return;
+}
+
+/* Write the n bytes at buf to the report of plate p, as report() would */
+void report_bytes(struct moody_plate *p, const char *buf, size_t n) {
+   if (!p->report) return;
+   p->stats.bytes_written += fwrite(buf, 1, n, p->report);
+   return;
+}
+
+/*
+ * Print an error message about plate p on stderr, as the other errors
+ * are, unless the plate is silent. The stages the library interface
+ * runs report their errors through this, and then fail().
+ */
+void plate_error(struct moody_plate *p, const char *format, ...) {
+   va_list ap;
+   if (p->silent) return;
+   va_start(ap, format);
+   vfprintf(stderr, format, ap);
+   va_end(ap);
+   return;
+}
+
+/* Close output file fp of plate p, counting what was written to it */
+void close_output(struct moody_plate *p, FILE *fp) {
+   long size = ftell(fp);
+   if (size > 0) p->stats.bytes_written += size;
+   fclose(fp);
+   return;
+}
+
+/* Seconds on a monotonic clock, or of CPU time where there is none */
+double wall_seconds(void) {
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+      return ts.tv_sec + 1e-9*ts.tv_nsec;
+#endif
+   return (double)clock()/CLOCKS_PER_SEC;
+}
+
+/* Add the time since *t to stage of plate p, and restart *t */
+void time_stage(struct moody_plate *p, int stage, double *t) {
+   double now = wall_seconds();
+   p->stats.seconds[stage] += now-*t;
+   *t = now;
+   return;
+}
+
+/* Give up on the current plate */
+void fail(struct moody_plate *p) {
+   if (p->fail_jmp) longjmp(*p->fail_jmp, 1);
+   exit(EXIT_FAILURE);
+}
+
+/* Build the path of file fname inside the plate directory */
+const char *plate_path(struct moody_plate *p, char *buf, const char *fname) {
+   const char *prefix = p->prefix ? p->prefix : "";
+   int len;
+   if (p->dir == NULL && *prefix == '\0') return fname;
+   if (p->dir)
+      len = snprintf(buf, MAX_PATHLEN, "%s/%s%s", p->dir, prefix, fname);
+   else
+      len = snprintf(buf, MAX_PATHLEN, "%s%s", prefix, fname);
+   if (len >= MAX_PATHLEN) {
+      fprintf(stderr, "Error: path to file %s in directory %s is too long\n",
+	      fname, p->dir);
+      fail(p);
+   }
+   return buf;
+}
+
+/*
+ * Read all of file fname into f->buf. A newline is appended, so that
+ * every line of f->buf (including the last one) ends with '\n'.
+ * Returns 0 on success, or -1 if the file cannot be opened or read.
+ */
+int load_text_file(const char *fname, struct text_file *f) {
+   FILE *fp;
+   size_t size=65536, n;
+   char *tmp;
+
+   f->buf = NULL;
+   f->len = 0;
+   if ((fp = fopen(fname, "rb")) == NULL) return -1;
+
+   /* start with the size of the file, if the stream can tell us */
+   if (fseek(fp, 0, SEEK_END) == 0) {
+      long end = ftell(fp);
+      /* a directory may claim to be LONG_MAX bytes long */
+      if (end > 0 && end < LONG_MAX) size = (size_t)end + 1;
+      rewind(fp);
+   }
+
+   for (;;) {
+      if (!(tmp = realloc(f->buf, size+1))) break;
+      f->buf = tmp;
+      n = fread(f->buf+f->len, 1, size-f->len, fp);
+      f->len += n;
+      if (f->len < size) {
+	 if (ferror(fp)) break;
+	 fclose(fp);
+	 f->buf[f->len] = '\n';
+	 return 0;
+      }
+      size *= 2;
+   }
+   fclose(fp);
+   free(f->buf);
+   f->buf = NULL;
+   return -1;
+}
+
+/*
+ * Return the next line of f, starting at *pos, and move *pos to the
+ * start of the line after it. Returns NULL at the end of the file.
+ */
+const char *next_line(const struct text_file *f, size_t *pos) {
+   const char *line = f->buf + *pos;
+   const char *eol;
+   if (*pos >= f->len) return NULL;
+   /* always found, because of the newline added by load_text_file() */
+   eol = memchr(line, '\n', f->len + 1 - *pos);
+   *pos = (size_t)(eol - f->buf) + 1;
+   return line;
+}
+
+/* Length of a line returned by next_line(), without the newline */
+int line_length(const char *line) {
+   const char *eol = strchr(line, '\n');
+   return eol ? (int)(eol - line) : (int)strlen(line);
+}
+
+/* Move past white space, but not past the end of the line */
+const char *skip_blanks(const char *s) {
+   while (isspace((unsigned char)*s) && *s!='\n') s++;
+   return s;
+}
+
+/* Which line does a tag such as "NW_SE" or "NW_SE.txt" name? -1 if none */
+int line_from_tag(const char *tag, int len) {
+   int i;
+   for (i=0; i<8; i++) {
+      const char *name = filenames[i];
+      /* name without the .txt extension */
+      int base = (int)strlen(name)-4;
+      if ((len==base || len==base+4) && !strncmp(tag, name, len))
+	 return i;
+   }
+   return -1;
+}
+
+/* Short name of a line, without the .txt extension */
+int line_name_length(int which_sheet) {
+   return (int)strlen(filenames[which_sheet])-4;
+}
+
+/* Exact powers of ten, as doubles */
+const double powers_of_ten[] = {
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Scan a decimal number such as "-12.3", ".5" or "1.5e-3", starting
+ * at *ps. This does not depend on the locale, and avoids sscanf(),
+ * which is slow. On success the value is stored in *x, *ps is moved
+ * past the number and 1 is returned; otherwise 0 is returned.
+ */
+int scan_double(const char **ps, double *x) {
+   const char *s = *ps;
+   unsigned long long mant=0;
+   int neg=0, digits=0, exp10=0;
+   double value;
+
+   if (*s=='+' || *s=='-') neg = (*s++ == '-');
+
+   /* integer part; digits past the 19th only change the exponent */
+   for (; *s>='0' && *s<='9'; s++, digits++) {
+      if (mant < 1000000000000000000ULL)
+	 mant = 10*mant + (*s-'0');
+      else
+	 exp10++;
+   }
+   /* fractional part */
+   if (*s=='.') {
+      for (s++; *s>='0' && *s<='9'; s++, digits++) {
+	 if (mant < 1000000000000000000ULL) {
+	    mant = 10*mant + (*s-'0');
+	    exp10--;
+	 }
+      }
+   }
+   if (digits == 0) return 0;
+
+   /* exponent, only if followed by at least one digit */
+   if (*s=='e' || *s=='E') {
+      const char *t = s+1;
+      int eneg=0, e=0;
+      if (*t=='+' || *t=='-') eneg = (*t++ == '-');
+      if (*t>='0' && *t<='9') {
+	 for (; *t>='0' && *t<='9'; t++)
+	    if (e < 10000) e = 10*e + (*t-'0');
+	 exp10 += eneg ? -e : e;
+	 s = t;
+      }
+   }
+
+   value = (double)mant;
+   if (mant != 0) {
+      if (exp10 < 0)
+	 value = (exp10 >= -22) ? value/powers_of_ten[-exp10] : value*pow(10.0, exp10);
+      else if (exp10 > 0)
+	 value = (exp10 <= 22) ? value*powers_of_ten[exp10] : value*pow(10.0, exp10);
+   }
+   *x = neg ? -value : value;
+   *ps = s;
+   return 1;
+}
+
+/* scan_double() for a float */
+int scan_float(const char **ps, float *x) {
+   double value;
+   if (!scan_double(ps, &value)) return 0;
+   *x = (float)value;
+   return 1;
+}
+
+/*
+ * Parse the units and foot spacing "M x" or "I x" at head, storing
+ * the unit flag in *pflag and x in the foot spacing of plate p.
+ * Returns the same count as sscanf(head, "%c %f %s") would.
+ */
+int parse_units(struct moody_plate *p, const char *head, char *pflag) {
+   int ret=1;
+   *pflag = *head++;
+   head = skip_blanks(head);
+   if (scan_float(&head, &p->foot_spacing)) {
+      ret++;
+      if (*skip_blanks(head)!='\n') ret++;
+   }
+   return ret;
+}
+
+/* Set the units from flag 'M' or 'I', once the foot spacing is known */
+void set_units(struct moody_plate *p, char flag, const char *fname) {
+   /* To convert from angle to distance */
+   if (flag=='M') {
+      p->metric=1;
+      /* output in microns */
+      p->out_spacing = p->foot_spacing*1000.0;
+      report(p, "From file %s: using a %.2f mm foot spacing.\n\n",
+	      fname, p->foot_spacing);
+   } else {
+      p->metric=0;
+      /* output in 1/100,000 of an inch */
+      p->out_spacing = p->foot_spacing*100000.0;
+      report(p, "From file %s: using a %.2f inch foot spacing.\n\n",
+	      fname, p->foot_spacing);
+   }
+   return;
+}
+
+/*
+ * Make room for n readings in buffer *pbuf, which has room for *psize,
+ * growing it geometrically. Returns 0 on success, -1 if out of memory.
+ */
+int reserve_readings(float **pbuf, int *psize, int n) {
+   int size = *psize ? *psize : 64;
+   float *tmp;
+   if (n <= *psize) return 0;
+   while (size < n) size *= 2;
+   if (!(tmp = realloc(*pbuf, size*sizeof(float)))) return -1;
+   *pbuf = tmp;
+   *psize = size;
+   return 0;
+}
 
-/* Number of input data entries in each of the 8 worksheets */
-int num_dat[8];
+/* Make room for n readings on line which_sheet */
+int reserve_input(struct moody_plate *p, int which_sheet, int n) {
+   return reserve_readings(&p->input[which_sheet], &p->input_size[which_sheet], n);
+}
 
-/* One arc second in radians */
-const float arcsec = 2.0*3.141592/(360.0*60*60);
+/*
+ * The lines of Config.txt after the units, from *pos (after line
+ * file_line of fname): a line name followed by a foot spacing, in the
+ * units of the plate, sets the spacing of that line, which may be
+ * measured with a shorter or longer reflector than the others, as in
+ *
+ *   I 4.0
+ *   NE_SW 2.0
+ *
+ * Other lines are ignored, as they always have been.
+ */
+void read_line_spacings(struct moody_plate *p, const struct text_file *f, size_t *pos,
+			int file_line, const char *fname) {
+   const char *line;
+   int i;
 
-/* Set to 1 for metric, 0 for imperial (inches) */
-int metric=-1;
+   for (i=0; i<8; i++) p->spacing[i] = 0.0;
+   while ((line = next_line(f, pos)) != NULL) {
+      const char *head, *tag;
+      int which;
+      float x;
 
-/* Reflector foot spacing in either inches or mm */
-float foot_spacing;
+      file_line++;
+      p->stats.lines_parsed++;
+      head = tag = skip_blanks(line);
+      if (*head=='\n' || *head=='#') {
+	 p->stats.comment_lines++;
+	 continue;
+      }
+      while (*head && !isspace((unsigned char)*head)) head++;
+      if ((which = line_from_tag(tag, (int)(head-tag))) < 0) continue;
+      head = skip_blanks(head);
+      if (!scan_float(&head, &x) || !(x > 0) || *skip_blanks(head) != '\n') {
+	 fprintf(stderr,
+		 "Error: unable to parse line %d of data file %s.\n"
+		 "Expected is \"%.*s x\", where \"x\" is the foot spacing of that line.\n"
+		 "Line %d reads:\n%.*s\n\n",
+		 file_line, fname, line_name_length(which), filenames[which],
+		 file_line, line_length(line), line);
+	 free(f->buf);
+	 fail(p);
+      }
+      p->spacing[which] = x;
+      report(p, "From file %s: line %.*s has a %.2f %s foot spacing.\n\n", fname,
+	     line_name_length(which), filenames[which], x, p->metric ? "mm" : "inch");
+   }
+   return;
+}
 
 /* Reads and parses configuration file */
-void read_config_file(void) {
-   FILE* fp;
-   char buf[MAX_LINELEN];
-   char* head;
+void read_config_file(struct moody_plate *p) {
+   struct text_file f;
+   const char *line;
+   size_t pos=0;
    int file_line=0;
-   const char fname[]="Config.txt";
+   const char *fname;
    char flag;
+   char path[MAX_PATHLEN];
 
-   /* open file for reading */
-   if ((fp = fopen(fname, "r")) == NULL) {
+   fname = plate_path(p, path, "Config.txt");
+
+   /* read file into memory */
+   if (load_text_file(fname, &f)) {
       fprintf(stderr, "Error: unable to find/open input data file %s\n", fname);
-      exit(EXIT_FAILURE);
+      fail(p);
    }
+   p->stats.bytes_read += f.len;
    
-   /* read line from file */
-   while (fgets(buf, sizeof(buf), fp) != NULL) {   
-      
+   /* step through lines of file */
+   while ((line = next_line(&f, &pos)) != NULL) {   
+      const char *head;
+
       /* keep track of which line we are on */
       file_line++;
-      
-      /* guarantee newline at the end */
-      buf[sizeof(buf)-1]='\n';
+      p->stats.lines_parsed++;
       
       /* move to first non-white-space character */
-      head = buf;
-      while (isspace(*head) && *head!='\n') head++;
+      head = skip_blanks(line);
 
       /* if comment or end of line, skip line */
-      if (*head=='\n' || *head=='#') continue;
+      if (*head=='\n' || *head=='#') {
+	 p->stats.comment_lines++;
+	 continue;
+      }
       
       /* parse foot spacing */
       {
-	 char remaining[MAX_LINELEN];
-	 int ret = sscanf(head, "%c %f %s\n", &flag, &foot_spacing, remaining);
+	 int ret = parse_units(p, head, &flag);
 	    if (ret !=2 || !(flag == 'M' || flag == 'I')) {
 	       fprintf(stderr,
 		       "Error: unable to parse line %d of data file %s.\n"
 		       "Expected is either \"M x\" or \"I x\",\n"
 		       "where \"x\" is the foot spacing in mm or inches respectively.\n"
-		       "Line %d reads:\n%s\n",
-		       file_line, fname, file_line, buf);
+		       "Line %d reads:\n%.*s\n\n",
+		       file_line, fname, file_line, line_length(line), line);
 	       fprintf(stderr,"Flag is %c ret is %d\n", flag, ret);
-	       exit(EXIT_FAILURE);
+	       free(f.buf);
+	       fail(p);
 	    }
 	    else {
-	       if (flag=='M') {
-		  metric=1;
-		  printf("From file %s: using a %.2f mm foot spacing.\n\n",
-			 fname, foot_spacing);
-	       } else {
-		  metric=0;
-		  printf("From file %s: using a %.2f inch foot spacing.\n\n",
-			 fname, foot_spacing);
-	       }
-	       fclose(fp);
+	       set_units(p, flag, fname);
+	       read_line_spacings(p, &f, &pos, file_line, fname);
+	       free(f.buf);
 	       return;
 	    }
       }
@@ -165,78 +1021,1055 @@ void read_config_file(void) {
 	   "I 4.0\n"
 	   "means 4 inch foot spacing.\n",
 	   fname);
-   exit(EXIT_FAILURE);
+   free(f.buf);
+   fail(p);
 }
 
-void read_data(int which_file) {
-   FILE* fp;
-   char buf[MAX_LINELEN];
-   char* head;
-   const char *fname= filenames[which_file];
+/*
+ * The k-th smallest of the n values x, which are reordered so that
+ * the ones before it are no larger and the ones after it no smaller
+ * (Hoare's selection, expected time linear in n)
+ */
+float select_float(float *x, int n, int k) {
+   int lo = 0, hi = n-1;
+   while (lo < hi) {
+      float pivot = x[lo + (hi-lo)/2];
+      int i = lo, j = hi;
+      while (i <= j) {
+	 while (x[i] < pivot) i++;
+	 while (x[j] > pivot) j--;
+	 if (i <= j) {
+	    float tmp = x[i];
+	    x[i++] = x[j];
+	    x[j--] = tmp;
+	 }
+      }
+      if (k <= j) hi = j;
+      else if (k >= i) lo = i;
+      else break;
+   }
+   return x[k];
+}
+
+/* Quantile q of the n values x, interpolating linearly; x is reordered */
+float quantile(float *x, int n, double q) {
+   double pos = q*(n-1);
+   int k = (int)pos;
+   float a = select_float(x, n, k);
+   if (k >= n-1) return a;
+   /* the next value is the smallest of those after x[k] */
+   return a + (pos-k)*(select_float(x+k+1, n-k-1, 0)-a);
+}
+
+/*
+ * Several samples per station. A clinometer that logs many samples at
+ * each station can write them all to the data file, and they are
+ * reduced to the reading of the station as they are parsed. The
+ * samples of a station are either
+ *
+ *   - all on one line, separated by blanks, or
+ *   - on the lines after a station marker, a line "station" or "S",
+ *     optionally followed by the number of the station, or
+ *   - with --samples N, N consecutive values, wherever they are.
+ *
+ * A file with one value per line is read as before. The samples are
+ * reduced by their mean (REDUCE_MEAN, kept by Welford's method in
+ * constant space), their median (REDUCE_MEDIAN), or the mean of those
+ * within clip standard deviations of it, recomputed until none is
+ * rejected (REDUCE_CLIP). The median and clipping need the samples of
+ * the station being read, in a buffer reused for every station. The
+ * standard error of each reading, from the scatter of its samples, is
+ * kept for the Monte Carlo uncertainty, see perturb_trial().
+ */
+#define REDUCE_MEAN 0
+#define REDUCE_MEDIAN 1
+#define REDUCE_CLIP 2
+/* standard deviation over median absolute deviation, for Gaussian noise */
+#define MAD_SCALE 1.4826
+/* standard error of the median over that of the mean, for Gaussian noise */
+#define MEDIAN_EFFICIENCY 1.2533
+#define CLIP_ROUNDS 10
+
+/* The samples of the station being read */
+struct reducer {
+   int method;
+   float clip;
+   int n;
+   /* running mean and sum of squared deviations */
+   double mean, m2;
+   /* the samples, for the median and clipping, with room for size of them */
+   float *x;
+   int size;
+};
+
+/* Add sample v to the station of r; returns -1 if out of memory */
+int add_sample(struct reducer *r, double v) {
+   double delta = v - r->mean;
+   r->n++;
+   /* the first sample itself, so that a reading of -0.0 keeps its sign */
+   r->mean = r->n == 1 ? v : r->mean + delta/r->n;
+   r->m2 += delta*(v - r->mean);
+   if (r->method != REDUCE_MEAN) {
+      if (r->n > r->size && reserve_readings(&r->x, &r->size, r->n)) return -1;
+      r->x[r->n-1] = (float)v;
+   }
+   return 0;
+}
+
+/*
+ * Reduce the samples of the station of r to its reading *value and
+ * the standard error *sigma of that, and start the next station.
+ * A single sample is the reading, exactly.
+ */
+void reduce_station(struct reducer *r, float *value, float *sigma) {
+   int n = r->n, m, k, rounds;
+   double mean = r->mean, sd = n > 1 ? sqrt(r->m2/(n-1)) : 0.0;
+
+   if (n > 1 && r->method == REDUCE_MEDIAN) {
+      float median = quantile(r->x, n, 0.5);
+      for (k=0; k<n; k++) r->x[k] = fabs(r->x[k]-median);
+      mean = median;
+      sd = MEDIAN_EFFICIENCY*MAD_SCALE*quantile(r->x, n, 0.5);
+   } else if (n > 2 && r->method == REDUCE_CLIP) {
+      for (rounds=0; rounds<CLIP_ROUNDS && sd > 0; rounds++) {
+	 for (m=0, k=0; k<n; k++)
+	    if (fabs(r->x[k]-mean) <= r->clip*sd) r->x[m++] = r->x[k];
+	 if (m == n || m < 2) break;
+	 n = m;
+	 for (mean=0.0, k=0; k<n; k++) mean += r->x[k];
+	 mean /= n;
+	 for (sd=0.0, k=0; k<n; k++) sd += (r->x[k]-mean)*(r->x[k]-mean);
+	 sd = sqrt(sd/(n-1));
+      }
+   }
+   *value = (float)mean;
+   *sigma = (float)(sd/sqrt((double)n));
+   r->n = 0;
+   r->mean = r->m2 = 0.0;
+   return;
+}
+
+/* Is line head a station marker? */
+int is_station_marker(const char *head) {
+   const char *s = head;
+   if (!strncmp(s, "station", 7)) s += 7;
+   else if (*s == 'S') s++;
+   else return 0;
+   if (!isspace((unsigned char)*s)) return 0;
+   s = skip_blanks(s);
+   while (isdigit((unsigned char)*s)) s++;
+   return *skip_blanks(s) == '\n';
+}
+
+/*
+ * Is line head the position "at x" of a station? Its distance x from
+ * the start of the line goes to *x.
+ */
+int is_position(const char *head, float *x) {
+   const char *s = head;
+   if (strncmp(s, "at", 2) || !isspace((unsigned char)s[2])) return 0;
+   s = skip_blanks(s+2);
+   return scan_float(&s, x) && *skip_blanks(s) == '\n';
+}
+
+/*
+ * Set the position of station n in *pat, with room for *psize, to x,
+ * marking those before it that have none as not given. Returns -1 if
+ * out of memory, 1 if station n already has a position, 0 otherwise.
+ */
+int set_position(float **pat, int *psize, int n, float x) {
+   int had = *pat ? *psize : 0, k;
+   if (reserve_readings(pat, psize, n+1)) return -1;
+   for (k=had; k<*psize; k++) (*pat)[k] = -1.0;
+   if ((*pat)[n] >= 0) return 1;
+   (*pat)[n] = x;
+   return 0;
+}
+
+/*
+ * Store the reading reduced by r as station n of *pbuf, with room for
+ * *psize, and its standard error in *psigma, with room for
+ * *psigma_size, if psigma is not NULL. Returns -1 if out of memory.
+ */
+int end_station(struct reducer *r, int n, float **pbuf, int *psize, float **psigma, int *psigma_size) {
+   float value, sigma;
+   reduce_station(r, &value, &sigma);
+   if (reserve_readings(pbuf, psize, n+1) ||
+       (psigma && reserve_readings(psigma, psigma_size, n+1)))
+      return -1;
+   (*pbuf)[n] = value;
+   if (psigma) (*psigma)[n] = sigma;
+   return 0;
+}
+
+/*
+ * Read the angles of data file fname into buffer *pbuf, with room for
+ * *psize of them, and return how many were read. The standard error
+ * of each one goes to *psigma, with room for *psigma_size, unless
+ * psigma is NULL; it is zero for stations with a single sample. A line
+ * "at x" before the samples of a station gives the distance x from the
+ * start of the line to the end of its step, which goes to *pat, with
+ * room for *pat_size, as set_position() does; if pat is NULL, such
+ * lines are an error.
+ */
+int read_angles(struct moody_plate *p, const char *fname, float **pbuf, int *psize,
+		float **psigma, int *psigma_size, float **pat, int *pat_size) {
+   const char *methods[3]={"mean", "median", "clipped mean"};
+   struct text_file f;
+   struct reducer r;
+   const char *line;
+   size_t pos=0;
+   long samples=0;
    int lines_read=0;
    int file_line=0;
+   /* whether the file has station markers, and one has begun a station */
+   int markers=-1, marked=0;
+   int most=0, oom=0;
 
-   /* open file for reading */
-   if ((fp = fopen(fname, "r")) == NULL) {
+   memset(&r, 0, sizeof(r));
+   r.method = p->reduce;
+   r.clip = p->clip;
+
+   /* read file into memory */
+   if (load_text_file(fname, &f)) {
       fprintf(stderr, "Error: unable to find/open input data file %s\n", fname);
-      exit(EXIT_FAILURE);
+      fail(p);
    }
+   p->stats.bytes_read += f.len;
    
-   /* read line from file */
-   while (fgets(buf, sizeof(buf), fp) != NULL) {
+   /* step through lines of file */
+   while ((line = next_line(&f, &pos)) != NULL) {
+	 const char *head;
+
 	 /* keep track of which line we are on */
 	 file_line++;
-
-         /* guarantee newline at the end */
-	 buf[sizeof(buf)-1]='\n';
+	 p->stats.lines_parsed++;
 
 	 /* move to first non-white-space character */
-	 head = buf;
-	 while (isspace(*head) && *head!='\n') head++;
+	 head = skip_blanks(line);
 
 	 /* if comment or end of line, skip line */
-	 if (*head=='\n' || *head=='#') continue;
-	 	 
-	 /* parse number of arcseconds */
+	 if (*head=='\n' || *head=='#') {
+	    p->stats.comment_lines++;
+	    continue;
+	 }
+
+	 /* the position of the station whose samples are next */
 	 {
-	    char remaining[MAX_LINELEN];
-	    int ret = sscanf(head, "%f%s\n", &ws[which_file][1][lines_read+1], remaining);
-	    if (ret !=1) {
-	       fprintf(stderr,
-		       "Error: unable to parse line %d of data file %s.\n"
-		       "Expected is an angle in arcseconds.\nLine %d reads:\n%s\n",
-		       file_line, fname, file_line, buf);
-	       exit(EXIT_FAILURE);
+	    float x;
+	    if (is_position(head, &x)) {
+	       const char *why = NULL;
+	       if (!pat)
+		  why = "station positions are not supported";
+	       else if (!(x > 0))
+		  why = "a station position must be positive";
+	       else if ((oom = set_position(pat, pat_size, lines_read + (r.n > 0), x)) > 0)
+		  why = "a station has a second position";
+	       if (why) {
+		  fprintf(stderr, "Error: %s, line %d of data file %s reads:\n%.*s\n\n",
+			  why, file_line, fname, line_length(line), line);
+		  free(r.x);
+		  free(f.buf);
+		  fail(p);
+	       }
+	       if (oom) break;
+	       continue;
 	    }
-	    lines_read++;
+	 }
 
-	    if (lines_read>=MAX_STATIONS-2) {
-	       fprintf(stderr,
-		       "Error: code can accept a maximum of MAX_STATIONS-2=%d stations,\n"
-		       "but file %s contains more stations than this. Recompile code\n"
-		       "with a larger value of MAX_STATIONS, then rerun analysis.\n",
-		       MAX_STATIONS-2, fname);
-	       exit(EXIT_FAILURE);
+	 /* the first line tells whether stations begin with a marker */
+	 if (markers < 0) markers = is_station_marker(head);
+	 if (markers && is_station_marker(head)) {
+	    if (marked && r.n == 0) {
+	       fprintf(stderr, "Error: the station marker before line %d of data file %s has no samples\n",
+		       file_line, fname);
+	       free(r.x);
+	       free(f.buf);
+	       fail(p);
 	    }
+	    if (r.n > most) most = r.n;
+	    if (marked && (oom = end_station(&r, lines_read++, pbuf, psize, psigma, psigma_size))) break;
+	    marked = 1;
+	    continue;
 	 }
-   }
-   if (lines_read<3) {
+
+	 /* parse the number of arcseconds of each sample, nothing else may follow them */
+	 do {
+	    double v;
+	    if (!scan_double(&head, &v) || !isspace((unsigned char)*head)) {
+	       fprintf(stderr,
+		       "Error: unable to parse line %d of data file %s.\n"
+		       "Expected is an angle in arcseconds, or several samples of one.\n"
+		       "Line %d reads:\n%.*s\n\n",
+		       file_line, fname, file_line, line_length(line), line);
+	       free(r.x);
+	       free(f.buf);
+	       fail(p);
+	    }
+	    if ((oom = add_sample(&r, v))) break;
+	    samples++;
+	    /* without markers, a fixed number of samples makes a station */
+	    if (!markers && p->samples > 0 && r.n == p->samples) {
+	       if (r.n > most) most = r.n;
+	       if ((oom = end_station(&r, lines_read++, pbuf, psize, psigma, psigma_size))) break;
+	    }
+	    head = skip_blanks(head);
+	 } while (*head != '\n');
+	 if (oom) break;
+
+	 /* and otherwise a line is a station */
+	 if (!markers && p->samples <= 0) {
+	    if (r.n > most) most = r.n;
+	    if ((oom = end_station(&r, lines_read++, pbuf, psize, psigma, psigma_size))) break;
+	 }
+   }
+   /* the last marked station ends with the file */
+   if (!oom && markers > 0) {
+      if (r.n == 0) {
+	 fprintf(stderr, "Error: the last station marker of data file %s has no samples\n", fname);
+	 free(r.x);
+	 free(f.buf);
+	 fail(p);
+      }
+      if (r.n > most) most = r.n;
+      oom = end_station(&r, lines_read++, pbuf, psize, psigma, psigma_size);
+   }
+   free(r.x);
+   free(f.buf);
+   if (oom) {
+      fprintf(stderr, "Error: out of memory reading data file %s\n", fname);
+      fail(p);
+   }
+   if (r.n > 0) {
+      fprintf(stderr, "Error: data file %s ends with %d of the %d samples of a station\n",
+	      fname, r.n, p->samples);
+      fail(p);
+   }
+   if (pat && *pat && *pat_size > lines_read && (*pat)[lines_read] >= 0) {
+      fprintf(stderr, "Error: data file %s ends with the position of a station that has no reading\n",
+	      fname);
+      fail(p);
+   }
+   if (lines_read<3) {
       fprintf(stderr, "Error: read %d data lines from data file %s.\n"
 	      "Need at least 3 valid data lines.\n",
 	      lines_read, fname);
-      exit(EXIT_FAILURE);
+      fail(p);
    }
-   printf("Read %d data entries from %s\n", lines_read, fname);
-   
+   if (most > 1)
+      report(p, "Read %d data entries from %s, the %s of %ld samples\n",
+	     lines_read, fname, methods[p->reduce], samples);
+   else
+      report(p, "Read %d data entries from %s\n", lines_read, fname);
+   return lines_read;
+}
+
+void read_data(struct moody_plate *p, int which_file) {
+   char path[MAX_PATHLEN];
+   const char *fname= plate_path(p, path, filenames[which_file]);
+
    /* store number of lines read in the array itself */
-   num_dat[which_file] = lines_read;
-   fclose(fp);
+   free(p->at[which_file]);
+   p->at[which_file] = NULL;
+   p->at_size[which_file] = 0;
+   p->num_dat[which_file] =
+      read_angles(p, fname, &p->input[which_file], &p->input_size[which_file],
+		  &p->input_sigma[which_file], &p->input_sigma_size[which_file],
+		  &p->at[which_file], &p->at_size[which_file]);
+   return;
+}
+
+
+/*
+ * Plate bundles hold the units, the foot spacing and all eight lines
+ * of a plate in a single file. The text variant looks like
+ *
+ *   # comment
+ *   I 4.0
+ *   NW_SE 20
+ *   6.5
+ *   6.0
+ *   ...
+ *
+ * with the units line of Config.txt first, and then, for each of the
+ * eight lines in any order, a header with its name and number of
+ * stations followed by that many angles, one per line. Comments and
+ * blank lines are ignored as in the data files.
+ *
+ * The binary variant is a fixed 64-byte header followed by the angles
+ * of the eight lines, in the order of filenames[], as 32-bit IEEE
+ * floats. All values are little-endian.
+ *   bytes  0-7   magic "MOODYPLT"
+ *   bytes  8-11  format version, 1
+ *   bytes 12-15  units, 1 for metric (mm), 0 for imperial (inches)
+ *   bytes 16-19  foot spacing, float
+ *   bytes 20-51  number of stations on each of the eight lines
+ *   bytes 52-63  reserved, zero
+ */
+#define BUNDLE_MAGIC "MOODYPLT"
+#define BUNDLE_VERSION 1
+#define BUNDLE_HEADER 64
+
+/* Little-endian 32-bit values, independent of the host byte order */
+unsigned long get_le32(const unsigned char *b) {
+   return (unsigned long)b[0] | (unsigned long)b[1]<<8 |
+      (unsigned long)b[2]<<16 | (unsigned long)b[3]<<24;
+}
+
+void put_le32(unsigned char *b, unsigned long v) {
+   b[0] = v & 0xff;
+   b[1] = (v>>8) & 0xff;
+   b[2] = (v>>16) & 0xff;
+   b[3] = (v>>24) & 0xff;
+   return;
+}
+
+float get_le_float(const unsigned char *b) {
+   unsigned long v = get_le32(b);
+   unsigned int u = (unsigned int)v;
+   float x;
+   /* floats and unsigned ints are both 32 bits on all supported hosts */
+   memcpy(&x, &u, sizeof(x));
+   return x;
+}
+
+void put_le_float(unsigned char *b, float x) {
+   unsigned int u;
+   memcpy(&u, &x, sizeof(u));
+   put_le32(b, u);
+   return;
+}
+
+/* Is this bundle binary? Text bundles cannot start with the magic */
+int is_binary_bundle(const struct text_file *f) {
+   return f->len >= 8 && !memcmp(f->buf, BUNDLE_MAGIC, 8);
+}
+
+/* Read a binary bundle, already in memory */
+void read_binary_bundle(struct moody_plate *p) {
+   const unsigned char *b = (const unsigned char *)p->bundle.buf;
+   const char *fname = p->bundle_name;
+   size_t total=0;
+   int i, j;
+
+   if (p->bundle.len < BUNDLE_HEADER || get_le32(b+8) != BUNDLE_VERSION ||
+       get_le32(b+12) > 1) {
+      fprintf(stderr, "Error: bundle file %s has an unsupported or damaged header.\n", fname);
+      fail(p);
+   }
+   p->foot_spacing = get_le_float(b+16);
+   set_units(p, get_le32(b+12) ? 'M' : 'I', fname);
+
+   for (i=0; i<8; i++) {
+      unsigned long n = get_le32(b+20+4*i);
+      if (n<3 || n>(p->bundle.len-BUNDLE_HEADER)/4) {
+	 fprintf(stderr, "Error: bundle file %s gives %lu stations for line %s.\n"
+		 "Need at least 3 stations, and no more than the file holds.\n",
+		 fname, n, filenames[i]);
+	 fail(p);
+      }
+      p->num_dat[i] = (int)n;
+      total += n;
+   }
+   if (p->bundle.len != BUNDLE_HEADER + 4*total) {
+      fprintf(stderr, "Error: bundle file %s is %lu bytes long, but its header\n"
+	      "describes %lu stations, which need %lu bytes.\n",
+	      fname, (unsigned long)p->bundle.len, (unsigned long)total,
+	      (unsigned long)(BUNDLE_HEADER + 4*total));
+      fail(p);
+   }
+
+   b += BUNDLE_HEADER;
+   for (i=0; i<8; i++) {
+      if (reserve_input(p, i, p->num_dat[i])) {
+	 fprintf(stderr, "Error: out of memory reading bundle file %s\n", fname);
+	 fail(p);
+      }
+      for (j=0; j<p->num_dat[i]; j++, b+=4)
+	 p->input[i][j] = get_le_float(b);
+      report(p, "Read %d data entries for %s from %s\n",
+	      p->num_dat[i], filenames[i], fname);
+   }
+   return;
+}
+
+/* Report an error on line file_line of a text bundle, and give up */
+void bundle_error(struct moody_plate *p, int file_line, const char *line, const char *expected) {
+   fprintf(stderr,
+	   "Error: unable to parse line %d of bundle file %s.\n"
+	   "Expected is %s.\nLine %d reads:\n%.*s\n\n",
+	   file_line, p->bundle_name, expected, file_line, line_length(line), line);
+   fail(p);
+}
+
+/* Check that line which_sheet of a text bundle got all its angles */
+void check_bundle_line(struct moody_plate *p, int which_sheet, int expected) {
+   if (p->num_dat[which_sheet] != expected) {
+      fprintf(stderr, "Error: bundle file %s gives %d stations for line %s,\n"
+	      "but only %d angles follow.\n",
+	      p->bundle_name, expected, filenames[which_sheet], p->num_dat[which_sheet]);
+      fail(p);
+   }
+   return;
+}
+
+/* Read a text bundle, already in memory */
+void read_text_bundle(struct moody_plate *p) {
+   const char *fname = p->bundle_name;
+   const char *line;
+   size_t pos=0;
+   int file_line=0;
+   int have_units=0;
+   int which=-1, expected=0;
+   int seen[8]={0};
+   int i;
+
+   while ((line = next_line(&p->bundle, &pos)) != NULL) {
+      const char *head;
+
+      /* keep track of which line we are on */
+      file_line++;
+      p->stats.lines_parsed++;
+
+      /* move to first non-white-space character */
+      head = skip_blanks(line);
+
+      /* if comment or end of line, skip line */
+      if (*head=='\n' || *head=='#') {
+	 p->stats.comment_lines++;
+	 continue;
+      }
+
+      if (!have_units) {
+	 /* the units and foot spacing come first */
+	 char flag;
+	 if (parse_units(p, head, &flag)!=2 || !(flag == 'M' || flag == 'I'))
+	    bundle_error(p, file_line, line,
+			 "either \"M x\" or \"I x\",\nwhere \"x\" is the foot spacing in mm or inches respectively");
+	 set_units(p, flag, fname);
+	 have_units = 1;
+      } else if (isalpha((unsigned char)*head)) {
+	 /* header of the next line: name and number of stations */
+	 const char *tag = head;
+	 char *end;
+	 long n;
+	 if (which>=0) check_bundle_line(p, which, expected);
+	 while (*head && !isspace((unsigned char)*head)) head++;
+	 which = line_from_tag(tag, (int)(head-tag));
+	 n = strtol(head, &end, 10);
+	 if (which<0 || seen[which] || end==head || n<3 || n>1000000000L ||
+	     *skip_blanks(end)!='\n')
+	    bundle_error(p, file_line, line,
+			 "the name of a line that has not yet appeared,\nsuch as \"NW_SE\", followed by its number of stations (at least 3)");
+	 seen[which] = 1;
+	 expected = (int)n;
+	 if (reserve_input(p, which, expected)) {
+	    fprintf(stderr, "Error: out of memory reading bundle file %s\n", fname);
+	    fail(p);
+	 }
+      } else {
+	 /* one more angle for the current line */
+	 if (which<0 || p->num_dat[which]>=expected)
+	    bundle_error(p, file_line, line, "a line name and number of stations, such as \"NW_SE 20\"");
+	 if (!scan_float(&head, &p->input[which][p->num_dat[which]]) ||
+	     *skip_blanks(head)!='\n')
+	    bundle_error(p, file_line, line, "an angle in arcseconds");
+	 p->num_dat[which]++;
+      }
+   }
+
+   if (!have_units) {
+      fprintf(stderr, "Error: bundle file %s must start with the units and foot spacing.\n", fname);
+      fail(p);
+   }
+   if (which>=0) check_bundle_line(p, which, expected);
+   for (i=0; i<8; i++) {
+      if (!seen[i]) {
+	 fprintf(stderr, "Error: bundle file %s has no line %s.\n", fname, filenames[i]);
+	 fail(p);
+      }
+      report(p, "Read %d data entries for %s from %s\n",
+	      p->num_dat[i], filenames[i], fname);
+   }
+   return;
+}
+
+/*
+ * Incremental runs. When a line is measured again, its data file is
+ * the only one that has changed, and with --incremental the others
+ * are not parsed again: the readings of all eight lines are kept in
+ * the file moody.state in the plate directory, and a data file with
+ * the size and modification time it had when it was last read, and
+ * not modified in the second in which it was read, is taken from
+ * there. Parsing takes several times as long as computing the
+ * worksheets, see --bench, so these are computed again from the
+ * readings, which is faster than loading them would be. The file
+ * holds, in the byte order of this machine, a struct state_head and
+ * then the readings and their standard errors, num_dat[i] floats
+ * each, for each line in the order of filenames[]. A file written for
+ * another reduction of the samples is ignored.
+ */
+#define STATE_MAGIC "MOODYSTA"
+#define STATE_VERSION 2
+
+struct state_head {
+   char magic[8];
+   int version;
+   int reduce, samples;
+   float clip;
+   int num_dat[8];
+   /* bit i for a data file with station positions, which is read again */
+   int positioned;
+   /* size and modification time of each data file, and when they were read */
+   long long size[8], mtime[8], read_time;
+};
+
+/*
+ * Load the state file of plate p into p->state, unless it was written
+ * for another reduction of the samples. A missing or damaged file is
+ * not an error.
+ */
+void load_state(struct moody_plate *p) {
+   struct state_head h;
+   char path[MAX_PATHLEN];
+   size_t size = sizeof(h);
+   int i = 0;
+
+   if (load_text_file(plate_path(p, path, "moody.state"), &p->state)) return;
+   p->stats.bytes_read += p->state.len;
+   if (p->state.len >= sizeof(h)) {
+      memcpy(&h, p->state.buf, sizeof(h));
+      for (i=0; i<8 && h.num_dat[i] >= 0; i++) size += 2*(size_t)h.num_dat[i]*sizeof(float);
+   }
+   if (i < 8 || size != p->state.len || memcmp(h.magic, STATE_MAGIC, 8) || h.version != STATE_VERSION ||
+       h.reduce != p->reduce || h.samples != p->samples || h.clip != p->clip) {
+      free(p->state.buf);
+      p->state.buf = NULL;
+      p->state.len = 0;
+   }
+   return;
+}
+
+/*
+ * Take the readings of line which_file of plate p from its state if
+ * the data file is as it was when they were read, and return 1; or
+ * return 0 to read the file. Its size and modification time are
+ * noted for the next state file either way.
+ */
+int keep_data(struct moody_plate *p, int which_file) {
+   struct state_head h;
+   struct stat st;
+   char path[MAX_PATHLEN];
+   const char *fname = plate_path(p, path, filenames[which_file]);
+   const unsigned char *at;
+   int i = which_file, n, k;
+
+   p->file_size[i] = p->file_mtime[i] = -1;
+   if (stat(fname, &st)) return 0;
+   p->file_size[i] = (long long)st.st_size;
+   p->file_mtime[i] = (long long)st.st_mtime;
+   if (!p->state.buf) return 0;
+   memcpy(&h, p->state.buf, sizeof(h));
+   /* a file modified in the second it was read may have changed again within that second */
+   if (h.size[i] != p->file_size[i] || h.mtime[i] != p->file_mtime[i] || h.mtime[i] >= h.read_time ||
+       h.positioned & 1<<i)
+      return 0;
+   n = h.num_dat[i];
+   if (reserve_input(p, i, n) ||
+       reserve_readings(&p->input_sigma[i], &p->input_sigma_size[i], n)) {
+      fprintf(stderr, "Error: out of memory reading data file %s\n", fname);
+      fail(p);
+   }
+   for (at=(const unsigned char *)p->state.buf+sizeof(h), k=0; k<i; k++)
+      at += 2*(size_t)h.num_dat[k]*sizeof(float);
+   memcpy(p->input[i], at, (size_t)n*sizeof(float));
+   memcpy(p->input_sigma[i], at + (size_t)n*sizeof(float), (size_t)n*sizeof(float));
+   p->num_dat[i] = n;
+   p->kept |= 1<<i;
+   report(p, "Kept %d data entries of %s, unchanged since the last run\n", n, fname);
+   return 1;
+}
+
+/*
+ * Write the state file of plate p, whose data files have just been
+ * read, for the next run. Failing to do so is only a warning.
+ */
+void save_state(struct moody_plate *p) {
+   struct state_head h;
+   char path[MAX_PATHLEN], tmp[MAX_PATHLEN];
+   const char *fname = plate_path(p, path, "moody.state");
+   int ok, i;
+   size_t n;
+   FILE *fp;
+
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, STATE_MAGIC, 8);
+   h.version = STATE_VERSION;
+   h.reduce = p->reduce;
+   h.samples = p->samples;
+   h.clip = p->clip;
+   memcpy(h.num_dat, p->num_dat, sizeof(h.num_dat));
+   for (i=0; i<8; i++)
+      if (p->at[i]) h.positioned |= 1<<i;
+   memcpy(h.size, p->file_size, sizeof(h.size));
+   memcpy(h.mtime, p->file_mtime, sizeof(h.mtime));
+   h.read_time = p->read_time;
+
+   if (snprintf(tmp, sizeof(tmp), "%s.tmp", fname) >= (int)sizeof(tmp) || !(fp = fopen(tmp, "wb"))) {
+      fprintf(stderr, "Warning: unable to write state file %s\n", fname);
+      return;
+   }
+   ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+   for (i=0; i<8; i++) {
+      n = (size_t)p->num_dat[i];
+      ok = ok && fwrite(p->input[i], sizeof(float), n, fp) == n;
+      ok = ok && fwrite(p->input_sigma[i], sizeof(float), n, fp) == n;
+   }
+   if (ok) p->stats.bytes_written += ftell(fp);
+   ok = !fclose(fp) && ok;
+   /* a run that stops halfway leaves the last state, not part of this one */
+   if (!ok || rename(tmp, fname)) {
+      fprintf(stderr, "Warning: unable to write state file %s\n", fname);
+      remove(tmp);
+   }
+   return;
+}
+
+/* Read all input of the plate: its bundle, or Config.txt and the data files */
+void read_plate(struct moody_plate *p) {
+   double t = wall_seconds();
+   int i;
+
+   if (p->bundle_name) {
+      p->stats.bytes_read += p->bundle.len;
+      if (is_binary_bundle(&p->bundle))
+	 read_binary_bundle(p);
+      else
+	 read_text_bundle(p);
+      time_stage(p, STAGE_READ, &t);
+   } else {
+      /* Read configuration file */
+      read_config_file(p);
+      time_stage(p, STAGE_CONFIG, &t);
+   
+      /* Read data from input files, or from the state of the last run if they have not changed */
+      if (p->incremental) {
+	 p->read_time = (long long)time(NULL);
+	 load_state(p);
+	 for (i=0; i<8; i++)
+	    if (!keep_data(p, i)) read_data(p, i);
+	 if (p->kept != 0xff) save_state(p);
+      } else
+	 for (i=0; i<8; i++) read_data(p, i);
+      time_stage(p, STAGE_READ, &t);
+   }
+   report(p, "\n");
+   return;
+}
+
+/*
+ * Format x with the fewest significant digits that scan_float() reads
+ * back as the same float, so that "5.2" stays "5.2". Returns buf.
+ */
+const char *format_exact(char *buf, float x) {
+   int digits;
+   for (digits=6; digits<9; digits++) {
+      const char *s = buf;
+      float y;
+      sprintf(buf, "%.*g", digits, x);
+      if (scan_float(&s, &y) && y==x) return buf;
+   }
+   sprintf(buf, "%.9g", x);
+   return buf;
+}
+
+/* format_exact() for a worksheet value, which may be a double */
+const char *format_real(char *buf, real x) {
+#if MOODY_PRECISION == MOODY_DOUBLE
+   int digits;
+   for (digits=6; digits<17; digits++) {
+      const char *s = buf;
+      double y;
+      sprintf(buf, "%.*g", digits, x);
+      if (scan_double(&s, &y) && y==x) return buf;
+   }
+   sprintf(buf, "%.17g", x);
+   return buf;
+#else
+   return format_exact(buf, x);
+#endif
+}
+
+/*
+ * Write the input of plate p as a bundle file fname: binary if its
+ * name ends in ".mpb", text otherwise.
+ */
+void write_bundle(struct moody_plate *p, const char *fname) {
+   size_t len = strlen(fname);
+   int binary = len>=4 && !strcmp(fname+len-4, ".mpb");
+   FILE *fp;
+   int i, j;
+
+   /* bundles have a single foot spacing, and no positions */
+   for (i=0; i<8; i++)
+      if ((p->spacing[i] > 0 && p->spacing[i] != p->foot_spacing) || p->at[i]) {
+	 fprintf(stderr, "Error: line %s is not evenly spaced at the foot spacing of the plate,\n"
+		 "which a bundle file cannot hold\n", filenames[i]);
+	 fail(p);
+      }
+   if (!(fp=fopen(fname, binary ? "wb" : "w"))) {
+      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+      fail(p);
+   }
+   if (binary) {
+      unsigned char header[BUNDLE_HEADER];
+      memset(header, 0, sizeof(header));
+      memcpy(header, BUNDLE_MAGIC, 8);
+      put_le32(header+8, BUNDLE_VERSION);
+      put_le32(header+12, p->metric);
+      put_le_float(header+16, p->foot_spacing);
+      for (i=0; i<8; i++) put_le32(header+20+4*i, p->num_dat[i]);
+      fwrite(header, 1, sizeof(header), fp);
+      for (i=0; i<8; i++)
+	 for (j=0; j<p->num_dat[i]; j++) {
+	    unsigned char b[4];
+	    put_le_float(b, p->input[i][j]);
+	    fwrite(b, 1, 4, fp);
+	 }
+   } else {
+      char num[32];
+      fprintf(fp, "# Moody plate bundle: units and foot spacing, then the eight lines\n"
+	      "%c %s\n", p->metric ? 'M' : 'I', format_exact(num, p->foot_spacing));
+      for (i=0; i<8; i++) {
+	 fprintf(fp, "\n%.*s %d\n", (int)strlen(filenames[i])-4, filenames[i], p->num_dat[i]);
+	 for (j=0; j<p->num_dat[i]; j++)
+	    fprintf(fp, "%s\n", format_exact(num, p->input[i][j]));
+      }
+   }
+   if (ferror(fp) | fclose(fp)) {
+      fprintf(stderr, "Error: unable to write output file %s\n", fname);
+      fail(p);
+   }
+   report(p, "Wrote plate bundle %s\n", fname);
+   return;
+}
+
+/*
+ * Take the input of plate p from path, which is either a bundle file
+ * or a directory holding Config.txt and the eight data files.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int set_plate_source(struct moody_plate *p, const char *path) {
+   char *base, *dot;
+
+   /* anything that can be read as a file is a bundle */
+   if (load_text_file(path, &p->bundle)) {
+      p->dir = path;
+      return 0;
+   }
+   p->bundle_name = path;
+
+   /* split "dir/name.ext" into directory "dir" and prefix "name." */
+   if (!(p->names = malloc(strlen(path)+2))) return -1;
+   strcpy(p->names, path);
+   if ((base = strrchr(p->names, '/')) != NULL) {
+      *base++ = '\0';
+      p->dir = p->names;
+   } else
+      base = p->names;
+   if ((dot = strrchr(base, '.')) != NULL)
+      dot[1] = '\0';
+   else
+      strcat(base, ".");
+   p->prefix = base;
+   return 0;
+}
+
+/*
+ * Allocate the worksheets, right-sized for the number of stations
+ * num_dat on each line, with all columns zero.
+ */
+void layout_worksheets(struct moody_plate *p) {
+   size_t total=0;
+   real *col;
+   int i, c;
+
+   for (i=0; i<8; i++)
+      total += (size_t)num_columns(i)*(p->num_dat[i]+1);
+   free(p->arena);
+   if (!(p->arena = calloc(total, sizeof(real)))) {
+      plate_error(p, "Error: out of memory allocating worksheets\n");
+      fail(p);
+   }
+
+   col = p->arena;
+   for (i=0; i<8; i++) {
+      for (c=0; c<9; c++) {
+	 if (c<num_columns(i)) {
+	    p->ws[i][c] = col;
+	    col += p->num_dat[i]+1;
+	 } else
+	    p->ws[i][c] = NULL;
+      }
+   }
+   return;
+}
+
+/* Length of a step of the reflector on line i, in foot spacings of the plate */
+real line_step(const struct moody_plate *p, int i) {
+   return p->spacing[i] > 0 ? p->spacing[i]/p->foot_spacing : 1.0;
+}
+
+/* Position of station index j of line i, in foot spacings of the plate */
+real station_distance(const struct moody_plate *p, int i, int j) {
+   return p->pos[i] ? p->pos[i][j] : j;
+}
+
+/* Length of line i, in foot spacings of the plate */
+real line_span(const struct moody_plate *p, int i) {
+   return station_distance(p, i, p->num_dat[i]);
+}
+
+/* Make room for the positions of n stations of line i; returns -1 if out of memory */
+int reserve_positions(struct moody_plate *p, int i, int n) {
+   int size = p->pos_size[i] ? p->pos_size[i] : 64;
+   real *tmp;
+   if (n <= p->pos_size[i]) return 0;
+   while (size < n) size *= 2;
+   if (!(tmp = realloc(p->pos[i], size*sizeof(real)))) return -1;
+   p->pos[i] = tmp;
+   p->pos_size[i] = size;
+   return 0;
+}
+
+/*
+ * Coarse-to-fine surveys measure a line with a long reflector base,
+ * and then the suspicious parts of it again with a short one, so the
+ * steps along a line need not all have the foot spacing of the plate.
+ * Each step of line i is one foot spacing of that line long, unless
+ * its data file gives where it ends. Lines whose stations are all at
+ * the foot spacing of the plate keep pos[i] NULL, and are computed
+ * exactly as Moody does.
+ */
+void station_positions(struct moody_plate *p) {
+   int i, j;
+
+   for (i=0; i<8; i++) {
+      real step = line_step(p, i), *pos;
+      int n = p->num_dat[i];
+
+      if (!p->at[i] && step == 1.0) {
+	 free(p->pos[i]);
+	 p->pos[i] = NULL;
+	 p->pos_size[i] = 0;
+	 continue;
+      }
+      if (reserve_positions(p, i, n+1)) {
+	 fprintf(stderr, "Error: out of memory for the station positions of line %s\n", filenames[i]);
+	 fail(p);
+      }
+      pos = p->pos[i];
+      pos[0] = 0.0;
+      for (j=1; j<=n; j++) {
+	 float at = p->at[i] && j-1 < p->at_size[i] ? p->at[i][j-1] : -1.0;
+	 pos[j] = at >= 0 ? at/p->foot_spacing : pos[j-1]+step;
+	 if (!(pos[j] > pos[j-1])) {
+	    fprintf(stderr, "Error: reading %d of line %s ends at %.2f %s, not beyond the one before it\n",
+		    j, filenames[i], at, p->metric ? "mm" : "inch");
+	    fail(p);
+	 }
+      }
+      /* evenly spaced after all */
+      for (j=1; j<=n && pos[j] == j; j++);
+      if (j > n) {
+	 free(p->pos[i]);
+	 p->pos[i] = NULL;
+	 p->pos_size[i] = 0;
+      }
+   }
+   return;
+}
+
+/* Is every line of plate p evenly spaced at its foot spacing? */
+int uniform_plate(const struct moody_plate *p) {
+   int i;
+   for (i=0; i<8 && !p->pos[i]; i++);
+   return i == 8;
+}
+
+/* Allocate the worksheets, and copy the readings into column 2 */
+void alloc_worksheets(struct moody_plate *p) {
+   int i, j;
+
+   station_positions(p);
+   layout_worksheets(p);
+   for (i=0; i<8; i++)
+      /* Moody column 2, station 1 is stored at index 1 */
+      for (j=0; j<p->num_dat[i]; j++)
+	 p->ws[i][1][j+1] = p->input[i][j];
    return;
 }
 
+/*
+ * Room for a row of a table of print_table(): a station and nine values
+ * of less than TABLE_LARGE, which format_tenths() writes in 12 bytes
+ */
+#define TABLE_ROW (16 + 9*16)
+#define TABLE_LARGE 4.0e8
+
+/*
+ * Format x into buf as printf("%8.1f", x) does, and return the length.
+ * A float times 10 is exact in double precision, so it is rounded to
+ * one decimal here as printf rounds it, to even on a tie; doubles that
+ * are not floats, and huge values, are left to printf.
+ */
+int format_tenths(char *buf, double x) {
+   unsigned long n;
+   double v, r;
+   char digits[16];
+   int len = 0, k = 0;
+
+   if (!(fabs(x) < TABLE_LARGE) || (double)(float)x != x) return sprintf(buf, "%8.1f", x);
+   v = fabs(x)*10;
+   r = floor(v);
+   n = (unsigned long)r;
+   if (v-r > 0.5 || (v-r == 0.5 && (n & 1))) n++;
+   /* the digits, from the last one */
+   digits[k++] = (char)('0' + n%10);
+   digits[k++] = '.';
+   do {
+      n /= 10;
+      digits[k++] = (char)('0' + n%10);
+   } while (n >= 10);
+   if (signbit(x)) digits[k++] = '-';
+   for (; len+k<8; len++) buf[len] = ' ';
+   while (k) buf[len++] = digits[--k];
+   return len;
+}
+
+/* Format station number n into buf as printf("%6d", n) does, and return the length */
+int format_station(char *buf, int n) {
+   char digits[16];
+   int len, k = 0;
+   unsigned int u = n < 0 ? 0u-(unsigned int)n : (unsigned int)n;
+
+   do {
+      digits[k++] = (char)('0' + u%10);
+      u /= 10;
+   } while (u);
+   if (n < 0) digits[k++] = '-';
+   for (len=0; len+k<6; len++) buf[len] = ' ';
+   while (k) buf[len++] = digits[--k];
+   return len;
+}
 
-/* printing assumes fixed character width and avoids tabs */ 
-void print_table(int which_file) {
+/*
+ * Print Moody's worksheet of line which_file as a table. Printing
+ * assumes fixed character width and avoids tabs. The table is formatted
+ * in p->table_buffer and written with a single call, which also keeps it
+ * in one piece when several plates write to the same stream.
+ */
+void print_table(struct moody_plate *p, int which_file) {
    
    const char h1[]=
       "   1       2       3       4       5       6       7       8   \n"
@@ -270,132 +2103,221 @@ void print_table(int which_file) {
       " ber    ArcSec  ArcSec  ArcSec   Factor  ArcSec    Out   ArcSec  micron\n"
       "-----------------------------------------------------------------------\n";
 
-   const char format1[]="%6d";
-   const char format2[]="%8.1f";
+   /* the columns of each row: Moody columns 2 to 6, 6a for the two center lines, 7 and 8 */
+   const int columns[2][9]={{1, 2, 3, 4, 5, 6, 7, -1, -1}, {1, 2, 3, 4, 5, 8, 6, 7, -1}};
    
-   int i,j;
+   int i,j,c;
+   size_t len, need;
+   char *s;
 
-   const char *header1, *header2;
+   const char *header1, *header2, *header;
 
-   if (metric) {
+   if (p->metric) {
       header1=h3;
       header2=h4;
    } else {
       header1=h1;
       header2=h2;
    }  
-   
-   printf("\nTABLE %s\n", filenames[which_file]);
-   if (which_file<6)
-      printf("%s", header1);
-   else
-      printf("%s", header2);
+   header = which_file<6 ? header1 : header2;
 
-   for (j=0; j<=num_dat[which_file]; j++) {
-      /* station number, Moody column 1 */
-      printf(format1, (int)ws[which_file][0][j]);
-      /* Moody columns 2 to 6 */
-      for (i=1; i<=5; i++) printf(format2, ws[which_file][i][j]);
-      /* Moody column 6a for the two center lines */
-      if (which_file>5) printf(format2, ws[which_file][8][j]);
-      /* Moody columns 7 and 8 */
-      for (i=6; i<8; i++) printf(format2, ws[which_file][i][j]);    
+   /* values of TABLE_LARGE or more are rare, so the buffer grows for them */
+   need = strlen(header) + 64 + (size_t)(p->num_dat[which_file]+1)*TABLE_ROW;
+   if (need > p->table_size) {
+      char *tmp = realloc(p->table_buffer, need);
+      if (!tmp) {
+	 fprintf(stderr, "Error: out of memory\n");
+	 fail(p);
+      }
+      p->table_buffer = tmp;
+      p->table_size = need;
+   }
+   len = sprintf(p->table_buffer, "\nTABLE %s\n%s", filenames[which_file], header);
 
-      printf("\n");
+   for (j=0; j<=p->num_dat[which_file]; j++) {
+      const int *col = columns[which_file>5];
+      s = p->table_buffer + len;
+      /* station number, Moody column 1 */
+      s += format_station(s, (int)p->ws[which_file][0][j]);
+      for (i=0; (c=col[i]) >= 0; i++) {
+	 real x = p->ws[which_file][c][j];
+	 if (fabs(x) >= TABLE_LARGE) {
+	    /* make room for it, up to DBL_MAX, and the rest of the row */
+	    char big[512];
+	    int n = sprintf(big, "%8.1f", x);
+	    len = s - p->table_buffer;
+	    need = p->table_size + n + TABLE_ROW;
+	    if (!(s = realloc(p->table_buffer, need))) {
+	       fprintf(stderr, "Error: out of memory\n");
+	       fail(p);
+	    }
+	    p->table_buffer = s;
+	    p->table_size = need;
+	    s += len;
+	    memcpy(s, big, n);
+	    s += n;
+	 } else
+	    s += format_tenths(s, x);
+      }
+      *s++ = '\n';
+      len = s - p->table_buffer;
    }
+   report_bytes(p, p->table_buffer, len);
    return;
    
 }
 
+/*
+ * Running sum: return sum+x. In MOODY_KAHAN builds the rounding error
+ * is carried in *carry (start it at zero) and taken off the next term,
+ * as in Kahan's compensated summation; otherwise *carry is unused.
+ */
+real accumulate(real sum, real x, real *carry) {
+#if MOODY_PRECISION == MOODY_KAHAN
+   /* this needs IEEE arithmetic: no -ffast-math */
+   real y = x - *carry;
+   real t = sum + y;
+   *carry = (t - sum) - y;
+   return t;
+#else
+   (void)carry;
+   return sum + x;
+#endif
+}
+
+/*
+ * The last of the n+1 increasing station positions pos[] at or before
+ * position x, but before the last station
+ */
+int station_before(const real *pos, int n, real x) {
+   int lo = 0, hi = n-1;
+   while (lo < hi) {
+      int m = (lo+hi+1)/2;
+      if (pos[m] <= x) lo = m; else hi = m-1;
+   }
+   return lo;
+}
+
+/* Value at position x along a line with n+1 values h at positions pos[], linearly interpolated */
+real value_at(const real *pos, const real *h, int n, real x) {
+   int j = station_before(pos, n, x);
+   return h[j] + (x-pos[j])/(pos[j+1]-pos[j])*(h[j+1]-h[j]);
+}
+
 /* Return the "middle value" from a given column of the specified
  * sheet, meaning: If there are an odd number of rows, return the
  * middle one.  If there are an even number of rows, return average of
- * two middle ones.
+ * two middle ones. On a line with stations at their own positions,
+ * the middle value is interpolated halfway along the line instead.
  */
-float mid_value(int which_sheet, int which_column) {
-   int ndat = num_dat[which_sheet];
+real mid_value(struct moody_plate *p, int which_sheet, int which_column) {
+   int ndat = p->num_dat[which_sheet];
+   const real *pos = p->pos[which_sheet];
+   if (pos)
+      return value_at(pos, p->ws[which_sheet][which_column], ndat, 0.5*pos[ndat]);
    if (ndat % 2 == 0)
-      return ws[which_sheet][which_column][ndat/2];
+      return p->ws[which_sheet][which_column][ndat/2];
    else {
-      float a = ws[which_sheet][which_column][(ndat-1)/2];
-      float b = ws[which_sheet][which_column][(ndat+1)/2];
+      real a = p->ws[which_sheet][which_column][(ndat-1)/2];
+      real b = p->ws[which_sheet][which_column][(ndat+1)/2];
       return 0.5*(a+b);
    }
 }
 
 /* Carry out the "correction factor" jazz for perimeter and center lines */
-void shift_lines(int which_sheet) {
-   float correction_factor,should_be_zero;
+void shift_lines(struct moody_plate *p, int which_sheet) {
+   real correction_factor,should_be_zero,carry;
    int j;
    int i=which_sheet;
-   int ndat=num_dat[i];
+   int ndat=p->num_dat[i];
    
-   ws[i][4][ndat] = ws[i][5][ndat]-ws[i][3][ndat];
-   correction_factor = (ws[i][4][0]-ws[i][4][ndat])/ndat;
-   for (j=ndat-1; j>0; j--) {
-      ws[i][4][j]=ws[i][4][j+1]+correction_factor;
-      ws[i][5][j]=ws[i][4][j]+ws[i][3][j];
+   p->ws[i][4][ndat] = p->ws[i][5][ndat]-p->ws[i][3][ndat];
+   if (p->pos[i]) {
+      /* the correction is linear in the distance along the line */
+      const real *pos = p->pos[i];
+      correction_factor = (p->ws[i][4][0]-p->ws[i][4][ndat])/pos[ndat];
+      for (j=ndat-1; j>0; j--) {
+	 p->ws[i][4][j]=p->ws[i][4][ndat]+correction_factor*(pos[ndat]-pos[j]);
+	 p->ws[i][5][j]=p->ws[i][4][j]+p->ws[i][3][j];
+      }
+   } else {
+      correction_factor = (p->ws[i][4][0]-p->ws[i][4][ndat])/ndat;
+      for (carry=0.0, j=ndat-1; j>0; j--) {
+	 p->ws[i][4][j]=accumulate(p->ws[i][4][j+1], correction_factor, &carry);
+	 p->ws[i][5][j]=p->ws[i][4][j]+p->ws[i][3][j];
+      }
    }
 
    /* do column 6a for center lines only */
    if (which_sheet==6 || which_sheet==7) {
-      should_be_zero = mid_value(which_sheet, 5);
+      should_be_zero = mid_value(p, which_sheet, 5);
       for (j=0; j<=ndat; j++)
-	 ws[which_sheet][8][j]=ws[which_sheet][5][j]-should_be_zero;
+	 p->ws[which_sheet][8][j]=p->ws[which_sheet][5][j]-should_be_zero;
    }
    return;
 }
 
 /* carry out the "cumulative corrections" to the diagonals */
-void diagonal_correction(int which_sheet) {
+void diagonal_correction(struct moody_plate *p, int which_sheet) {
    int j;
-   int ndat=num_dat[which_sheet];      
-   float a= -1.0*ws[which_sheet][3][ndat]/ndat;
-   float b=  0.5*ws[which_sheet][3][ndat]-mid_value(which_sheet,3);      
+   int ndat=p->num_dat[which_sheet];      
+   real a= -1.0*p->ws[which_sheet][3][ndat]/line_span(p, which_sheet);
+   real b=  0.5*p->ws[which_sheet][3][ndat]-mid_value(p, which_sheet,3);      
    for (j=0;j<=ndat; j++) {
       /* column 5 */
-      ws[which_sheet][4][j]=a*j+b;
+      p->ws[which_sheet][4][j]=a*station_distance(p, which_sheet, j)+b;
       /* column 6 */
-      ws[which_sheet][5][j] = ws[which_sheet][3][j] + ws[which_sheet][4][j];
+      p->ws[which_sheet][5][j] = p->ws[which_sheet][3][j] + p->ws[which_sheet][4][j];
    }
    return;
 }
 
-/* compute the first four columns of the worksheets */
-void first_four_columns(int which_sheet) {
+/*
+ * Fill in the first four columns col[0] to col[3] of a worksheet
+ * with ndat readings in column 2, and stations at positions pos[] in
+ * foot spacings, or evenly spaced if pos is NULL
+ */
+void integrate_line(real *const *col, const real *pos, int ndat) {
+      real carry;
       int j;
-      int ndat=num_dat[which_sheet];
       /* label stations, Moody column 1 */
-      for (j=0; j<=ndat; j++) ws[which_sheet][0][j]=j+1;
+      for (j=0; j<=ndat; j++) col[0][j]=j+1;
       
       /* angular differences, Moody column 3 */
-      for (j=1; j<=ndat; j++) ws[which_sheet][2][j]=
-				 ws[which_sheet][1][j]-ws[which_sheet][1][1];
+      for (j=1; j<=ndat; j++) col[2][j]=col[1][j]-col[1][1];
+      /* times the length of each step, in foot spacings, if they differ */
+      if (pos)
+	 for (j=1; j<=ndat; j++) col[2][j] *= pos[j]-pos[j-1];
       
       /* sum of angular differences, Moody column 4 */
-      ws[which_sheet][3][0]=0.0;
-      ws[which_sheet][3][1]=0.0;
-      for (j=2; j<=ndat; j++) ws[which_sheet][3][j]=
-				 ws[which_sheet][3][j-1]+ws[which_sheet][2][j];
+      col[3][0]=0.0;
+      col[3][1]=0.0;
+      for (carry=0.0, j=2; j<=ndat; j++) col[3][j]=accumulate(col[3][j-1], col[2][j], &carry);
+      return;
+}
+
+/* compute the first four columns of the worksheets */
+void first_four_columns(struct moody_plate *p, int which_sheet) {
+      integrate_line(p->ws[which_sheet], p->pos[which_sheet], p->num_dat[which_sheet]);
       return;
 }
 
 /* search column 6 or 6a of all sheets for the min and max value */
-void return_low_and_high_point(float *pmin, float *pmax) {
+void return_low_and_high_point(struct moody_plate *p, real *pmin, real *pmax) {
    int i, j;
-   float min=ws[0][5][0];
-   float max=ws[0][5][0];
+   real min=p->ws[0][5][0];
+   real max=p->ws[0][5][0];
    
    /* loop over all worksheets */
    for (i=0; i<8; i++) {
       /* loop over all rows */
-      for (j=0; j<=num_dat[i]; j++) {
+      for (j=0; j<=p->num_dat[i]; j++) {
 	 /* select column six, except for center lines select column 6a */
-	 float tmp;
+	 real tmp;
 	 if (i==6 || i==7) 
-	    tmp = ws[i][8][j];
+	    tmp = p->ws[i][8][j];
 	 else
-	    tmp = ws[i][5][j];
+	    tmp = p->ws[i][5][j];
 
 	 /* keep track of the smallest and largest values */
 	 if (tmp<min) min=tmp;
@@ -408,47 +2330,56 @@ void return_low_and_high_point(float *pmin, float *pmax) {
    return;
 }
 
-void do_consistency_checks(void) {
-
+/*
+ * The lines are compared by their lengths in foot spacings, which for
+ * evenly spaced lines are their numbers of stations
+ */
+void do_consistency_checks(struct moody_plate *p) {
+   const char *what = uniform_plate(p) ? "number of stations" : "length in foot spacings";
    int i;
    
-   if (num_dat[0] != num_dat[1])
-      printf("Warning: the number of stations along the %s and %s diagonals\n"
-	     "are expected to be the same, but are not.\n", filenames[0], filenames[1]);
-   
+   if (fabs(line_span(p, 0) - line_span(p, 1)) > 0.5) {
+      p->warnings |= WARN_DIAGONALS;
+      report(p, "Warning: the %s along the %s and %s diagonals\n"
+	     "are expected to be the same, but are not.\n", what, filenames[0], filenames[1]);
+   }
+
    for (i=0; i<2; i++) {
-      int stat1=2+i;
-      int stat2=4+i;
-      int stat3=6+i;
+      real len1=line_span(p, 2+i);
+      real len2=line_span(p, 4+i);
+      real len3=line_span(p, 6+i);
 
       if (
-	  (num_dat[stat1] != num_dat[stat2]) ||
-	  (num_dat[stat2] != num_dat[stat3]) ||
-	  (num_dat[stat1] != num_dat[stat3])
-	  )
-            printf("Warning: the number of stations along the three lines\n"
+	  (fabs(len1 - len2) > 0.5) ||
+	  (fabs(len2 - len3) > 0.5) ||
+	  (fabs(len1 - len3) > 0.5)
+	  ) {
+	    p->warnings |= i ? WARN_LINES_NS : WARN_LINES_EW;
+            report(p, "Warning: the %s along the three lines\n"
 		   "%s, %s and %s are expected to be the same, but are not.\n",
-		   filenames[stat1], filenames[stat2], filenames[stat3]);
+		   what, filenames[2+i], filenames[4+i], filenames[6+i]);
+      }
    }
-   printf("\n");
+   report(p, "\n");
 
    /* Pythagoras check x^2+y^2=z^2 where x,y,z refer to data sets 2,3,0  and 4,5,1 */
    for (i=0; i<2; i++) {
-      int x=num_dat[2*i+2];
-      int y=num_dat[2*i+3];
-      int z=num_dat[i];
+      float x=line_span(p, 2*i+2);
+      float y=line_span(p, 2*i+3);
+      float z=line_span(p, i);
 	 
-      float diag_len = sqrt((float)x*(float)x+(float)y*(float)y);
+      float diag_len = sqrt(x*x+y*y);
 
       if (fabs(diag_len - z) > 1.5) {
-	 printf("Warning: the number of stations along the perimeter lines\n"
+	 p->warnings |= i ? WARN_PYTHAGORAS_NE_SW : WARN_PYTHAGORAS_NW_SE;
+	 report(p, "Warning: the %s along the perimeter lines\n"
 		"and diagonal lines appears to deviate significantly from\n"
 		"Pythagoras' Theorem x^2 + y^2 = z^2 for\n"
-		"x = %d, y = %d and z=%d\n",
-		x, y, z);
+		"x = %g, y = %g and z=%g\n",
+		what, x, y, z);
       }
    }
-   printf("\n");
+   report(p, "\n");
    return;
 }
 
@@ -470,32 +2401,433 @@ int max(int a, int b, int c) {
 }
 
 
+/*
+ * Dense height map. The eight lines divide the plate into eight
+ * triangular sectors, each with the center of the plate, one corner
+ * and the midpoint of one edge as vertices. The heights are known
+ * (from column 8) along all three sides of every sector: half a
+ * perimeter line, half a center line and half a diagonal. Inside a
+ * sector the height is interpolated with Nielson's side-vertex
+ * method, the triangular counterpart of a Coons patch: it reproduces
+ * the measured heights exactly along all three sides.
+ *
+ * Positions are normalized, u from West (0) to East (1) and v from
+ * South (0) to North (1). A position t along a line runs from 0 at
+ * its first station to 1 at its last one.
+ */
+
+/* Part of a line forming one side of a sector, from t0 to t1 */
+struct sector_side {
+   int line;
+   float t0, t1;
+};
+
+/*
+ * A sector with vertices center, corner and edge midpoint. Side k is
+ * opposite vertex k, and runs from vertex k+1 to vertex k+2 (mod 3).
+ */
+struct sector {
+   float u[3], v[3];
+   struct sector_side side[3];
+};
+
+/* In the order NE-N, NE-E, SE-E, SE-S, SW-S, SW-W, NW-W, NW-N */
+const struct sector sectors[8]={
+   {{0.5, 1.0, 0.5}, {0.5, 1.0, 1.0}, {{NE_NW, 0.0, 0.5}, {N_S, 0.0, 0.5}, {NE_SW, 0.5, 0.0}}},
+   {{0.5, 1.0, 1.0}, {0.5, 1.0, 0.5}, {{NE_SE, 0.0, 0.5}, {E_W, 0.0, 0.5}, {NE_SW, 0.5, 0.0}}},
+   {{0.5, 1.0, 1.0}, {0.5, 0.0, 0.5}, {{NE_SE, 1.0, 0.5}, {E_W, 0.0, 0.5}, {NW_SE, 0.5, 1.0}}},
+   {{0.5, 1.0, 0.5}, {0.5, 0.0, 0.0}, {{SE_SW, 0.0, 0.5}, {N_S, 1.0, 0.5}, {NW_SE, 0.5, 1.0}}},
+   {{0.5, 0.0, 0.5}, {0.5, 0.0, 0.0}, {{SE_SW, 1.0, 0.5}, {N_S, 1.0, 0.5}, {NE_SW, 0.5, 1.0}}},
+   {{0.5, 0.0, 0.0}, {0.5, 0.0, 0.5}, {{NW_SW, 1.0, 0.5}, {E_W, 1.0, 0.5}, {NE_SW, 0.5, 1.0}}},
+   {{0.5, 0.0, 0.0}, {0.5, 1.0, 0.5}, {{NW_SW, 0.0, 0.5}, {E_W, 1.0, 0.5}, {NW_SE, 0.5, 0.0}}},
+   {{0.5, 0.0, 0.5}, {0.5, 1.0, 1.0}, {{NE_NW, 1.0, 0.5}, {N_S, 0.0, 0.5}, {NW_SE, 0.5, 0.0}}}
+};
+
+/*
+ * A sector prepared for one plate: its barycentric coordinates as
+ * affine functions l[k] = a[k]*u + b[k]*v + c[k] of the position, and
+ * for each side the heights h (column 8) of its line, with n+1
+ * stations, and the position along the line as t0 + dt*s for s from
+ * 0 to 1 along the side
+ */
+struct sector_map {
+   float a[3], b[3], c[3];
+   const real *h[3], *pos[3];
+   int n[3];
+   float t0[3], dt[3];
+   float vh[3];
+};
+
+/*
+ * Height (column 8) at position t along a line with n+1 heights h, at
+ * positions pos[] or evenly spaced if pos is NULL, linearly interpolated
+ */
+real interpolate_line(const real *h, const real *pos, int n, float t) {
+   float x = t*n;
+   int j = (int)x;
+   if (pos) {
+      if (t >= 1) return h[n];
+      if (t <= 0) return h[0];
+      return value_at(pos, h, n, t*pos[n]);
+   }
+   if (j >= n) return h[n];
+   if (j < 0) return h[0];
+   return h[j] + (x-j)*(h[j+1]-h[j]);
+}
+
+/* Prepare sector s for interpolating the heights of plate p */
+void map_sector(struct moody_plate *p, const struct sector *s, struct sector_map *m) {
+   float det = (s->u[1]-s->u[0])*(s->v[2]-s->v[0]) - (s->u[2]-s->u[0])*(s->v[1]-s->v[0]);
+   int k;
+
+   /* barycentric coordinates 1 and 2 by Cramer's rule, and 0 from their sum */
+   m->a[1] = (s->v[2]-s->v[0])/det;
+   m->b[1] = -(s->u[2]-s->u[0])/det;
+   m->c[1] = -(m->a[1]*s->u[0] + m->b[1]*s->v[0]);
+   m->a[2] = -(s->v[1]-s->v[0])/det;
+   m->b[2] = (s->u[1]-s->u[0])/det;
+   m->c[2] = -(m->a[2]*s->u[0] + m->b[2]*s->v[0]);
+   m->a[0] = -m->a[1]-m->a[2];
+   m->b[0] = -m->b[1]-m->b[2];
+   m->c[0] = 1-m->c[1]-m->c[2];
+
+   for (k=0; k<3; k++) {
+      const struct sector_side *sd = &s->side[k];
+      m->h[k] = p->ws[sd->line][7];
+      m->pos[k] = p->pos[sd->line];
+      m->n[k] = p->num_dat[sd->line];
+      m->t0[k] = sd->t0;
+      m->dt[k] = sd->t1-sd->t0;
+   }
+   /*
+    * Height at each vertex, from the side that ends there. Because
+    * of Moody's column 6a shift, the ends of the center lines differ
+    * from the midpoints of the perimeter lines by the center line
+    * error; the midpoint vertices take the perimeter value.
+    */
+   for (k=0; k<3; k++) {
+      int sd = (k+1)%3;
+      m->vh[k] = interpolate_line(m->h[sd], m->pos[sd], m->n[sd], m->t0[sd] + m->dt[sd]);
+   }
+   return;
+}
+
+/* Side-vertex interpolation in sector m at normalized position (u,v) */
+float sector_height(const struct sector_map *m, float u, float v) {
+   float l[3], w[3], f[3], wsum;
+   int k;
+
+   for (k=0; k<3; k++) {
+      l[k] = m->a[k]*u + m->b[k]*v + m->c[k];
+      if (l[k]<0) l[k]=0;
+   }
+
+   /* weight of each side-vertex interpolant: one on its own side */
+   for (k=0; k<3; k++) {
+      w[k] = l[(k+1)%3]*l[(k+2)%3];
+      w[k] *= w[k];
+   }
+   wsum = w[0]+w[1]+w[2];
+   /* at a vertex */
+   if (wsum < 1e-20) {
+      k = l[0]>l[1] ? (l[0]>l[2] ? 0 : 2) : (l[1]>l[2] ? 1 : 2);
+      return m->vh[k];
+   }
+
+   /*
+    * Interpolant k: linear along the ray from vertex k through (u,v)
+    * to the point on side k where the ray ends
+    */
+   for (k=0; k<3; k++) {
+      float a = l[(k+1)%3], b = l[(k+2)%3];
+      float side = (a+b > 0) ? b/(a+b) : 0.5;
+      f[k] = l[k]*m->vh[k] +
+	 (1-l[k])*interpolate_line(m->h[k], m->pos[k], m->n[k], m->t0[k] + side*m->dt[k]);
+   }
+   return (w[0]*f[0] + w[1]*f[1] + w[2]*f[2])/wsum;
+}
+
+/* Which sector contains normalized position (u,v)? */
+int find_sector(float u, float v) {
+   float du = u-0.5, dv = v-0.5;
+   if (du >= 0)
+      return dv >= 0 ? (dv >= du ? 0 : 1) : (-dv >= du ? 3 : 2);
+   else
+      return dv < 0 ? (dv <= du ? 4 : 5) : (dv >= -du ? 7 : 6);
+}
+
+/* Length of line i, in whole foot spacings */
+int line_feet(struct moody_plate *p, int i) {
+   return p->pos[i] ? (int)(line_span(p, i)+0.5) : p->num_dat[i];
+}
+
+/*
+ * Extent of the plate in stations, as used for plotting, or in foot
+ * spacings (to the nearest one) if the stations are not evenly spaced
+ */
+void plate_extent(struct moody_plate *p, int *max_x, int *max_y) {
+   *max_x = max(line_feet(p, 2), line_feet(p, 4), line_feet(p, 6));
+   *max_y = max(line_feet(p, 3), line_feet(p, 5), line_feet(p, 7));
+   return;
+}
+
+/* Number of columns nx and rows ny of a height map of plate p, size points along its longer side */
+void grid_shape(struct moody_plate *p, int size, int *pnx, int *pny) {
+   int max_x, max_y, nx, ny;
+
+   plate_extent(p, &max_x, &max_y);
+   if (max_x >= max_y) {
+      nx = size;
+      ny = (int)((float)(nx-1)*max_y/max_x + 0.5) + 1;
+   } else {
+      ny = size;
+      nx = (int)((float)(ny-1)*max_x/max_y + 0.5) + 1;
+   }
+   if (nx < 2) nx = 2;
+   if (ny < 2) ny = 2;
+   *pnx = nx;
+   *pny = ny;
+   return;
+}
+
+/*
+ * Interpolate the heights of plate p over nx by ny points into z,
+ * row by row, from South to North, each row from West to East
+ */
+void fill_height_map(struct moody_plate *p, float *z, int nx, int ny) {
+   int r, c, k;
+   struct sector_map maps[8];
+
+   for (k=0; k<8; k++) map_sector(p, &sectors[k], &maps[k]);
+
+   /* row-major, so each row is written sequentially */
+   for (r=0; r<ny; r++) {
+      float v = (float)r/(ny-1);
+      float *row = z + (size_t)r*nx;
+      for (c=0; c<nx; c++) {
+	 float u = (float)c/(nx-1);
+	 row[c] = sector_height(&maps[find_sector(u, v)], u, v);
+      }
+   }
+   return;
+}
+
+/*
+ * Build the height map, with p->grid_size points along the longer
+ * side of the plate and proportionally fewer along the shorter one.
+ */
+void build_height_map(struct moody_plate *p) {
+   int nx, ny;
+
+   grid_shape(p, p->grid_size, &nx, &ny);
+
+   free(p->grid);
+   if (!(p->grid = malloc((size_t)nx*ny*sizeof(float)))) {
+      fprintf(stderr, "Error: out of memory for a %d x %d height map\n", nx, ny);
+      fail(p);
+   }
+   p->grid_nx = nx;
+   p->grid_ny = ny;
+   fill_height_map(p, p->grid, nx, ny);
+   return;
+}
+
+/*
+ * The gnuplot files are written in text (PLOT_TEXT) or in gnuplot's
+ * binary formats (PLOT_BINARY): float32 records of x, y and height
+ * for the lines, and a "binary matrix" for the height map, both in the
+ * byte order of this machine. Binary files are a fraction of the size
+ * and are read by gnuplot without parsing.
+ */
+#define PLOT_TEXT 0
+#define PLOT_BINARY 1
+
+/* Images of the plate rendered without gnuplot, see output_image() */
+#define IMAGE_NONE 0
+#define IMAGE_PNG 1
+#define IMAGE_SVG 2
+
+/* Meshes of the plate for 3D viewers, see output_mesh() */
+#define MESH_NONE 0
+#define MESH_GLTF 1
+#define MESH_PLY 2
+
+/* Contour maps of the plate, see output_contours() */
+#define CONTOUR_NONE 0
+#define CONTOUR_SVG 1
+#define CONTOUR_JSON 2
+
+/* The order of the lines in gnuplot.dat: diagonals, East-West, North-South */
+const int plot_order[8] = {0, 1, 2, 4, 6, 3, 5, 7};
+
+/* Position on the plate, as plotted, of station j of line i */
+void plot_position(const struct moody_plate *p, int i, int j, int max_x, int max_y,
+		   float *x, float *y) {
+   /* as fractions of the length of the line, which are exact for evenly spaced stations */
+   float max = line_span(p, i), s = station_distance(p, i, j);
+   if (i < 2) {
+      /* the diagonals */
+      *y = max_y*(max-s)/max;
+      *x = i==0 ? max_x*s/max : max_x*(max-s)/max;
+   } else if (i%2 == 0) {
+      /* the East to West lines, at these North/South locations */
+      if (i==2) *y=max_y; else if (i==4) *y=0; else *y=0.5*max_y;
+      *x = max_x*(max-s)/max;
+   } else {
+      /* the North to South lines, at these East/West locations */
+      if (i==3) *x=max_x; else if (i==5) *x=0; else *x=0.5*max_x;
+      *y = max_y*(max-s)/max;
+   }
+   return;
+}
+
+/*
+ * Format x into buf as printf("%f", x) does, and return the length.
+ * All plotted values are floats (in the float build), and a float of
+ * less than 2^32 times 10^6 is exact in double precision, so it is
+ * rounded to six decimals here as printf rounds it, to even on a tie;
+ * any other value is left to printf.
+ */
+int format_fixed(char *buf, double x) {
+   unsigned long long n, whole;
+   double v, r;
+   char digits[24];
+   int len = 0, k = 0, frac;
+
+   if (!(fabs(x) < 4.0e9) || (double)(float)x != x) return sprintf(buf, "%f", x);
+   if (signbit(x)) {
+      buf[len++] = '-';
+      x = -x;
+   }
+   v = x*1e6;
+   r = floor(v);
+   n = (unsigned long long)r;
+   if (v-r > 0.5 || (v-r == 0.5 && (n & 1))) n++;
+   whole = n/1000000;
+   frac = (int)(n%1000000);
+   do {
+      digits[k++] = (char)('0' + whole%10);
+      whole /= 10;
+   } while (whole);
+   while (k) buf[len++] = digits[--k];
+   buf[len++] = '.';
+   for (k=5; k>=0; k--, frac/=10) buf[len+k] = (char)('0' + frac%10);
+   return len+6;
+}
+
+/* A plot file, written through a buffer of PLOT_BUFFER bytes */
+#define PLOT_BUFFER 65536
+/* room left for a point before the buffer is flushed: three %f of any double */
+#define PLOT_POINT 1024
+
+struct plot_file {
+   struct moody_plate *p;
+   FILE *fp;
+   char *buf;
+   size_t len;
+};
+
+/* Open plot file fname of plate p as f, in mode "w" or "wb"; returns -1 if unable to */
+int open_plot(struct moody_plate *p, struct plot_file *f, const char *fname, const char *mode) {
+   if (!p->plot_buffer && !(p->plot_buffer = malloc(PLOT_BUFFER))) {
+      fprintf(stderr, "Error: out of memory\n");
+      return -1;
+   }
+   if (!(f->fp = fopen(fname, mode))) {
+      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+      return -1;
+   }
+   f->p = p;
+   f->buf = p->plot_buffer;
+   f->len = 0;
+   return 0;
+}
+
+void flush_plot(struct plot_file *f) {
+   fwrite(f->buf, 1, f->len, f->fp);
+   f->len = 0;
+   return;
+}
+
+void close_plot(struct plot_file *f) {
+   flush_plot(f);
+   close_output(f->p, f->fp);
+   return;
+}
+
+/* Write the n bytes at data, or the string s, to f */
+void plot_bytes(struct plot_file *f, const void *data, size_t n) {
+   if (f->len + n > PLOT_BUFFER) flush_plot(f);
+   if (n > PLOT_BUFFER) {
+      fwrite(data, 1, n, f->fp);
+      return;
+   }
+   memcpy(f->buf + f->len, data, n);
+   f->len += n;
+   return;
+}
+
+void plot_text(struct plot_file *f, const char *s) {
+   plot_bytes(f, s, strlen(s));
+   return;
+}
+
+/* Write point x, y, z to f as text, the way "%f %f %f\n" does */
+void plot_point(struct plot_file *f, double x, double y, double z) {
+   char *s;
+   if (f->len > PLOT_BUFFER - PLOT_POINT) flush_plot(f);
+   s = f->buf + f->len;
+   s += format_fixed(s, x);
+   *s++ = ' ';
+   s += format_fixed(s, y);
+   *s++ = ' ';
+   s += format_fixed(s, z);
+   *s++ = '\n';
+   f->len = s - f->buf;
+   return;
+}
+
+/* Write point x, y, z to f as three float32 */
+void plot_record(struct plot_file *f, float x, float y, float z) {
+   float r[3];
+   r[0] = x;
+   r[1] = y;
+   r[2] = z;
+   plot_bytes(f, r, sizeof(r));
+   return;
+}
+
 /* output a data file which can be plotted with gnuplot */
-void output_gnuplot(float biggest) {
-   int i,j;
+void output_gnuplot(struct moody_plate *p, real biggest) {
+   int i,j,k;
 
    FILE *fp;
-   char *fname;
-   const char *zlabels[2];   
-   int max_x = max(num_dat[2], num_dat[4], num_dat[6]);
-   int max_y = max(num_dat[3], num_dat[5], num_dat[7]);
+   struct plot_file f;
+   const char *fname;
+   char path[MAX_PATHLEN];
+   const char *zlabels[2];
+   int max_x, max_y;
    int max_z = (int)(1.0+biggest);
+   const char *prefix = p->prefix ? p->prefix : "";
+   int binary = p->plot_format == PLOT_BINARY;
+   long skip;
+   plate_extent(p, &max_x, &max_y);
    zlabels[0]="height\\nin\\ntens of\\nmicroinch";
    zlabels[1]="height\\nin\\nmicrons";
 
-   fname="gnuplot.cmd";
+   fname=plate_path(p, path, "gnuplot.cmd");
    if (!(fp=fopen(fname, "w"))) {
             fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
-	    exit(EXIT_FAILURE);
+	    fail(p);
    }
 
    fprintf(fp,
 	   "# The following command file can be used with gnuplot to produce\n"
 	   "# a 3-dimensional plot of the surface plate. The associated data\n"
-	   "# file is called \"gnuplot.dat\" and can be found in this directory.\n"
+	   "# file is called \"%sgnuplot.dat\" and can be found in this directory.\n"
 	   "#\n"
 	   "# On typical Unix/Linux/Mac systems, invoke gnuplot with:\n"
-	   "# gnuplot -c gnuplot.cmd\n"
+	   "# gnuplot -c %sgnuplot.cmd\n"
 	   "\n"
 	   "set term X11 enhanced\n"
 	   "set xyplane at 0\n"
@@ -506,202 +2838,7429 @@ void output_gnuplot(float biggest) {
 	   "set zrange [0:%d]\n"
 	   "set zlabel \"%s\"\n"
 	   "set key off\n"
-	   "splot [0:%d][0:%d][0:%d] \"gnuplot.dat\" using 1:2:3 with lines\n"
-	   "pause -1\n",
+	   "splot [0:%d][0:%d][0:%d] ",
+	   prefix, prefix,
 	   0.5*max_x,  1.1*max_y, 0.0,
 	   0.5*max_x, -0.1*max_y, 0.0,
 	   1.1*max_x, 0.5*max_y,  0.0,
 	   -0.1*max_x, 0.5*max_y,  0.0,
 	   max_z,
-	   zlabels[metric],
+	   zlabels[p->metric],
 	   max_x, max_y, max_z
 	   );
-   fclose(fp);
+   if (!binary)
+      fprintf(fp, "\"%sgnuplot.dat\" using 1:2:3 with lines", prefix);
+   else
+      /* a binary file has no blank lines to separate the lines, so each one is plotted by itself */
+      for (skip=0, k=0; k<8; skip+=12L*(p->num_dat[plot_order[k]]+1), k++)
+	 fprintf(fp, "%s\"%sgnuplot.dat\" binary record=%d skip=%ld"
+		 " format=\"%%float32%%float32%%float32\" using 1:2:3 with lines lt 1",
+		 k ? ", " : "", prefix, p->num_dat[plot_order[k]]+1, skip);
+   /* the height map is drawn as a surface under the eight lines */
+   if (p->grid)
+      fprintf(fp, ", \"%sgnuplot_grid.dat\" %susing 1:2:3 with pm3d",
+	      prefix, binary ? "binary matrix " : "");
+   fprintf(fp, "\npause -1\n");
+   close_output(p, fp);
 
-   fname="gnuplot.dat";
-   if (!(fp=fopen(fname, "w"))) {
-      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
-      exit(EXIT_FAILURE);
+   if (open_plot(p, &f, plate_path(p, path, "gnuplot.dat"), binary ? "wb" : "w")) fail(p);
+   if (!binary) {
+      fprintf(f.fp,
+	      "# This is a data file for use with gnuplot.\n"
+	      "# The corresponding command file in this directory\n"
+	      "# is called \"%sgnuplot.cmd\". Together these can be\n"
+	      "# used to generate a 3-d plot of the surface plate height.\n"
+	      "\n\n",
+	      prefix
+	      );
    }
-
-   fprintf(fp,
-	   "# This is a data file for use with gnuplot.\n"
-	   "# The corresponding command file in this directory\n"
-	   "# is called \"gnuplot.cmd\". Together these can be\n"
-	   "# used to generate a 3-d plot of the surface plate height.\n"
-	   "\n\n"
-	   );
-   
-   /* now output data, first for the two diagonals */
-   for (i=0; i<2; i++) {
-      int max=num_dat[i];
-      fprintf(fp,"# %s\n", filenames[i]);
-      for (j=0; j<=max; j++) {
-	 float x[2];
-	 float y = max_y*((float)(max-j))/max;
-	 x[0]= max_x*((float)j)/max;
-	 x[1]= max_x*((float)(max-j))/max;
-	 fprintf(fp, "%f %f %f\n", x[i], y, ws[i][7][j]);
+   for (k=0; k<8; k++) {
+      i = plot_order[k];
+      if (!binary) {
+	 plot_text(&f, "# ");
+	 plot_text(&f, filenames[i]);
+	 plot_text(&f, "\n");
+      }
+      for (j=0; j<=p->num_dat[i]; j++) {
+	 float x, y;
+	 plot_position(p, i, j, max_x, max_y, &x, &y);
+	 if (binary) plot_record(&f, x, y, (float)p->ws[i][7][j]);
+	 else plot_point(&f, x, y, p->ws[i][7][j]);
       }
-      fprintf(fp,"\n\n");
+      if (!binary) plot_text(&f, "\n\n");
    }
+   close_plot(&f);
 
-   /* three East to West lines */
-   for (i=2; i<=6; i+=2) {
-      float y;
-      int max = num_dat[i];
-      fprintf(fp,"# %s\n", filenames[i]);
-      /* the North/South locations of these three lines */
-      if (i==2) y=max_y; else if (i==4) y=0; else y=0.5*max_y;
-      for (j=0; j<=max; j++) {
-	 float x = max_x*((float)(max-j))/max;
-	 fprintf(fp, "%f %f %f\n", x, y, ws[i][7][j]);
+   if (!p->grid) return;
+
+   /*
+    * The height map: in text, one block per row; in binary, gnuplot's
+    * matrix of the number of columns and their x, then every row as
+    * its y and heights
+    */
+   if (open_plot(p, &f, plate_path(p, path, "gnuplot_grid.dat"), binary ? "wb" : "w")) fail(p);
+   if (binary) {
+      float v = (float)p->grid_nx;
+      plot_bytes(&f, &v, sizeof(v));
+      for (i=0; i<p->grid_nx; i++) {
+	 v = max_x*((float)i)/(p->grid_nx-1);
+	 plot_bytes(&f, &v, sizeof(v));
       }
-      fprintf(fp,"\n\n");
+      for (j=0; j<p->grid_ny; j++) {
+	 v = max_y*((float)j)/(p->grid_ny-1);
+	 plot_bytes(&f, &v, sizeof(v));
+	 plot_bytes(&f, p->grid + (size_t)j*p->grid_nx, (size_t)p->grid_nx*sizeof(float));
+      }
+      close_plot(&f);
+      return;
    }
+   fprintf(f.fp,
+	   "# Height map interpolated from the eight lines, for use with\n"
+	   "# the gnuplot command file \"%sgnuplot.cmd\".\n"
+	   "\n",
+	   prefix);
+   for (j=0; j<p->grid_ny; j++) {
+      float y = max_y*((float)j)/(p->grid_ny-1);
+      for (i=0; i<p->grid_nx; i++)
+	 plot_point(&f, max_x*((float)i)/(p->grid_nx-1), y, p->grid[(size_t)j*p->grid_nx+i]);
+      plot_text(&f, "\n");
+   }
+   close_plot(&f);
+   return;
+}
 
-   /* three North to South lines */
-   for (i=3; i<=7; i+=2) {
-      float x;
-      int  max = num_dat[i];
-      fprintf(fp,"# %s\n", filenames[i]);
-      /* the East/West locations of these three lines */
-      if (i==3) x=max_x; else if (i==5) x=0; else x=0.5*max_x;
-      for (j=0; j<=max; j++) {
-	 float y = max_y*((float)(max-j))/max;
-	 fprintf(fp, "%f %f %f\n", x, y, ws[i][7][j]);
-      }
-      fprintf(fp,"\n\n");
+/*
+ * Image of the plate, rendered without gnuplot for machines with no
+ * display: the eight lines over the height map, if there is one, seen
+ * as gnuplot's default view does, from 60 degrees off the vertical and
+ * turned 30 degrees. The height map is drawn as coloured cells, far
+ * ones first, at most IMAGE_CELLS along either side, so the cost of an
+ * image does not grow with the map.
+ */
+#define IMAGE_WIDTH 800
+#define IMAGE_HEIGHT 600
+#define IMAGE_MARGIN 40
+#define IMAGE_CELLS 100
+#define IMAGE_PI 3.14159265358979323846
+
+struct view {
+   double scale, height, cos_z, sin_z, cos_x, sin_x;
+   /* pixels per unit and the image position of the origin */
+   double pixels, x0, y0;
+};
+
+/* Project plate point x, y, z to image point *u, *v, at depth *d (larger is farther) */
+void project(const struct view *w, double x, double y, double z, double *u, double *v, double *d) {
+   double px = x*w->scale, py = y*w->scale, pz = z*w->height;
+   double rx = px*w->cos_z - py*w->sin_z, ry = px*w->sin_z + py*w->cos_z;
+   *u = w->x0 + w->pixels*rx;
+   *v = w->y0 - w->pixels*(ry*w->cos_x + pz*w->sin_x);
+   if (d) *d = ry*w->sin_x - pz*w->cos_x;
+   return;
+}
+
+/* The view of a plate of max_x by max_y by max_z, filling the image */
+void set_view(struct view *w, int max_x, int max_y, int max_z) {
+   double u, v, lo_u = 1e30, hi_u = -1e30, lo_v = 1e30, hi_v = -1e30;
+   int k;
+   w->scale = 1.0/(max_x > max_y ? max_x : max_y);
+   /* the heights take half the side of the plate, as in gnuplot */
+   w->height = 0.5/max_z;
+   w->cos_z = cos(IMAGE_PI/6);
+   w->sin_z = sin(IMAGE_PI/6);
+   w->cos_x = cos(IMAGE_PI/3);
+   w->sin_x = sin(IMAGE_PI/3);
+   w->pixels = 1.0;
+   w->x0 = w->y0 = 0.0;
+   for (k=0; k<8; k++) {
+      project(w, k&1 ? max_x : 0, k&2 ? max_y : 0, k&4 ? max_z : 0, &u, &v, NULL);
+      if (u < lo_u) lo_u = u;
+      if (u > hi_u) hi_u = u;
+      if (v < lo_v) lo_v = v;
+      if (v > hi_v) hi_v = v;
    }
-   fclose(fp);
+   w->pixels = (IMAGE_WIDTH-2*IMAGE_MARGIN)/(hi_u-lo_u);
+   if ((IMAGE_HEIGHT-2*IMAGE_MARGIN)/(hi_v-lo_v) < w->pixels)
+      w->pixels = (IMAGE_HEIGHT-2*IMAGE_MARGIN)/(hi_v-lo_v);
+   w->x0 = 0.5*IMAGE_WIDTH - w->pixels*0.5*(lo_u+hi_u);
+   w->y0 = 0.5*IMAGE_HEIGHT - w->pixels*0.5*(lo_v+hi_v);
    return;
 }
 
-void do_moody_consistency_checks(void) {
-   int i;
-   int printwarning=0;
+/* Colour of height t of 0 to 1: black, blue, red, yellow, like gnuplot's pm3d */
+void height_colour(double t, unsigned char rgb[3]) {
+   double b = sin(2*IMAGE_PI*t);
+   if (t < 0) t = 0;
+   if (t > 1) t = 1;
+   rgb[0] = (unsigned char)(255*sqrt(t));
+   rgb[1] = (unsigned char)(255*t*t*t);
+   rgb[2] = (unsigned char)(b > 0 ? 255*b : 0);
+   return;
+}
 
-   /* A couple of consistency checks */
-   printf("================================================================\n"
-	  "Measurement errors are estimated from the computed\n"
-	  "heights at the middle of the two center lines. Absent any\n"
-	  "measurement errors, these computed heights would be zero.\n"
-	  );
+/* A cell of the height map: its corners in the image, colour and depth */
+struct image_cell {
+   double u[4], v[4], depth;
+   unsigned char rgb[3];
+};
 
-   for (i=6; i<8; i++) {
-      float error = mid_value(i, 5)*arcsec*foot_spacing;
-      if (metric) {
-	 printf("Computed height at the center of the %s line: %4.2f microns.\n",
-		filenames[i],error);
-	 if (fabs(error)>2.54) printwarning=1;
-      } else {
-	 printf("Computed height at the center of the %s line: %4.2f micro-inches.\n",
-		filenames[i],10*error);
-	 if (fabs(error)>10.0) printwarning=1;
+int compare_cells(const void *a, const void *b) {
+   double da = ((const struct image_cell *)a)->depth, db = ((const struct image_cell *)b)->depth;
+   return da > db ? -1 : da < db;
+}
+
+/*
+ * The cells of the height map of p in view w, far ones first, in a
+ * block to be freed by the caller; sets *n to their number, 0 if
+ * there is no map, or -1 if out of memory.
+ */
+struct image_cell *image_cells(const struct moody_plate *p, const struct view *w, int max_x, int max_y,
+			       double max_z, int *n) {
+   struct image_cell *cells, *c;
+   int step, i, j, k, nx, ny;
+   double lo, hi;
+   size_t m;
+
+   *n = 0;
+   if (!p->grid) return NULL;
+   nx = p->grid_nx;
+   ny = p->grid_ny;
+   step = ((nx > ny ? nx : ny) - 2)/IMAGE_CELLS + 1;
+   for (lo=hi=p->grid[0], m=0; m<(size_t)nx*ny; m++) {
+      if (p->grid[m] < lo) lo = p->grid[m];
+      if (p->grid[m] > hi) hi = p->grid[m];
+   }
+   if (hi > max_z) hi = max_z;
+   if (!(cells = malloc(sizeof(*cells)*((nx-2)/step+1)*((ny-2)/step+1)))) {
+      *n = -1;
+      return NULL;
+   }
+   for (c=cells, j=0; j+1<ny; j+=step)
+      for (i=0; i+1<nx; i+=step, c++) {
+	 int i1 = i+step < nx ? i+step : nx-1, j1 = j+step < ny ? j+step : ny-1;
+	 int ci[4], cj[4];
+	 double mean = 0.0, d, depth = 0.0;
+	 ci[0] = i;  cj[0] = j;
+	 ci[1] = i1; cj[1] = j;
+	 ci[2] = i1; cj[2] = j1;
+	 ci[3] = i;  cj[3] = j1;
+	 for (k=0; k<4; k++) {
+	    float z = p->grid[(size_t)cj[k]*nx+ci[k]];
+	    project(w, max_x*(double)ci[k]/(nx-1), max_y*(double)cj[k]/(ny-1), z,
+		    &c->u[k], &c->v[k], &d);
+	    mean += 0.25*z;
+	    depth += 0.25*d;
+	 }
+	 c->depth = depth;
+	 height_colour(hi > lo ? (mean-lo)/(hi-lo) : 0.5, c->rgb);
       }
+   *n = c - cells;
+   qsort(cells, *n, sizeof(*cells), compare_cells);
+   return cells;
+}
+
+/*
+ * Fill triangle u, v of img, an RGB raster of IMAGE_WIDTH by
+ * IMAGE_HEIGHT. Its bounding box is clipped to the image before it is
+ * converted to pixels, so that any coordinates are safe.
+ */
+void fill_triangle(unsigned char *img, const double *u, const double *v, const unsigned char rgb[3]) {
+   double area = (u[1]-u[0])*(v[2]-v[0]) - (u[2]-u[0])*(v[1]-v[0]);
+   double lu = u[0], hu = u[0], lv = v[0], hv = v[0];
+   int x, y, lo_x, hi_x, lo_y, hi_y, k;
+   if (!isfinite(area) || area == 0) return;
+   for (k=1; k<3; k++) {
+      if (u[k] < lu) lu = u[k];
+      if (u[k] > hu) hu = u[k];
+      if (v[k] < lv) lv = v[k];
+      if (v[k] > hv) hv = v[k];
    }
-   if (printwarning)
-      printf("Warning: measurement errors are larger than Moody considers\n"
-	     "acceptable (100 micro-inch = 2.54 microns). The job must be done over!\n");
-   else
-      printf("According to Moody these errors are acceptable, because their\n"
-	     "magnitude is less than 100 micro-inch = 2.54 microns.\n");
-   printf("================================================================\n");
+   if (hu < 0 || hv < 0 || lu >= IMAGE_WIDTH || lv >= IMAGE_HEIGHT) return;
+   lo_x = lu < 0 ? 0 : (int)lu;
+   lo_y = lv < 0 ? 0 : (int)lv;
+   hi_x = hu >= IMAGE_WIDTH ? IMAGE_WIDTH-1 : (int)hu;
+   hi_y = hv >= IMAGE_HEIGHT ? IMAGE_HEIGHT-1 : (int)hv;
+   for (y=lo_y; y<=hi_y; y++)
+      for (x=lo_x; x<=hi_x; x++) {
+	 /* pixel centres on or inside all three edges, the same way round as the triangle */
+	 double px = x+0.5, py = y+0.5, e[3];
+	 for (k=0; k<3; k++) {
+	    int a = k, b = (k+1)%3;
+	    e[k] = ((u[b]-u[a])*(py-v[a]) - (px-u[a])*(v[b]-v[a]))*(area > 0 ? 1 : -1);
+	 }
+	 if (e[0] >= 0 && e[1] >= 0 && e[2] >= 0)
+	    memcpy(img + 3*((size_t)y*IMAGE_WIDTH+x), rgb, 3);
+      }
    return;
 }
 
-/* The main routine is structured to follow Moody's recipe closely */
-int main(int argc, char *argv[]) {
+/*
+ * Clip the segment from u0, v0 to u1, v1 to the image and a pixel
+ * around it, by Liang and Barsky's method. Returns 0 if nothing of it
+ * is left. A segment inside the image is left as it is.
+ */
+int clip_segment(double *u0, double *v0, double *u1, double *v1) {
+   double du = *u1-*u0, dv = *v1-*v0, t0 = 0.0, t1 = 1.0, p[4], q[4];
+   int k;
+   if (!isfinite(du) || !isfinite(dv)) return 0;
+   p[0] = -du;  q[0] = *u0+1;
+   p[1] = du;   q[1] = IMAGE_WIDTH+1-*u0;
+   p[2] = -dv;  q[2] = *v0+1;
+   p[3] = dv;   q[3] = IMAGE_HEIGHT+1-*v0;
+   for (k=0; k<4; k++)
+      if (p[k] == 0) {
+	 if (q[k] < 0) return 0;
+      } else if (p[k] < 0) {
+	 if (q[k]/p[k] > t0) t0 = q[k]/p[k];
+      } else if (q[k]/p[k] < t1)
+	 t1 = q[k]/p[k];
+   if (t0 > t1) return 0;
+   if (t1 < 1.0) {
+      *u1 = *u0 + t1*du;
+      *v1 = *v0 + t1*dv;
+   }
+   if (t0 > 0.0) {
+      *u0 += t0*du;
+      *v0 += t0*dv;
+   }
+   return 1;
+}
 
-   int i,j;
-   float lowest, highest;
+/* Draw the line from u0, v0 to u1, v1 on img */
+void draw_line(unsigned char *img, double u0, double v0, double u1, double v1, const unsigned char rgb[3]) {
+   double du, dv, len;
+   int steps, k, x, y;
+   if (!clip_segment(&u0, &v0, &u1, &v1)) return;
+   du = u1-u0;
+   dv = v1-v0;
+   len = fabs(du) > fabs(dv) ? fabs(du) : fabs(dv);
+   steps = (int)len + 1;
+   for (k=0; k<=steps; k++) {
+      /* two pixels wide */
+      x = (int)(u0 + du*k/steps);
+      y = (int)(v0 + dv*k/steps);
+      if (x >= 0 && x+1 < IMAGE_WIDTH && y >= 0 && y < IMAGE_HEIGHT) {
+	 memcpy(img + 3*((size_t)y*IMAGE_WIDTH+x), rgb, 3);
+	 memcpy(img + 3*((size_t)y*IMAGE_WIDTH+x+1), rgb, 3);
+      }
+   }
+   return;
+}
 
-   /* Print out license information */
-   print_license();
-   
-   /* Read configuration file */
-   read_config_file();
-   
-   /* Read data from input files*/
-   for (i=0; i<8; i++) read_data(i);
-   printf("\n");
+/* Big-endian 32-bit values, as PNG has them */
+void put_be32(unsigned char *b, unsigned long v) {
+   b[0] = (v>>24) & 0xff;
+   b[1] = (v>>16) & 0xff;
+   b[2] = (v>>8) & 0xff;
+   b[3] = v & 0xff;
+   return;
+}
 
-   /* Check for consistency of the input data */
-   do_consistency_checks();
+/*
+ * PNG encoding: the rows of the image, each after filter byte 0, go
+ * into a single deflate block with the fixed Huffman codes, where runs
+ * of a pixel are a copy of the one before it (distance 3), which is
+ * what most of a plot is.
+ */
+struct bit_writer {
+   unsigned char *out;
+   size_t len;
+   unsigned long acc;
+   int bits;
+};
 
-   /* Step through all eight worksheets, doing first four columns */
-   for (i=0; i<8; i++) first_four_columns(i);
-   
-   /* Moody columns 5 and 6 for diagonal lines */
-   for (i=0; i<2; i++) diagonal_correction(i);
-
-   /* Moody columns 5 and 6 for perimeter lines. */
-   /* Copy NE corner into worksheets */
-   ws[2][4][0] = ws[2][5][0] = ws[3][4][0] = ws[3][5][0] = ws[1][5][0];
-   /* Copy SW corner into worksheets */
-   ws[4][5][num_dat[4]] = ws[5][5][num_dat[5]] = ws[1][5][num_dat[1]];
-   /* Copy NW corner into worksheets */
-   ws[2][5][num_dat[2]]= ws[5][4][0]= ws[5][5][0]= ws[0][5][0];
-   /* Copy SE corner into worksheets */
-   ws[3][5][num_dat[3]] = ws[4][4][0] = ws[4][5][0] = ws[0][5][num_dat[0]];
-
-   /* Perimeter line correction factors */
-   for (i=2; i<6; i++) shift_lines(i);
-   
-   /* Moody columns 5 and 6 for center lines */
-   /* Copy midpoints of perimeter E-W (East end) */
-   ws[6][4][0] = ws[6][5][0] = mid_value(3,5);
-   /* Copy E-W (West end) */
-   ws[6][5][num_dat[6]] = mid_value(5,5);
-   /* Copy N-S (North end) */
-   ws[7][4][0] = ws[7][5][0] = mid_value(2,5);   
-   /* Copy N-S (South end) */
-   ws[7][5][num_dat[7]] = mid_value(4,5);
-
-   /* Center line correction factors and column 6a */
-   for (i=6; i<8; i++) shift_lines(i);
+void put_bits(struct bit_writer *b, unsigned long value, int n) {
+   b->acc |= value << b->bits;
+   b->bits += n;
+   while (b->bits >= 8) {
+      b->out[b->len++] = (unsigned char)b->acc;
+      b->acc >>= 8;
+      b->bits -= 8;
+   }
+   return;
+}
 
-   /* Compute Moody column 7  */
-   
-   /* For diagonals and perimeter lines */
-   return_low_and_high_point(&lowest, &highest);
-   for (i=0; i<6; i++)
-      for (j=0; j<=num_dat[i]; j++)
-	 ws[i][6][j]=ws[i][5][j]-lowest;
-   /* and for the center lines */
-   for (i=6; i<8; i++)
-      for (j=0; j<=num_dat[i]; j++)
-	 ws[i][6][j]=ws[i][8][j]-lowest;
+/* Huffman codes are sent from their first bit */
+void put_code(struct bit_writer *b, unsigned code, int n) {
+   unsigned long r = 0;
+   int k;
+   for (k=0; k<n; k++) r |= (unsigned long)((code >> k) & 1) << (n-1-k);
+   put_bits(b, r, n);
+   return;
+}
 
-   /* To convert from angle to distance */
-   if (metric) {
-      /* output in microns */
-      foot_spacing *= 1000.0;
-   } else {
-      /* output in 1/100,000 of an inch */
-      foot_spacing *= 100000.0;
+void put_symbol(struct bit_writer *b, int sym) {
+   if (sym < 144) put_code(b, 0x30+sym, 8);
+   else if (sym < 256) put_code(b, 0x190+sym-144, 9);
+   else if (sym < 280) put_code(b, sym-256, 7);
+   else put_code(b, 0xc0+sym-280, 8);
+   return;
+}
+
+void put_copy(struct bit_writer *b, int len) {
+   static const int base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+				35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+   static const int extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+				 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+   int k = 28;
+   while (base[k] > len) k--;
+   put_symbol(b, 257+k);
+   put_bits(b, len-base[k], extra[k]);
+   /* distance 3 */
+   put_code(b, 2, 5);
+   return;
+}
+
+/* Deflate the n bytes at data into a zlib stream at out, of room n+n/8+64; returns its length */
+size_t deflate_runs(const unsigned char *data, size_t n, unsigned char *out) {
+   struct bit_writer b;
+   unsigned long s1 = 1, s2 = 0;
+   size_t i, k;
+   b.out = out;
+   b.len = 0;
+   b.acc = 0;
+   b.bits = 0;
+   out[b.len++] = 0x78;
+   out[b.len++] = 0x01;
+   /* last block, fixed codes */
+   put_bits(&b, 1, 1);
+   put_bits(&b, 1, 2);
+   for (i=0; i<n; ) {
+      for (k=0; i>=3 && i+k<n && k<258 && data[i+k]==data[i+k-3]; k++);
+      if (k >= 3) {
+	 put_copy(&b, (int)k);
+	 i += k;
+      } else
+	 put_symbol(&b, data[i++]);
    }
-   
-   /* Now fill in column 8 */
-   for (i=0; i<8; i++)
-      for (j=0; j<=num_dat[i]; j++)
-	    ws[i][7][j] = ws[i][6][j]*arcsec*foot_spacing;
+   put_symbol(&b, 256);
+   if (b.bits) put_bits(&b, 0, 8-b.bits);
+   /* Adler-32, reduced every 5552 bytes, the most that cannot overflow */
+   for (i=0; i<n; ) {
+      for (k=i+5552 < n ? i+5552 : n; i<k; i++) {
+	 s1 += data[i];
+	 s2 += s1;
+      }
+      s1 %= 65521;
+      s2 %= 65521;
+   }
+   put_be32(out + b.len, (s2 << 16) | s1);
+   return b.len + 4;
+}
 
-   /* Check if the middle of the center lines falls at zero as it should */
-   do_moody_consistency_checks();
-   
-   /* Print out the completed worksheet */
-   for (i=0; i<8; i++) print_table(i);
+unsigned long png_crc(const unsigned char *data, size_t n, unsigned long crc) {
+   size_t i;
+   int k;
+   for (i=0; i<n; i++) {
+      crc ^= data[i];
+      for (k=0; k<8; k++) crc = crc & 1 ? 0xedb88320UL ^ (crc >> 1) : crc >> 1;
+   }
+   return crc;
+}
 
-   /* Maximum height over plate, with units */
-   highest = (highest-lowest)*arcsec*foot_spacing;
-   
-   /* Output a surface plot */
-   output_gnuplot(highest);
-   
+void png_chunk(FILE *fp, const char *type, const unsigned char *data, size_t n) {
+   unsigned char b[4];
+   put_be32(b, n);
+   fwrite(b, 1, 4, fp);
+   fwrite(type, 1, 4, fp);
+   if (n) fwrite(data, 1, n, fp);
+   put_be32(b, png_crc(data, n, png_crc((const unsigned char *)type, 4, 0xffffffffUL)) ^ 0xffffffffUL);
+   fwrite(b, 1, 4, fp);
+   return;
+}
+
+/* Write image img to PNG file fname of plate p; returns -1 if unable to */
+int write_png(struct moody_plate *p, const char *fname, const unsigned char *img) {
+   size_t row = 3*IMAGE_WIDTH+1, n = row*IMAGE_HEIGHT, len;
+   unsigned char *raw, *z, head[13];
+   FILE *fp;
+   int y;
+
+   raw = malloc(n);
+   z = malloc(n+n/8+64);
+   if (!raw || !z) {
+      free(raw);
+      free(z);
+      fprintf(stderr, "Error: out of memory\n");
+      return -1;
+   }
+   for (y=0; y<IMAGE_HEIGHT; y++) {
+      raw[y*row] = 0;
+      memcpy(raw+y*row+1, img+(size_t)y*3*IMAGE_WIDTH, 3*IMAGE_WIDTH);
+   }
+   len = deflate_runs(raw, n, z);
+   free(raw);
+   if (!(fp = fopen(fname, "wb"))) {
+      free(z);
+      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+      return -1;
+   }
+   put_be32(head, IMAGE_WIDTH);
+   put_be32(head+4, IMAGE_HEIGHT);
+   /* 8 bits per channel, RGB, deflate, no interlace */
+   head[8] = 8;
+   head[9] = 2;
+   head[10] = head[11] = head[12] = 0;
+   fwrite("\211PNG\r\n\032\n", 1, 8, fp);
+   png_chunk(fp, "IHDR", head, sizeof(head));
+   png_chunk(fp, "IDAT", z, len);
+   png_chunk(fp, "IEND", NULL, 0);
+   free(z);
+   close_output(p, fp);
    return 0;
 }
 
+/*
+ * Render plate p, with heights up to biggest, to surface.png or
+ * surface.svg in its directory.
+ */
+void output_image(struct moody_plate *p, real biggest) {
+   static const unsigned char line_rgb[3] = {0, 0, 0}, base_rgb[3] = {160, 160, 160};
+   static const char *labels[4] = {"N", "S", "E", "W"};
+   double lx[4], ly[4], u[4], v[4];
+   struct image_cell *cells;
+   struct view w;
+   char path[MAX_PATHLEN];
+   const char *fname;
+   /* like output_gnuplot(), but safe for any height */
+   int max_x, max_y, max_z = biggest < INT_MAX-1 ? (int)(1.0+biggest) : INT_MAX;
+   int n, i, j, k;
 
+   plate_extent(p, &max_x, &max_y);
+   set_view(&w, max_x, max_y, max_z);
+   if (!(cells = image_cells(p, &w, max_x, max_y, max_z, &n)) && n < 0) {
+      fprintf(stderr, "Error: out of memory\n");
+      fail(p);
+   }
+   /* the outline of the plate, and where its sides are labelled */
+   project(&w, 0, 0, 0, &u[0], &v[0], NULL);
+   project(&w, max_x, 0, 0, &u[1], &v[1], NULL);
+   project(&w, max_x, max_y, 0, &u[2], &v[2], NULL);
+   project(&w, 0, max_y, 0, &u[3], &v[3], NULL);
+   project(&w, 0.5*max_x, 1.1*max_y, 0, &lx[0], &ly[0], NULL);
+   project(&w, 0.5*max_x, -0.1*max_y, 0, &lx[1], &ly[1], NULL);
+   project(&w, 1.1*max_x, 0.5*max_y, 0, &lx[2], &ly[2], NULL);
+   project(&w, -0.1*max_x, 0.5*max_y, 0, &lx[3], &ly[3], NULL);
 
+   if (p->image == IMAGE_SVG) {
+      struct plot_file f;
+      char s[128];
+      fname = plate_path(p, path, "surface.svg");
+      if (open_plot(p, &f, fname, "w")) {
+	 free(cells);
+	 fail(p);
+      }
+      snprintf(s, sizeof(s), "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\">\n"
+	       "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n", IMAGE_WIDTH, IMAGE_HEIGHT);
+      plot_text(&f, s);
+      snprintf(s, sizeof(s), "<polygon points=\"%.1f,%.1f %.1f,%.1f %.1f,%.1f %.1f,%.1f\" fill=\"none\" stroke=\"#a0a0a0\"/>\n",
+	       u[0], v[0], u[1], v[1], u[2], v[2], u[3], v[3]);
+      plot_text(&f, s);
+      for (k=0; k<n; k++) {
+	 struct image_cell *c = cells+k;
+	 snprintf(s, sizeof(s), "<polygon points=\"%.1f,%.1f %.1f,%.1f %.1f,%.1f %.1f,%.1f\" fill=\"#%02x%02x%02x\"",
+		  c->u[0], c->v[0], c->u[1], c->v[1], c->u[2], c->v[2], c->u[3], c->v[3],
+		  c->rgb[0], c->rgb[1], c->rgb[2]);
+	 plot_text(&f, s);
+	 /* outlined in its own colour, so neighbours leave no seams */
+	 snprintf(s, sizeof(s), " stroke=\"#%02x%02x%02x\" stroke-width=\"0.5\"/>\n", c->rgb[0], c->rgb[1], c->rgb[2]);
+	 plot_text(&f, s);
+      }
+      for (k=0; k<8; k++) {
+	 i = plot_order[k];
+	 plot_text(&f, "<polyline fill=\"none\" stroke=\"black\" stroke-width=\"1.5\" points=\"");
+	 for (j=0; j<=p->num_dat[i]; j++) {
+	    float x, y;
+	    double pu, pv;
+	    plot_position(p, i, j, max_x, max_y, &x, &y);
+	    project(&w, x, y, p->ws[i][7][j], &pu, &pv, NULL);
+	    snprintf(s, sizeof(s), "%s%.1f,%.1f", j ? " " : "", pu, pv);
+	    plot_text(&f, s);
+	 }
+	 plot_text(&f, "\"/>\n");
+      }
+      for (k=0; k<4; k++) {
+	 snprintf(s, sizeof(s), "<text x=\"%.1f\" y=\"%.1f\" font-family=\"sans-serif\" font-size=\"16\""
+		  " text-anchor=\"middle\">%s</text>\n", lx[k], ly[k], labels[k]);
+	 plot_text(&f, s);
+      }
+      snprintf(s, sizeof(s), "<text x=\"%d\" y=\"24\" font-family=\"sans-serif\" font-size=\"16\">"
+	       "Flatness %.2f %s</text>\n",
+	       IMAGE_MARGIN, (double)p->flatness, p->metric ? "microns" : "tens of microinch");
+      plot_text(&f, s);
+      plot_text(&f, "</svg>\n");
+      close_plot(&f);
+      free(cells);
+      return;
+   }
 
+   /* the raster is the plot buffer's size or larger, so it has its own */
+   {
+      unsigned char *img = malloc((size_t)3*IMAGE_WIDTH*IMAGE_HEIGHT);
+      if (!img) {
+	 free(cells);
+	 fprintf(stderr, "Error: out of memory\n");
+	 fail(p);
+      }
+      memset(img, 255, (size_t)3*IMAGE_WIDTH*IMAGE_HEIGHT);
+      for (k=0; k<4; k++) draw_line(img, u[k], v[k], u[(k+1)%4], v[(k+1)%4], base_rgb);
+      for (k=0; k<n; k++) {
+	 double tu[3], tv[3];
+	 struct image_cell *c = cells+k;
+	 fill_triangle(img, c->u, c->v, c->rgb);
+	 tu[0] = c->u[0]; tv[0] = c->v[0];
+	 tu[1] = c->u[2]; tv[1] = c->v[2];
+	 tu[2] = c->u[3]; tv[2] = c->v[3];
+	 fill_triangle(img, tu, tv, c->rgb);
+      }
+      free(cells);
+      for (k=0; k<8; k++) {
+	 double pu, pv, qu = 0, qv = 0;
+	 i = plot_order[k];
+	 for (j=0; j<=p->num_dat[i]; j++) {
+	    float x, y;
+	    plot_position(p, i, j, max_x, max_y, &x, &y);
+	    project(&w, x, y, p->ws[i][7][j], &pu, &pv, NULL);
+	    if (j) draw_line(img, qu, qv, pu, pv, line_rgb);
+	    qu = pu;
+	    qv = pv;
+	 }
+      }
+      fname = plate_path(p, path, "surface.png");
+      k = write_png(p, fname, img);
+      free(img);
+      if (k) fail(p);
+   }
+   return;
+}
+
+/*
+ * Triangle mesh of the plate for 3D viewers, such as those of web
+ * browsers: the height map of -g, or else one with a point at every
+ * foot along the longer side, as two triangles per cell, with a normal
+ * and the colour of the image by height at every point. Level of
+ * detail K keeps every 2^K-th row and column of the map, and its last
+ * ones, from level 0 at full size until neither side has more than
+ * MESH_COARSEST points; each level is a file of its own,
+ * surface_lodK.glb (binary glTF) or surface_lodK.ply, so that a viewer
+ * can show the coarsest at once and finer ones as they arrive.
+ *
+ * Positions are in meters from the SW corner of the plate, with the
+ * heights above the lowest point multiplied by the exaggeration, by
+ * default the one making the flatness MESH_RELIEF of the longer side.
+ * The PLY axes are x East, y North and z up; glTF has y up, so its
+ * are x East, y up and z South. Both are little-endian.
+ */
+#define MESH_LEVELS 12
+#define MESH_COARSEST 32
+#define MESH_RELIEF 0.1
+/* bytes of a vertex: position and normal, and the colour (RGBA in glTF, RGB in PLY) */
+#define MESH_VERTEX 28
+
+struct mesh {
+   const float *z;
+   int nx, ny;
+   /* meters between the columns and rows of the map, and per unit of height */
+   double dx, dy, dz;
+   /* range of the heights, for the colours */
+   float lo, hi;
+   /* every step-th column and row of the map, cols by rows points */
+   int step, cols, rows;
+};
+
+/* Column or row of the map of point k of n at this level */
+int mesh_index(const struct mesh *m, int k, int n, int count) {
+   return k < count-1 ? k*m->step : n-1;
+}
+
+/*
+ * Point k, l (column and row) of this level of mesh m, with x East,
+ * y North and z up, its unit normal and its colour
+ */
+void mesh_point(const struct mesh *m, int k, int l, float pos[3], float nrm[3], unsigned char rgb[3]) {
+   int c = mesh_index(m, k, m->nx, m->cols), r = mesh_index(m, l, m->ny, m->rows);
+   int c0 = mesh_index(m, k ? k-1 : k, m->nx, m->cols), c1 = mesh_index(m, k+1 < m->cols ? k+1 : k, m->nx, m->cols);
+   int r0 = mesh_index(m, l ? l-1 : l, m->ny, m->rows), r1 = mesh_index(m, l+1 < m->rows ? l+1 : l, m->ny, m->rows);
+   const float *row = m->z + (size_t)r*m->nx;
+   double hx, hy, len;
+
+   pos[0] = (float)(c*m->dx);
+   pos[1] = (float)(r*m->dy);
+   pos[2] = (float)(row[c]*m->dz);
+   /* the slopes, from the neighbours at this level */
+   hx = (row[c1]-row[c0])*m->dz/((c1-c0)*m->dx);
+   hy = (m->z[(size_t)r1*m->nx+c]-m->z[(size_t)r0*m->nx+c])*m->dz/((r1-r0)*m->dy);
+   len = sqrt(hx*hx + hy*hy + 1.0);
+   nrm[0] = (float)(-hx/len);
+   nrm[1] = (float)(-hy/len);
+   nrm[2] = (float)(1.0/len);
+   height_colour(m->hi > m->lo ? (row[c]-m->lo)/(m->hi-m->lo) : 0.0, rgb);
+   return;
+}
+
+/* Write the vertices of this level of mesh m to f, for glTF if gltf and for PLY otherwise */
+void write_mesh_vertices(struct plot_file *f, const struct mesh *m, int gltf) {
+   unsigned char b[MESH_VERTEX];
+   float pos[3], nrm[3];
+   int k, l;
+
+   for (l=0; l<m->rows; l++)
+      for (k=0; k<m->cols; k++) {
+	 mesh_point(m, k, l, pos, nrm, b+24);
+	 if (gltf) {
+	    put_le_float(b, pos[0]);
+	    put_le_float(b+4, pos[2]);
+	    put_le_float(b+8, -pos[1]);
+	    put_le_float(b+12, nrm[0]);
+	    put_le_float(b+16, nrm[2]);
+	    put_le_float(b+20, -nrm[1]);
+	    b[27] = 255;
+	    plot_bytes(f, b, MESH_VERTEX);
+	 } else {
+	    put_le_float(b, pos[0]);
+	    put_le_float(b+4, pos[1]);
+	    put_le_float(b+8, pos[2]);
+	    put_le_float(b+12, nrm[0]);
+	    put_le_float(b+16, nrm[1]);
+	    put_le_float(b+20, nrm[2]);
+	    plot_bytes(f, b, MESH_VERTEX-1);
+	 }
+      }
+   return;
+}
+
+/*
+ * Write the triangles of this level of mesh m to f, counterclockwise
+ * seen from above: as indices of size bytes for glTF, or as PLY faces
+ */
+void write_mesh_triangles(struct plot_file *f, const struct mesh *m, int size, int gltf) {
+   unsigned char b[13];
+   unsigned long v[6];
+   int k, l, t;
+
+   b[0] = 3;
+   for (l=0; l+1<m->rows; l++)
+      for (k=0; k+1<m->cols; k++) {
+	 v[0] = (unsigned long)l*m->cols + k;
+	 v[1] = v[0]+1;
+	 v[2] = v[1]+m->cols;
+	 v[3] = v[0];
+	 v[4] = v[2];
+	 v[5] = v[0]+m->cols;
+	 for (t=0; t<6; t+=3)
+	    if (!gltf) {
+	       put_le32(b+1, v[t]);
+	       put_le32(b+5, v[t+1]);
+	       put_le32(b+9, v[t+2]);
+	       plot_bytes(f, b, 13);
+	    } else if (size == 2) {
+	       b[1] = v[t] & 0xff;
+	       b[2] = v[t] >> 8;
+	       b[3] = v[t+1] & 0xff;
+	       b[4] = v[t+1] >> 8;
+	       b[5] = v[t+2] & 0xff;
+	       b[6] = v[t+2] >> 8;
+	       plot_bytes(f, b+1, 6);
+	    } else {
+	       put_le32(b+1, v[t]);
+	       put_le32(b+5, v[t+1]);
+	       put_le32(b+9, v[t+2]);
+	       plot_bytes(f, b+1, 12);
+	    }
+      }
+   return;
+}
+
+/*
+ * Write this level of mesh m of plate p, of levels, with heights
+ * exaggerated exaggeration times, to file fname; returns -1 if unable to
+ */
+int write_mesh_level(struct moody_plate *p, const struct mesh *m, const char *fname, int level, int levels,
+		     double exaggeration) {
+   unsigned long vertices = (unsigned long)m->cols*m->rows;
+   unsigned long indices = 6UL*(m->cols-1)*(m->rows-1);
+   double bin;
+   /* glTF forbids the largest index of its type, kept for restarting strips */
+   int size = vertices < 65535 ? 2 : 4;
+   float lo = 0, hi = 0;
+   unsigned char b[12];
+   struct plot_file f;
+   char text[2048];
+   int k, l, len;
+
+   if (p->mesh == MESH_PLY) {
+      if (open_plot(p, &f, fname, "wb")) return -1;
+      sprintf(text, "ply\nformat binary_little_endian 1.0\n"
+	      "comment moody plate, level of detail %d (0 to %d), in meters, heights exaggerated %g times\n"
+	      "element vertex %lu\n"
+	      "property float x\nproperty float y\nproperty float z\n"
+	      "property float nx\nproperty float ny\nproperty float nz\n"
+	      "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+	      "element face %lu\n"
+	      "property list uchar uint vertex_indices\n"
+	      "end_header\n", level, levels-1, exaggeration, vertices, indices/3);
+      plot_text(&f, text);
+      write_mesh_vertices(&f, m, 0);
+      write_mesh_triangles(&f, m, 4, 0);
+      close_plot(&f);
+      return 0;
+   }
+
+   /* a binary glTF file has 32-bit lengths */
+   bin = (double)vertices*MESH_VERTEX + (double)indices*size;
+   if (bin > 4.0e9) {
+      fprintf(stderr, "Error: mesh of %d x %d points is too large for glTF\n", m->cols, m->rows);
+      return -1;
+   }
+   /* the range of the positions, which glTF requires */
+   for (l=0; l<m->rows; l++) {
+      const float *row = m->z + (size_t)mesh_index(m, l, m->ny, m->rows)*m->nx;
+      for (k=0; k<m->cols; k++) {
+	 float h = (float)(row[mesh_index(m, k, m->nx, m->cols)]*m->dz);
+	 if (!(k|l) || h < lo) lo = h;
+	 if (!(k|l) || h > hi) hi = h;
+      }
+   }
+   len = sprintf(text,
+		 "{\"asset\":{\"version\":\"2.0\",\"generator\":\"moody\","
+		 "\"extras\":{\"level\":%d,\"levels\":%d,\"exaggeration\":%.9g,\"flatness\":%.9g,\"units\":\"%s\"}},"
+		 "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],\"nodes\":[{\"mesh\":0,\"name\":\"plate\"}],"
+		 "\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"COLOR_0\":2},"
+		 "\"indices\":3,\"material\":0}]}],"
+		 "\"materials\":[{\"pbrMetallicRoughness\":{\"metallicFactor\":0,\"roughnessFactor\":0.8},"
+		 "\"doubleSided\":true}],"
+		 "\"buffers\":[{\"byteLength\":%.0f}],"
+		 "\"bufferViews\":[{\"buffer\":0,\"byteLength\":%lu,\"byteStride\":%d,\"target\":34962},"
+		 "{\"buffer\":0,\"byteOffset\":%lu,\"byteLength\":%lu,\"target\":34963}],"
+		 "\"accessors\":[{\"bufferView\":0,\"componentType\":5126,\"count\":%lu,\"type\":\"VEC3\","
+		 "\"min\":[0,%.9g,%.9g],\"max\":[%.9g,%.9g,0]},"
+		 "{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5126,\"count\":%lu,\"type\":\"VEC3\"},"
+		 "{\"bufferView\":0,\"byteOffset\":24,\"componentType\":5121,\"normalized\":true,"
+		 "\"count\":%lu,\"type\":\"VEC4\"},"
+		 "{\"bufferView\":1,\"componentType\":%d,\"count\":%lu,\"type\":\"SCALAR\"}]}",
+		 level, levels, exaggeration, (double)p->flatness, p->metric ? "microns" : "tens of microinch",
+		 bin, vertices*MESH_VERTEX, MESH_VERTEX, vertices*MESH_VERTEX, indices*size,
+		 vertices, lo, -(float)((m->ny-1)*m->dy), (float)((m->nx-1)*m->dx), hi,
+		 vertices, vertices, size == 2 ? 5123 : 5125, indices);
+   /* chunks are padded to 4 bytes, the JSON one with spaces */
+   while (len % 4) text[len++] = ' ';
+
+   if (open_plot(p, &f, fname, "wb")) return -1;
+   memcpy(b, "glTF", 4);
+   put_le32(b+4, 2);
+   put_le32(b+8, 12 + 8 + len + 8 + (unsigned long)bin);
+   plot_bytes(&f, b, 12);
+   put_le32(b, len);
+   memcpy(b+4, "JSON", 4);
+   plot_bytes(&f, b, 8);
+   plot_bytes(&f, text, len);
+   put_le32(b, (unsigned long)bin);
+   memcpy(b+4, "BIN", 4);
+   plot_bytes(&f, b, 8);
+   write_mesh_vertices(&f, m, 1);
+   write_mesh_triangles(&f, m, size, 1);
+   close_plot(&f);
+   return 0;
+}
+
+/*
+ * The height map of plate p, nx by ny points: that of -g, or else one
+ * with a point at every foot along the longer side, in *own, to be
+ * freed by the caller
+ */
+const float *surface_map(struct moody_plate *p, int *nx, int *ny, float **own) {
+   int max_x, max_y;
+
+   *own = NULL;
+   if (p->grid) {
+      *nx = p->grid_nx;
+      *ny = p->grid_ny;
+      return p->grid;
+   }
+   plate_extent(p, &max_x, &max_y);
+   grid_shape(p, (max_x > max_y ? max_x : max_y) + 1, nx, ny);
+   if (!(*own = malloc((size_t)*nx * *ny * sizeof(float)))) {
+      fprintf(stderr, "Error: out of memory for a %d x %d height map\n", *nx, *ny);
+      fail(p);
+   }
+   fill_height_map(p, *own, *nx, *ny);
+   return *own;
+}
+
+/* Write the meshes of plate p, with heights up to biggest, to surface_lodK.glb or .ply in its directory */
+void output_mesh(struct moody_plate *p, real biggest) {
+   struct mesh m;
+   float *map;
+   double spacing, unit, longer, exaggeration;
+   char name[32], path[MAX_PATHLEN];
+   int max_x, max_y, levels, step, level;
+   size_t i, n;
+
+   plate_extent(p, &max_x, &max_y);
+   m.z = surface_map(p, &m.nx, &m.ny, &map);
+   for (n=(size_t)m.nx*m.ny, m.lo=m.hi=m.z[0], i=1; i<n; i++) {
+      if (m.z[i] < m.lo) m.lo = m.z[i];
+      if (m.z[i] > m.hi) m.hi = m.z[i];
+   }
+
+   /* meters per foot spacing, and per micron or 1/100,000 inch */
+   spacing = p->metric ? 0.001*p->foot_spacing : 0.0254*p->foot_spacing;
+   unit = p->metric ? 1.0e-6 : 2.54e-7;
+   longer = (max_x > max_y ? max_x : max_y)*spacing;
+   if (p->exaggerate > 0) exaggeration = p->exaggerate;
+   else exaggeration = biggest > 0 ? MESH_RELIEF*longer/(biggest*unit) : 1.0;
+   m.dx = max_x*spacing/(m.nx-1);
+   m.dy = max_y*spacing/(m.ny-1);
+   m.dz = exaggeration*unit;
+
+   for (levels=1, step=1; levels < MESH_LEVELS &&
+	   ((m.nx-2)/step+2 > MESH_COARSEST || (m.ny-2)/step+2 > MESH_COARSEST); levels++, step*=2);
+   for (level=0, m.step=1; level<levels; level++, m.step*=2) {
+      m.cols = (m.nx-2)/m.step+2;
+      m.rows = (m.ny-2)/m.step+2;
+      sprintf(name, "surface_lod%d.%s", level, p->mesh == MESH_PLY ? "ply" : "glb");
+      if (write_mesh_level(p, &m, plate_path(p, path, name), level, levels, exaggeration)) {
+	 free(map);
+	 fail(p);
+      }
+   }
+   free(map);
+   return;
+}
+
+/*
+ * Contour map of the plate, for lapping: the lines of equal height of
+ * the height map (of -g, or one point per foot) every contour_step, by
+ * default a round step giving about CONTOUR_LINES of them, and the
+ * high spots, the connected regions higher than high_spot above the
+ * lowest point (by default CONTOUR_HIGH of the flatness), each with its
+ * outline, area and peak. Written to contours.svg, seen from above with
+ * North up, or to contours.json.
+ *
+ * The lines are traced by marching squares in a single pass over the
+ * map, each cell giving the segments of every level that crosses it,
+ * and then joined into lines. A segment joins two edges of its
+ * cell with the higher side to its left, and the middle of a saddle
+ * cell is taken as the mean of its corners, so a closed line runs
+ * counterclockwise around higher ground and clockwise around lower.
+ * The high spots are traced over the map with a rim below every level
+ * around it, so that their outlines are closed, running along the
+ * edge of the plate where a spot reaches it; their points are joined
+ * across saddles the same way.
+ */
+#define CONTOUR_LINES 10
+#define CONTOUR_HIGH 0.8
+/* at most this many lines of equal height, and peaks labelled in the SVG */
+#define CONTOUR_MAX 1000
+#define CONTOUR_LABELS 20
+
+/* A segment of a line of level level, from edge from to edge to, see contour_crossing() */
+struct contour_segment {
+   long from, to;
+   int level, flags;
+};
+/* flags: the segment follows another one, or it has been added to a line */
+#define SEGMENT_FOLLOWS 1
+#define SEGMENT_USED 2
+
+/*
+ * A line of level level, points first to first+count-1, starting at
+ * edge start, and closed or from edge to edge of the map; the outlines
+ * of high spots also have their spot
+ */
+struct contour_line {
+   int level, spot, closed;
+   long start;
+   size_t first, count;
+};
+
+struct high_spot {
+   /* its area, and its peak and where it is */
+   double area, x, y;
+   float peak;
+   int label;
+};
+
+struct contours {
+   const float *z;
+   float *own;
+   /* the map is nx by ny points, wx by wy with its rim, dx and dy mm or inches apart */
+   int nx, ny, wx, wy;
+   double dx, dy;
+   float lo, hi;
+   /* levels lines of equal height, at level[0] and up, step apart, and the high spots at level[levels] */
+   int levels;
+   double step;
+   float *level;
+   struct contour_segment *seg;
+   size_t segs, seg_size;
+   /* the segments by level and first edge, see next_segment() */
+   size_t *table, mask;
+   /* x and y of the points of the lines */
+   float *pt;
+   size_t pts, pt_size;
+   struct contour_line *line;
+   size_t lines, line_size;
+   /* label of each point, see label_spots() */
+   int *label;
+   struct high_spot *spot;
+   size_t spots, spot_size;
+};
+
+void free_contours(struct contours *c) {
+   free(c->own);
+   free(c->level);
+   free(c->seg);
+   free(c->table);
+   free(c->pt);
+   free(c->line);
+   free(c->label);
+   free(c->spot);
+   return;
+}
+
+/*
+ * Make room for n elements of elem bytes in buf, which has room for
+ * *psize, growing it geometrically. Returns the buffer, or NULL if out
+ * of memory.
+ */
+void *reserve_elements(void *buf, size_t *psize, size_t n, size_t elem) {
+   size_t size = *psize ? *psize : 256;
+   void *tmp;
+   if (n <= *psize) return buf;
+   while (size < n) size *= 2;
+   if (!(tmp = realloc(buf, size*elem))) return NULL;
+   *psize = size;
+   return tmp;
+}
+
+/* Height of point r, col of the map with its rim, or NULL on the rim */
+const float *contour_point(const struct contours *c, int r, int col) {
+   if (r < 1 || col < 1 || r > c->ny || col > c->nx) return NULL;
+   return c->z + (size_t)(r-1)*c->nx + (col-1);
+}
+
+/*
+ * Where level crosses edge e of the map with its rim: edge r*wx+col
+ * from point r, col to the one East of it, or wx*wy+r*wx+col to the
+ * one North of it. An edge to the rim is crossed at its end on the map.
+ */
+void contour_crossing(const struct contours *c, long e, float level, float *x, float *y) {
+   long n = (long)c->wx*c->wy, k = e < n ? e : e-n;
+   int r = (int)(k / c->wx), col = (int)(k % c->wx);
+   int r1 = r + (e >= n), col1 = col + (e < n);
+   const float *a = contour_point(c, r, col), *b = contour_point(c, r1, col1);
+   double t = !a ? 1.0 : !b ? 0.0 : (level - *a)/(*b - *a);
+
+   *x = (float)((col-1 + t*(col1-col))*c->dx);
+   *y = (float)((r-1 + t*(r1-r))*c->dy);
+   return;
+}
+
+/* Do the higher corners of a saddle cell of heights a, b, c, d meet in its middle, at level? */
+int saddle_joined(float a, float b, float c, float d, float level) {
+   return 0.25*((double)a+b+c+d) >= level;
+}
+
+/*
+ * Add the segments of level k across cell r, col of the map with its
+ * rim, whose corners, counterclockwise from the SW one, have heights
+ * v (NULL on the rim); returns -1 if out of memory
+ */
+int cell_segments(struct contours *c, int r, int col, const float *const v[4], int k) {
+   float level = c->level[k];
+   long n = (long)c->wx*c->wy, edge[4];
+   int above[4], i, j, joined = 0;
+   struct contour_segment *s;
+
+   for (i=0; i<4; i++) above[i] = v[i] && *v[i] >= level;
+   /* edge i runs counterclockwise from corner i to the next one */
+   edge[0] = (long)r*c->wx + col;
+   edge[1] = n + (long)r*c->wx + col+1;
+   edge[2] = (long)(r+1)*c->wx + col;
+   edge[3] = n + (long)r*c->wx + col;
+   if (above[0] == above[2] && above[1] == above[3] && above[0] != above[1])
+      joined = saddle_joined(*v[0], *v[1], *v[2], *v[3], level) ? 1 : 3;
+
+   for (i=0; i<4; i++) {
+      /* from an edge leaving a higher corner to one reaching a higher corner */
+      if (!above[i] || above[(i+1)%4]) continue;
+      if (joined) j = (i+joined)%4;
+      else for (j=0; above[j] || !above[(j+1)%4]; j++);
+      if (!(s = reserve_elements(c->seg, &c->seg_size, c->segs+1, sizeof(*s)))) return -1;
+      c->seg = s;
+      s += c->segs++;
+      s->from = edge[i];
+      s->to = edge[j];
+      s->level = k;
+      s->flags = 0;
+   }
+   return 0;
+}
+
+/*
+ * Classify row r of the map with its rim into cls: twice the number of
+ * levels of equal height up to each point, plus one if it is as high
+ * as a high spot; -1 on the rim
+ */
+void classify_row(const struct contours *c, int r, int *cls) {
+   const float *row = r >= 1 && r <= c->ny ? c->z + (size_t)(r-1)*c->nx : NULL;
+   float spot = c->level[c->levels];
+   int col, k;
+
+   cls[0] = cls[c->wx-1] = -1;
+   for (col=1; col<=c->nx; col++) {
+      double t;
+      float z;
+      if (!row) {
+	 cls[col] = -1;
+	 continue;
+      }
+      z = row[col-1];
+      t = c->levels ? floor((z - c->level[0])/c->step) + 1 : 0;
+      k = t < 0 ? 0 : t > c->levels ? c->levels : (int)t;
+      /* exactly as the heights compare with the levels */
+      while (k < c->levels && c->level[k] <= z) k++;
+      while (k > 0 && c->level[k-1] > z) k--;
+      cls[col] = 2*k + (z >= spot);
+   }
+   return;
+}
+
+/*
+ * The single pass over the cells of the map, see above, classifying
+ * each row of it once; returns -1 if out of memory
+ */
+int contour_segments(struct contours *c) {
+   int r, col, k, lo, hi, *rows, *south, *north, *tmp, err = 0;
+   const float *v[4], *s, *n;
+
+   if (!(rows = malloc(2*c->wx*sizeof(int)))) return -1;
+   south = rows;
+   north = rows + c->wx;
+   classify_row(c, 0, north);
+   for (r=0; r+1<c->wy; r++) {
+      tmp = south;
+      south = north;
+      north = tmp;
+      classify_row(c, r+1, north);
+      /* the rows of the map, point col-1 being column col of the cells */
+      s = r >= 1 ? c->z + (size_t)(r-1)*c->nx : c->z;
+      n = c->z + (size_t)r*c->nx;
+      for (col=0; col+1<c->wx && !err; col++) {
+	 int a = south[col], b = south[col+1], d = north[col], e = north[col+1];
+	 if ((a|b|d|e) < 0) {
+	    /* on the rim, which is lower than every level */
+	    if (!((a >= 0 && a&1) || (b >= 0 && b&1) || (d >= 0 && d&1) || (e >= 0 && e&1))) continue;
+	    v[0] = a < 0 ? NULL : s+col-1;
+	    v[1] = b < 0 ? NULL : s+col;
+	    v[2] = e < 0 ? NULL : n+col;
+	    v[3] = d < 0 ? NULL : n+col-1;
+	    err = cell_segments(c, r, col, v, c->levels);
+	    continue;
+	 }
+	 lo = a < b ? a : b;
+	 if (d < lo) lo = d;
+	 if (e < lo) lo = e;
+	 hi = a > b ? a : b;
+	 if (d > hi) hi = d;
+	 if (e > hi) hi = e;
+	 if (lo>>1 == hi>>1 && ((a&b&d&e) & 1) == ((a|b|d|e) & 1)) continue;
+	 v[0] = s+col-1;
+	 v[1] = s+col;
+	 v[2] = n+col;
+	 v[3] = n+col-1;
+	 for (k=lo>>1; k<hi>>1 && !err; k++) err = cell_segments(c, r, col, v, k);
+	 if (!err && ((a&b&d&e) & 1) != ((a|b|d|e) & 1)) err = cell_segments(c, r, col, v, c->levels);
+      }
+   }
+   free(rows);
+   return err;
+}
+
+int spot_find(int *label, int k) {
+   while (label[k] != k) k = label[k] = label[label[k]];
+   return k;
+}
+
+/* Join the sets of points a and b, keeping the lower index as the root */
+void spot_union(int *label, int a, int b) {
+   a = spot_find(label, a);
+   b = spot_find(label, b);
+   if (a < b) label[b] = a;
+   else label[a] = b;
+   return;
+}
+
+/*
+ * Find the high spots: label[i] is -1 for a point of the map lower
+ * than the high spot level, and -2-s for one in spot s. Points are
+ * joined to their neighbours East and North, and across saddle cells as
+ * contour_segments() joins them. Returns -1 if out of memory.
+ */
+int label_spots(struct contours *c) {
+   const float *z = c->z;
+   float level = c->level[c->levels];
+   int nx = c->nx, ny = c->ny, r, col, i;
+   struct high_spot *s;
+
+   if (!(c->label = malloc((size_t)nx*ny*sizeof(int)))) return -1;
+   for (i=0; i<nx*ny; i++) c->label[i] = z[i] >= level ? i : -1;
+   for (r=0; r<ny; r++)
+      for (col=0; col<nx; col++) {
+	 i = r*nx + col;
+	 if (c->label[i] < 0) {
+	    /* a saddle cell whose higher corners are the ones NW and SE of this point */
+	    if (r+1 < ny && col+1 < nx && c->label[i+1] >= 0 && c->label[i+nx] >= 0 && c->label[i+nx+1] < 0 &&
+		saddle_joined(z[i], z[i+1], z[i+nx+1], z[i+nx], level))
+	       spot_union(c->label, i+1, i+nx);
+	    continue;
+	 }
+	 if (col+1 < nx && c->label[i+1] >= 0) spot_union(c->label, i, i+1);
+	 if (r+1 < ny && c->label[i+nx] >= 0) spot_union(c->label, i, i+nx);
+	 if (r+1 < ny && col+1 < nx && c->label[i+1] < 0 && c->label[i+nx] < 0 && c->label[i+nx+1] >= 0 &&
+	     saddle_joined(z[i], z[i+1], z[i+nx+1], z[i+nx], level))
+	    spot_union(c->label, i, i+nx+1);
+      }
+
+   /* every point is after its root, which is labelled first */
+   for (i=0; i<nx*ny; i++) {
+      if (c->label[i] < 0) continue;
+      if (c->label[i] == i) {
+	 if (!(s = reserve_elements(c->spot, &c->spot_size, c->spots+1, sizeof(*s)))) return -1;
+	 c->spot = s;
+	 s += c->spots;
+	 s->area = 0;
+	 s->peak = z[i] - 1;
+	 s->label = (int)c->spots;
+	 c->label[i] = -2 - (int)c->spots++;
+      } else
+	 c->label[i] = c->label[c->label[i]];
+      s = c->spot + (-2 - c->label[i]);
+      if (z[i] > s->peak) {
+	 s->peak = z[i];
+	 s->x = (i % nx)*c->dx;
+	 s->y = (i / nx)*c->dy;
+      }
+   }
+   return 0;
+}
+
+int compare_lines(const void *a, const void *b) {
+   const struct contour_line *l = a, *m = b;
+   if (l->level != m->level) return l->level < m->level ? -1 : 1;
+   return l->spot < m->spot ? -1 : l->spot > m->spot;
+}
+
+int compare_spots(const void *a, const void *b) {
+   float pa = ((const struct high_spot *)a)->peak, pb = ((const struct high_spot *)b)->peak;
+   return pa > pb ? -1 : pa < pb;
+}
+
+/* Slot of the hash table of the segments for a segment of level level from edge e */
+size_t segment_slot(const struct contours *c, long e, int level) {
+   unsigned long long h = ((unsigned long long)e*(c->levels+1) + level)*0x9e3779b97f4a7c15ULL;
+   return (size_t)(h >> 32) & c->mask;
+}
+
+/* The segment of level level starting at edge e, or NULL */
+struct contour_segment *next_segment(const struct contours *c, long e, int level) {
+   size_t k;
+   for (k=segment_slot(c, e, level); c->table[k]; k=(k+1) & c->mask) {
+      struct contour_segment *s = c->seg + c->table[k]-1;
+      if (s->from == e && s->level == level) return s;
+   }
+   return NULL;
+}
+
+/* Add a line following the segments from segment s; returns -1 if out of memory */
+int trace_line(struct contours *c, struct contour_segment *s) {
+   float level = c->level[s->level];
+   struct contour_line *l;
+   float *pt;
+
+   if (!(l = reserve_elements(c->line, &c->line_size, c->lines+1, sizeof(*l)))) return -1;
+   c->line = l;
+   l += c->lines++;
+   l->level = s->level;
+   l->spot = -1;
+   l->start = s->from;
+   l->first = c->pts;
+   if (!(pt = reserve_elements(c->pt, &c->pt_size, 2*(c->pts+1), sizeof(float)))) return -1;
+   c->pt = pt;
+   contour_crossing(c, s->from, level, c->pt + 2*c->pts, c->pt + 2*c->pts+1);
+   c->pts++;
+   for (; s && !(s->flags & SEGMENT_USED); s = next_segment(c, s->to, s->level)) {
+      s->flags |= SEGMENT_USED;
+      if (!(pt = reserve_elements(c->pt, &c->pt_size, 2*(c->pts+1), sizeof(float)))) return -1;
+      c->pt = pt;
+      contour_crossing(c, s->to, level, c->pt + 2*c->pts, c->pt + 2*c->pts+1);
+      c->pts++;
+   }
+   l->count = c->pts - l->first;
+   l->closed = s != NULL;
+   return 0;
+}
+
+/*
+ * Join the segments into lines, the open ones from the edge of the map
+ * first, and give each outline of a high spot its spot, adding up the
+ * area it encloses. Returns -1 if out of memory.
+ */
+int join_segments(struct contours *c) {
+   size_t k, j, *spot_of, size;
+   struct contour_segment *s, *t, *end = c->seg + c->segs;
+
+   /* a table at most half full, of the index of each segment plus one */
+   for (size=16; size < 2*c->segs; size*=2);
+   if (!(c->table = calloc(size, sizeof(size_t)))) return -1;
+   c->mask = size-1;
+   for (k=0; k<c->segs; k++) {
+      for (j=segment_slot(c, c->seg[k].from, c->seg[k].level); c->table[j]; j=(j+1) & c->mask);
+      c->table[j] = k+1;
+   }
+   for (s=c->seg; s<end; s++)
+      if ((t = next_segment(c, s->to, s->level))) t->flags |= SEGMENT_FOLLOWS;
+   for (s=c->seg; s<end; s++)
+      if (!(s->flags & (SEGMENT_FOLLOWS|SEGMENT_USED)) && trace_line(c, s)) return -1;
+   for (s=c->seg; s<end; s++)
+      if (!(s->flags & SEGMENT_USED) && trace_line(c, s)) return -1;
+
+   /* the spots from the highest peak down */
+   qsort(c->spot, c->spots, sizeof(*c->spot), compare_spots);
+   if (!(spot_of = malloc((c->spots+1)*sizeof(size_t)))) return -1;
+   for (k=0; k<c->spots; k++) spot_of[c->spot[k].label] = k;
+   for (k=0; k<c->lines; k++) {
+      struct contour_line *l = c->line+k;
+      const float *pt = c->pt + 2*l->first, *v;
+      long n = (long)c->wx*c->wy, e = l->start < n ? l->start : l->start-n;
+      int r = (int)(e / c->wx), col = (int)(e % c->wx);
+      double area = 0;
+
+      if (l->level != c->levels) continue;
+      /* the point of the spot at the start of the outline, at one end of its first edge */
+      if (!(v = contour_point(c, r, col)) || *v < c->level[c->levels])
+	 v = l->start < n ? contour_point(c, r, col+1) : contour_point(c, r+1, col);
+      l->spot = (int)spot_of[-2 - c->label[v - c->z]];
+      for (j=0; j+1<l->count; j++)
+	 area += (double)pt[2*j]*pt[2*j+3] - (double)pt[2*j+2]*pt[2*j+1];
+      c->spot[l->spot].area += 0.5*area;
+   }
+   free(spot_of);
+   /* the lines by level, and the outlines of each spot together */
+   qsort(c->line, c->lines, sizeof(*c->line), compare_lines);
+   return 0;
+}
+
+/* Write the points of line l of c to f as a JSON array of [x, y], as format_fixed() writes them */
+void json_points(struct plot_file *f, const struct contours *c, const struct contour_line *l) {
+   char *s;
+   size_t j;
+   plot_text(f, "[");
+   for (j=0; j<l->count; j++) {
+      if (f->len > PLOT_BUFFER - PLOT_POINT) flush_plot(f);
+      s = f->buf + f->len;
+      if (j) *s++ = ',';
+      *s++ = '[';
+      s += format_fixed(s, c->pt[2*(l->first+j)]);
+      *s++ = ',';
+      s += format_fixed(s, c->pt[2*(l->first+j)+1]);
+      *s++ = ']';
+      f->len = s - f->buf;
+   }
+   plot_text(f, "]");
+   return;
+}
+
+/* Write point x, y of an SVG drawing to f, after text head, with one decimal as format_tenths() writes it */
+void svg_point(struct plot_file *f, const char *head, float x, float y) {
+   char num[32], *s;
+   int k, n;
+   if (f->len > PLOT_BUFFER - PLOT_POINT) flush_plot(f);
+   s = f->buf + f->len;
+   while (*head) *s++ = *head++;
+   n = format_tenths(num, x);
+   for (k=0; num[k]==' '; k++);
+   while (k < n) *s++ = num[k++];
+   *s++ = ',';
+   n = format_tenths(num, y);
+   for (k=0; num[k]==' '; k++);
+   while (k < n) *s++ = num[k++];
+   f->len = s - f->buf;
+   return;
+}
+
+/* Write contour map c of plate p to f as JSON */
+void write_contours_json(struct moody_plate *p, struct plot_file *f, const struct contours *c) {
+   const struct contour_line *l = c->line, *end = c->line + c->lines;
+   char s[256];
+   size_t j;
+
+   sprintf(s, "{\n  \"units\": \"%s\",\n  \"height_unit\": \"%s\",\n"
+	   "  \"contour_step\": %.6g,\n  \"high_spot\": %.6g,\n  \"contours\": [",
+	   p->metric ? "mm" : "inch", p->metric ? "micron" : "1e-5 inch",
+	   c->step, (double)c->level[c->levels]);
+   plot_text(f, s);
+   for (; l<end && l->level < c->levels; l++) {
+      sprintf(s, "%s\n    {\"height\": %.6g, \"closed\": %s, \"points\": ", l > c->line ? "," : "",
+	      (double)c->level[l->level], l->closed ? "true" : "false");
+      plot_text(f, s);
+      json_points(f, c, l);
+      plot_text(f, "}");
+   }
+   plot_text(f, "\n  ],\n  \"high_spots\": [");
+   for (j=0; j<c->spots; j++) {
+      const struct high_spot *h = c->spot+j;
+      sprintf(s, "%s\n    {\"peak\": %.6g, \"at\": [%.6g,%.6g], \"area\": %.6g, \"outlines\": [",
+	      j ? "," : "", (double)h->peak, h->x, h->y, h->area);
+      plot_text(f, s);
+      for (; l<end && l->spot == (int)j; l++) {
+	 json_points(f, c, l);
+	 if (l+1 < end && l[1].spot == (int)j) plot_text(f, ",");
+      }
+      plot_text(f, "]}");
+   }
+   plot_text(f, "\n  ]\n}\n");
+   return;
+}
+
+/* Write contour map c of plate p, width by height mm or inches, to f as SVG */
+void write_contours_svg(struct moody_plate *p, struct plot_file *f, const struct contours *c,
+			double width, double height) {
+   const struct contour_line *l = c->line, *end = c->line + c->lines;
+   const char *unit = p->metric ? "microns" : "micro-inches";
+   double scale = (IMAGE_WIDTH-2*IMAGE_MARGIN)/width, x0, y0, u = p->metric ? 1.0 : 10.0;
+   unsigned char rgb[3];
+   char s[256];
+   size_t j, k;
+
+   if ((IMAGE_HEIGHT-2*IMAGE_MARGIN)/height < scale) scale = (IMAGE_HEIGHT-2*IMAGE_MARGIN)/height;
+   x0 = 0.5*(IMAGE_WIDTH - scale*width);
+   y0 = 0.5*(IMAGE_HEIGHT + scale*height);
+   sprintf(s, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\">\n"
+	   "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n", IMAGE_WIDTH, IMAGE_HEIGHT);
+   plot_text(f, s);
+   sprintf(s, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%.1f\" fill=\"none\" stroke=\"#a0a0a0\"/>\n",
+	   x0, y0-scale*height, scale*width, scale*height);
+   plot_text(f, s);
+
+   for (; l<end && l->level < c->levels; l++) {
+      height_colour(c->hi > c->lo ? (c->level[l->level]-c->lo)/(c->hi-c->lo) : 0.0, rgb);
+      sprintf(s, "<polyline fill=\"none\" stroke=\"#%02x%02x%02x\" points=\"", rgb[0], rgb[1], rgb[2]);
+      plot_text(f, s);
+      for (k=0; k<l->count; k++)
+	 svg_point(f, k ? " " : "", x0 + scale*c->pt[2*(l->first+k)], y0 - scale*c->pt[2*(l->first+k)+1]);
+      plot_text(f, "\"/>\n");
+   }
+   /* each high spot as one path, so that its holes are left out */
+   for (j=0; j<c->spots; j++) {
+      const struct high_spot *h = c->spot+j;
+      height_colour(c->hi > c->lo ? (h->peak-c->lo)/(c->hi-c->lo) : 1.0, rgb);
+      sprintf(s, "<path fill=\"#%02x%02x%02x\" fill-opacity=\"0.4\" fill-rule=\"evenodd\" stroke=\"black\""
+	      " stroke-width=\"0.5\" d=\"", rgb[0], rgb[1], rgb[2]);
+      plot_text(f, s);
+      for (; l<end && l->spot == (int)j; l++) {
+	 for (k=0; k+1<l->count; k++)
+	    svg_point(f, k ? " L" : "M", x0 + scale*c->pt[2*(l->first+k)], y0 - scale*c->pt[2*(l->first+k)+1]);
+	 plot_text(f, " Z ");
+      }
+      plot_text(f, "\"/>\n");
+   }
+   /* and the peaks of the largest */
+   for (j=0; j<c->spots; j++) {
+      const struct high_spot *h = c->spot+j;
+      if (j >= CONTOUR_LABELS) break;
+      sprintf(s, "<circle cx=\"%.1f\" cy=\"%.1f\" r=\"2\"/>"
+	      "<text x=\"%.1f\" y=\"%.1f\" font-family=\"sans-serif\" font-size=\"12\">%.2f</text>\n",
+	      x0 + scale*h->x, y0 - scale*h->y, x0 + scale*h->x + 4, y0 - scale*h->y - 4, u*h->peak);
+      plot_text(f, s);
+   }
+   sprintf(s, "<text x=\"%.1f\" y=\"%.1f\" font-family=\"sans-serif\" font-size=\"16\" text-anchor=\"middle\">N</text>\n"
+	   "<text x=\"%.1f\" y=\"%.1f\" font-family=\"sans-serif\" font-size=\"16\" text-anchor=\"middle\">S</text>\n",
+	   x0 + 0.5*scale*width, y0 - scale*height - 8, x0 + 0.5*scale*width, y0 + 20);
+   plot_text(f, s);
+   sprintf(s, "<text x=\"%.1f\" y=\"%.1f\" font-family=\"sans-serif\" font-size=\"16\" text-anchor=\"middle\">E</text>\n"
+	   "<text x=\"%.1f\" y=\"%.1f\" font-family=\"sans-serif\" font-size=\"16\" text-anchor=\"middle\">W</text>\n",
+	   x0 + scale*width + 14, y0 - 0.5*scale*height + 6, x0 - 14, y0 - 0.5*scale*height + 6);
+   plot_text(f, s);
+   sprintf(s, "<text x=\"%d\" y=\"24\" font-family=\"sans-serif\" font-size=\"16\">"
+	   "Contours every %g %s; %d high spot%s above %.2f %s</text>\n</svg>\n",
+	   IMAGE_MARGIN, u*c->step, unit, (int)c->spots, c->spots == 1 ? "" : "s",
+	   u*c->level[c->levels], unit);
+   plot_text(f, s);
+   return;
+}
+
+/* The round step, 1, 2 or 5 times a power of ten, of at least x */
+double round_step(double x) {
+   double m;
+   if (!(x > 0)) return 1.0;
+   m = pow(10.0, floor(log10(x)));
+   return x <= m ? m : x <= 2*m ? 2*m : x <= 5*m ? 5*m : 10*m;
+}
+
+/* Write the contour map of plate p, with heights up to biggest, to contours.svg or .json in its directory */
+void output_contours(struct moody_plate *p, real biggest) {
+   struct contours c;
+   struct plot_file f;
+   char path[MAX_PATHLEN];
+   double width, height, u = p->metric ? 1.0 : 10.0, first;
+   int max_x, max_y, k;
+   size_t i, n;
+
+   memset(&c, 0, sizeof(c));
+   plate_extent(p, &max_x, &max_y);
+   c.z = surface_map(p, &c.nx, &c.ny, &c.own);
+   c.wx = c.nx+2;
+   c.wy = c.ny+2;
+   width = max_x*p->foot_spacing;
+   height = max_y*p->foot_spacing;
+   c.dx = width/(c.nx-1);
+   c.dy = height/(c.ny-1);
+   for (n=(size_t)c.nx*c.ny, c.lo=c.hi=c.z[0], i=1; i<n; i++) {
+      if (c.z[i] < c.lo) c.lo = c.z[i];
+      if (c.z[i] > c.hi) c.hi = c.z[i];
+   }
+
+   /* the options are in microns or micro-inches, the map in microns or 1/100,000 inch */
+   c.step = p->contour_step > 0 ? p->contour_step/u : round_step((c.hi-c.lo)/CONTOUR_LINES);
+   first = floor(c.lo/c.step) + 1;
+   for (c.levels=0; (first+c.levels)*c.step < c.hi && c.levels <= CONTOUR_MAX; c.levels++);
+   if (c.levels > CONTOUR_MAX) {
+      free_contours(&c);
+      fprintf(stderr, "Error: contours every %g %s make more than %d lines\n",
+	      u*c.step, p->metric ? "microns" : "micro-inches", CONTOUR_MAX);
+      fail(p);
+   }
+   if (!(c.level = malloc((c.levels+1)*sizeof(float)))) {
+      free_contours(&c);
+      fprintf(stderr, "Error: out of memory\n");
+      fail(p);
+   }
+   for (k=0; k<c.levels; k++) c.level[k] = (float)((first+k)*c.step);
+   c.level[c.levels] = (float)(p->high_spot > 0 ? p->high_spot/u : CONTOUR_HIGH*biggest);
+
+   if (contour_segments(&c) || label_spots(&c) || join_segments(&c)) {
+      free_contours(&c);
+      fprintf(stderr, "Error: out of memory for the contours\n");
+      fail(p);
+   }
+   if (open_plot(p, &f, plate_path(p, path, p->contours == CONTOUR_SVG ? "contours.svg" : "contours.json"), "w")) {
+      free_contours(&c);
+      fail(p);
+   }
+   if (p->contours == CONTOUR_SVG) write_contours_svg(p, &f, &c, width, height);
+   else write_contours_json(p, &f, &c);
+   close_plot(&f);
+   free_contours(&c);
+   return;
+}
+
+/*
+ * Computed height at the middle of center line which_sheet, in the
+ * output units of column 8. Absent measurement errors this is zero.
+ */
+real center_height(struct moody_plate *p, int which_sheet) {
+   return mid_value(p, which_sheet, 5)*arcsec*p->out_spacing;
+}
+
+/* Is a center height within Moody's limit of 100 micro-inch = 2.54 microns? */
+int center_height_ok(struct moody_plate *p, real error) {
+   return fabs(error) <= (p->metric ? 2.54 : 10.0);
+}
+
+void do_moody_consistency_checks(struct moody_plate *p) {
+   int i;
+   int printwarning=0;
+
+   /* A couple of consistency checks */
+   report(p, "================================================================\n"
+	  "Measurement errors are estimated from the computed\n"
+	  "heights at the middle of the two center lines. Absent any\n"
+	  "measurement errors, these computed heights would be zero.\n"
+	  );
+
+   for (i=6; i<8; i++) {
+      real error;
+      /* solve_network() has already taken them from Moody's recipe */
+      if (!p->least_squares) p->center[i-6] = center_height(p, i);
+      error = p->center[i-6];
+      if (p->metric)
+	 report(p, "Computed height at the center of the %s line: %4.2f microns.\n",
+		filenames[i],error);
+      else
+	 report(p, "Computed height at the center of the %s line: %4.2f micro-inches.\n",
+		filenames[i],10*error);
+      if (!center_height_ok(p, error)) printwarning=1;
+   }
+   if (printwarning) {
+      p->warnings |= WARN_CENTER;
+      report(p, "Warning: measurement errors are larger than Moody considers\n"
+	     "acceptable (100 micro-inch = 2.54 microns). The job must be done over!\n");
+   } else
+      report(p, "According to Moody these errors are acceptable, because their\n"
+	     "magnitude is less than 100 micro-inch = 2.54 microns.\n");
+   report(p, "================================================================\n");
+   return;
+}
+
+/* corner values of the plate, column 6 of the diagonals */
+real corner_value(struct moody_plate *p, int corner) {
+   switch (corner) {
+   case NE: return p->ws[NE_SW][5][0];
+   case SW: return p->ws[NE_SW][5][p->num_dat[NE_SW]];
+   case NW: return p->ws[NW_SE][5][0];
+   default: return p->ws[NW_SE][5][p->num_dat[NW_SE]];
+   }
+}
+
+/*
+ * Copy the corner values from the (already corrected) diagonals into
+ * the first and last station of perimeter line which_sheet. The first
+ * station gets both columns 5 and 6, the last one only column 6.
+ */
+void copy_corners(struct moody_plate *p, int which_sheet) {
+   /* corners at the start and end of lines NE_NW, NE_SE, SE_SW, NW_SW */
+   const int start[4]={NE, NE, SE, NW};
+   const int end[4]  ={NW, SE, SW, SW};
+   int i=which_sheet;
+
+   p->ws[i][4][0] = p->ws[i][5][0] = corner_value(p, start[i-2]);
+   p->ws[i][5][p->num_dat[i]] = corner_value(p, end[i-2]);
+   return;
+}
+
+/*
+ * Copy the midpoints of the (already corrected) perimeter lines into
+ * the two ends of center line which_sheet.
+ */
+void copy_midpoints(struct moody_plate *p, int which_sheet) {
+   if (which_sheet==E_W) {
+      /* East end, from NE_SE, and West end, from NW_SW */
+      p->ws[E_W][4][0] = p->ws[E_W][5][0] = mid_value(p, NE_SE, 5);
+      p->ws[E_W][5][p->num_dat[E_W]] = mid_value(p, NW_SW, 5);
+   } else {
+      /* North end, from NE_NW, and South end, from SE_SW */
+      p->ws[N_S][4][0] = p->ws[N_S][5][0] = mid_value(p, NE_NW, 5);
+      p->ws[N_S][5][p->num_dat[N_S]] = mid_value(p, SE_SW, 5);
+   }
+   return;
+}
+
+/*
+ * Least-squares network adjustment.
+ *
+ * Moody corrects the lines one after the other, so the closure error
+ * of the whole plate ends up in the lines corrected last. Instead,
+ * each measured step is taken as an observation
+ *
+ *    x[j] - x[j-1] - c = r[j]
+ *
+ * where x are the heights (in the arc second units of column 6) of
+ * the stations of a line, r is Moody column 3 and c the unknown
+ * offset of the autocollimator on that line, and the heights and
+ * offsets of all eight lines are found together by least squares.
+ *
+ * Lines meet at the corners, at the midpoints of the perimeter lines
+ * (the ends of the center lines) and at the center, so the stations
+ * at the ends and the middle of each line are "junctions", given
+ * below as combinations of a few global unknowns. Between two
+ * junctions a line is a chain whose normal equations are
+ * tridiagonal; eliminating its stations leaves the single reduced
+ * observation x[e] - x[s] - k*c = r[s+1] + ... + r[e] of weight 1/k
+ * over its k steps, and spreads its residual evenly over them. This
+ * leaves a small dense system for the global unknowns, so the cost
+ * is linear in the number of stations.
+ *
+ * A plane added to the plate only changes the offsets, so the
+ * reference plane is fixed as Moody's: the ends of each diagonal at
+ * the same height, and the center at zero. As in mid_value(), the
+ * middle of a line with an odd number of steps is the average of its
+ * two middle stations.
+ */
+
+/* Global unknowns of the network adjustment */
+#define NET_NE 0      /* NE and SW corners */
+#define NET_NW 1      /* NW and SE corners */
+#define NET_MID 2     /* midpoint of perimeter line i at NET_MID+i-2 */
+#define NET_OFFSET 6  /* offset of line i at NET_OFFSET+i */
+#define NET_HALF 14   /* first middle station of line i, if odd, at NET_HALF+i */
+#define NET_UNKNOWNS 22
+
+/* A junction height, as a combination of up to two global unknowns */
+struct net_term {
+   int n;
+   int var[2];
+   double coef[2];
+};
+
+void add_term(struct net_term *t, int var, double coef) {
+   t->var[t->n] = var;
+   t->coef[t->n++] = coef;
+   return;
+}
+
+/* If station j of line i is a junction, set t to its height and return 1 */
+int net_junction(struct moody_plate *p, int i, int j, struct net_term *t) {
+   /* corners at the start and end of each line, as for copy_corners() */
+   const int start[6]={NW, NE, NE, NE, SE, NW};
+   const int end[6]  ={SE, SW, NW, SE, SW, SW};
+   int n = p->num_dat[i];
+
+   t->n = 0;
+   if (j==0 || j==n) {
+      if (i<6) {
+	 int corner = j ? end[i] : start[i];
+	 add_term(t, corner==NE || corner==SW ? NET_NE : NET_NW, 1.0);
+      } else if (i==E_W)
+	 add_term(t, NET_MID+(j ? NW_SW : NE_SE)-2, 1.0);
+      else
+	 add_term(t, NET_MID+(j ? SE_SW : NE_NW)-2, 1.0);
+      return 1;
+   }
+
+   /* the middle: a perimeter midpoint, or the center at zero */
+   if (n%2 == 0) {
+      if (j != n/2) return 0;
+      if (i>=2 && i<6) add_term(t, NET_MID+i-2, 1.0);
+      return 1;
+   }
+   if (j == (n-1)/2) {
+      add_term(t, NET_HALF+i, 1.0);
+      return 1;
+   }
+   if (j == (n+1)/2) {
+      add_term(t, NET_HALF+i, -1.0);
+      if (i>=2 && i<6) add_term(t, NET_MID+i-2, 2.0);
+      return 1;
+   }
+   return 0;
+}
+
+double net_value(const struct net_term *t, const double *x) {
+   double v = 0.0;
+   int k;
+   for (k=0; k<t->n; k++) v += t->coef[k]*x[t->var[k]];
+   return v;
+}
+
+/* Sum of Moody column 3 over the steps s+1 to e of line i */
+double net_steps(struct moody_plate *p, int i, int s, int e) {
+   double sum = 0.0;
+   int j;
+   for (j=s+1; j<=e; j++) sum += p->ws[i][2][j];
+   return sum;
+}
+
+/*
+ * Add the reduced observation of the chain of line i between
+ * junctions ts at station s and te at station e to the normal
+ * equations a x = b
+ */
+void add_chain(struct moody_plate *p, int i, int s, int e,
+	       const struct net_term *ts, const struct net_term *te,
+	       double a[NET_UNKNOWNS][NET_UNKNOWNS], double *b) {
+   int var[5], m=0, k, l;
+   double coef[5], w = 1.0/(e-s), r = net_steps(p, i, s, e);
+
+   for (k=0; k<te->n; k++) {
+      var[m] = te->var[k];
+      coef[m++] = te->coef[k];
+   }
+   for (k=0; k<ts->n; k++) {
+      var[m] = ts->var[k];
+      coef[m++] = -ts->coef[k];
+   }
+   var[m] = NET_OFFSET+i;
+   coef[m++] = -(e-s);
+
+   for (k=0; k<m; k++) {
+      for (l=0; l<m; l++) a[var[k]][var[l]] += w*coef[k]*coef[l];
+      b[var[k]] += w*coef[k]*r;
+   }
+   return;
+}
+
+/* Solve a x = b in place for a symmetric positive definite a; returns -1 if it is not */
+int cholesky_solve(double a[NET_UNKNOWNS][NET_UNKNOWNS], double *b, int n) {
+   int i, j, k;
+
+   for (j=0; j<n; j++) {
+      double d = a[j][j];
+      for (k=0; k<j; k++) d -= a[j][k]*a[j][k];
+      if (d <= 1e-12) return -1;
+      a[j][j] = sqrt(d);
+      for (i=j+1; i<n; i++) {
+	 double s = a[i][j];
+	 for (k=0; k<j; k++) s -= a[i][k]*a[j][k];
+	 a[i][j] = s/a[j][j];
+      }
+   }
+   for (i=0; i<n; i++) {
+      for (k=0; k<i; k++) b[i] -= a[i][k]*b[k];
+      b[i] /= a[i][i];
+   }
+   for (i=n-1; i>=0; i--) {
+      for (k=i+1; k<n; k++) b[i] -= a[k][i]*b[k];
+      b[i] /= a[i][i];
+   }
+   return 0;
+}
+
+/* Report the size of the residuals of the least-squares adjustment */
+void report_network(struct moody_plate *p) {
+   report(p, "Least-squares adjustment of all eight lines: residuals of the\n"
+	  "steps between stations %4.2f %s RMS, %4.2f %s at most.\n",
+	  (p->metric ? 1.0 : 10.0)*p->rms_residual, p->metric ? "microns" : "micro-inches",
+	  (p->metric ? 1.0 : 10.0)*p->max_residual, p->metric ? "microns" : "micro-inches");
+   return;
+}
+
+/*
+ * The normal equations a x = b of the adjustment, with one reduced
+ * observation per chain, of all lines but line skip (if not -1), whose
+ * own unknowns are then held at zero
+ */
+void net_normal_equations(struct moody_plate *p, int skip,
+			  double a[NET_UNKNOWNS][NET_UNKNOWNS], double *b) {
+   struct net_term ts, te;
+   int i, j, s;
+
+   memset(a, 0, NET_UNKNOWNS*sizeof(a[0]));
+   memset(b, 0, NET_UNKNOWNS*sizeof(b[0]));
+   for (i=0; i<8; i++) {
+      if (i == skip) {
+	 a[NET_OFFSET+i][NET_OFFSET+i] = a[NET_HALF+i][NET_HALF+i] = 1.0;
+	 continue;
+      }
+      net_junction(p, i, 0, &ts);
+      for (s=0, j=1; j<=p->num_dat[i]; j++)
+	 if (net_junction(p, i, j, &te)) {
+	    add_chain(p, i, s, j, &ts, &te, a, b);
+	    ts = te;
+	    s = j;
+	 }
+      /* lines with an even number of steps have no NET_HALF unknown */
+      if (p->num_dat[i]%2 == 0) a[NET_HALF+i][NET_HALF+i] = 1.0;
+   }
+   return;
+}
+
+/*
+ * Sum of the squared residuals of the steps of all lines but line skip
+ * (if not -1), for the solution x of their adjustment, in arc seconds
+ * squared; their number goes to *steps
+ */
+double net_misfit(struct moody_plate *p, int skip, const double *x, int *steps) {
+   struct net_term ts, te;
+   double sum2 = 0.0;
+   int i, j, s;
+
+   *steps = 0;
+   for (i=0; i<8; i++) {
+      if (i == skip) continue;
+      net_junction(p, i, 0, &ts);
+      for (s=0, j=1; j<=p->num_dat[i]; j++)
+	 if (net_junction(p, i, j, &te)) {
+	    double v = (net_value(&te, x)-net_value(&ts, x)-(j-s)*x[NET_OFFSET+i]-net_steps(p, i, s, j))/(j-s);
+	    sum2 += (j-s)*v*v;
+	    *steps += j-s;
+	    ts = te;
+	    s = j;
+	 }
+   }
+   return sum2;
+}
+
+/*
+ * Replace columns 5 and 6 (and 6a) of all eight worksheets, filled
+ * in by Moody's recipe, by the least-squares network adjustment, and
+ * fill in the residuals. Moody's center line check is kept in
+ * p->center, because it still tells how well the lines close.
+ */
+void solve_network(struct moody_plate *p) {
+   double a[NET_UNKNOWNS][NET_UNKNOWNS], x[NET_UNKNOWNS];
+   double scale = arcsec*p->out_spacing, sum2 = 0.0;
+   struct net_term ts, te;
+   size_t total = 0;
+   float *col;
+   int i, j, s, steps = 0;
+
+   for (i=0; i<8; i++) {
+      if (p->num_dat[i] < 2) {
+	 plate_error(p, "Error: the least-squares adjustment needs at least two steps on line %s\n",
+		     filenames[i]);
+	 fail(p);
+      }
+      /* its junctions are stations, and its chains steps of equal weight */
+      if (p->pos[i]) {
+	 plate_error(p, "Error: the least-squares adjustment needs the stations of line %s\n"
+		     "evenly spaced at the foot spacing of the plate\n", filenames[i]);
+	 fail(p);
+      }
+      total += p->num_dat[i]+1;
+   }
+   for (i=6; i<8; i++) p->center[i-6] = center_height(p, i);
+
+   net_normal_equations(p, -1, a, x);
+   if (cholesky_solve(a, x, NET_UNKNOWNS)) {
+      plate_error(p, "Error: the least-squares adjustment of the lines is singular\n");
+      fail(p);
+   }
+
+   free(p->residuals);
+   if (!(p->residuals = calloc(total, sizeof(float)))) {
+      plate_error(p, "Error: out of memory allocating residuals\n");
+      fail(p);
+   }
+   p->max_residual = 0.0;
+
+   /* back substitution within each chain */
+   for (col=p->residuals, i=0; i<8; col+=p->num_dat[i]+1, i++) {
+      double c = x[NET_OFFSET+i];
+      p->residual[i] = col;
+      net_junction(p, i, 0, &ts);
+      p->ws[i][5][0] = net_value(&ts, x);
+      for (s=0, j=1; j<=p->num_dat[i]; j++)
+	 if (net_junction(p, i, j, &te)) {
+	    double xs = net_value(&ts, x), xe = net_value(&te, x);
+	    double v = (xe-xs-(j-s)*c-net_steps(p, i, s, j))/(j-s);
+	    double h = xs;
+	    int m;
+	    for (m=s+1; m<=j; m++) {
+	       h += c+p->ws[i][2][m]+v;
+	       p->ws[i][5][m] = m<j ? h : xe;
+	       p->residual[i][m] = v*scale;
+	    }
+	    if (fabs(v*scale) > p->max_residual) p->max_residual = fabs(v*scale);
+	    sum2 += (j-s)*v*v;
+	    steps += j-s;
+	    ts = te;
+	    s = j;
+	 }
+      /* column 5 is what was added to the sum of the angles */
+      for (j=0; j<=p->num_dat[i]; j++)
+	 p->ws[i][4][j] = p->ws[i][5][j]-p->ws[i][3][j];
+      /* the center is at zero, so column 6a is column 6 */
+      if (i>=6)
+	 for (j=0; j<=p->num_dat[i]; j++) p->ws[i][8][j] = p->ws[i][5][j];
+   }
+   p->rms_residual = sqrt(sum2/steps)*scale;
+   report_network(p);
+   return;
+}
+
+/* Print the residuals of line which_sheet, six stations per row */
+void print_residuals(struct moody_plate *p, int which_sheet) {
+   int j;
+   report(p, "\nRESIDUALS %s (%s)\n", filenames[which_sheet],
+	  p->metric ? "micron" : "10^-5in");
+   for (j=1; j<=p->num_dat[which_sheet]; j++)
+      report(p, "%4d%8.2f%s", (int)p->ws[which_sheet][0][j], p->residual[which_sheet][j],
+	     j%6==0 || j==p->num_dat[which_sheet] ? "\n" : "   ");
+   return;
+}
+
+/*
+ * Leave-one-line-out diagnosis. The eight lines of a plate hold two
+ * more chains than the network adjustment has unknowns, so the closure
+ * error has two components, which Moody sees as the heights at the
+ * middle of the center lines. Each line in turn is left out of the
+ * adjustment; the less the others disagree among themselves without it,
+ * the more of the closure error that line explains. Lines that change
+ * the closure in the same way cannot be told apart by it, which is
+ * reported as such. As the residuals are spread evenly over the steps
+ * of a chain, the stations within a line are checked on their own: a
+ * reading that differs from the median of the DIAGNOSE_WINDOW readings
+ * on either side of it by more than DIAGNOSE_SIGMAS robust standard
+ * deviations of these differences along the line (and by DIAGNOSE_FLOOR
+ * arc seconds at least, for lines read to a tenth of an arc second) is
+ * flagged. A step thrown off by such a reading shifts all the stations
+ * after it.
+ */
+#define DIAGNOSE_WINDOW 2
+#define DIAGNOSE_SIGMAS 4.0
+#define DIAGNOSE_FLOOR 0.5
+/* lines explaining fractions closer than this are not told apart */
+#define DIAGNOSE_TIE 0.1
+
+/* Report the stations of line i whose reading stands out from those around it; returns how many */
+int diagnose_stations(struct moody_plate *p, int i) {
+   int n = p->num_dat[i], j, k, found = 0;
+   float *dev, *work, window[2*DIAGNOSE_WINDOW], sigma, limit;
+   float scale = (p->metric ? 1.0 : 10.0)*arcsec*p->out_spacing;
+   const real *r = p->ws[i][1];
+
+   if (!(dev = malloc(2*n*sizeof(float)))) {
+      fprintf(stderr, "Error: out of memory\n");
+      fail(p);
+   }
+   work = dev+n;
+   /* readings r[1] to r[n], each against the median of those around it */
+   for (j=1; j<=n; j++) {
+      int lo = j-DIAGNOSE_WINDOW, hi = j+DIAGNOSE_WINDOW, m = 0;
+      if (lo < 1) lo = 1;
+      if (hi > n) hi = n;
+      for (k=lo; k<=hi; k++)
+	 if (k != j) window[m++] = r[k];
+      dev[j-1] = r[j]-quantile(window, m, 0.5);
+      work[j-1] = fabs(dev[j-1]);
+   }
+   sigma = MAD_SCALE*quantile(work, n, 0.5);
+   limit = DIAGNOSE_SIGMAS*sigma > DIAGNOSE_FLOOR ? DIAGNOSE_SIGMAS*sigma : DIAGNOSE_FLOOR;
+   for (j=1; j<=n; j++)
+      if (fabs(dev[j-1]) > limit) {
+	 report(p, "%-10s station %4d: reading off by %5.1f arc seconds (%.2f %s)\n",
+		filenames[i], (int)p->ws[i][0][j], dev[j-1], scale*dev[j-1],
+		p->metric ? "microns" : "micro-inches");
+	 found++;
+      }
+   free(dev);
+   return found;
+}
+
+/*
+ * Rank the lines of plate p by how much of its closure error leaving
+ * each one out explains, report them and the stations that stand out,
+ * and keep the first one in p->suspect if the closure is not acceptable
+ * and no other line explains nearly as much
+ */
+void diagnose_lines(struct moody_plate *p) {
+   double a[NET_UNKNOWNS][NET_UNKNOWNS], x[NET_UNKNOWNS], misfit[9];
+   double scale = (p->metric ? 1.0 : 10.0)*arcsec*p->out_spacing;
+   const char *unit = p->metric ? "microns" : "micro-inches";
+   int steps[9], order[8], i, k, found;
+
+   p->suspect = -1;
+   p->explained = 0.0;
+   for (i=0; i<8; i++)
+      if (p->num_dat[i] < 2) {
+	 report(p, "Diagnosis needs at least two steps on every line.\n");
+	 return;
+      }
+   if (!uniform_plate(p)) {
+      report(p, "Diagnosis needs the stations of every line evenly spaced at the foot spacing.\n");
+      return;
+   }
+   /* misfit[0] with all the lines, misfit[k+1] without line k */
+   for (k=-1; k<8; k++) {
+      net_normal_equations(p, k, a, x);
+      misfit[k+1] = cholesky_solve(a, x, NET_UNKNOWNS) ? -1.0 : net_misfit(p, k, x, &steps[k+1]);
+   }
+   if (misfit[0] < 0) {
+      report(p, "Diagnosis: the adjustment of the lines is singular.\n");
+      return;
+   }
+
+   report(p, "Diagnosis of the closure error: the least-squares residuals of the\n"
+	  "steps are %.2f %s RMS with all eight lines; leaving out one line:\n",
+	  scale*sqrt(misfit[0]/steps[0]), unit);
+   /* by misfit without the line, smallest first, lines that could not be left out last */
+   for (i=0; i<8; i++) {
+      for (k=i; k>0; k--) {
+	 double m = misfit[order[k-1]+1];
+	 if (misfit[i+1] < 0 || (m >= 0 && m <= misfit[i+1])) break;
+	 order[k] = order[k-1];
+      }
+      order[k] = i;
+   }
+   report(p, "   line        RMS residual  closure error explained\n");
+   for (k=0; k<8; k++) {
+      i = order[k];
+      if (misfit[i+1] < 0)
+	 report(p, "   %-10s   cannot be left out\n", filenames[i]);
+      else
+	 report(p, "   %-10s %8.2f %12.0f%%\n", filenames[i], scale*sqrt(misfit[i+1]/steps[i+1]),
+		misfit[0] > 0 ? 100.0*(1.0-misfit[i+1]/misfit[0]) : 0.0);
+   }
+
+   if (misfit[0] > 0 && misfit[order[0]+1] >= 0) {
+      double first = 1.0-misfit[order[0]+1]/misfit[0];
+      double second = misfit[order[1]+1] >= 0 ? 1.0-misfit[order[1]+1]/misfit[0] : 0.0;
+      p->explained = first;
+      if (first-second < DIAGNOSE_TIE) {
+	 report(p, "The closure error cannot tell lines");
+	 for (k=0; k<8 && misfit[order[k]+1] >= 0 &&
+		 first-(1.0-misfit[order[k]+1]/misfit[0]) < DIAGNOSE_TIE; k++)
+	    report(p, "%s %s", k ? "," : "", filenames[order[k]]);
+	 if (p->warnings & WARN_CENTER)
+	    report(p, " apart;\nmeasure %s again first, or a line with stations flagged below.\n",
+		   filenames[order[0]]);
+	 else
+	    report(p, " apart, but it is acceptable.\n");
+      } else if (p->warnings & WARN_CENTER) {
+	 p->suspect = order[0];
+	 report(p, "The closure error points to line %s: measure it again first.\n",
+		filenames[order[0]]);
+      } else
+	 report(p, "Most of the closure error is explained by line %s, but it is acceptable.\n",
+		filenames[order[0]]);
+   }
+
+   for (found=0, i=0; i<8; i++) found += diagnose_stations(p, i);
+   if (!found) report(p, "No reading stands out from those around it.\n");
+   report(p, "================================================================\n");
+   return;
+}
+
+/*
+ * Fill in Moody columns 7 and 8, once columns 6 (and 6a) of all eight
+ * worksheets are complete. Returns the height of the highest point
+ * above the lowest one, in the output units of column 8.
+ */
+real height_columns(struct moody_plate *p) {
+   int i,j;
+   real lowest, highest;
+
+   /* Compute Moody column 7  */
+   
+   /* For diagonals and perimeter lines */
+   return_low_and_high_point(p, &lowest, &highest);
+   for (i=0; i<6; i++)
+      for (j=0; j<=p->num_dat[i]; j++)
+	 p->ws[i][6][j]=p->ws[i][5][j]-lowest;
+   /* and for the center lines */
+   for (i=6; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++)
+	 p->ws[i][6][j]=p->ws[i][8][j]-lowest;
+
+   /* Now fill in column 8 */
+   for (i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++)
+	    p->ws[i][7][j] = p->ws[i][6][j]*arcsec*p->out_spacing;
+
+   /* Maximum height over plate, with units */
+   return (highest-lowest)*arcsec*p->out_spacing;
+}
+
+/*
+ * The dependencies between the worksheets. Columns 1 to 4 of a sheet
+ * depend only on the readings of its line, and columns 5 and 6 (and
+ * 6a) also on column 6 of the sheets in sheet_inputs[]: the diagonals
+ * on nothing else, the perimeter lines on both diagonals, whose ends
+ * are the corners, and the center lines on the two perimeter lines
+ * whose middles they join. Every sheet comes after its inputs in the
+ * order of filenames[]. Columns 7 and 8 depend on all the sheets.
+ */
+const int sheet_inputs[8][2] = {
+   {-1, -1}, {-1, -1},
+   {NW_SE, NE_SW}, {NW_SE, NE_SW}, {NW_SE, NE_SW}, {NW_SE, NE_SW},
+   {NE_SE, NW_SW}, {NE_NW, SE_SW}
+};
+
+/* The sheets (bit i for sheet i) to compute again when the lines in changed have */
+int dirty_sheets(int changed) {
+   int i, k, dirty = changed;
+   for (i=0; i<8; i++)
+      for (k=0; k<2; k++)
+	 if (sheet_inputs[i][k] >= 0 && dirty & 1<<sheet_inputs[i][k]) dirty |= 1<<i;
+   return dirty;
+}
+
+/* Moody columns 5 and 6 (and 6a) of sheet i, once those of its sheet_inputs[] are done */
+void correct_sheet(struct moody_plate *p, int i) {
+   if (i < 2) {
+      /* the diagonals */
+      diagonal_correction(p, i);
+      return;
+   }
+   if (i < 6)
+      /* perimeter lines: copy corners into worksheets, then correction factors */
+      copy_corners(p, i);
+   else
+      /* center lines: copy midpoints of perimeter lines, then correction factors and column 6a */
+      copy_midpoints(p, i);
+   shift_lines(p, i);
+   return;
+}
+
+/* Moody columns 5 and 6 (and 6a) of all eight worksheets, once columns 1 to 4 are done */
+void correction_columns(struct moody_plate *p) {
+   int i;
+   for (i=0; i<8; i++) correct_sheet(p, i);
+   return;
+}
+
+/*
+ * Moody columns 1 to 6 (and 6a) of all eight worksheets, from the
+ * readings in column 2
+ */
+void correct_lines(struct moody_plate *p) {
+   int i;
+
+   /* Step through all eight worksheets, doing first four columns */
+   for (i=0; i<8; i++) first_four_columns(p, i);
+   correction_columns(p);
+   return;
+}
+
+/*
+ * Batched worksheet kernel. MOODY_LANES plates with the same numbers
+ * of stations are computed together, stored station-major with the
+ * plates interleaved: value j of column c of line i of lane l is
+ * ws[i][c][j*MOODY_LANES+l]. Each stage below is the one of the same
+ * name for a single plate, with the same arithmetic in the same order,
+ * so every lane gives exactly the results of the scalar code. The
+ * innermost loops run over the lanes and are vectorized by the
+ * compiler.
+ */
+struct lane_sheets {
+   int num_dat[8];
+   real *ws[8][9];
+   real *arena;
+   /* per lane, as in struct moody_plate */
+   real out_spacing[MOODY_LANES];
+   /* the same for all lanes, as in struct moody_plate */
+   const real *pos[8];
+};
+
+/* Value j of lane l of a batched column */
+#define LANE(col, j, l) ((col)[(size_t)(j)*MOODY_LANES+(l)])
+
+/* Allocate the batched worksheets for the station counts num_dat; returns -1 if out of memory */
+int layout_lanes(struct lane_sheets *s) {
+   size_t total=0;
+   real *col;
+   int i, c;
+
+   for (i=0; i<8; i++)
+      total += (size_t)num_columns(i)*(s->num_dat[i]+1)*MOODY_LANES;
+   if (!(s->arena = calloc(total, sizeof(real)))) return -1;
+   col = s->arena;
+   for (i=0; i<8; i++)
+      for (c=0; c<9; c++) {
+	 if (c<num_columns(i)) {
+	    s->ws[i][c] = col;
+	    col += (size_t)(s->num_dat[i]+1)*MOODY_LANES;
+	 } else
+	    s->ws[i][c] = NULL;
+      }
+   return 0;
+}
+
+/* mid_value() for all lanes */
+void mid_lanes(const struct lane_sheets *s, int which_sheet, int which_column, real *mid) {
+   const real *col = s->ws[which_sheet][which_column];
+   const real *pos = s->pos[which_sheet];
+   int ndat = s->num_dat[which_sheet], l;
+   if (pos) {
+      real x = 0.5*pos[ndat];
+      int j = station_before(pos, ndat, x);
+      for (l=0; l<MOODY_LANES; l++)
+	 mid[l] = LANE(col, j, l) + (x-pos[j])/(pos[j+1]-pos[j])*(LANE(col, j+1, l)-LANE(col, j, l));
+   } else if (ndat % 2 == 0)
+      for (l=0; l<MOODY_LANES; l++) mid[l] = LANE(col, ndat/2, l);
+   else
+      for (l=0; l<MOODY_LANES; l++) {
+	 real a = LANE(col, (ndat-1)/2, l);
+	 real b = LANE(col, (ndat+1)/2, l);
+	 mid[l] = 0.5*(a+b);
+      }
+   return;
+}
+
+/* first_four_columns() for all lanes */
+void first_four_lanes(struct lane_sheets *s, int which_sheet) {
+   real *const *col = s->ws[which_sheet];
+   real carry[MOODY_LANES];
+   int ndat = s->num_dat[which_sheet], j, l;
+
+   for (j=0; j<=ndat; j++)
+      for (l=0; l<MOODY_LANES; l++) LANE(col[0], j, l) = j+1;
+   for (j=1; j<=ndat; j++)
+      for (l=0; l<MOODY_LANES; l++)
+	 LANE(col[2], j, l) = LANE(col[1], j, l) - LANE(col[1], 1, l);
+   if (s->pos[which_sheet])
+      for (j=1; j<=ndat; j++) {
+	 real step = s->pos[which_sheet][j]-s->pos[which_sheet][j-1];
+	 for (l=0; l<MOODY_LANES; l++) LANE(col[2], j, l) *= step;
+      }
+   for (l=0; l<MOODY_LANES; l++) {
+      LANE(col[3], 0, l) = LANE(col[3], 1, l) = 0.0;
+      carry[l] = 0.0;
+   }
+   for (j=2; j<=ndat; j++)
+      for (l=0; l<MOODY_LANES; l++)
+	 LANE(col[3], j, l) = accumulate(LANE(col[3], j-1, l), LANE(col[2], j, l), &carry[l]);
+   return;
+}
+
+/* diagonal_correction() for all lanes */
+void diagonal_lanes(struct lane_sheets *s, int which_sheet) {
+   real *const *col = s->ws[which_sheet];
+   const real *pos = s->pos[which_sheet];
+   int ndat = s->num_dat[which_sheet], j, l;
+   real a[MOODY_LANES], b[MOODY_LANES], span = pos ? pos[ndat] : ndat;
+
+   mid_lanes(s, which_sheet, 3, b);
+   for (l=0; l<MOODY_LANES; l++) {
+      a[l] = -1.0*LANE(col[3], ndat, l)/span;
+      b[l] = 0.5*LANE(col[3], ndat, l)-b[l];
+   }
+   for (j=0; j<=ndat; j++)
+      for (l=0; l<MOODY_LANES; l++) {
+	 LANE(col[4], j, l) = a[l]*(pos ? pos[j] : j)+b[l];
+	 LANE(col[5], j, l) = LANE(col[3], j, l) + LANE(col[4], j, l);
+      }
+   return;
+}
+
+/* corner_value() for all lanes: column 6 of a diagonal, at station j */
+void corner_lanes(const struct lane_sheets *s, int corner, real *value) {
+   int i = corner==NE || corner==SW ? NE_SW : NW_SE;
+   int j = corner==NE || corner==NW ? 0 : s->num_dat[i];
+   int l;
+   for (l=0; l<MOODY_LANES; l++) value[l] = LANE(s->ws[i][5], j, l);
+   return;
+}
+
+/* copy_corners() for all lanes */
+void copy_corner_lanes(struct lane_sheets *s, int which_sheet) {
+   const int start[4]={NE, NE, SE, NW};
+   const int end[4]  ={NW, SE, SW, SW};
+   real v[MOODY_LANES];
+   int i=which_sheet, l;
+
+   corner_lanes(s, start[i-2], v);
+   for (l=0; l<MOODY_LANES; l++) LANE(s->ws[i][4], 0, l) = LANE(s->ws[i][5], 0, l) = v[l];
+   corner_lanes(s, end[i-2], v);
+   for (l=0; l<MOODY_LANES; l++) LANE(s->ws[i][5], s->num_dat[i], l) = v[l];
+   return;
+}
+
+/* copy_midpoints() for all lanes */
+void copy_midpoint_lanes(struct lane_sheets *s, int which_sheet) {
+   int first = which_sheet==E_W ? NE_SE : NE_NW;
+   int last  = which_sheet==E_W ? NW_SW : SE_SW;
+   real *const *col = s->ws[which_sheet];
+   real v[MOODY_LANES];
+   int l;
+
+   mid_lanes(s, first, 5, v);
+   for (l=0; l<MOODY_LANES; l++) LANE(col[4], 0, l) = LANE(col[5], 0, l) = v[l];
+   mid_lanes(s, last, 5, v);
+   for (l=0; l<MOODY_LANES; l++) LANE(col[5], s->num_dat[which_sheet], l) = v[l];
+   return;
+}
+
+/* shift_lines() for all lanes */
+void shift_lanes(struct lane_sheets *s, int which_sheet) {
+   real *const *col = s->ws[which_sheet];
+   int ndat = s->num_dat[which_sheet], j, l;
+   const real *pos = s->pos[which_sheet];
+   real correction_factor[MOODY_LANES], should_be_zero[MOODY_LANES], carry[MOODY_LANES];
+
+   for (l=0; l<MOODY_LANES; l++) {
+      LANE(col[4], ndat, l) = LANE(col[5], ndat, l) - LANE(col[3], ndat, l);
+      correction_factor[l] = (LANE(col[4], 0, l) - LANE(col[4], ndat, l))/(pos ? pos[ndat] : ndat);
+      carry[l] = 0.0;
+   }
+   if (pos)
+      for (j=ndat-1; j>0; j--)
+	 for (l=0; l<MOODY_LANES; l++) {
+	    LANE(col[4], j, l) = LANE(col[4], ndat, l) + correction_factor[l]*(pos[ndat]-pos[j]);
+	    LANE(col[5], j, l) = LANE(col[4], j, l) + LANE(col[3], j, l);
+	 }
+   else
+      for (j=ndat-1; j>0; j--)
+	 for (l=0; l<MOODY_LANES; l++) {
+	    LANE(col[4], j, l) = accumulate(LANE(col[4], j+1, l), correction_factor[l], &carry[l]);
+	    LANE(col[5], j, l) = LANE(col[4], j, l) + LANE(col[3], j, l);
+	 }
+   if (which_sheet==6 || which_sheet==7) {
+      mid_lanes(s, which_sheet, 5, should_be_zero);
+      for (j=0; j<=ndat; j++)
+	 for (l=0; l<MOODY_LANES; l++)
+	    LANE(col[8], j, l) = LANE(col[5], j, l) - should_be_zero[l];
+   }
+   return;
+}
+
+/* correct_lines() for all lanes */
+void correct_lanes(struct lane_sheets *s) {
+   int i;
+   for (i=0; i<8; i++) first_four_lanes(s, i);
+   for (i=0; i<2; i++) diagonal_lanes(s, i);
+   for (i=2; i<6; i++) {
+      copy_corner_lanes(s, i);
+      shift_lanes(s, i);
+   }
+   for (i=6; i<8; i++) {
+      copy_midpoint_lanes(s, i);
+      shift_lanes(s, i);
+   }
+   return;
+}
+
+/* height_columns() for all lanes, with the flatness of each lane in flatness[] */
+void height_lanes(struct lane_sheets *s, real *flatness) {
+   real lowest[MOODY_LANES], highest[MOODY_LANES], out_spacing[MOODY_LANES];
+   int i, j, l;
+
+   /* a local copy, which the stores into the columns cannot change */
+   memcpy(out_spacing, s->out_spacing, sizeof(out_spacing));
+
+   /* return_low_and_high_point(): column 6, or 6a for the center lines */
+   for (l=0; l<MOODY_LANES; l++) lowest[l] = highest[l] = LANE(s->ws[0][5], 0, l);
+   for (i=0; i<8; i++) {
+      const real *col = s->ws[i][i==6 || i==7 ? 8 : 5];
+      for (j=0; j<=s->num_dat[i]; j++)
+	 for (l=0; l<MOODY_LANES; l++) {
+	    real tmp = LANE(col, j, l);
+	    lowest[l] = tmp<lowest[l] ? tmp : lowest[l];
+	    highest[l] = tmp>highest[l] ? tmp : highest[l];
+	 }
+   }
+   for (i=0; i<8; i++) {
+      const real *col = s->ws[i][i==6 || i==7 ? 8 : 5];
+      real *base = s->ws[i][6], *height = s->ws[i][7];
+      for (j=0; j<=s->num_dat[i]; j++)
+	 for (l=0; l<MOODY_LANES; l++) {
+	    real d = LANE(col, j, l)-lowest[l];
+	    LANE(base, j, l) = d;
+	    LANE(height, j, l) = d*arcsec*out_spacing[l];
+	 }
+   }
+   for (l=0; l<MOODY_LANES; l++)
+      flatness[l] = (highest[l]-lowest[l])*arcsec*out_spacing[l];
+   return;
+}
+
+/*
+ * Moody columns 1 to 6 (and 6a) of up to MOODY_LANES plates with the
+ * same numbers of stations, at the same positions (see same_stations()),
+ * as correct_lines() does for each one alone; returns -1 if out of memory
+ */
+int correct_plates(struct moody_plate **p, int n) {
+   struct lane_sheets s;
+   int i, c, j, k;
+
+   memcpy(s.num_dat, p[0]->num_dat, sizeof(s.num_dat));
+   memcpy(s.pos, p[0]->pos, sizeof(s.pos));
+   if (layout_lanes(&s)) return -1;
+   for (k=0; k<n; k++)
+      for (i=0; i<8; i++)
+	 for (j=0; j<=s.num_dat[i]; j++) LANE(s.ws[i][1], j, k) = p[k]->ws[i][1][j];
+   correct_lanes(&s);
+   for (k=0; k<n; k++)
+      for (i=0; i<8; i++)
+	 for (c=0; c<num_columns(i); c++)
+	    if (c != 1)
+	       for (j=0; j<=s.num_dat[i]; j++) p[k]->ws[i][c][j] = LANE(s.ws[i][c], j, k);
+   free(s.arena);
+   return 0;
+}
+
+/*
+ * Monte Carlo uncertainty. Each trial perturbs the readings and the
+ * foot spacing of a copy of the plate and repeats the computation up
+ * to column 8. Trial k draws its noise from its own xoshiro256**
+ * stream, seeded from the plate seed and k with splitmix64, so the
+ * results do not depend on how the trials are shared between threads.
+ */
+
+/* splitmix64, to seed the generators */
+unsigned long long splitmix64(unsigned long long *x) {
+   unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+/* xoshiro256** random number generator, with a cached Gaussian deviate */
+struct rng {
+   unsigned long long s[4];
+   int have_spare;
+   double spare;
+};
+
+void rng_seed(struct rng *r, unsigned long long seed, unsigned long long stream) {
+   unsigned long long x = seed ^ splitmix64(&stream);
+   int k;
+   for (k=0; k<4; k++) r->s[k] = splitmix64(&x);
+   r->have_spare = 0;
+   return;
+}
+
+unsigned long long rotl64(unsigned long long x, int k) {
+   return (x << k) | (x >> (64-k));
+}
+
+unsigned long long rng_next(struct rng *r) {
+   unsigned long long *s = r->s;
+   unsigned long long result = rotl64(s[1]*5, 7)*9, t = s[1] << 17;
+   s[2] ^= s[0];
+   s[3] ^= s[1];
+   s[1] ^= s[2];
+   s[0] ^= s[3];
+   s[2] ^= t;
+   s[3] = rotl64(s[3], 45);
+   return result;
+}
+
+/* Uniform deviate in (0,1) */
+double rng_uniform(struct rng *r) {
+   return ((rng_next(r) >> 11) + 0.5) * (1.0/9007199254740992.0);
+}
+
+/* Standard Gaussian deviate, by Marsaglia's polar method */
+double rng_gauss(struct rng *r) {
+   double u, v, s;
+   if (r->have_spare) {
+      r->have_spare = 0;
+      return r->spare;
+   }
+   do {
+      u = 2.0*rng_uniform(r)-1.0;
+      v = 2.0*rng_uniform(r)-1.0;
+      s = u*u+v*v;
+   } while (s >= 1.0);
+   s = sqrt(-2.0*log(s)/s);
+   r->spare = v*s;
+   r->have_spare = 1;
+   return u*s;
+}
+
+/* Trials done by one thread, and its sums of column 8 over them */
+struct mc_worker {
+   struct moody_plate *p;
+   int first, last;
+   double *sum, *sum2;
+   float *flatness;
+   /* set if the worker could not run its trials */
+   int failed;
+};
+
+/*
+ * Draw the perturbed readings of trial k of plate p into columns
+ * col[i] of the eight lines, station j at col[i][j*stride], and return
+ * its foot spacing
+ */
+real perturb_trial(const struct moody_plate *p, int k, real *const *col, size_t stride) {
+   struct rng r;
+   int i, j;
+   rng_seed(&r, p->mc_seed, k);
+   for (i=0; i<8; i++)
+      for (j=1; j<=p->num_dat[i]; j++)
+	 col[i][j*stride] = p->ws[i][1][j] +
+	    (p->mc_sigma < 0 ? p->input_sigma[i][j-1] : p->mc_sigma)*rng_gauss(&r);
+   return p->foot_spacing + p->mc_foot_sigma*rng_gauss(&r);
+}
+
+/* Add column 8 of a trial, given as in perturb_trial(), to the sums of worker w */
+void add_trial(struct mc_worker *w, const real *const *col, size_t stride) {
+   int i, j, n;
+   for (n=0, i=0; i<8; i++)
+      for (j=0; j<=w->p->num_dat[i]; j++, n++) {
+	 double h = col[i][j*stride];
+	 w->sum[n] += h;
+	 w->sum2[n] += h*h;
+      }
+   return;
+}
+
+/*
+ * Run trials first to last-1 of plate w->p, MOODY_LANES at a time on
+ * batched worksheets, or one at a time on a private copy of the
+ * worksheets for the least-squares adjustment. An error sets
+ * w->failed, for run_monte_carlo() to fail the plate.
+ */
+void *mc_worker_run(void *arg) {
+   struct mc_worker *w = arg;
+   struct moody_plate *p = w->p;
+   struct moody_plate *q;
+   struct lane_sheets s;
+   jmp_buf env;
+   real *col[8];
+   int i, k, l;
+
+   if (p->least_squares) {
+      /* other threads may be running, so errors only jump back to here */
+      if (!(q = new_plate(NULL, NULL))) {
+	 fprintf(stderr, "Error: out of memory for the Monte Carlo trials\n");
+	 w->failed = 1;
+	 return NULL;
+      }
+      q->fail_jmp = &env;
+      if (setjmp(env)) {
+	 free_plate(q);
+	 w->failed = 1;
+	 return NULL;
+      }
+      memcpy(q->num_dat, p->num_dat, sizeof(q->num_dat));
+      q->metric = p->metric;
+      q->least_squares = p->least_squares;
+      layout_worksheets(q);
+      for (k=w->first; k<w->last; k++) {
+	 for (i=0; i<8; i++) col[i] = q->ws[i][1];
+	 q->foot_spacing = perturb_trial(p, k, col, 1);
+	 q->out_spacing = p->out_spacing*(q->foot_spacing/p->foot_spacing);
+	 correct_lines(q);
+	 solve_network(q);
+	 w->flatness[k] = height_columns(q);
+	 for (i=0; i<8; i++) col[i] = q->ws[i][7];
+	 add_trial(w, (const real *const *)col, 1);
+      }
+      free_plate(q);
+   } else {
+      memcpy(s.num_dat, p->num_dat, sizeof(s.num_dat));
+      memcpy(s.pos, p->pos, sizeof(s.pos));
+      if (layout_lanes(&s)) {
+	 fprintf(stderr, "Error: out of memory for the Monte Carlo trials\n");
+	 w->failed = 1;
+	 return NULL;
+      }
+      for (k=w->first; k<w->last; k+=MOODY_LANES) {
+	 int n = w->last-k < MOODY_LANES ? w->last-k : MOODY_LANES;
+	 real flatness[MOODY_LANES];
+	 for (l=0; l<n; l++) {
+	    real foot;
+	    for (i=0; i<8; i++) col[i] = &LANE(s.ws[i][1], 0, l);
+	    foot = perturb_trial(p, k+l, col, MOODY_LANES);
+	    s.out_spacing[l] = p->out_spacing*(foot/p->foot_spacing);
+	 }
+	 correct_lanes(&s);
+	 height_lanes(&s, flatness);
+	 for (l=0; l<n; l++) {
+	    w->flatness[k+l] = flatness[l];
+	    for (i=0; i<8; i++) col[i] = &LANE(s.ws[i][7], 0, l);
+	    add_trial(w, (const real *const *)col, MOODY_LANES);
+	 }
+      }
+      free(s.arena);
+   }
+   return NULL;
+}
+
+/*
+ * Number of threads for the Monte Carlo trials of plate p. The sums
+ * of the threads are added in a fixed order, so the results depend on
+ * this number, but not on the timing of the threads.
+ */
+int mc_worker_count(const struct moody_plate *p) {
+   int num_workers = p->mc_workers;
+#ifdef MOODY_THREADS
+   if (num_workers <= 0) num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+   if (num_workers > p->mc_trials) num_workers = p->mc_trials;
+   if (num_workers < 1) num_workers = 1;
+#ifndef MOODY_THREADS
+   num_workers = 1;
+#endif
+   return num_workers;
+}
+
+/*
+ * Repeat the computation for p->mc_trials perturbed copies of plate
+ * p, whose worksheets are complete, and fill in the mean and spread
+ * of column 8 and the distribution of the flatness
+ */
+void run_monte_carlo(struct moody_plate *p) {
+   struct mc_worker *w;
+   int num_workers = mc_worker_count(p);
+   int stations = 0, i, j, k, n;
+   double sum = 0.0, sum2 = 0.0;
+   float *flatness, *col;
+   double *sums;
+
+   for (i=0; i<8; i++) {
+      stations += p->num_dat[i]+1;
+      if (p->mc_sigma < 0 && !p->input_sigma[i]) {
+	 fprintf(stderr, "Error: --sigma samples needs the data files, not a bundle\n");
+	 fail(p);
+      }
+   }
+
+   free(p->mc);
+   p->mc = malloc(2*stations*sizeof(float));
+   flatness = malloc(p->mc_trials*sizeof(float));
+   sums = calloc((size_t)2*stations*num_workers, sizeof(double));
+   w = malloc(num_workers*sizeof(struct mc_worker));
+   if (!p->mc || !flatness || !sums || !w) {
+      fprintf(stderr, "Error: out of memory for the Monte Carlo trials\n");
+      fail(p);
+   }
+   for (k=0; k<num_workers; k++) {
+      w[k].p = p;
+      w[k].first = (int)((long long)p->mc_trials*k/num_workers);
+      w[k].last = (int)((long long)p->mc_trials*(k+1)/num_workers);
+      w[k].sum = sums + (size_t)2*stations*k;
+      w[k].sum2 = w[k].sum + stations;
+      w[k].flatness = flatness;
+      w[k].failed = 0;
+   }
+
+#ifdef MOODY_THREADS
+   {
+      pthread_t *tid = malloc(num_workers*sizeof(pthread_t));
+      int *started = calloc(num_workers, sizeof(int));
+      if (!tid || !started) {
+	 fprintf(stderr, "Error: out of memory for the Monte Carlo trials\n");
+	 fail(p);
+      }
+      /* the first share is done by this thread, as are those of threads that fail to start */
+      for (k=1; k<num_workers; k++)
+	 started[k] = pthread_create(&tid[k], NULL, mc_worker_run, &w[k]) == 0;
+      mc_worker_run(&w[0]);
+      for (k=1; k<num_workers; k++)
+	 if (started[k]) pthread_join(tid[k], NULL);
+	 else mc_worker_run(&w[k]);
+      free(started);
+      free(tid);
+   }
+#else
+   mc_worker_run(&w[0]);
+#endif
+   for (k=0; k<num_workers; k++)
+      if (w[k].failed) {
+	 free(w);
+	 free(sums);
+	 free(flatness);
+	 fail(p);
+      }
+
+   /* combine the sums of the workers, in a fixed order */
+   for (col=p->mc, i=0; i<8; col += 2*(p->num_dat[i]+1), i++) {
+      p->mc_mean[i] = col;
+      p->mc_spread[i] = col + p->num_dat[i]+1;
+   }
+   for (n=0, i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++, n++) {
+	 double s = 0.0, s2 = 0.0, mean, var;
+	 for (k=0; k<num_workers; k++) {
+	    s += w[k].sum[n];
+	    s2 += w[k].sum2[n];
+	 }
+	 mean = s/p->mc_trials;
+	 var = s2/p->mc_trials - mean*mean;
+	 p->mc_mean[i][j] = mean;
+	 p->mc_spread[i][j] = var > 0 ? sqrt(var) : 0;
+      }
+
+   for (k=0; k<p->mc_trials; k++) {
+      sum += flatness[k];
+      sum2 += (double)flatness[k]*flatness[k];
+   }
+   p->flat_mean = sum/p->mc_trials;
+   p->flat_sigma = sum2/p->mc_trials > p->flat_mean*p->flat_mean ?
+      sqrt(sum2/p->mc_trials - p->flat_mean*p->flat_mean) : 0;
+   p->flat_quantile[0] = quantile(flatness, p->mc_trials, 0.025);
+   p->flat_quantile[1] = quantile(flatness, p->mc_trials, 0.5);
+   p->flat_quantile[2] = quantile(flatness, p->mc_trials, 0.975);
+
+   free(w);
+   free(sums);
+   free(flatness);
+   return;
+}
+
+/* A 95% band around column 8, from the Monte Carlo spread */
+#define MC_BAND 1.96
+
+void report_monte_carlo(struct moody_plate *p) {
+   float scale = p->metric ? 1.0 : 10.0;
+   const char *unit = p->metric ? "microns" : "micro-inches";
+   if (p->mc_sigma < 0)
+      report(p, "Monte Carlo uncertainty from %d trials, with the standard errors of the\n"
+	     "samples as noise on the readings and %.4f %s on the foot spacing:\n",
+	     p->mc_trials, p->mc_foot_sigma, p->metric ? "mm" : "inch");
+   else
+      report(p, "Monte Carlo uncertainty from %d trials, with %.3f arc seconds of noise\n"
+	     "on the readings and %.4f %s on the foot spacing:\n",
+	     p->mc_trials, p->mc_sigma, p->mc_foot_sigma, p->metric ? "mm" : "inch");
+   report(p, "flatness %.2f +/- %.2f %s, 95%% between %.2f and %.2f %s.\n",
+	  scale*p->flat_mean, scale*p->flat_sigma, unit,
+	  scale*p->flat_quantile[0], scale*p->flat_quantile[2], unit);
+   report(p, "================================================================\n");
+   return;
+}
+
+/* Print the column 8 band of line which_sheet, from the Monte Carlo trials */
+void print_uncertainty(struct moody_plate *p, int which_sheet) {
+   int j;
+   report(p, "\nUNCERTAINTY %s (%s)\n", filenames[which_sheet],
+	  p->metric ? "micron" : "10^-5in");
+   report(p, "Station  Height    Mean   Sigma  95%% low 95%% high\n");
+   for (j=0; j<=p->num_dat[which_sheet]; j++) {
+      float mean = p->mc_mean[which_sheet][j], sigma = p->mc_spread[which_sheet][j];
+      report(p, "%6d%8.1f%8.1f%8.2f%8.1f%8.1f\n", (int)p->ws[which_sheet][0][j],
+	     p->ws[which_sheet][7][j], mean, sigma, mean-MC_BAND*sigma, mean+MC_BAND*sigma);
+   }
+   return;
+}
+
+/* All worksheet columns, one row per station, then the summary */
+void write_csv(struct moody_plate *p) {
+   FILE *fp = p->out;
+   char num[32];
+   int i, j, c;
+
+   fprintf(fp, "line");
+   for (c=0; c<9; c++) fprintf(fp, ",%s", column_names[c]);
+   fprintf(fp, "%s%s\n", p->residuals ? ",residual" : "", p->mc ? ",mc_mean,mc_sigma" : "");
+   for (i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++) {
+	 fprintf(fp, "%.*s,%d", line_name_length(i), filenames[i], (int)p->ws[i][0][j]);
+	 for (c=1; c<9; c++)
+	    fprintf(fp, ",%s", p->ws[i][c] ? format_real(num, p->ws[i][c][j]) : "");
+	 if (p->residuals) fprintf(fp, ",%s", format_exact(num, p->residual[i][j]));
+	 if (p->mc) {
+	    fprintf(fp, ",%s", format_exact(num, p->mc_mean[i][j]));
+	    fprintf(fp, ",%s", format_exact(num, p->mc_spread[i][j]));
+	 }
+	 fprintf(fp, "\n");
+      }
+
+   fprintf(fp, "\nquantity,value\n");
+   fprintf(fp, "units,%s\n", p->metric ? "mm" : "inch");
+   fprintf(fp, "foot_spacing,%s\n", format_exact(num, p->foot_spacing));
+   fprintf(fp, "height_unit,%s\n", p->metric ? "micron" : "1e-5 inch");
+   fprintf(fp, "center_height_E_W,%s\n", format_real(num, p->center[0]));
+   fprintf(fp, "center_height_N_S,%s\n", format_real(num, p->center[1]));
+   fprintf(fp, "flatness,%s\n", format_real(num, p->flatness));
+   if (p->zone) {
+      fprintf(fp, "zone_flatness,%s\n", format_exact(num, p->zone_flatness));
+      fprintf(fp, "lsq_flatness,%s\n", format_exact(num, p->lsq_flatness));
+   }
+   if (p->diagnose) {
+      fprintf(fp, "suspect_line,%s\n", p->suspect >= 0 ? filenames[p->suspect] : "");
+      fprintf(fp, "closure_explained,%s\n", format_exact(num, p->explained));
+   }
+   if (p->residuals) {
+      fprintf(fp, "rms_residual,%s\n", format_exact(num, p->rms_residual));
+      fprintf(fp, "max_residual,%s\n", format_exact(num, p->max_residual));
+   }
+   if (p->mc) {
+      fprintf(fp, "mc_trials,%d\n", p->mc_trials);
+      fprintf(fp, "flatness_mean,%s\n", format_exact(num, p->flat_mean));
+      fprintf(fp, "flatness_sigma,%s\n", format_exact(num, p->flat_sigma));
+      fprintf(fp, "flatness_p2.5,%s\n", format_exact(num, p->flat_quantile[0]));
+      fprintf(fp, "flatness_median,%s\n", format_exact(num, p->flat_quantile[1]));
+      fprintf(fp, "flatness_p97.5,%s\n", format_exact(num, p->flat_quantile[2]));
+   }
+   for (c=0; c<NUM_WARNINGS; c++)
+      if (p->warnings & 1<<c) fprintf(fp, "warning,%s\n", warning_text[c]);
+
+   /* the height map, with positions in foot spacings */
+   if (p->grid) {
+      int max_x, max_y;
+      plate_extent(p, &max_x, &max_y);
+      fprintf(fp, "\nx,y,height\n");
+      for (j=0; j<p->grid_ny; j++)
+	 for (i=0; i<p->grid_nx; i++) {
+	    fprintf(fp, "%s,", format_exact(num, max_x*((float)i)/(p->grid_nx-1)));
+	    fprintf(fp, "%s,", format_exact(num, max_y*((float)j)/(p->grid_ny-1)));
+	    fprintf(fp, "%s\n", format_exact(num, p->grid[(size_t)j*p->grid_nx+i]));
+	 }
+   }
+   return;
+}
+
+/* All worksheet columns and the summary, as one JSON object */
+void write_json(struct moody_plate *p) {
+   FILE *fp = p->out;
+   char num[32];
+   int i, j, c, first=1;
+
+   fprintf(fp, "{\n  \"units\": \"%s\",\n  \"foot_spacing\": %s,\n"
+	   "  \"height_unit\": \"%s\",\n  \"lines\": [\n",
+	   p->metric ? "mm" : "inch", format_exact(num, p->foot_spacing),
+	   p->metric ? "micron" : "1e-5 inch");
+   for (i=0; i<8; i++) {
+      fprintf(fp, "    {\"name\": \"%.*s\", \"stations\": %d",
+	      line_name_length(i), filenames[i], p->num_dat[i]);
+      /* in foot spacings, for lines whose stations are not evenly spaced */
+      if (p->pos[i]) {
+	 fprintf(fp, ",\n      \"position\": [");
+	 for (j=0; j<=p->num_dat[i]; j++)
+	    fprintf(fp, "%s%s", j ? "," : "", format_real(num, p->pos[i][j]));
+	 fprintf(fp, "]");
+      }
+      for (c=0; c<9; c++) {
+	 if (!p->ws[i][c]) continue;
+	 fprintf(fp, ",\n      \"%s\": [", column_names[c]);
+	 for (j=0; j<=p->num_dat[i]; j++)
+	    fprintf(fp, "%s%s", j ? "," : "", format_real(num, p->ws[i][c][j]));
+	 fprintf(fp, "]");
+      }
+      if (p->residuals) {
+	 fprintf(fp, ",\n      \"residual\": [");
+	 for (j=0; j<=p->num_dat[i]; j++)
+	    fprintf(fp, "%s%s", j ? "," : "", format_exact(num, p->residual[i][j]));
+	 fprintf(fp, "]");
+      }
+      if (p->mc) {
+	 fprintf(fp, ",\n      \"mc_mean\": [");
+	 for (j=0; j<=p->num_dat[i]; j++)
+	    fprintf(fp, "%s%s", j ? "," : "", format_exact(num, p->mc_mean[i][j]));
+	 fprintf(fp, "],\n      \"mc_sigma\": [");
+	 for (j=0; j<=p->num_dat[i]; j++)
+	    fprintf(fp, "%s%s", j ? "," : "", format_exact(num, p->mc_spread[i][j]));
+	 fprintf(fp, "]");
+      }
+      fprintf(fp, "}%s\n", i<7 ? "," : "");
+   }
+   fprintf(fp, "  ],\n  \"summary\": {\n");
+   fprintf(fp, "    \"center_height_E_W\": %s,\n", format_real(num, p->center[0]));
+   fprintf(fp, "    \"center_height_N_S\": %s,\n", format_real(num, p->center[1]));
+   fprintf(fp, "    \"flatness\": %s,\n", format_real(num, p->flatness));
+   if (p->zone) {
+      fprintf(fp, "    \"zone_flatness\": %s,\n", format_exact(num, p->zone_flatness));
+      fprintf(fp, "    \"lsq_flatness\": %s,\n", format_exact(num, p->lsq_flatness));
+   }
+   if (p->diagnose) {
+      if (p->suspect >= 0)
+	 fprintf(fp, "    \"suspect_line\": \"%s\",\n", filenames[p->suspect]);
+      else
+	 fprintf(fp, "    \"suspect_line\": null,\n");
+      fprintf(fp, "    \"closure_explained\": %s,\n", format_exact(num, p->explained));
+   }
+   if (p->residuals) {
+      fprintf(fp, "    \"rms_residual\": %s,\n", format_exact(num, p->rms_residual));
+      fprintf(fp, "    \"max_residual\": %s,\n", format_exact(num, p->max_residual));
+   }
+   if (p->mc) {
+      fprintf(fp, "    \"uncertainty\": {\"trials\": %d, ", p->mc_trials);
+      fprintf(fp, "\"sigma_arcsec\": %s, ", p->mc_sigma < 0 ? "\"samples\"" : format_exact(num, p->mc_sigma));
+      fprintf(fp, "\"sigma_foot_spacing\": %s,\n", format_exact(num, p->mc_foot_sigma));
+      fprintf(fp, "      \"flatness_mean\": %s, ", format_exact(num, p->flat_mean));
+      fprintf(fp, "\"flatness_sigma\": %s,\n", format_exact(num, p->flat_sigma));
+      fprintf(fp, "      \"flatness_quantiles\": {\"0.025\": %s, ", format_exact(num, p->flat_quantile[0]));
+      fprintf(fp, "\"0.5\": %s, ", format_exact(num, p->flat_quantile[1]));
+      fprintf(fp, "\"0.975\": %s}},\n", format_exact(num, p->flat_quantile[2]));
+   }
+   fprintf(fp, "    \"acceptable\": %s,\n", p->warnings & WARN_CENTER ? "false" : "true");
+   fprintf(fp, "    \"warnings\": [");
+   for (c=0; c<NUM_WARNINGS; c++)
+      if (p->warnings & 1<<c) {
+	 fprintf(fp, "%s\"%s\"", first ? "" : ", ", warning_text[c]);
+	 first = 0;
+      }
+   fprintf(fp, "]\n  }");
+
+   /* the height map, row by row from South to North */
+   if (p->grid) {
+      size_t k, n = (size_t)p->grid_nx*p->grid_ny;
+      int max_x, max_y;
+      plate_extent(p, &max_x, &max_y);
+      fprintf(fp, ",\n  \"grid\": {\"nx\": %d, \"ny\": %d, \"x_max\": %d, \"y_max\": %d,\n"
+	      "    \"height\": [", p->grid_nx, p->grid_ny, max_x, max_y);
+      for (k=0; k<n; k++)
+	 fprintf(fp, "%s%s", k ? "," : "", format_exact(num, p->grid[k]));
+      fprintf(fp, "]}");
+   }
+   fprintf(fp, "\n}\n");
+   return;
+}
+
+/*
+ * Packed binary record, little-endian like the binary bundle:
+ *   bytes  0-7   magic "MOODYRES"
+ *   bytes  8-11  format version, 1
+ *   bytes 12-15  units, 1 for metric, 0 for imperial
+ *   bytes 16-19  foot spacing, float
+ *   bytes 20-51  number of stations on each of the eight lines
+ *   bytes 52-63  center heights of E_W and N_S, and flatness, floats
+ *   bytes 64-67  WARN_ flags
+ * followed, for each line in the order of filenames[], by columns
+ * ws[i][0] to ws[i][7] (and ws[i][8] for the center lines) of
+ * num_dat[i]+1 floats each, then by the height map: its number
+ * of columns and rows (zero if there is none), and its heights, and
+ * last by the number of residual columns, 8 with the least-squares
+ * adjustment and 0 otherwise, followed by the RMS and largest
+ * residual and residual[i] of num_dat[i]+1 floats for each line,
+ * and finally by the number of Monte Carlo trials (zero if none),
+ * followed by the mean, standard deviation and 2.5%, 50% and 97.5%
+ * quantiles of the flatness, and mc_mean[i] and mc_spread[i] of
+ * num_dat[i]+1 floats each for each line.
+ */
+void write_binary(struct moody_plate *p) {
+   unsigned char b[68];
+   int i, j, c;
+
+   memset(b, 0, sizeof(b));
+   memcpy(b, "MOODYRES", 8);
+   put_le32(b+8, 1);
+   put_le32(b+12, p->metric);
+   put_le_float(b+16, p->foot_spacing);
+   for (i=0; i<8; i++) put_le32(b+20+4*i, p->num_dat[i]);
+   put_le_float(b+52, p->center[0]);
+   put_le_float(b+56, p->center[1]);
+   put_le_float(b+60, p->flatness);
+   put_le32(b+64, p->warnings);
+   fwrite(b, 1, sizeof(b), p->out);
+   for (i=0; i<8; i++)
+      for (c=0; c<num_columns(i); c++)
+	 for (j=0; j<=p->num_dat[i]; j++) {
+	    put_le_float(b, p->ws[i][c][j]);
+	    fwrite(b, 1, 4, p->out);
+	 }
+
+   put_le32(b, p->grid ? p->grid_nx : 0);
+   put_le32(b+4, p->grid ? p->grid_ny : 0);
+   fwrite(b, 1, 8, p->out);
+   if (p->grid) {
+      size_t k, n = (size_t)p->grid_nx*p->grid_ny;
+      for (k=0; k<n; k++) {
+	 put_le_float(b, p->grid[k]);
+	 fwrite(b, 1, 4, p->out);
+      }
+   }
+
+   put_le32(b, p->residuals ? 8 : 0);
+   fwrite(b, 1, 4, p->out);
+   if (p->residuals) {
+      put_le_float(b, p->rms_residual);
+      put_le_float(b+4, p->max_residual);
+      fwrite(b, 1, 8, p->out);
+      for (i=0; i<8; i++)
+	 for (j=0; j<=p->num_dat[i]; j++) {
+	    put_le_float(b, p->residual[i][j]);
+	    fwrite(b, 1, 4, p->out);
+	 }
+   }
+
+   put_le32(b, p->mc ? p->mc_trials : 0);
+   fwrite(b, 1, 4, p->out);
+   if (p->mc) {
+      put_le_float(b, p->flat_mean);
+      put_le_float(b+4, p->flat_sigma);
+      for (c=0; c<3; c++) put_le_float(b+8+4*c, p->flat_quantile[c]);
+      fwrite(b, 1, 20, p->out);
+      for (i=0; i<8; i++)
+	 for (c=0; c<2; c++)
+	    for (j=0; j<=p->num_dat[i]; j++) {
+	       put_le_float(b, (c ? p->mc_spread : p->mc_mean)[i][j]);
+	       fwrite(b, 1, 4, p->out);
+	    }
+   }
+   return;
+}
+
+/*
+ * One line summing up the plate, for quiet mode: the flatness (and by
+ * the minimum zone with --zone) and Moody's closure check at the
+ * center lines, and with --diagnose the line to measure again
+ */
+void write_summary_line(struct moody_plate *p) {
+   const char *unit = p->metric ? "microns" : "micro-inches";
+   float scale = p->metric ? 1.0 : 10.0;
+   fprintf(p->out, "flatness %.2f %s", scale*p->flatness, unit);
+   if (p->mc)
+      fprintf(p->out, " (95%% between %.2f and %.2f)",
+	      scale*p->flat_quantile[0], scale*p->flat_quantile[2]);
+   if (p->zone)
+      fprintf(p->out, ", minimum zone %.2f", scale*p->zone_flatness);
+   fprintf(p->out, ", center heights %.2f and %.2f %s: %s",
+	   scale*p->center[0], scale*p->center[1], unit,
+	   p->warnings & WARN_CENTER ? "the job must be done over" : "acceptable");
+   if (p->diagnose && p->suspect >= 0)
+      fprintf(p->out, ", suspect line %s", filenames[p->suspect]);
+   fprintf(p->out, "\n");
+   return;
+}
+
+/* Write the results in the selected machine-readable format, if any */
+void write_results(struct moody_plate *p) {
+   long start;
+   if (!p->out) return;
+   start = ftell(p->out);
+   switch (p->format) {
+   case OUTPUT_CSV: write_csv(p); break;
+   case OUTPUT_JSON: write_json(p); break;
+   case OUTPUT_BINARY: write_binary(p); break;
+   default: write_summary_line(p); break;
+   }
+   /* only files can tell how much was written */
+   if (start >= 0 && ftell(p->out) > start) p->stats.bytes_written += ftell(p->out)-start;
+   return;
+}
+
+/*
+ * Result cache. With --cache dir, the results of every plate are
+ * stored in directory dir, in a file named after a 128-bit hash of
+ * everything they depend on: the readings as they were read (so
+ * comments, blank lines and the bundle format do not matter), the
+ * units and foot spacing, the options of the computation, and
+ * MOODY_SOLVER_VERSION and the worksheet precision. When a plate is
+ * found there, its worksheets, summary, residuals, height map and
+ * Monte Carlo results are taken from the file instead of being
+ * computed again, and only its output is written. A file holds its
+ * whole key, which is compared before it is used, so a hash collision
+ * costs a recomputation and nothing else. Files are written under a
+ * temporary name and renamed into place, so batch workers and
+ * separate processes can share the directory: a reader sees a
+ * complete file or none.
+ */
+
+/* Increase whenever a change to the computation changes any result */
+#define MOODY_SOLVER_VERSION 1
+
+/* Everything the results depend on, except the readings that follow it */
+struct cache_head {
+   char magic[8];
+   int version, precision, real_size;
+   int metric;
+   float foot_spacing;
+   int num_dat[8];
+   /* bit i for a line whose station positions follow the readings */
+   int positioned;
+   int least_squares, grid_size;
+   int mc_trials, mc_workers;
+   float mc_sigma, mc_foot_sigma;
+   unsigned long long mc_seed;
+};
+
+/*
+ * Fill in the key of plate p: a struct cache_head and then the
+ * readings of the eight lines, and the positions of their stations
+ * where these are not evenly spaced. Returns it, in a block of *len
+ * bytes to be freed by the caller, or NULL if out of memory.
+ */
+unsigned char *cache_key(const struct moody_plate *p, size_t *len) {
+   struct cache_head h;
+   unsigned char *key, *at;
+   size_t n = sizeof(h);
+   int i;
+
+   /* the noise of the trials may be the standard errors of the readings, which follow them */
+   for (i=0; i<8; i++) n += (size_t)p->num_dat[i]*sizeof(float)*(p->mc_trials > 0 && p->mc_sigma < 0 ? 2 : 1);
+   for (i=0; i<8; i++)
+      if (p->pos[i]) n += (size_t)(p->num_dat[i]+1)*sizeof(real);
+   if (!(key = malloc(n))) return NULL;
+   /* zero the padding as well, as it is hashed and compared */
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, "MOODYRC", 8);
+   h.version = MOODY_SOLVER_VERSION;
+   h.precision = MOODY_PRECISION;
+   h.real_size = sizeof(real);
+   h.metric = p->metric;
+   h.foot_spacing = p->foot_spacing;
+   memcpy(h.num_dat, p->num_dat, sizeof(h.num_dat));
+   for (i=0; i<8; i++)
+      if (p->pos[i]) h.positioned |= 1<<i;
+   h.least_squares = p->least_squares;
+   h.grid_size = p->grid_size > 0 ? p->grid_size : 0;
+   if (p->mc_trials > 0) {
+      h.mc_trials = p->mc_trials;
+      h.mc_workers = mc_worker_count(p);
+      h.mc_sigma = p->mc_sigma;
+      h.mc_foot_sigma = p->mc_foot_sigma;
+      h.mc_seed = p->mc_seed;
+   }
+   memcpy(key, &h, sizeof(h));
+   for (at=key+sizeof(h), i=0; i<8; at+=(size_t)p->num_dat[i]*sizeof(float), i++)
+      memcpy(at, p->input[i], (size_t)p->num_dat[i]*sizeof(float));
+   if (p->mc_trials > 0 && p->mc_sigma < 0)
+      for (i=0; i<8; at+=(size_t)p->num_dat[i]*sizeof(float), i++)
+	 memcpy(at, p->input_sigma[i], (size_t)p->num_dat[i]*sizeof(float));
+   for (i=0; i<8; i++)
+      if (p->pos[i]) {
+	 memcpy(at, p->pos[i], (size_t)(p->num_dat[i]+1)*sizeof(real));
+	 at += (size_t)(p->num_dat[i]+1)*sizeof(real);
+      }
+   *len = n;
+   return key;
+}
+
+/*
+ * 128-bit hash of the n bytes of key, eight at a time, into h[0] and
+ * h[1]. It need not be cryptographic, as the key itself is compared
+ * on a lookup, only spread the keys evenly.
+ */
+void hash_key(const unsigned char *key, size_t n, unsigned long long h[2]) {
+   unsigned long long a = 0x243f6a8885a308d3ULL ^ n, b = 0x13198a2e03707344ULL, w;
+   size_t i = 0;
+
+   while (i < n) {
+      w = 0;
+      memcpy(&w, key+i, n-i < 8 ? n-i : 8);
+      i += 8;
+      a = rotl64(a ^ w, 29) * 0xff51afd7ed558ccdULL;
+      b = rotl64(b + w, 31) * 0xc4ceb9fe1a85ec53ULL + a;
+   }
+   h[0] = splitmix64(&a) ^ b;
+   h[1] = splitmix64(&b) ^ a;
+   return;
+}
+
+/* Path of the cache file of plate p with key hash h, in buf of MAX_PATHLEN bytes; NULL if too long */
+const char *cache_path(const struct moody_plate *p, const unsigned long long h[2], char *buf) {
+   if (snprintf(buf, MAX_PATHLEN, "%s/%016llx%016llx.mrc", p->cache_dir, h[0], h[1]) >= MAX_PATHLEN)
+      return NULL;
+   return buf;
+}
+
+/*
+ * The results of plate p, as stored after its key: center heights and
+ * flatness, the worksheets, then the residuals, the height map and the
+ * Monte Carlo results if they were computed. cache_state() gives the
+ * blocks of p, which must be allocated already, and their number;
+ * the height map must have its size.
+ */
+struct cache_block {
+   void *data;
+   size_t size;
+};
+
+int cache_state(struct moody_plate *p, struct cache_block *b) {
+   size_t stations = 0, total = 0;
+   int i, n = 0;
+
+   for (i=0; i<8; i++) {
+      stations += p->num_dat[i]+1;
+      total += (size_t)num_columns(i)*(p->num_dat[i]+1);
+   }
+   b[n].data = p->center; b[n++].size = sizeof(p->center);
+   b[n].data = &p->flatness; b[n++].size = sizeof(p->flatness);
+   b[n].data = p->arena; b[n++].size = total*sizeof(real);
+   if (p->least_squares) {
+      b[n].data = p->residuals; b[n++].size = stations*sizeof(float);
+      b[n].data = &p->rms_residual; b[n++].size = sizeof(float);
+      b[n].data = &p->max_residual; b[n++].size = sizeof(float);
+   }
+   if (p->grid_size > 0) {
+      b[n].data = p->grid; b[n++].size = (size_t)p->grid_nx*p->grid_ny*sizeof(float);
+   }
+   if (p->mc_trials > 0) {
+      b[n].data = p->mc; b[n++].size = 2*stations*sizeof(float);
+      b[n].data = &p->flat_mean; b[n++].size = sizeof(float);
+      b[n].data = &p->flat_sigma; b[n++].size = sizeof(float);
+      b[n].data = p->flat_quantile; b[n++].size = sizeof(p->flat_quantile);
+   }
+   return n;
+}
+
+#define CACHE_BLOCKS 16
+
+/*
+ * Read the cache file fname, which must hold size bytes starting with
+ * the len bytes of key. Returns its contents, to be freed by the
+ * caller, or NULL if it is missing, of another size or another key.
+ */
+unsigned char *read_cache_file(const char *fname, const unsigned char *key, size_t len, size_t size) {
+   unsigned char *data;
+   FILE *fp;
+
+   if (!(fp = fopen(fname, "rb"))) return NULL;
+   if ((data = malloc(size+1)) && (fread(data, 1, size+1, fp) != size || memcmp(data, key, len))) {
+      free(data);
+      data = NULL;
+   }
+   fclose(fp);
+   return data;
+}
+
+/*
+ * Allocate the residuals, height map and Monte Carlo results of plate
+ * p that its options call for. Returns -1 if out of memory.
+ */
+int alloc_cached_results(struct moody_plate *p) {
+   size_t stations = 0;
+   float *col;
+   int i;
+
+   for (i=0; i<8; i++) stations += p->num_dat[i]+1;
+   if (p->least_squares) {
+      free(p->residuals);
+      if (!(p->residuals = malloc(stations*sizeof(float)))) return -1;
+      for (col=p->residuals, i=0; i<8; col+=p->num_dat[i]+1, i++) p->residual[i] = col;
+   }
+   if (p->grid_size > 0) {
+      free(p->grid);
+      if (!(p->grid = malloc((size_t)p->grid_nx*p->grid_ny*sizeof(float)))) return -1;
+   }
+   if (p->mc_trials > 0) {
+      free(p->mc);
+      if (!(p->mc = malloc(2*stations*sizeof(float)))) return -1;
+      for (col=p->mc, i=0; i<8; col += 2*(p->num_dat[i]+1), i++) {
+	 p->mc_mean[i] = col;
+	 p->mc_spread[i] = col + p->num_dat[i]+1;
+      }
+   }
+   return 0;
+}
+
+/*
+ * Look for the results of plate p, whose worksheets have been
+ * allocated, in its cache directory, and if they are there fill them
+ * in and set p->cached. A missing or damaged file is not an error.
+ */
+void lookup_cache(struct moody_plate *p) {
+   struct cache_block b[CACHE_BLOCKS];
+   char buf[MAX_PATHLEN];
+   unsigned long long h[2];
+   unsigned char *key, *data = NULL;
+   size_t len, size;
+   const char *fname;
+   int k, n;
+
+   if (!(key = cache_key(p, &len))) return;
+   hash_key(key, len, h);
+   if (p->grid_size > 0) grid_shape(p, p->grid_size, &p->grid_nx, &p->grid_ny);
+   n = cache_state(p, b);
+   for (size=len, k=0; k<n; k++) size += b[k].size;
+
+   /* the whole file is read first, so a short or foreign one changes nothing */
+   if ((fname = cache_path(p, h, buf)) && (data = read_cache_file(fname, key, len, size)) &&
+       !alloc_cached_results(p)) {
+      n = cache_state(p, b);
+      for (size=len, k=0; k<n; k++) {
+	 memcpy(b[k].data, data+size, b[k].size);
+	 size += b[k].size;
+      }
+      p->cached = 1;
+      p->stats.cache_hits = 1;
+   }
+   free(data);
+   free(key);
+   return;
+}
+
+/*
+ * Store the results of plate p, which have just been computed, in its
+ * cache directory. Failing to do so is only a warning.
+ */
+void store_cache(struct moody_plate *p) {
+   struct cache_block b[CACHE_BLOCKS];
+   char buf[MAX_PATHLEN], tmp[MAX_PATHLEN];
+   unsigned long long h[2];
+   unsigned char *key;
+   size_t len;
+   const char *fname;
+   int ok, k, n;
+   FILE *fp;
+
+   if (!(key = cache_key(p, &len))) return;
+   hash_key(key, len, h);
+   if (!(fname = cache_path(p, h, buf))) {
+      free(key);
+      return;
+   }
+   /* unique among the plates of this process; another process writes the same bytes */
+   if (snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", fname, (unsigned long)(size_t)p) >= (int)sizeof(tmp) ||
+       !(fp = fopen(tmp, "wb"))) {
+      fprintf(stderr, "Warning: unable to write cache file %s\n", fname);
+      free(key);
+      return;
+   }
+   ok = fwrite(key, 1, len, fp) == len;
+   n = cache_state(p, b);
+   for (k=0; k<n; k++) ok = ok && fwrite(b[k].data, 1, b[k].size, fp) == b[k].size;
+   ok = !fclose(fp) && ok;
+   /* rename() replaces a file written meanwhile on POSIX, and fails on Windows, which is as good */
+   if (!ok || rename(tmp, fname)) {
+      if (!ok) fprintf(stderr, "Warning: unable to write cache file %s\n", fname);
+      remove(tmp);
+   }
+   free(key);
+   return;
+}
+
+/*
+ * Calibration history. With --history file, every plate that is
+ * processed is appended to the history file as a calibration record,
+ * under its plate id and date, and its report shows how every station
+ * has moved since the previous calibration of the same plate. The
+ * file is never rewritten. Each record, little-endian, is
+ *
+ *   bytes 0-7     "MOODYCAL"
+ *   bytes 8-11    version, 1
+ *   bytes 12-15   length of the record in bytes
+ *   bytes 16-79   plate id, padded with zeros
+ *   bytes 80-83   date, as yyyymmdd
+ *   bytes 84-87   units, 1 for metric (mm), 0 for imperial (inches)
+ *   bytes 88-91   foot spacing, float
+ *   bytes 92-123  number of stations on each of the eight lines
+ *   bytes 124-135 flatness and the heights at the two centers, floats
+ *   bytes 136-159 reserved, zero
+ *
+ * followed by column 8 of the eight lines, num_dat[i]+1 floats each.
+ * Next to it, file.idx holds one HISTORY_ENTRY byte entry per record,
+ * with its plate id (bytes 0-63), date (64-67), length (68-71) and
+ * offset in the history file (72-79), so that the previous record of
+ * a plate is found by reading the index alone, however long the
+ * history. An index that does not end with the last record, because a
+ * crash came between the two writes or it was deleted, is rebuilt from
+ * the history file.
+ */
+#define HISTORY_MAGIC "MOODYCAL"
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER 160
+#define HISTORY_ID 64
+#define HISTORY_ENTRY 80
+
+#ifdef MOODY_THREADS
+/* batch workers append to the same history */
+pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* One calibration record */
+struct calibration {
+   char id[HISTORY_ID];
+   long date;
+   int metric;
+   float foot_spacing;
+   int num_dat[8];
+   float flatness, center[2];
+   /* column 8 of line i starts at heights[start[i]] */
+   float *heights;
+   size_t start[9];
+};
+
+/* Parse date s, as yyyy-mm-dd, into *date as yyyymmdd; returns -1 if it is not one */
+int parse_date(const char *s, long *date) {
+   int y, m, d;
+   char c;
+   if (sscanf(s, "%4d-%2d-%2d%c", &y, &m, &d, &c) != 3 || m < 1 || m > 12 || d < 1 || d > 31)
+      return -1;
+   *date = y*10000L + m*100 + d;
+   return 0;
+}
+
+/* Today's date, as yyyymmdd */
+long today(void) {
+   time_t now = time(NULL);
+   struct tm *t = localtime(&now);
+   return t ? (t->tm_year+1900)*10000L + (t->tm_mon+1)*100 + t->tm_mday : 0;
+}
+
+/* 64-bit little-endian offsets, as two 32-bit halves */
+long long get_le64(const unsigned char *b) {
+   return (long long)get_le32(b) | (long long)get_le32(b+4)<<32;
+}
+
+void put_le64(unsigned char *b, long long v) {
+   put_le32(b, (unsigned long)(v & 0xffffffffUL));
+   put_le32(b+4, (unsigned long)((v>>32) & 0xffffffffUL));
+   return;
+}
+
+/* Index entry e of the record of length len at offset off, whose header is b */
+void make_entry(unsigned char *e, const unsigned char *b, unsigned long len, long long off) {
+   memcpy(e, b+16, HISTORY_ID);
+   memcpy(e+64, b+80, 4);
+   put_le32(e+68, len);
+   put_le64(e+72, off);
+   return;
+}
+
+/* Name of the index of history file fname, in buf of MAX_PATHLEN bytes; NULL if too long */
+const char *index_path(const char *fname, char *buf) {
+   if (snprintf(buf, MAX_PATHLEN, "%s.idx", fname) >= MAX_PATHLEN) return NULL;
+   return buf;
+}
+
+/*
+ * Write the index of history file fname afresh, from the records in
+ * it. Returns -1 if it cannot be read or written.
+ */
+int rebuild_index(const char *fname) {
+   unsigned char b[HISTORY_HEADER], e[HISTORY_ENTRY];
+   char buf[MAX_PATHLEN];
+   const char *iname = index_path(fname, buf);
+   long long off = 0;
+   unsigned long len;
+   FILE *fp, *ip;
+   int ok = 1;
+
+   if (!iname || !(fp = fopen(fname, "rb"))) return -1;
+   if (!(ip = fopen(iname, "wb"))) {
+      fclose(fp);
+      return -1;
+   }
+   while (fread(b, 1, HISTORY_HEADER, fp) == HISTORY_HEADER) {
+      len = get_le32(b+12);
+      /* a record cut short by a crash ends the history */
+      if (memcmp(b, HISTORY_MAGIC, 8) || len < HISTORY_HEADER ||
+	  fseek(fp, (long)(len-HISTORY_HEADER), SEEK_CUR))
+	 break;
+      make_entry(e, b, len, off);
+      ok = ok && fwrite(e, 1, HISTORY_ENTRY, ip) == HISTORY_ENTRY;
+      off += len;
+   }
+   fclose(fp);
+   return !fclose(ip) && ok ? 0 : -1;
+}
+
+/*
+ * Read the index of history file fname into *idx, *n entries, to be
+ * freed by the caller, rebuilding it if it does not match the file.
+ * A missing history has no entries. Returns -1 on a read error.
+ */
+int read_index(const char *fname, unsigned char **idx, size_t *n) {
+   char buf[MAX_PATHLEN];
+   const char *iname = index_path(fname, buf);
+   struct text_file f;
+   long long end = 0;
+   FILE *fp;
+   int rebuilt = 0;
+
+   *idx = NULL;
+   *n = 0;
+   if (!iname) return -1;
+   if ((fp = fopen(fname, "rb")) == NULL) return 0;
+   if (!fseek(fp, 0, SEEK_END)) end = ftell(fp);
+   fclose(fp);
+   for (;;) {
+      if (load_text_file(iname, &f)) f.len = 0;
+      f.len -= f.len % HISTORY_ENTRY;
+      /* the last entry must end where the history does */
+      if (f.len ? get_le64((unsigned char *)f.buf+f.len-8) +
+	  (long long)get_le32((unsigned char *)f.buf+f.len-12) == end : end == 0)
+	 break;
+      free(f.buf);
+      if (rebuilt++ || rebuild_index(fname)) return -1;
+   }
+   *idx = (unsigned char *)f.buf;
+   *n = f.len / HISTORY_ENTRY;
+   return 0;
+}
+
+/*
+ * The latest of the n index entries for plate id dated before date
+ * (or on it, if on is set), or -1 if there is none. Of several on the
+ * same day, the one appended last is taken.
+ */
+long find_entry(const unsigned char *idx, size_t n, const char *id, long date, int on) {
+   long best = -1, best_date = 0;
+   size_t k;
+   for (k=n; k-- > 0; ) {
+      const unsigned char *e = idx + k*HISTORY_ENTRY;
+      long d = (long)get_le32(e+64);
+      if ((on ? d <= date : d < date) && d > best_date && !strncmp((const char *)e, id, HISTORY_ID)) {
+	 best = (long)k;
+	 best_date = d;
+      }
+   }
+   return best;
+}
+
+/* Read the record of index entry e from history file fname into c; returns -1 if it is damaged */
+int read_calibration(const char *fname, const unsigned char *e, struct calibration *c) {
+   unsigned char *b;
+   unsigned long len = get_le32(e+68);
+   size_t total = 0;
+   FILE *fp;
+   int i, ok;
+
+   c->heights = NULL;
+   if (len < HISTORY_HEADER || !(fp = fopen(fname, "rb"))) return -1;
+   if (!(b = malloc(len))) {
+      fclose(fp);
+      return -1;
+   }
+   ok = !fseek(fp, (long)get_le64(e+72), SEEK_SET) && fread(b, 1, len, fp) == len &&
+      !memcmp(b, HISTORY_MAGIC, 8) && get_le32(b+8) == HISTORY_VERSION;
+   fclose(fp);
+   for (i=0; ok && i<8; i++) {
+      c->num_dat[i] = (int)get_le32(b+92+4*i);
+      c->start[i] = total;
+      total += c->num_dat[i]+1;
+      ok = c->num_dat[i] > 0 && total <= len/4;
+   }
+   c->start[8] = total;
+   if (!ok || len != HISTORY_HEADER + 4*total || !(c->heights = malloc(total*sizeof(float)))) {
+      free(b);
+      return -1;
+   }
+   memcpy(c->id, b+16, HISTORY_ID);
+   c->id[HISTORY_ID-1] = '\0';
+   c->date = (long)get_le32(b+80);
+   c->metric = (int)get_le32(b+84);
+   c->foot_spacing = get_le_float(b+88);
+   c->flatness = get_le_float(b+124);
+   c->center[0] = get_le_float(b+128);
+   c->center[1] = get_le_float(b+132);
+   for (i=0; i<(int)total; i++) c->heights[i] = get_le_float(b+HISTORY_HEADER+4*i);
+   free(b);
+   return 0;
+}
+
+/* Append the calibration of plate p to history file fname; returns -1 if it cannot be written */
+int append_calibration(const char *fname, struct moody_plate *p) {
+   unsigned char *b, e[HISTORY_ENTRY];
+   char buf[MAX_PATHLEN];
+   const char *iname = index_path(fname, buf);
+   unsigned long len = HISTORY_HEADER;
+   long long off = -1;
+   FILE *fp, *ip;
+   int i, j, ok;
+
+   for (i=0; i<8; i++) len += 4*(p->num_dat[i]+1);
+   if (!iname || !(b = calloc(len, 1))) return -1;
+   memcpy(b, HISTORY_MAGIC, 8);
+   put_le32(b+8, HISTORY_VERSION);
+   put_le32(b+12, len);
+   strncpy((char *)b+16, p->plate_id, HISTORY_ID-1);
+   put_le32(b+80, p->date);
+   put_le32(b+84, p->metric);
+   put_le_float(b+88, p->foot_spacing);
+   for (i=0; i<8; i++) put_le32(b+92+4*i, p->num_dat[i]);
+   put_le_float(b+124, p->flatness);
+   put_le_float(b+128, p->center[0]);
+   put_le_float(b+132, p->center[1]);
+   for (len=HISTORY_HEADER, i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++, len+=4) put_le_float(b+len, p->ws[i][7][j]);
+
+   if (!(fp = fopen(fname, "ab"))) {
+      free(b);
+      return -1;
+   }
+   if (!fseek(fp, 0, SEEK_END)) off = ftell(fp);
+   ok = off >= 0 && fwrite(b, 1, len, fp) == len;
+   ok = !fclose(fp) && ok;
+   make_entry(e, b, len, off);
+   free(b);
+   /* without its index entry the record is found by rebuild_index() */
+   if (ok && (ip = fopen(iname, "ab")) != NULL) {
+      fwrite(e, 1, HISTORY_ENTRY, ip);
+      fclose(ip);
+   }
+   return ok ? 0 : -1;
+}
+
+/* A date yyyymmdd as yyyy-mm-dd, in buf of at least 16 bytes */
+const char *format_date(long date, char *buf) {
+   sprintf(buf, "%04ld-%02ld-%02ld", date/10000 % 10000, date/100 % 100, date % 100);
+   return buf;
+}
+
+/*
+ * Moody's number of station j of line i, from column 1 of the
+ * worksheet, or j+1 as there for a plate without worksheets
+ */
+int station_number(const struct moody_plate *p, int i, int j) {
+   return p->ws[i][0] ? (int)p->ws[i][0][j] : j+1;
+}
+
+/*
+ * Report how the column 8 heights of calibration now have changed
+ * since calibration then, station by station, in the units of now
+ */
+void report_change(struct moody_plate *p, const struct calibration *then, const struct calibration *now) {
+   /* 1/100,000 inch in microns */
+   float scale = then->metric == now->metric ? 1.0 : now->metric ? 0.254 : 1/0.254;
+   const char *unit = now->metric ? "microns" : "micro-inches";
+   float out = now->metric ? 1.0 : 10.0;
+   double sum2 = 0.0, worst = 0.0, d;
+   int i, j, at_i = 0, at_j = 0;
+   char d1[16], d2[16];
+
+   report(p, "================================================================\n"
+	  "Change of plate %s since its calibration of %s:\n",
+	  now->id, format_date(then->date, d1));
+   if (memcmp(then->num_dat, now->num_dat, sizeof(now->num_dat))) {
+      report(p, "the numbers of stations on the lines differ, so the stations\n"
+	     "cannot be compared.\n");
+      report(p, "================================================================\n");
+      return;
+   }
+   for (i=0; i<8; i++)
+      for (j=0; j<=now->num_dat[i]; j++) {
+	 d = now->heights[now->start[i]+j] - scale*then->heights[then->start[i]+j];
+	 sum2 += d*d;
+	 if (fabs(d) > fabs(worst)) {
+	    worst = d;
+	    at_i = i;
+	    at_j = j;
+	 }
+      }
+   report(p, "flatness %.2f %s then and %.2f %s on %s; station heights changed\n"
+	  "by %.2f %s RMS, most at station %d of %.*s (%+.2f %s).\n",
+	  out*scale*then->flatness, unit, out*now->flatness, unit, format_date(now->date, d2),
+	  out*sqrt(sum2/now->start[8]), unit, station_number(p, at_i, at_j),
+	  line_name_length(at_i), filenames[at_i], out*worst, unit);
+   for (i=0; i<8; i++) {
+      report(p, "\nCHANGE %s (%s)\n", filenames[i], now->metric ? "micron" : "10^-5in");
+      for (j=0; j<=now->num_dat[i]; j++)
+	 report(p, "%4d%8.2f%s", station_number(p, i, j), now->heights[now->start[i]+j] - scale*then->heights[then->start[i]+j],
+		j%6==5 || j==now->num_dat[i] ? "\n" : "   ");
+   }
+   report(p, "================================================================\n");
+   return;
+}
+
+/* The calibration of plate p, whose heights are done, into c; returns -1 if out of memory */
+int plate_calibration(struct moody_plate *p, struct calibration *c) {
+   int i, j;
+   size_t total = 0;
+
+   memset(c->id, 0, sizeof(c->id));
+   strncpy(c->id, p->plate_id, HISTORY_ID-1);
+   c->date = p->date;
+   c->metric = p->metric;
+   c->foot_spacing = p->foot_spacing;
+   memcpy(c->num_dat, p->num_dat, sizeof(c->num_dat));
+   c->flatness = p->flatness;
+   c->center[0] = p->center[0];
+   c->center[1] = p->center[1];
+   for (i=0; i<8; i++) {
+      c->start[i] = total;
+      total += p->num_dat[i]+1;
+   }
+   c->start[8] = total;
+   if (!(c->heights = malloc(total*sizeof(float)))) return -1;
+   for (i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++) c->heights[c->start[i]+j] = p->ws[i][7][j];
+   return 0;
+}
+
+/*
+ * Append plate p, whose results are complete, to its history file,
+ * and report its change since the previous calibration, if any
+ */
+void record_history(struct moody_plate *p) {
+   struct calibration then, now;
+   unsigned char *idx;
+   size_t n;
+   long k = -1;
+   int found = 0;
+
+   if (strlen(p->plate_id) >= HISTORY_ID) {
+      fprintf(stderr, "Error: plate id %s is longer than %d characters\n", p->plate_id, HISTORY_ID-1);
+      fail(p);
+   }
+#ifdef MOODY_THREADS
+   pthread_mutex_lock(&history_lock);
+#endif
+   if (read_index(p->history, &idx, &n) == 0) {
+      k = find_entry(idx, n, p->plate_id, p->date, 0);
+      found = k >= 0 && !read_calibration(p->history, idx + (size_t)k*HISTORY_ENTRY, &then);
+      if (k >= 0 && !found)
+	 fprintf(stderr, "Warning: the previous calibration of plate %s in %s is damaged\n",
+		 p->plate_id, p->history);
+      free(idx);
+   }
+   if (append_calibration(p->history, p))
+      fprintf(stderr, "Error: unable to append to history file %s\n", p->history);
+#ifdef MOODY_THREADS
+   pthread_mutex_unlock(&history_lock);
+#endif
+   if (!found) return;
+   if (!plate_calibration(p, &now)) report_change(p, &then, &now);
+   free(now.heights);
+   free(then.heights);
+   return;
+}
+
+/*
+ * History queries: list the calibrations of plate id in history file
+ * fname (all plates if id is NULL), or with diff set report the
+ * change from the calibration before date to the one on it (the
+ * latest ones if date is 0)
+ */
+int run_history(const char *fname, const char *id, long date, int diff) {
+   struct calibration then, now;
+   struct moody_plate *p;
+   unsigned char *idx;
+   size_t n, k;
+   long a, b;
+   char d[16];
+   int status = EXIT_SUCCESS;
+
+   then.heights = now.heights = NULL;
+   if (read_index(fname, &idx, &n)) {
+      fprintf(stderr, "Error: unable to read history file %s\n", fname);
+      return EXIT_FAILURE;
+   }
+   if (!diff) {
+      for (k=0; k<n; k++) {
+	 const unsigned char *e = idx + k*HISTORY_ENTRY;
+	 if (id && strncmp((const char *)e, id, HISTORY_ID)) continue;
+	 if (read_calibration(fname, e, &now)) {
+	    fprintf(stderr, "Warning: calibration %lu in %s is damaged\n", (unsigned long)k, fname);
+	    continue;
+	 }
+	 printf("%-20s %s  flatness %8.2f %s\n", now.id, format_date(now.date, d),
+		(now.metric ? 1.0 : 10.0)*now.flatness, now.metric ? "microns" : "micro-inches");
+	 free(now.heights);
+      }
+      free(idx);
+      return EXIT_SUCCESS;
+   }
+
+   b = find_entry(idx, n, id, date ? date : LONG_MAX, 1);
+   a = b >= 0 ? find_entry(idx, n, id, (long)get_le32(idx + (size_t)b*HISTORY_ENTRY + 64), 0) : -1;
+   if (a < 0) {
+      fprintf(stderr, "Error: history file %s has fewer than two calibrations of plate %s%s%s\n",
+	      fname, id, date ? " up to " : "", date ? format_date(date, d) : "");
+      free(idx);
+      return EXIT_FAILURE;
+   }
+   if (read_calibration(fname, idx + (size_t)a*HISTORY_ENTRY, &then) ||
+       read_calibration(fname, idx + (size_t)b*HISTORY_ENTRY, &now)) {
+      fprintf(stderr, "Error: history file %s is damaged\n", fname);
+      status = EXIT_FAILURE;
+   } else if ((p = new_plate(NULL, stdout)) != NULL) {
+      report_change(p, &then, &now);
+      free_plate(p);
+   }
+   free(then.heights);
+   free(now.heights);
+   free(idx);
+   return status;
+}
+
+/*
+ * Minimum-zone flatness (ISO 1101): the smallest distance between two
+ * parallel planes enclosing all the points, here the stations of the
+ * eight lines or, with a height map, its nodes. Moody's flatness is
+ * the width of the zone parallel to his datum plane, which is never
+ * less. Heights are a few microns over a plate of a metre, so the
+ * tilt of any plane that matters is tiny and the width is measured
+ * vertically: the zone of tilt a, b (heights per foot spacing along x
+ * and y) has width
+ *
+ *   w(a, b) = max (z - a x - b y) - min (z - a x - b y)
+ *
+ * over the points, which is convex in a and b. The points are taken in
+ * rows of the same y, and for each row only the corners of its upper
+ * and lower convex hull in x and z can be the largest or smallest; these
+ * are found once, in O(n log n). For a given a the hull corners of each
+ * row give its largest and smallest z - a x, and the best b is then
+ * found exactly by turning a pair of parallel lines around the hulls of
+ * these extremes over y (rotating calipers; see zone_width()). The
+ * best a is found by golden-section search, as w minimised over b is
+ * convex in a. Some row spans the plate (an East-West line, or every
+ * row of the map), so with R the range of the heights and X the width
+ * of the plate, any a beyond 2R/X gives a wider zone than a = 0; the
+ * search starts there, and widens if the zone narrows towards its ends.
+ *
+ * The least-squares plane is the secondary figure: the range of the
+ * residuals of the plane fitted to the same points.
+ */
+
+/* Golden-section steps, enough to narrow the tilt to 1e-12 of its range */
+#define ZONE_STEPS 60
+
+/* A row of points of the same y, sorted by x */
+struct zone_row {
+   double y;
+   const float *x, *z;
+   int n;
+};
+
+/* The convex hulls of the rows, above and below, and room to evaluate them */
+struct zone {
+   int rows;
+   double *y;
+   /* corners of row k are ux[upper[k]] to ux[upper[k+1]-1], and lx likewise */
+   int *upper, *lower;
+   float *ux, *uz, *lx, *lz;
+   int upper_size[2], lower_size[2];
+   /* the extremes of each row for the current a, and their hulls */
+   double *high, *low;
+   int *hull_high, *hull_low;
+};
+
+/*
+ * Append the corners of the upper (side 1) or lower (side -1) hull of
+ * row r to *px, *pz, from position n with room for *psize; returns
+ * the new end, or -1 if out of memory. Collinear and repeated points
+ * are dropped, which keeps every corner.
+ */
+int row_hull(const struct zone_row *r, int side, float **px, float **pz, int *psize, int n) {
+   int start = n, k;
+   if (reserve_readings(px, &psize[0], n+r->n) || reserve_readings(pz, &psize[1], n+r->n))
+      return -1;
+   for (k=0; k<r->n; k++) {
+      double x = r->x[k], z = r->z[k];
+      while (n-start >= 2) {
+	 double ax = (*px)[n-2], az = (*pz)[n-2];
+	 double cross = ((*px)[n-1]-ax)*(z-az) - ((*pz)[n-1]-az)*(x-ax);
+	 if (side*cross < 0) break;
+	 n--;
+      }
+      /* a point at the same x as the last corner replaces it if it is further out */
+      if (n > start && (*px)[n-1] == x) {
+	 if (side*(z-(*pz)[n-1]) > 0) (*pz)[n-1] = (float)z;
+	 continue;
+      }
+      (*px)[n] = (float)x;
+      (*pz)[n] = (float)z;
+      n++;
+   }
+   return n;
+}
+
+void free_zone(struct zone *s) {
+   free(s->y);
+   free(s->upper);
+   free(s->lower);
+   free(s->ux);
+   free(s->uz);
+   free(s->lx);
+   free(s->lz);
+   free(s->high);
+   free(s->low);
+   free(s->hull_high);
+   free(s->hull_low);
+   return;
+}
+
+/* Set up s for the rows r[0] to r[rows-1], in order of y; returns -1 if out of memory */
+int init_zone(struct zone *s, const struct zone_row *r, int rows) {
+   int k, nu = 0, nl = 0;
+   memset(s, 0, sizeof(*s));
+   s->rows = rows;
+   s->y = malloc(rows*sizeof(double));
+   s->upper = malloc((rows+1)*sizeof(int));
+   s->lower = malloc((rows+1)*sizeof(int));
+   s->high = malloc(rows*sizeof(double));
+   s->low = malloc(rows*sizeof(double));
+   s->hull_high = malloc(rows*sizeof(int));
+   s->hull_low = malloc(rows*sizeof(int));
+   if (!s->y || !s->upper || !s->lower || !s->high || !s->low || !s->hull_high || !s->hull_low)
+      return -1;
+   for (k=0; k<rows; k++) {
+      s->y[k] = r[k].y;
+      s->upper[k] = nu;
+      s->lower[k] = nl;
+      if ((nu = row_hull(r+k, 1, &s->ux, &s->uz, s->upper_size, nu)) < 0 ||
+	  (nl = row_hull(r+k, -1, &s->lx, &s->lz, s->lower_size, nl)) < 0)
+	 return -1;
+   }
+   s->upper[rows] = nu;
+   s->lower[rows] = nl;
+   return 0;
+}
+
+/*
+ * Hull of the points (y[k], v[k]) for k < n, y increasing, above
+ * (side 1) or below (side -1), into hull[]; returns its size
+ */
+int chain_hull(const double *y, const double *v, int n, int side, int *hull) {
+   int m = 0, k;
+   for (k=0; k<n; k++) {
+      while (m >= 2) {
+	 int a = hull[m-2], b = hull[m-1];
+	 if (side*((y[b]-y[a])*(v[k]-v[a]) - (v[b]-v[a])*(y[k]-y[a])) < 0) break;
+	 m--;
+      }
+      hull[m++] = k;
+   }
+   return m;
+}
+
+/*
+ * The narrowest zone of tilt a along x, over all tilts along y: its
+ * width, and the tilt along y in *pb. The width as a function of b is
+ * convex and linear between the slopes of the edges of the hull above
+ * the highest point of each row and of the hull below the lowest, so
+ * it is smallest at one of these slopes. Taking them in increasing
+ * order, the corner of the upper hull touching a line of slope b only
+ * moves towards low y, and that of the lower hull towards high y.
+ */
+double zone_width(struct zone *s, double a, double *pb) {
+   double best, b;
+   int k, j, nh, nl, jh, jl;
+
+   for (k=0; k<s->rows; k++) {
+      double hi = -HUGE_VAL, lo = HUGE_VAL, v;
+      for (j=s->upper[k]; j<s->upper[k+1]; j++)
+	 if ((v = s->uz[j] - a*s->ux[j]) > hi) hi = v;
+      for (j=s->lower[k]; j<s->lower[k+1]; j++)
+	 if ((v = s->lz[j] - a*s->lx[j]) < lo) lo = v;
+      s->high[k] = hi;
+      s->low[k] = lo;
+   }
+   *pb = 0.0;
+   if (s->rows == 1) return s->high[0] - s->low[0];
+
+   nh = chain_hull(s->y, s->high, s->rows, 1, s->hull_high);
+   nl = chain_hull(s->y, s->low, s->rows, -1, s->hull_low);
+   best = HUGE_VAL;
+   /* the upper slopes decrease along the hull, so they are taken from its end */
+   for (jh=nh-1, jl=0, k=nh-2, j=0; k>=0 || j<nl-1; ) {
+      int h, l;
+      double w, su = k>=0 ? (s->high[s->hull_high[k+1]]-s->high[s->hull_high[k]]) /
+	 (s->y[s->hull_high[k+1]]-s->y[s->hull_high[k]]) : HUGE_VAL;
+      double sl = j<nl-1 ? (s->low[s->hull_low[j+1]]-s->low[s->hull_low[j]]) /
+	 (s->y[s->hull_low[j+1]]-s->y[s->hull_low[j]]) : HUGE_VAL;
+      if (su <= sl) {
+	 b = su;
+	 k--;
+      } else {
+	 b = sl;
+	 j++;
+      }
+      while (jh > 0 && (s->high[s->hull_high[jh-1]]-s->high[s->hull_high[jh]]) >=
+	     b*(s->y[s->hull_high[jh-1]]-s->y[s->hull_high[jh]])) jh--;
+      while (jl < nl-1 && (s->low[s->hull_low[jl+1]]-s->low[s->hull_low[jl]]) <=
+	     b*(s->y[s->hull_low[jl+1]]-s->y[s->hull_low[jl]])) jl++;
+      h = s->hull_high[jh];
+      l = s->hull_low[jl];
+      w = (s->high[h] - b*s->y[h]) - (s->low[l] - b*s->y[l]);
+      if (w < best) {
+	 best = w;
+	 *pb = b;
+      }
+   }
+   return best;
+}
+
+/*
+ * Minimum-zone and least-squares flatness of the rows r[0] to
+ * r[rows-1], in order of y, into *zone and *lsq; returns -1 if out of
+ * memory
+ */
+int zone_flatness(const struct zone_row *r, int rows, float *zone, float *lsq) {
+   struct zone s;
+   double lo = HUGE_VAL, hi = -HUGE_VAL, x_lo = HUGE_VAL, x_hi = -HUGE_VAL;
+   double n = 0, mx = 0, my = 0, mz = 0, sxx = 0, sxy = 0, syy = 0, sxz = 0, syz = 0, det, a, b;
+   double range, p, q, wp, wq, bp;
+   const double golden = 0.6180339887498949;
+   int i, k;
+
+   /* the least-squares plane, about the centroid */
+   for (k=0; k<rows; k++)
+      for (i=0; i<r[k].n; i++) {
+	 mx += r[k].x[i];
+	 my += r[k].y;
+	 mz += r[k].z[i];
+	 n++;
+	 if (r[k].z[i] < lo) lo = r[k].z[i];
+	 if (r[k].z[i] > hi) hi = r[k].z[i];
+	 if (r[k].x[i] < x_lo) x_lo = r[k].x[i];
+	 if (r[k].x[i] > x_hi) x_hi = r[k].x[i];
+      }
+   mx /= n;
+   my /= n;
+   mz /= n;
+   for (k=0; k<rows; k++)
+      for (i=0; i<r[k].n; i++) {
+	 double dx = r[k].x[i]-mx, dy = r[k].y-my, dz = r[k].z[i]-mz;
+	 sxx += dx*dx;
+	 sxy += dx*dy;
+	 syy += dy*dy;
+	 sxz += dx*dz;
+	 syz += dy*dz;
+      }
+   det = sxx*syy - sxy*sxy;
+   a = det > 0 ? (sxz*syy - syz*sxy)/det : 0.0;
+   b = det > 0 ? (syz*sxx - sxz*sxy)/det : 0.0;
+   for (p=HUGE_VAL, q=-HUGE_VAL, k=0; k<rows; k++)
+      for (i=0; i<r[k].n; i++) {
+	 double e = r[k].z[i] - a*r[k].x[i] - b*r[k].y;
+	 if (e < p) p = e;
+	 if (e > q) q = e;
+      }
+   *lsq = (float)(q-p);
+
+   /* the minimum zone, searching the tilt along x */
+   if (init_zone(&s, r, rows)) {
+      free_zone(&s);
+      return -1;
+   }
+   range = x_hi > x_lo ? 2.0*(hi-lo)/(x_hi-x_lo) : 0.0;
+   /* w is convex, so if it does not fall towards either end the narrowest zone is within */
+   for (k=0; k<ZONE_STEPS && range > 0; k++, range *= 4) {
+      wp = zone_width(&s, range, &bp);
+      wq = zone_width(&s, -range, &bp);
+      if (wp >= zone_width(&s, 0.5*range, &bp) && wq >= zone_width(&s, -0.5*range, &bp)) break;
+   }
+   lo = -range;
+   hi = range;
+   p = hi - golden*(hi-lo);
+   q = lo + golden*(hi-lo);
+   wp = zone_width(&s, p, &bp);
+   wq = zone_width(&s, q, &bp);
+   for (k=0; k<ZONE_STEPS && range > 0; k++)
+      if (wp <= wq) {
+	 hi = q;
+	 q = p;
+	 wq = wp;
+	 p = hi - golden*(hi-lo);
+	 wp = zone_width(&s, p, &bp);
+      } else {
+	 lo = p;
+	 p = q;
+	 wp = wq;
+	 q = lo + golden*(hi-lo);
+	 wq = zone_width(&s, q, &bp);
+      }
+   /* the narrower of the last two zones */
+   *zone = (float)(wp < wq ? wp : wq);
+   free_zone(&s);
+   return 0;
+}
+
+/* A station of plate p, at its plotted position, for sorting into rows */
+struct zone_point {
+   float y, x, z;
+};
+
+int compare_zone_points(const void *a, const void *b) {
+   const struct zone_point *p = a, *q = b;
+   if (p->y != q->y) return p->y < q->y ? -1 : 1;
+   return p->x < q->x ? -1 : p->x > q->x;
+}
+
+/*
+ * Minimum-zone and least-squares flatness of plate p, on the nodes of
+ * its height map if it has one and on the stations of its eight lines
+ * otherwise, in the output units of column 8
+ */
+void plate_zone(struct moody_plate *p) {
+   struct zone_point *pt = NULL;
+   struct zone_row *r;
+   float *x = NULL, *z = NULL;
+   int max_x, max_y, i, j, n = 0, rows = 0, failed;
+
+   plate_extent(p, &max_x, &max_y);
+   if (p->grid) {
+      r = malloc(p->grid_ny*sizeof(*r));
+      x = malloc(p->grid_nx*sizeof(float));
+      if (r && x) {
+	 for (i=0; i<p->grid_nx; i++) x[i] = max_x*((float)i)/(p->grid_nx-1);
+	 for (rows=0; rows<p->grid_ny; rows++) {
+	    r[rows].y = max_y*((float)rows)/(p->grid_ny-1);
+	    r[rows].x = x;
+	    r[rows].z = p->grid + (size_t)rows*p->grid_nx;
+	    r[rows].n = p->grid_nx;
+	 }
+      }
+   } else {
+      for (i=0; i<8; i++) n += p->num_dat[i]+1;
+      pt = malloc(n*sizeof(*pt));
+      r = malloc(n*sizeof(*r));
+      x = malloc(n*sizeof(float));
+      z = malloc(n*sizeof(float));
+      if (pt && r && x && z) {
+	 for (n=0, i=0; i<8; i++)
+	    for (j=0; j<=p->num_dat[i]; j++, n++) {
+	       plot_position(p, i, j, max_x, max_y, &pt[n].x, &pt[n].y);
+	       pt[n].z = p->ws[i][7][j];
+	    }
+	 qsort(pt, n, sizeof(*pt), compare_zone_points);
+	 for (i=0; i<n; i++) {
+	    x[i] = pt[i].x;
+	    z[i] = pt[i].z;
+	    if (!i || pt[i].y != pt[i-1].y) {
+	       r[rows].y = pt[i].y;
+	       r[rows].x = x+i;
+	       r[rows].z = z+i;
+	       r[rows++].n = 0;
+	    }
+	    r[rows-1].n++;
+	 }
+      }
+   }
+   failed = !r || !x || (!p->grid && (!pt || !z)) ||
+      zone_flatness(r, rows, &p->zone_flatness, &p->lsq_flatness);
+   free(pt);
+   free(r);
+   free(x);
+   free(z);
+   if (failed) {
+      fprintf(stderr, "Error: out of memory\n");
+      fail(p);
+   }
+   return;
+}
+
+/* Report the flatness of plate p by the minimum zone and the least-squares plane */
+void report_zone(struct moody_plate *p) {
+   float scale = p->metric ? 1.0 : 10.0;
+   const char *unit = p->metric ? "microns" : "micro-inches";
+   if (p->grid)
+      report(p, "Flatness of the %d by %d height map:\n", p->grid_nx, p->grid_ny);
+   else
+      report(p, "Flatness of the stations of the eight lines:\n");
+   report(p, "minimum zone %.2f %s, least-squares plane %.2f %s,\n"
+	  "against %.2f %s from Moody's datum plane.\n",
+	  scale*p->zone_flatness, unit, scale*p->lsq_flatness, unit, scale*p->flatness, unit);
+   report(p, "================================================================\n");
+   return;
+}
+
+/*
+ * Complete the plate once the corrections are done: columns 7 and 8,
+ * the center line check, the tables and the surface plot.
+ */
+void finish_plate(struct moody_plate *p) {
+   double t = wall_seconds();
+   int i;
+   real highest;
+
+   /* a plate found in the cache has all its results already */
+   if (!p->cached) {
+      if (p->least_squares) solve_network(p);
+      p->flatness = height_columns(p);
+      if (p->grid_size > 0) build_height_map(p);
+   } else if (p->least_squares)
+      report_network(p);
+   highest = p->flatness;
+
+   /* Check if the middle of the center lines falls at zero as it should */
+   do_moody_consistency_checks(p);
+   /* and if not, which line is to blame */
+   if (p->diagnose) diagnose_lines(p);
+
+   /* and how much the results could change with noise in the readings */
+   if (p->mc_trials > 0) {
+      if (!p->cached) run_monte_carlo(p);
+      report_monte_carlo(p);
+   }
+   if (p->cache_dir && !p->cached) store_cache(p);
+
+   /* and its flatness by the minimum zone, which the cache does not keep */
+   if (p->zone) {
+      plate_zone(p);
+      report_zone(p);
+   }
+
+   /* and how the plate has changed since it was last calibrated */
+   if (p->history && p->plate_id) record_history(p);
+   time_stage(p, STAGE_SOLVE, &t);
+   
+   /* Print out the completed worksheet */
+   if (p->report)
+      for (i=0; i<8; i++) {
+	 print_table(p, i);
+	 if (p->residuals) print_residuals(p, i);
+	 if (p->mc) print_uncertainty(p, i);
+      }
+   time_stage(p, STAGE_TABLES, &t);
+
+   /* and the machine-readable results */
+   write_results(p);
+   time_stage(p, STAGE_RESULTS, &t);
+
+   /* Output a surface plot */
+   if (!p->no_plot) {
+      output_gnuplot(p, highest);
+      if (p->image != IMAGE_NONE) output_image(p, highest);
+      if (p->mesh != MESH_NONE) output_mesh(p, highest);
+      if (p->contours != CONTOUR_NONE) output_contours(p, highest);
+   }
+   time_stage(p, STAGE_GNUPLOT, &t);
+
+   for (p->stats.warnings=0, i=p->warnings; i; i>>=1) p->stats.warnings += i&1;
+   return;
+}
+
+/* The plate pipeline is structured to follow Moody's recipe closely */
+void moody_pipeline(struct moody_plate *p) {
+   double t;
+
+   /* Read the bundle, or configuration file and data from input files */
+   read_plate(p);
+   t = wall_seconds();
+   alloc_worksheets(p);
+
+   /* Check for consistency of the input data */
+   do_consistency_checks(p);
+   if (p->cache_dir) lookup_cache(p);
+
+   /* Moody columns 1 to 6 and 6a, then columns 7 and 8, checks and output */
+   if (!p->cached) correct_lines(p);
+   time_stage(p, STAGE_SOLVE, &t);
+   finish_plate(p);
+   return;
+}
+
+/*
+ * Make room for station n on worksheet which_sheet of a streamed
+ * plate, keeping the values already there.
+ */
+void grow_line(struct moody_plate *p, int which_sheet, int n) {
+   int i=which_sheet;
+   int cap = p->capacity[i] ? p->capacity[i] : 64;
+   int c;
+   real *block;
+
+   if (n < p->capacity[i]) return;
+   while (cap <= n) cap *= 2;
+   if (!(block = calloc((size_t)num_columns(i)*cap, sizeof(real)))) {
+      fprintf(stderr, "Error: out of memory for streamed line %s\n", filenames[i]);
+      fail(p);
+   }
+   for (c=0; c<num_columns(i); c++) {
+      if (p->lines[i])
+	 memcpy(block+(size_t)c*cap, p->ws[i][c], p->capacity[i]*sizeof(real));
+      p->ws[i][c] = block+(size_t)c*cap;
+   }
+   free(p->lines[i]);
+   p->lines[i] = block;
+   p->capacity[i] = cap;
+   return;
+}
+
+/*
+ * Add one more reading to a streamed worksheet, extending Moody
+ * columns 1 to 4 in the same way as first_four_columns() does for a
+ * complete line.
+ */
+void add_reading(struct moody_plate *p, int which_sheet, float angle) {
+   int i=which_sheet;
+   int j=p->num_dat[i]+1;
+
+   grow_line(p, i, j);
+   p->num_dat[i] = j;
+   p->ws[i][0][j] = j+1;
+   p->ws[i][1][j] = angle;
+   /* angular difference, Moody column 3 */
+   p->ws[i][2][j] = p->ws[i][1][j]-p->ws[i][1][1];
+   /* times the length of the step, on a line with its own foot spacing */
+   if (line_step(p, i) != 1.0) {
+      if (reserve_positions(p, i, j+1)) {
+	 fprintf(stderr, "Error: out of memory for streamed line %s\n", filenames[i]);
+	 fail(p);
+      }
+      p->pos[i][0] = 0.0;
+      p->pos[i][j] = p->pos[i][j-1]+line_step(p, i);
+      p->ws[i][2][j] *= p->pos[i][j]-p->pos[i][j-1];
+   }
+   /* sum of angular differences, Moody column 4 */
+   if (j==1) {
+      p->ws[i][0][0] = 1;
+      p->ws[i][3][0] = 0.0;
+      p->ws[i][3][1] = 0.0;
+      p->carry[i] = 0.0;
+   } else
+      p->ws[i][3][j] = accumulate(p->ws[i][3][j-1], p->ws[i][2][j], &p->carry[i]);
+   return;
+}
+
+/* A plate whose readings arrive one at a time */
+struct moody_stream {
+   struct moody_plate *p;
+   /* no more readings will arrive for this line */
+   int complete[8];
+   /* Moody columns 5 and 6 (and 6a) of this line are computed */
+   int done[8];
+   /* columns 7 and 8 are computed and the tables printed */
+   int finished;
+};
+
+/*
+ * Carry out every stage of the computation whose inputs have become
+ * available: the diagonals as soon as they are complete, the
+ * perimeter lines once both diagonals are done, and the center lines
+ * once the perimeter lines they end on are done, see sheet_inputs[].
+ * After a line is measured again only the sheets depending on it are
+ * computed again, see redo_line().
+ */
+void update_stream(struct moody_stream *s) {
+   struct moody_plate *p = s->p;
+   int i;
+
+   for (i=0; i<8; i++) {
+      const int *in = sheet_inputs[i];
+      if (!s->complete[i] || s->done[i] || (in[0] >= 0 && !(s->done[in[0]] && s->done[in[1]])))
+	 continue;
+      correct_sheet(p, i);
+      s->done[i] = 1;
+      if (i < 2)
+	 report(p, "Diagonal %s corrected.\n", filenames[i]);
+      else if (i < 6)
+	 report(p, "Perimeter line %s corrected.\n", filenames[i]);
+      else {
+	 real error = center_height(p, i);
+	 report(p, "Center line %s corrected. Computed height at its center: %4.2f %s (%s).\n",
+		 filenames[i], p->metric ? error : 10*error,
+		 p->metric ? "microns" : "micro-inches",
+		 center_height_ok(p, error) ? "acceptable" : "too large, do the job over");
+      }
+   }
+
+   for (i=0; i<8 && s->done[i]; i++);
+   if (i==8 && !s->finished) {
+      s->finished = 1;
+      report(p, "\n");
+      p->warnings = 0;
+      do_consistency_checks(p);
+      finish_plate(p);
+   }
+   fflush(p->report);
+   return;
+}
+
+/*
+ * Start line which_sheet over, to be measured again: its readings are
+ * dropped, and the sheets depending on it are to be computed again
+ * once it is complete, while the others are kept.
+ */
+void redo_line(struct moody_stream *s, int which_sheet) {
+   int i, dirty = dirty_sheets(1<<which_sheet);
+   /* the least-squares adjustment has replaced columns 5 and 6 of every sheet */
+   if (s->p->least_squares) dirty = 0xff;
+   s->p->num_dat[which_sheet] = 0;
+   s->complete[which_sheet] = 0;
+   for (i=0; i<8; i++)
+      if (dirty & 1<<i) s->done[i] = 0;
+   s->finished = 0;
+   report(s->p, "Line %s to be measured again.\n", filenames[which_sheet]);
+   return;
+}
+
+/* Kinds of lines of streamed input, see parse_stream_line() */
+#define RECORD_READING 0
+#define RECORD_END 1
+#define RECORD_REDO 2
+#define RECORD_UNKNOWN 3  /* names no known measurement line */
+#define RECORD_BAD 4      /* cannot be parsed */
+#define RECORD_BLANK 5    /* blank, or a comment */
+
+/*
+ * Parse a line of streamed input buf, which ends with a newline, into
+ * the line *which it is about and, for a reading, its *angle. Returns
+ * its kind, RECORD_READING etc.
+ */
+int parse_stream_line(const char *buf, int *which, float *angle) {
+   const char *head = skip_blanks(buf), *tag;
+
+   if (*head=='\n' || *head=='#') return RECORD_BLANK;
+   /* line tag */
+   tag = head;
+   while (*head && !isspace((unsigned char)*head)) head++;
+   *which = line_from_tag(tag, (int)(head-tag));
+   head = skip_blanks(head);
+
+   if (*which<0) return RECORD_UNKNOWN;
+   if (!strncmp(head, "redo", 4) && *skip_blanks(head+4)=='\n') return RECORD_REDO;
+   if (!strncmp(head, "end", 3) && *skip_blanks(head+3)=='\n') return RECORD_END;
+   if (!scan_float(&head, angle) || *skip_blanks(head)!='\n') return RECORD_BAD;
+   return RECORD_READING;
+}
+
+/*
+ * Apply input line file_line of stream s, text, parsed by
+ * parse_stream_line(). t is the time it was read, in seconds since the
+ * acquisition started, or negative if unknown; it is echoed with a
+ * reading.
+ */
+void stream_input(struct moody_stream *s, int kind, int which, float angle, int file_line,
+		  const char *text, double t) {
+   struct moody_plate *p = s->p;
+   int j;
+
+   switch (kind) {
+   case RECORD_UNKNOWN:
+      fprintf(stderr, "Warning: input line %d names no known measurement line, ignored:\n%s",
+	      file_line, text);
+      break;
+   case RECORD_REDO:
+      redo_line(s, which);
+      break;
+   case RECORD_END:
+      if (p->num_dat[which]<3)
+	 fprintf(stderr, "Warning: line %s has %d stations, need at least 3; end ignored.\n",
+		 filenames[which], p->num_dat[which]);
+      else if (!s->complete[which]) {
+	 s->complete[which] = 1;
+	 report(p, "Line %s complete with %d stations.\n",
+		filenames[which], p->num_dat[which]);
+	 update_stream(s);
+      }
+      break;
+   case RECORD_BAD:
+      fprintf(stderr, "Warning: unable to parse input line %d, expected \"LINE angle\":\n%s",
+	      file_line, text);
+      break;
+   case RECORD_READING:
+      if (s->complete[which]) {
+	 fprintf(stderr, "Warning: line %s is already complete, input line %d ignored.\n",
+		 filenames[which], file_line);
+	 break;
+      }
+      add_reading(p, which, angle);
+      j = p->num_dat[which];
+      /* numbered as in the table, by column 1 of the worksheet */
+      if (t < 0)
+	 report(p, "%-10s%6d%8.1f%8.1f%8.1f\n", filenames[which], (int)p->ws[which][0][j],
+		p->ws[which][2][j], p->ws[which][3][j],
+		p->ws[which][3][j]*arcsec*p->out_spacing);
+      else
+	 report(p, "%-10s%6d%8.1f%8.1f%8.1f%10.3f\n", filenames[which], (int)p->ws[which][0][j],
+		p->ws[which][2][j], p->ws[which][3][j],
+		p->ws[which][3][j]*arcsec*p->out_spacing, t);
+      if (p->report) fflush(p->report);
+      break;
+   }
+   return;
+}
+
+#ifdef MOODY_THREADS
+/*
+ * Acquisition from an instrument. With --device, a reader thread reads
+ * the lines of streamed input from a serial port (or any file or
+ * pipe), stamps each with the time it arrived, parses it, and hands it
+ * to the thread that updates the worksheets through a ring of
+ * STREAM_RING records with a single producer and a single consumer.
+ * Neither side takes a lock: only the reader moves head, and only the
+ * updater tail, each publishing it with release ordering and reading
+ * the other's with acquire ordering (the __atomic builtins of GCC and
+ * Clang). Printing the tables to a slow terminal only holds up the
+ * updater. When the ring is full the reader keeps the records that
+ * arrive in an overflow queue of its own, and moves them to the ring,
+ * in order, as soon as there is room, so it never waits for the
+ * updater and no reading is dropped.
+ */
+#define STREAM_RING 4096
+/* the start of an input line kept for warnings, with its newline */
+#define STREAM_TEXT 80
+/* how long the updater sleeps when the ring is empty, in nanoseconds */
+#define STREAM_NAP 1000000L
+
+struct stream_record {
+   double time;
+   int file_line, kind, which;
+   float angle;
+   char text[STREAM_TEXT];
+};
+
+struct stream_ring {
+   struct stream_record slot[STREAM_RING];
+   /* records written by the reader and taken by the updater; they only grow */
+   unsigned long head, tail;
+   /* set by the reader at the end of the input, and by the updater to stop the reader */
+   int eof, stop;
+   int fd;
+   double start;
+   /* the overflow queue of the reader: spilled records from spill[first] on */
+   struct stream_record *spill;
+   size_t first, spilled, spill_size;
+   /* counters, for the report at the end */
+   long records, lost;
+   size_t most_spilled;
+};
+
+/* Move the overflow of ring r to the ring, as far as there is room; reader only */
+void flush_spill(struct stream_ring *r) {
+   unsigned long head = r->head;
+   unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+   while (r->spilled && head - tail < STREAM_RING) {
+      r->slot[head % STREAM_RING] = r->spill[r->first++];
+      r->spilled--;
+      head++;
+   }
+   if (!r->spilled) r->first = 0;
+   __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+   return;
+}
+
+/* Hand record e to the updater; reader only */
+void push_record(struct stream_ring *r, const struct stream_record *e) {
+   unsigned long tail;
+
+   r->records++;
+   if (!r->spilled) {
+      tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      if (r->head - tail < STREAM_RING) {
+	 r->slot[r->head % STREAM_RING] = *e;
+	 __atomic_store_n(&r->head, r->head+1, __ATOMIC_RELEASE);
+	 return;
+      }
+   }
+   if (r->first + r->spilled == r->spill_size) {
+      /* reuse the room of the records already moved before growing */
+      if (r->first > 0) {
+	 memmove(r->spill, r->spill + r->first, r->spilled*sizeof(*e));
+	 r->first = 0;
+      } else {
+	 size_t size = r->spill_size ? 2*r->spill_size : STREAM_RING;
+	 struct stream_record *tmp = realloc(r->spill, size*sizeof(*e));
+	 if (!tmp) {
+	    r->lost++;
+	    return;
+	 }
+	 r->spill = tmp;
+	 r->spill_size = size;
+      }
+   }
+   r->spill[r->first + r->spilled++] = *e;
+   if (r->spilled > r->most_spilled) r->most_spilled = r->spilled;
+   return;
+}
+
+/* Parse input line file_line, the len characters at buf, read at time t, for ring r */
+void ring_line(struct stream_ring *r, char *buf, int len, int file_line, double t) {
+   struct stream_record e;
+   int n;
+
+   buf[len] = '\n';
+   buf[len+1] = '\0';
+   e.kind = parse_stream_line(buf, &e.which, &e.angle);
+   if (e.kind == RECORD_BLANK) return;
+   e.time = t;
+   e.file_line = file_line;
+   n = len < STREAM_TEXT-2 ? len : STREAM_TEXT-2;
+   memcpy(e.text, buf, n);
+   e.text[n] = '\n';
+   e.text[n+1] = '\0';
+   push_record(r, &e);
+   return;
+}
+
+/* The reader thread: parse the device of ring arg into it until its end, or until stopped */
+void *stream_reader(void *arg) {
+   struct stream_ring *r = arg;
+   char buf[MAX_LINELEN], chunk[4096];
+   struct pollfd pfd;
+   int len = 0, file_line = 0;
+   ssize_t n, k;
+   double t;
+
+   pfd.fd = r->fd;
+   pfd.events = POLLIN;
+   while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+      if (r->spilled) flush_spill(r);
+      /* wake up now and then to see whether to stop, or to move the overflow */
+      if (poll(&pfd, 1, r->spilled ? 1 : 100) <= 0) continue;
+      n = read(r->fd, chunk, sizeof(chunk));
+      if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+      if (n <= 0) break;
+      t = wall_seconds() - r->start;
+      for (k=0; k<n; k++) {
+	 if (chunk[k] == '\n') {
+	    ring_line(r, buf, len, ++file_line, t);
+	    len = 0;
+	 } else if (chunk[k] != '\r' && len < (int)sizeof(buf)-2)
+	    /* instruments end their lines with CR LF; longer lines are cut, as with fgets() */
+	    buf[len++] = chunk[k];
+      }
+   }
+   if (len > 0) ring_line(r, buf, len, ++file_line, wall_seconds() - r->start);
+   /* the overflow must reach the ring before the end is announced */
+   while (r->spilled && !__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+      struct timespec nap = {0, STREAM_NAP};
+      flush_spill(r);
+      if (r->spilled) nanosleep(&nap, NULL);
+   }
+   __atomic_store_n(&r->eof, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+/* The speed_t of a serial port at baud bits per second; returns -1 if there is none */
+int baud_speed(int baud, speed_t *speed) {
+   const int rates[] = {1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200};
+   const speed_t speeds[] = {B1200, B2400, B4800, B9600, B19200, B38400, B57600, B115200};
+   int i;
+   for (i=0; i<(int)(sizeof(rates)/sizeof(rates[0])); i++)
+      if (rates[i] == baud) {
+	 *speed = speeds[i];
+	 return 0;
+      }
+#ifdef B230400
+   if (baud == 230400) {
+      *speed = B230400;
+      return 0;
+   }
+#endif
+   return -1;
+}
+
+/*
+ * Open the instrument at path for reading; a serial port is switched
+ * to raw 8-bit input, at baud bits per second unless that is zero.
+ * Returns the file descriptor, or -1 after printing why not.
+ */
+int open_device(const char *path, int baud) {
+   struct termios tio;
+   speed_t speed;
+   int fd;
+
+   if ((fd = open(path, O_RDONLY | O_NOCTTY)) < 0) {
+      fprintf(stderr, "Error: unable to open device %s\n", path);
+      return -1;
+   }
+   if (!isatty(fd)) return fd;
+   if (tcgetattr(fd, &tio)) {
+      fprintf(stderr, "Error: unable to read the settings of serial port %s\n", path);
+      close(fd);
+      return -1;
+   }
+   tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+   tio.c_oflag &= ~OPOST;
+   tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+   tio.c_cflag &= ~(CSIZE | PARENB);
+   tio.c_cflag |= CS8 | CREAD | CLOCAL;
+   tio.c_cc[VMIN] = 1;
+   tio.c_cc[VTIME] = 0;
+   if (baud) {
+      if (baud_speed(baud, &speed)) {
+	 fprintf(stderr, "Error: serial port %s cannot be set to %d baud\n", path, baud);
+	 close(fd);
+	 return -1;
+      }
+      cfsetispeed(&tio, speed);
+      cfsetospeed(&tio, speed);
+   }
+   if (tcsetattr(fd, TCSANOW, &tio)) {
+      fprintf(stderr, "Error: unable to set up serial port %s\n", path);
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/*
+ * Feed stream s from the device of options o, read by a reader thread,
+ * until the plate is finished or the device has no more input.
+ * Returns -1 if the device cannot be read.
+ */
+int acquire_stream(struct moody_stream *s, const struct moody_options *o) {
+   struct stream_ring *r;
+   struct stream_record *e;
+   struct timespec nap = {0, STREAM_NAP};
+   pthread_t reader;
+   unsigned long head;
+   size_t waiting, most_waiting = 0;
+
+   if (!(r = calloc(1, sizeof(*r)))) {
+      fprintf(stderr, "Error: out of memory\n");
+      return -1;
+   }
+   if ((r->fd = open_device(o->device, o->baud)) < 0) {
+      free(r);
+      return -1;
+   }
+   r->start = wall_seconds();
+   if (pthread_create(&reader, NULL, stream_reader, r)) {
+      fprintf(stderr, "Error: unable to start the reader thread\n");
+      close(r->fd);
+      free(r);
+      return -1;
+   }
+
+   while (!s->finished) {
+      head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      if (r->tail == head) {
+	 /* the last records may have come just before the end was announced */
+	 if (__atomic_load_n(&r->eof, __ATOMIC_ACQUIRE) &&
+	     __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail)
+	    break;
+	 nanosleep(&nap, NULL);
+	 continue;
+      }
+      waiting = head - r->tail;
+      if (waiting > most_waiting) most_waiting = waiting;
+      e = &r->slot[r->tail % STREAM_RING];
+      stream_input(s, e->kind, e->which, e->angle, e->file_line, e->text, e->time);
+      __atomic_store_n(&r->tail, r->tail+1, __ATOMIC_RELEASE);
+   }
+   __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+   pthread_join(reader, NULL);
+
+   report(s->p, "Acquired %ld input lines from %s in %.1f s; at most %lu waited in the ring",
+	  r->records, o->device, wall_seconds() - r->start, (unsigned long)most_waiting);
+   if (r->most_spilled) report(s->p, ", and %lu beyond it", (unsigned long)r->most_spilled);
+   report(s->p, ".\n");
+   if (r->lost)
+      fprintf(stderr, "Error: out of memory, %ld input lines from %s were lost\n", r->lost, o->device);
+   close(r->fd);
+   free(r->spill);
+   free(r);
+   return 0;
+}
+#endif
+
+/*
+ * Streaming mode: read tagged readings from stdin, one per line, for
+ * example "NW_SE 6.5", and update the worksheets as each one arrives.
+ * "NW_SE end" says that line NW_SE is complete, and "NW_SE redo" that
+ * it is measured again from its first station. At the end of the
+ * input all lines are taken to be complete. Lines beginning with "#"
+ * and blank lines are ignored. Malformed lines are reported and
+ * skipped, so that a typo does not end a survey. With --device the
+ * lines come from an instrument instead, see acquire_stream(), and
+ * the acquisition ends once the plate is finished.
+ */
+int run_stream(const struct moody_options *o) {
+   struct moody_stream s;
+   struct moody_plate *p;
+   char buf[MAX_LINELEN];
+   int file_line=0;
+   int i, ret;
+
+#ifndef MOODY_THREADS
+   if (o->device) {
+      fprintf(stderr, "Error: reading from a device needs a build with MOODY_THREADS\n");
+      return EXIT_FAILURE;
+   }
+#endif
+   memset(&s, 0, sizeof(s));
+   if (!(p = s.p = new_plate(NULL, NULL))) {
+      fprintf(stderr, "Error: out of memory\n");
+      return EXIT_FAILURE;
+   }
+   set_output(p, o, stdout);
+   read_config_file(p);
+   report(p, "Streaming mode: reading \"LINE angle\", \"LINE end\" or \"LINE redo\" from %s.\n"
+	   "Columns: line, station, angle displacement, sum of displacements (arcsec),\n"
+	   "uncorrected height along the line (%s)%s.\n\n",
+	   o->device ? o->device : "standard input",
+	   p->metric ? "microns" : "10^-5 inch",
+	   o->device ? ", seconds since the start" : "");
+   if (p->report) fflush(p->report);
+
+#ifdef MOODY_THREADS
+   if (o->device) {
+      if (acquire_stream(&s, o)) {
+	 free_plate(p);
+	 return EXIT_FAILURE;
+      }
+   } else
+#endif
+      while (fgets(buf, sizeof(buf), stdin) != NULL) {
+	 int len, kind, which = -1;
+	 float angle = 0;
+
+	 file_line++;
+	 /* guarantee newline at the end */
+	 len = (int)strlen(buf);
+	 if (len==0 || buf[len-1]!='\n') {
+	    if (len+1 < (int)sizeof(buf)) {
+	       buf[len]='\n';
+	       buf[len+1]='\0';
+	    } else
+	       buf[len-1]='\n';
+	 }
+	 kind = parse_stream_line(buf, &which, &angle);
+	 stream_input(&s, kind, which, angle, file_line, buf, -1.0);
+      }
+
+   /* end of input: every line with enough stations is complete */
+   for (i=0; i<8; i++)
+      if (!s.complete[i] && p->num_dat[i]>=3) {
+	 s.complete[i] = 1;
+	 report(p, "Line %s complete with %d stations.\n",
+		 filenames[i], p->num_dat[i]);
+      }
+   update_stream(&s);
+
+   ret = EXIT_SUCCESS;
+   if (!s.finished) {
+      fprintf(stderr, "Error: input ended before all eight lines had at least 3 stations.\n");
+      ret = EXIT_FAILURE;
+   }
+   free_plate(p);
+   return ret;
+}
+
+/*
+ * Open the plate whose input files are in directory dir, or in bundle
+ * file dir, for batch mode. The tables and commentary go to the file
+ * moody.txt in that directory, next to the gnuplot files; for a bundle
+ * "name.mpb" these files are called name.moody.txt and so on.
+ * Returns NULL if the plate or its results file cannot be opened.
+ */
+struct moody_plate *open_plate(const char *dir, const struct moody_options *o) {
+   /* results file name for each output format */
+   const char *names[4]={"moody.txt", "moody.csv", "moody.json", "moody.bin"};
+   char path[MAX_PATHLEN];
+   const char *fname;
+   struct moody_plate *p;
+   double t = wall_seconds();
+   FILE *fp;
+
+   if (!(p = new_plate(NULL, NULL)) || set_plate_source(p, dir)) {
+      fprintf(stderr, "Error: out of memory\n");
+      free_plate(p);
+      return NULL;
+   }
+   /* a bundle has been read */
+   time_stage(p, STAGE_READ, &t);
+   fname = plate_path(p, path, names[o->format]);
+   if (!(fp=fopen(fname, o->format==OUTPUT_BINARY ? "wb" : "w"))) {
+      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+      free_plate(p);
+      return NULL;
+   }
+   set_output(p, o, fp);
+   /* in batch mode each plate is recorded under its own name */
+   if (!p->plate_id) p->plate_id = dir;
+   return p;
+}
+
+/* Close the results file of a plate opened by open_plate(), and release it */
+void close_plate(struct moody_plate *p) {
+   fclose(p->report ? p->report : p->out);
+   free_plate(p);
+   return;
+}
+
+/*
+ * In batch mode an error in one plate must not stop the others, so
+ * these run a stage of the pipeline with fail() jumping back to them.
+ * They return 0 on success, 1 if the plate could not be processed.
+ */
+int start_plate(struct moody_plate *p) {
+   jmp_buf env;
+   double t;
+   p->fail_jmp = &env;
+   if (setjmp(env)) {
+      p->fail_jmp = NULL;
+      return 1;
+   }
+   read_plate(p);
+   t = wall_seconds();
+   alloc_worksheets(p);
+   do_consistency_checks(p);
+   if (p->cache_dir) lookup_cache(p);
+   time_stage(p, STAGE_SOLVE, &t);
+   p->fail_jmp = NULL;
+   return 0;
+}
+
+int end_plate(struct moody_plate *p) {
+   jmp_buf env;
+   p->fail_jmp = &env;
+   if (setjmp(env)) {
+      p->fail_jmp = NULL;
+      return 1;
+   }
+   finish_plate(p);
+   p->fail_jmp = NULL;
+   return 0;
+}
+
+/* Do plates p and q have the same numbers of stations, at the same positions? */
+int same_stations(const struct moody_plate *p, const struct moody_plate *q) {
+   int i;
+   if (memcmp(p->num_dat, q->num_dat, sizeof(p->num_dat))) return 0;
+   for (i=0; i<8; i++)
+      if (!p->pos[i] != !q->pos[i] ||
+	  (p->pos[i] && memcmp(p->pos[i], q->pos[i], (p->num_dat[i]+1)*sizeof(real))))
+	 return 0;
+   return 1;
+}
+
+/*
+ * Process the n (at most MOODY_LANES) plates in dirs, setting
+ * status[k] to 0 on success or 1 on failure for each one, and stats[k]
+ * to its timings and counters. Plates with
+ * the same stations are corrected together, by the batched
+ * kernel.
+ */
+void run_plates(char **dirs, int n, const struct moody_options *o, int *status,
+		struct moody_stats *stats) {
+   struct moody_plate *p[MOODY_LANES], *group[MOODY_LANES];
+   int done[MOODY_LANES];
+   double t;
+   int k, m, g;
+
+   for (k=0; k<n; k++) {
+      p[k] = open_plate(dirs[k], o);
+      status[k] = done[k] = !p[k] || start_plate(p[k]);
+      if (!done[k]) done[k] = p[k]->cached;
+   }
+   for (k=0; k<n; k++) {
+      if (done[k]) continue;
+      for (g=0, m=k; m<n; m++)
+	 if (!done[m] && same_stations(p[m], p[k])) {
+	    group[g++] = p[m];
+	    done[m] = 1;
+	 }
+      /* without memory for the batched worksheets, one at a time */
+      t = wall_seconds();
+      if (correct_plates(group, g))
+	 for (m=0; m<g; m++) correct_lines(group[m]);
+      /* the plates of a group share its time */
+      t = (wall_seconds()-t)/g;
+      for (m=0; m<g; m++) group[m]->stats.seconds[STAGE_SOLVE] += t;
+   }
+   for (k=0; k<n; k++) {
+      if (!status[k]) status[k] = end_plate(p[k]);
+      if (p[k]) {
+	 stats[k] = p[k]->stats;
+	 close_plate(p[k]);
+      }
+   }
+   return;
+}
+
+/*
+ * Read the plate in directory or bundle src (NULL for the current
+ * directory) and write it as a bundle file dst.
+ */
+int convert_plate(const char *src, const char *dst) {
+   struct moody_plate *p = new_plate(NULL, stdout);
+
+   if (!p || (src && set_plate_source(p, src))) {
+      fprintf(stderr, "Error: out of memory\n");
+      return EXIT_FAILURE;
+   }
+   read_plate(p);
+   write_bundle(p, dst);
+   free_plate(p);
+   return EXIT_SUCCESS;
+}
+
+/* Total time of all stages of a plate */
+double total_seconds(const struct moody_stats *s) {
+   double t = 0.0;
+   int i;
+   for (i=0; i<NUM_STAGES; i++) t += s->seconds[i];
+   return t;
+}
+
+/* Print the counters of s to stderr */
+void print_counters(const struct moody_stats *s) {
+   fprintf(stderr, "Counters: %ld lines parsed, %ld comment or blank lines, %ld bytes read,\n"
+	   "%ld bytes written, %d warnings, %d cache hits\n",
+	   s->lines_parsed, s->comment_lines, s->bytes_read, s->bytes_written, s->warnings,
+	   s->cache_hits);
+   return;
+}
+
+/* Print the timings and counters of plate name to stderr, for --timings */
+void print_stats(const char *name, const struct moody_stats *s) {
+   int i;
+   fprintf(stderr, "Timings of plate %s in milliseconds:", name);
+   for (i=0; i<NUM_STAGES; i++) fprintf(stderr, " %s %.3f,", stage_names[i], 1e3*s->seconds[i]);
+   fprintf(stderr, " total %.3f\n", 1e3*total_seconds(s));
+   print_counters(s);
+   return;
+}
+
+/*
+ * Print the percentiles over the n plates of a batch of the time of
+ * each stage, and the counters of all plates together, to stderr
+ */
+void print_stats_summary(const struct moody_stats *s, int n) {
+   const double q[4]={0.5, 0.9, 0.99, 1.0};
+   struct moody_stats sum;
+   float *x = malloc(n*sizeof(float));
+   int i, j, k;
+
+   if (!x) {
+      fprintf(stderr, "Error: out of memory for the timings\n");
+      return;
+   }
+   memset(&sum, 0, sizeof(sum));
+   fprintf(stderr, "Timings of %d plates in milliseconds:\n%-8s %10s %10s %10s %10s\n",
+	   n, "stage", "p50", "p90", "p99", "max");
+   for (i=0; i<=NUM_STAGES; i++) {
+      for (k=0; k<n; k++) x[k] = 1e3*(i<NUM_STAGES ? s[k].seconds[i] : total_seconds(&s[k]));
+      fprintf(stderr, "%-8s", i<NUM_STAGES ? stage_names[i] : "total");
+      for (j=0; j<4; j++) fprintf(stderr, " %10.3f", quantile(x, n, q[j]));
+      fprintf(stderr, "\n");
+   }
+   for (k=0; k<n; k++) {
+      sum.lines_parsed += s[k].lines_parsed;
+      sum.comment_lines += s[k].comment_lines;
+      sum.bytes_read += s[k].bytes_read;
+      sum.bytes_written += s[k].bytes_written;
+      sum.warnings += s[k].warnings;
+      sum.cache_hits += s[k].cache_hits;
+   }
+   print_counters(&sum);
+   free(x);
+   return;
+}
+
+/*
+ * Write the timings and counters of plate name as one line of JSON to
+ * fp, for --stats
+ */
+void write_stats_record(FILE *fp, const char *name, int failed, const struct moody_stats *s) {
+   const char *c;
+   int i;
+   fprintf(fp, "{\"plate\": \"");
+   for (c=name; *c; c++)
+      if (*c=='"' || *c=='\\') fprintf(fp, "\\%c", *c);
+      else if ((unsigned char)*c < 0x20) fprintf(fp, "\\u%04x", *c);
+      else fputc(*c, fp);
+   fprintf(fp, "\", \"status\": \"%s\", \"seconds\": {", failed ? "failed" : "ok");
+   for (i=0; i<NUM_STAGES; i++) fprintf(fp, "\"%s\": %.9f, ", stage_names[i], s->seconds[i]);
+   fprintf(fp, "\"total\": %.9f}, \"lines_parsed\": %ld, \"comment_lines\": %ld, "
+	   "\"bytes_read\": %ld, \"bytes_written\": %ld, \"warnings\": %d, \"cache_hit\": %s}\n",
+	   total_seconds(s), s->lines_parsed, s->comment_lines,
+	   s->bytes_read, s->bytes_written, s->warnings, s->cache_hits ? "true" : "false");
+   return;
+}
+
+/* Write the percentiles of print_stats_summary() as one line of JSON to fp */
+void write_stats_summary(FILE *fp, const struct moody_stats *s, int n, int failed) {
+   const double q[4]={0.5, 0.9, 0.99, 1.0};
+   const char *qnames[4]={"p50", "p90", "p99", "max"};
+   float *x = malloc(n*sizeof(float));
+   int i, j, k;
+
+   if (!x) {
+      fprintf(stderr, "Error: out of memory for the timings\n");
+      return;
+   }
+   fprintf(fp, "{\"plates\": %d, \"failed\": %d, \"seconds\": {", n, failed);
+   for (i=0; i<=NUM_STAGES; i++) {
+      for (k=0; k<n; k++) x[k] = i<NUM_STAGES ? s[k].seconds[i] : total_seconds(&s[k]);
+      fprintf(fp, "%s\"%s\": {", i ? ", " : "", i<NUM_STAGES ? stage_names[i] : "total");
+      for (j=0; j<4; j++) fprintf(fp, "%s\"%s\": %.9f", j ? ", " : "", qnames[j], quantile(x, n, q[j]));
+      fprintf(fp, "}");
+   }
+   fprintf(fp, "}}\n");
+   free(x);
+   return;
+}
+
+/* A list of plate directories, shared by the batch workers */
+struct batch {
+   const struct moody_options *opts;
+   char **dirs;
+   int num;
+   int next;
+   /* plates taken at a time, at most MOODY_LANES */
+   int chunk;
+   int *status;
+   struct moody_stats *stats;
+#ifdef MOODY_THREADS
+   pthread_mutex_t lock;
+#endif
+};
+
+/* Take plates from the batch until none are left */
+void *batch_worker(void *arg) {
+   struct batch *b = arg;
+   int k;
+
+   for (;;) {
+#ifdef MOODY_THREADS
+      pthread_mutex_lock(&b->lock);
+#endif
+      k = b->next;
+      b->next += b->chunk;
+#ifdef MOODY_THREADS
+      pthread_mutex_unlock(&b->lock);
+#endif
+      if (k >= b->num) break;
+      run_plates(b->dirs+k, b->num-k < b->chunk ? b->num-k : b->chunk, b->opts,
+		 b->status+k, b->stats+k);
+   }
+   return NULL;
+}
+
+/* Process all plates of a batch, using up to o->num_workers threads */
+int run_batch(char **dirs, int num, const struct moody_options *o) {
+   struct batch b;
+   struct moody_options plate_opts = *o;
+   int num_workers = o->num_workers;
+   int k, failed=0;
+
+   b.opts = &plate_opts;
+   b.dirs = dirs;
+   b.num = num;
+   b.next = 0;
+   b.chunk = MOODY_LANES;
+   b.status = calloc(num, sizeof(int));
+   b.stats = calloc(num, sizeof(struct moody_stats));
+   if (!b.status || !b.stats) {
+      fprintf(stderr, "Error: out of memory\n");
+      exit(EXIT_FAILURE);
+   }
+
+#ifdef MOODY_THREADS
+   {
+      pthread_t *tid;
+      int started=0;
+
+      if (num_workers <= 0) num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      if (num_workers > num) num_workers = num;
+      if (num_workers < 1) num_workers = 1;
+      /* with several plates at a time, each one runs its Monte Carlo trials alone */
+      if (num_workers > 1) plate_opts.mc_workers = 1;
+      /* keep all workers busy, even if the chunks get smaller */
+      if (b.chunk > (num+num_workers-1)/num_workers) b.chunk = (num+num_workers-1)/num_workers;
+      if (!(tid = malloc(num_workers*sizeof(pthread_t)))) {
+	 fprintf(stderr, "Error: out of memory\n");
+	 exit(EXIT_FAILURE);
+      }
+      pthread_mutex_init(&b.lock, NULL);
+      for (k=0; k<num_workers; k++)
+	 if (pthread_create(&tid[started], NULL, batch_worker, &b) == 0)
+	    started++;
+      /* if no thread could be started, do the work ourselves */
+      if (started == 0) batch_worker(&b);
+      for (k=0; k<started; k++) pthread_join(tid[k], NULL);
+      pthread_mutex_destroy(&b.lock);
+      free(tid);
+   }
+#else
+   (void)num_workers;
+   batch_worker(&b);
+#endif
+
+   for (k=0; k<num; k++) {
+      printf("%s %s\n", b.status[k] ? "FAILED" : "OK    ", dirs[k]);
+      failed += b.status[k];
+   }
+   printf("\nProcessed %d plates, %d failed.\n", num, failed);
+   if (o->timings) print_stats_summary(b.stats, num);
+   if (o->stats) {
+      for (k=0; k<num; k++) write_stats_record(o->stats, dirs[k], b.status[k], &b.stats[k]);
+      write_stats_summary(o->stats, b.stats, num, failed);
+   }
+   free(b.stats);
+   free(b.status);
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Read a manifest file listing one plate directory per line. Lines
+ * beginning with "#" and blank lines are ignored. The directories
+ * are appended to *pdirs, which holds *pnum entries.
+ */
+void read_manifest(const char *fname, char ***pdirs, int *pnum) {
+   FILE *fp;
+   char buf[MAX_PATHLEN];
+   char *head, *tail;
+
+   if ((fp = fopen(fname, "r")) == NULL) {
+      fprintf(stderr, "Error: unable to find/open manifest file %s\n", fname);
+      exit(EXIT_FAILURE);
+   }
+   while (fgets(buf, sizeof(buf), fp) != NULL) {
+      /* strip leading and trailing white space */
+      head = buf;
+      while (isspace((unsigned char)*head)) head++;
+      if (*head=='\0' || *head=='#') continue;
+      tail = head + strlen(head);
+      while (tail>head && isspace((unsigned char)tail[-1])) tail--;
+      *tail = '\0';
+
+      if (!(*pdirs = realloc(*pdirs, (*pnum+1)*sizeof(char *))) ||
+	  !((*pdirs)[*pnum] = malloc(strlen(head)+1))) {
+	 fprintf(stderr, "Error: out of memory\n");
+	 exit(EXIT_FAILURE);
+      }
+      strcpy((*pdirs)[(*pnum)++], head);
+   }
+   fclose(fp);
+   return;
+}
+
+#ifdef MOODY_THREADS
+/*
+ * Server mode. run_server() listens on a Unix socket (an address
+ * containing a "/") or a TCP port ("port" or "host:port"), and every
+ * connection may send any number of requests without waiting for the
+ * replies:
+ *
+ *   PLATE n [prefix]      followed by n bytes of a text or binary bundle
+ *   QUIT                  close the connection
+ *
+ * Each plate is answered, in the order of the requests, by
+ *
+ *   OK m                  followed by the m bytes of its results
+ *   FAILED 0              if the plate could not be processed
+ *
+ * The results are those moody prints for the plate with the options
+ * the server was started with (-f, -q, -l, -g, -u and so on). Nothing
+ * is written to disk, unless a request gives a prefix and the server
+ * was started with --plot-dir D: then its gnuplot files are written
+ * as D/prefix + "gnuplot.dat" and so on, on the server. A prefix is a
+ * file name, without "/" or "..", so that a client cannot write outside
+ * D. A TCP port without a host only listens on the loopback interface.
+ * The plates are computed by a pool of worker threads, shared by all
+ * connections. A connection hands over all requests that have already
+ * arrived, up to SERVER_BATCH of them, and sends their replies
+ * together. No request may be larger than --max-request bytes, and a
+ * connection stops adding requests to its batch once they hold that
+ * many bytes, so that it never holds twice as much.
+ */
+#define SERVER_BATCH 64
+#define SERVER_BUFFER 65536
+/* default largest bundle accepted, in bytes */
+#define SERVER_MAX_REQUEST (16UL<<20)
+
+/* One plate to compute */
+struct server_job {
+   /* the bundle, with room for a newline after it, and the gnuplot prefix or NULL */
+   char *request;
+   size_t len;
+   char *plot;
+   /* the results, set once done is */
+   char *result;
+   size_t result_len;
+   int failed;
+   int done;
+   struct server_job *next;
+};
+
+/* The worker pool, and its queue of jobs */
+struct server {
+   struct moody_options opts;
+   /* where the gnuplot files of requests with a prefix go, or NULL to refuse them */
+   const char *plot_dir;
+   /* largest bundle accepted, in bytes */
+   unsigned long max_request;
+   pthread_mutex_t lock;
+   pthread_cond_t work, done;
+   struct server_job *head, *tail;
+};
+
+/* A client connection, with its buffered input */
+struct server_conn {
+   struct server *s;
+   int fd;
+   size_t pos, len;
+   char buf[SERVER_BUFFER];
+};
+
+/* Compute the plate of job, with the options of server s */
+void run_job(struct server *s, struct server_job *job) {
+   struct moody_plate *p = new_plate(NULL, NULL);
+   FILE *fp = NULL;
+
+   job->result = NULL;
+   job->result_len = 0;
+   job->failed = 1;
+   if (!p || !(fp = open_memstream(&job->result, &job->result_len))) {
+      fprintf(stderr, "Error: out of memory\n");
+      free(job->request);
+      free_plate(p);
+      return;
+   }
+   /* the plate owns the request from now on, as if it had been loaded */
+   job->request[job->len] = '\n';
+   p->bundle.buf = job->request;
+   p->bundle.len = job->len;
+   p->bundle_name = "request";
+   p->dir = s->plot_dir;
+   p->prefix = job->plot;
+   p->no_plot = job->plot == NULL;
+   set_output(p, &s->opts, fp);
+   if (!start_plate(p)) {
+      if (!p->cached) correct_lines(p);
+      job->failed = end_plate(p);
+   }
+   free_plate(p);
+   fclose(fp);
+   if (job->failed) {
+      free(job->result);
+      job->result = NULL;
+      job->result_len = 0;
+   }
+   return;
+}
+
+/* Take jobs from the queue of server s, forever */
+void *server_worker(void *arg) {
+   struct server *s = arg;
+   struct server_job *job;
+
+   for (;;) {
+      pthread_mutex_lock(&s->lock);
+      while (!s->head) pthread_cond_wait(&s->work, &s->lock);
+      job = s->head;
+      s->head = job->next;
+      if (!s->head) s->tail = NULL;
+      pthread_mutex_unlock(&s->lock);
+
+      run_job(s, job);
+
+      pthread_mutex_lock(&s->lock);
+      job->done = 1;
+      pthread_cond_broadcast(&s->done);
+      pthread_mutex_unlock(&s->lock);
+   }
+   return NULL;
+}
+
+/* Make at least one more byte of input available on c; returns 0 at its end */
+int conn_fill(struct server_conn *c) {
+   ssize_t n;
+   if (c->pos < c->len) return 1;
+   do
+      n = read(c->fd, c->buf, sizeof(c->buf));
+   while (n < 0 && errno == EINTR);
+   if (n <= 0) return 0;
+   c->pos = 0;
+   c->len = (size_t)n;
+   return 1;
+}
+
+/* Read a line from c into line, without its newline; returns 0 at the end or if it is too long */
+int conn_line(struct server_conn *c, char *line, size_t size) {
+   size_t n = 0;
+   char ch;
+   for (;;) {
+      if (!conn_fill(c)) return 0;
+      ch = c->buf[c->pos++];
+      if (ch == '\n') break;
+      if (n+1 >= size) return 0;
+      line[n++] = ch;
+   }
+   /* allow CR LF line ends */
+   if (n > 0 && line[n-1] == '\r') n--;
+   line[n] = '\0';
+   return 1;
+}
+
+/* Read n bytes from c into buf; returns 0 if the connection ends first */
+int conn_bytes(struct server_conn *c, char *buf, size_t n) {
+   size_t k;
+   while (n > 0) {
+      if (!conn_fill(c)) return 0;
+      k = c->len - c->pos < n ? c->len - c->pos : n;
+      memcpy(buf, c->buf + c->pos, k);
+      c->pos += k;
+      buf += k;
+      n -= k;
+   }
+   return 1;
+}
+
+/*
+ * Read the bundle of request line "PLATE n [prefix]" from c into job.
+ * Returns 0 on success, -1 for a malformed request, -2 for a prefix
+ * the server does not allow, -3 for a bundle larger than the server
+ * accepts, 1 if the connection ends first.
+ */
+int read_request(struct server_conn *c, const char *line, struct server_job *job) {
+   const char *head;
+   char *end;
+   unsigned long n;
+
+   if (strncmp(line, "PLATE ", 6)) return -1;
+   n = strtoul(line+6, &end, 10);
+   if (end == line+6 || n == 0) return -1;
+   if (n > c->s->max_request) return -3;
+   head = skip_blanks(end);
+   if (*head && (!c->s->plot_dir || strchr(head, '/') || strstr(head, ".."))) return -2;
+   memset(job, 0, sizeof(*job));
+   if (*head && !(job->plot = malloc(strlen(head)+1))) return -1;
+   if (*head) strcpy(job->plot, head);
+   job->len = n;
+   if (!(job->request = malloc(n+1))) {
+      free(job->plot);
+      return -1;
+   }
+   if (!conn_bytes(c, job->request, n)) {
+      free(job->request);
+      free(job->plot);
+      return 1;
+   }
+   return 0;
+}
+
+/* Serve one connection until the client closes it or sends QUIT */
+void *serve_connection(void *arg) {
+   struct server_conn *c = arg;
+   struct server *s = c->s;
+   struct server_job jobs[SERVER_BATCH];
+   char line[MAX_PATHLEN+64];
+   size_t held;
+   int open = 1, bad = 0, n, k, r;
+   int wfd = dup(c->fd);
+   FILE *out = wfd >= 0 ? fdopen(wfd, "w") : NULL;
+
+   if (!out) {
+      if (wfd >= 0) close(wfd);
+      open = 0;
+   }
+   while (open) {
+      /* one request, and then those that have already arrived */
+      n = 0;
+      held = 0;
+      do {
+	 if (!conn_line(c, line, sizeof(line)) || !strcmp(line, "QUIT")) {
+	    open = 0;
+	    break;
+	 }
+	 if ((r = read_request(c, line, &jobs[n])) != 0) {
+	    bad = r < 0 ? r : 0;
+	    open = 0;
+	    break;
+	 }
+	 held += jobs[n++].len;
+      } while (n < SERVER_BATCH && held < s->max_request && c->pos < c->len);
+
+      pthread_mutex_lock(&s->lock);
+      for (k=0; k<n; k++) {
+	 if (s->tail) s->tail->next = &jobs[k];
+	 else s->head = &jobs[k];
+	 s->tail = &jobs[k];
+      }
+      if (n) pthread_cond_broadcast(&s->work);
+      for (k=0; k<n; k++)
+	 while (!jobs[k].done) pthread_cond_wait(&s->done, &s->lock);
+      pthread_mutex_unlock(&s->lock);
+
+      for (k=0; k<n; k++) {
+	 fprintf(out, "%s %lu\n", jobs[k].failed ? "FAILED" : "OK", (unsigned long)jobs[k].result_len);
+	 if (jobs[k].result_len > 0) fwrite(jobs[k].result, 1, jobs[k].result_len, out);
+	 free(jobs[k].result);
+	 free(jobs[k].plot);
+      }
+      if (bad == -2)
+	 fprintf(out, "ERROR prefix not allowed: the server needs --plot-dir, and a prefix without \"/\" or \"..\"\n");
+      else if (bad == -3)
+	 fprintf(out, "ERROR request larger than %lu bytes\n", s->max_request);
+      else if (bad)
+	 fprintf(out, "ERROR expected \"PLATE n [prefix]\" or \"QUIT\"\n");
+      if (fflush(out)) open = 0;
+   }
+   if (out) fclose(out);
+   close(c->fd);
+   free(c);
+   return NULL;
+}
+
+/* Open a listening socket on addr: a Unix socket path, or [host:]port */
+int server_socket(const char *addr) {
+   int fd = -1, one = 1;
+
+   if (strchr(addr, '/')) {
+      struct sockaddr_un sa;
+      if (strlen(addr) >= sizeof(sa.sun_path)) {
+	 fprintf(stderr, "Error: socket path %s is too long\n", addr);
+	 return -1;
+      }
+      memset(&sa, 0, sizeof(sa));
+      sa.sun_family = AF_UNIX;
+      strcpy(sa.sun_path, addr);
+      /* a socket left over by an earlier server */
+      unlink(addr);
+      if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	  bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+	 fprintf(stderr, "Error: unable to listen on socket %s: %s\n", addr, strerror(errno));
+	 if (fd >= 0) close(fd);
+	 return -1;
+      }
+   } else {
+      struct addrinfo hints, *res, *ai;
+      char host[256];
+      const char *colon = strrchr(addr, ':');
+      const char *port = colon ? colon+1 : addr;
+      int err;
+
+      if (colon && (size_t)(colon-addr) >= sizeof(host)) {
+	 fprintf(stderr, "Error: host name in %s is too long\n", addr);
+	 return -1;
+      }
+      if (colon) {
+	 memcpy(host, addr, colon-addr);
+	 host[colon-addr] = '\0';
+      }
+      /* without a host, listen on loopback only; "0.0.0.0:port" listens everywhere */
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if ((err = getaddrinfo(colon && *host ? host : "127.0.0.1", port, &hints, &res)) != 0) {
+	 fprintf(stderr, "Error: unable to resolve %s: %s\n", addr, gai_strerror(err));
+	 return -1;
+      }
+      for (ai=res; ai; ai=ai->ai_next) {
+	 if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) continue;
+	 setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	 if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+	 close(fd);
+	 fd = -1;
+      }
+      freeaddrinfo(res);
+      if (fd < 0) {
+	 fprintf(stderr, "Error: unable to listen on %s: %s\n", addr, strerror(errno));
+	 return -1;
+      }
+   }
+   if (listen(fd, SOMAXCONN) < 0) {
+      fprintf(stderr, "Error: unable to listen on %s: %s\n", addr, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/*
+ * Serve plate requests on addr with the options o, until killed,
+ * writing the gnuplot files of requests with a prefix into plot_dir
+ * (if not NULL), and accepting bundles of up to max_request bytes
+ * (SERVER_MAX_REQUEST if 0)
+ */
+int run_server(const char *addr, const char *plot_dir, unsigned long max_request,
+	       const struct moody_options *o) {
+   struct server s;
+   pthread_t tid;
+   pthread_attr_t attr;
+   int num_workers = o->num_workers, fd, k, started = 0, one = 1;
+
+   memset(&s, 0, sizeof(s));
+   s.opts = *o;
+   /* the plates run side by side, so each one runs its Monte Carlo trials alone */
+   s.opts.mc_workers = 1;
+   s.plot_dir = plot_dir;
+   s.max_request = max_request ? max_request : SERVER_MAX_REQUEST;
+   pthread_mutex_init(&s.lock, NULL);
+   pthread_cond_init(&s.work, NULL);
+   pthread_cond_init(&s.done, NULL);
+
+   /* a client that goes away must not take the server with it */
+   signal(SIGPIPE, SIG_IGN);
+   if ((fd = server_socket(addr)) < 0) return EXIT_FAILURE;
+
+   if (num_workers <= 0) num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (num_workers < 1) num_workers = 1;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (k=0; k<num_workers; k++)
+      if (pthread_create(&tid, &attr, server_worker, &s) == 0) started++;
+   if (!started) {
+      fprintf(stderr, "Error: unable to start the worker threads\n");
+      return EXIT_FAILURE;
+   }
+   fprintf(stderr, "Listening on %s with %d workers\n", addr, started);
+
+   for (;;) {
+      struct server_conn *c;
+      int cfd = accept(fd, NULL, NULL);
+      if (cfd < 0) {
+	 if (errno != EINTR)
+	    fprintf(stderr, "Error: unable to accept a connection: %s\n", strerror(errno));
+	 continue;
+      }
+      /* replies are small and should not wait for more */
+      setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (!(c = malloc(sizeof(*c)))) {
+	 close(cfd);
+	 continue;
+      }
+      c->s = &s;
+      c->fd = cfd;
+      c->pos = c->len = 0;
+      if (pthread_create(&tid, &attr, serve_connection, c) != 0) {
+	 close(cfd);
+	 free(c);
+      }
+   }
+   return EXIT_SUCCESS;
+}
+#endif
+
+/*
+ * General grid networks. Instead of Moody's Union Jack, a plate can
+ * be measured along any set of straight lines, for example N lines in
+ * each direction and the diagonals, described by a topology file:
+ *
+ *   # name   x0 y0   x1 y1
+ *   R0        0  0   40  0
+ *   C0        0  0    0 30
+ *   ...
+ *
+ * with, for each line, its name and the positions of its first and
+ * last station in foot spacings, x to the East and y to the North.
+ * The readings of line R0 are read from R0.txt, the units from
+ * Config.txt, and the stations of a line are spread evenly between
+ * its ends. Where two lines cross at a station of each (within
+ * TOPO_SNAP steps), these stations are the same point, a node of the
+ * network. Where they cross between stations, the heights
+ * interpolated on both lines are tied by an observation of the same
+ * weight as a step. Parallel lines do not meet.
+ *
+ * The network is adjusted by least squares as in solve_network():
+ * the stations of each chain between two nodes are eliminated, which
+ * leaves one observation per chain and tie on the heights of the
+ * nodes and the offsets of the lines. These are solved by conjugate
+ * gradients on the sparse normal equations, so each iteration costs
+ * time linear in the number of observations. The reference plane is
+ * the least-squares plane through all stations.
+ */
+
+/* Stations closer than this to a crossing, in steps, are on it */
+#define TOPO_SNAP 0.25
+
+/* Columns of a network line: Moody columns 1 to 4, then these */
+#define TOPO_HEIGHT 4    /* above the reference plane, in arc seconds as column 6 */
+#define TOPO_BASE 5      /* above the lowest point, in the output units of column 8 */
+#define TOPO_RESIDUAL 6  /* adjusted minus measured step, in the units of column 8 */
+#define TOPO_COLUMNS 7
+
+/* One line of a network */
+struct topo_line {
+   char *name;
+   float x0, y0, x1, y1;
+   int num_dat;
+   float *input;
+   int input_size;
+   real *ws[TOPO_COLUMNS];
+   /* node of each station, or -1 inside a chain */
+   int *node;
+};
+
+/* Crossing between stations: station j+f of line[0] is station j+f of line[1] */
+struct topo_tie {
+   int line[2], j[2];
+   double f[2];
+};
+
+/* The sum of coef[k]*x[var[k]] is observed to be rhs, with weight w */
+struct topo_obs {
+   int n;
+   int var[4];
+   double coef[4];
+   double rhs, w;
+};
+
+struct topology {
+   struct moody_plate *p;
+   int num_lines;
+   struct topo_line *line;
+   int num_ties;
+   struct topo_tie *tie;
+   int num_nodes;
+   int num_obs;
+   struct topo_obs *obs;
+   /* all worksheet columns, and all node indices */
+   real *arena;
+   int *nodes;
+   /* conjugate gradient iterations, and results in the units of column 8 */
+   int iterations;
+   float rms_residual, max_residual, flatness;
+};
+
+void free_topology(struct topology *t) {
+   int i;
+   for (i=0; i<t->num_lines; i++) {
+      free(t->line[i].name);
+      free(t->line[i].input);
+   }
+   free(t->line);
+   free(t->tie);
+   free(t->obs);
+   free(t->arena);
+   free(t->nodes);
+   return;
+}
+
+void topo_out_of_memory(struct topology *t) {
+   fprintf(stderr, "Error: out of memory setting up the network\n");
+   fail(t->p);
+}
+
+/* Position of station j of line l, in foot spacings */
+void station_position(const struct topo_line *l, int j, float *x, float *y) {
+   float s = (float)j/l->num_dat;
+   *x = l->x0 + s*(l->x1-l->x0);
+   *y = l->y0 + s*(l->y1-l->y0);
+   return;
+}
+
+/* Read the lines of topology file fname, and their readings */
+void read_topology(struct topology *t, const char *fname) {
+   struct text_file f;
+   const char *line;
+   size_t pos=0;
+   int file_line=0, size=0, i;
+
+   if (load_text_file(fname, &f)) {
+      fprintf(stderr, "Error: unable to find/open topology file %s\n", fname);
+      fail(t->p);
+   }
+   while ((line = next_line(&f, &pos)) != NULL) {
+      const char *head = skip_blanks(line), *name = head, *end;
+      struct topo_line *l;
+      float *ends[4];
+      int len, k, ok=1;
+
+      file_line++;
+      if (*head=='\n' || *head=='#') continue;
+
+      if (t->num_lines == size) {
+	 struct topo_line *tmp;
+	 size = size ? 2*size : 64;
+	 if (!(tmp = realloc(t->line, size*sizeof(struct topo_line)))) {
+	    free(f.buf);
+	    topo_out_of_memory(t);
+	 }
+	 t->line = tmp;
+      }
+      l = &t->line[t->num_lines];
+      memset(l, 0, sizeof(*l));
+
+      for (end=head; !isspace((unsigned char)*end); end++);
+      len = (int)(end-head);
+      ends[0] = &l->x0;
+      ends[1] = &l->y0;
+      ends[2] = &l->x1;
+      ends[3] = &l->y1;
+      for (head=end, k=0; k<4 && ok; k++) {
+	 head = skip_blanks(head);
+	 ok = scan_float(&head, ends[k]);
+      }
+      if (!ok || *skip_blanks(head)!='\n') {
+	 fprintf(stderr,
+		 "Error: unable to parse line %d of topology file %s.\n"
+		 "Expected is a line name and the positions x0 y0 x1 y1 of its ends.\n"
+		 "Line %d reads:\n%.*s\n\n",
+		 file_line, fname, file_line, line_length(line), line);
+	 free(f.buf);
+	 fail(t->p);
+      }
+      if (!(l->name = malloc(len+1))) {
+	 free(f.buf);
+	 topo_out_of_memory(t);
+      }
+      memcpy(l->name, name, len);
+      l->name[len] = '\0';
+      t->num_lines++;
+   }
+   free(f.buf);
+   if (t->num_lines < 2) {
+      fprintf(stderr, "Error: topology file %s must describe at least two lines\n", fname);
+      fail(t->p);
+   }
+
+   read_config_file(t->p);
+   for (i=0; i<t->num_lines; i++) {
+      struct topo_line *l = &t->line[i];
+      char name[MAX_PATHLEN], path[MAX_PATHLEN];
+      if (snprintf(name, sizeof(name), "%s.txt", l->name) >= (int)sizeof(name)) {
+	 fprintf(stderr, "Error: line name %s is too long\n", l->name);
+	 fail(t->p);
+      }
+      l->num_dat = read_angles(t->p, plate_path(t->p, path, name), &l->input, &l->input_size,
+			       NULL, NULL, NULL, NULL);
+   }
+   report(t->p, "\n");
+   return;
+}
+
+/* Union-find over the stations of the network */
+int topo_find(int *parent, int k) {
+   while (parent[k] != k) k = parent[k] = parent[parent[k]];
+   return k;
+}
+
+/*
+ * Where line i crosses line k, at station ti of line i and sk of
+ * line k, or between them: merge the stations, or add a tie
+ */
+void add_crossing(struct topology *t, int i, int k, double ti, double sk,
+		  const int *first, int *parent, char *junction, int *tie_size) {
+   int li[2], j[2], m;
+   double pos[2], f[2];
+
+   li[0] = i;
+   li[1] = k;
+   pos[0] = ti;
+   pos[1] = sk;
+   for (m=0; m<2; m++) {
+      int n = t->line[li[m]].num_dat;
+      j[m] = (int)floor(pos[m]+0.5);
+      if (fabs(pos[m]-j[m]) <= TOPO_SNAP)
+	 f[m] = 0.0;
+      else {
+	 j[m] = (int)floor(pos[m]);
+	 f[m] = pos[m]-j[m];
+      }
+      if (j[m] < 0) j[m] = 0;
+      if (j[m] > n) j[m] = n;
+      if (j[m] == n && f[m] > 0) f[m] = 0;
+      junction[first[li[m]]+j[m]] = 1;
+      if (f[m] > 0) junction[first[li[m]]+j[m]+1] = 1;
+   }
+
+   if (f[0] == 0 && f[1] == 0) {
+      int a = topo_find(parent, first[i]+j[0]);
+      int b = topo_find(parent, first[k]+j[1]);
+      parent[a] = b;
+      return;
+   }
+
+   if (t->num_ties == *tie_size) {
+      struct topo_tie *tmp;
+      *tie_size = *tie_size ? 2 * *tie_size : 64;
+      if (!(tmp = realloc(t->tie, *tie_size*sizeof(struct topo_tie)))) topo_out_of_memory(t);
+      t->tie = tmp;
+   }
+   for (m=0; m<2; m++) {
+      t->tie[t->num_ties].line[m] = li[m];
+      t->tie[t->num_ties].j[m] = j[m];
+      t->tie[t->num_ties].f[m] = f[m];
+   }
+   t->num_ties++;
+   return;
+}
+
+/*
+ * Allocate the worksheets of the network and integrate the readings,
+ * then find where the lines meet and number the nodes
+ */
+void build_topology(struct topology *t) {
+   int num_stations=0, tie_size=0, i, k, j, m;
+   int *first, *parent, *line_set, *refs, *node_line;
+   char *junction;
+   real *col;
+
+   for (i=0; i<t->num_lines; i++) num_stations += t->line[i].num_dat+1;
+   free(t->arena);
+   free(t->nodes);
+   t->arena = calloc((size_t)num_stations*TOPO_COLUMNS, sizeof(real));
+   t->nodes = malloc(num_stations*sizeof(int));
+   first = malloc(t->num_lines*sizeof(int));
+   parent = malloc(num_stations*sizeof(int));
+   junction = calloc(num_stations, 1);
+   if (!t->arena || !t->nodes || !first || !parent || !junction) topo_out_of_memory(t);
+
+   col = t->arena;
+   for (k=0, i=0; i<t->num_lines; i++) {
+      struct topo_line *l = &t->line[i];
+      int c;
+      for (c=0; c<TOPO_COLUMNS; c++) {
+	 l->ws[c] = col;
+	 col += l->num_dat+1;
+      }
+      for (j=0; j<l->num_dat; j++) l->ws[1][j+1] = l->input[j];
+      integrate_line(l->ws, NULL, l->num_dat);
+      l->node = t->nodes + k;
+      first[i] = k;
+      /* the ends of a line always end a chain */
+      junction[k] = junction[k+l->num_dat] = 1;
+      k += l->num_dat+1;
+   }
+   for (k=0; k<num_stations; k++) parent[k] = k;
+
+   /* every pair of lines that are not parallel may cross */
+   for (i=0; i<t->num_lines; i++)
+      for (k=i+1; k<t->num_lines; k++) {
+	 const struct topo_line *a = &t->line[i], *b = &t->line[k];
+	 double ax = a->x1-a->x0, ay = a->y1-a->y0;
+	 double bx = b->x1-b->x0, by = b->y1-b->y0;
+	 double dx = b->x0-a->x0, dy = b->y0-a->y0;
+	 double det = ax*by - ay*bx;
+	 double s, u;
+	 if (fabs(det) <= 1e-9*sqrt((ax*ax+ay*ay)*(bx*bx+by*by))) continue;
+	 s = (dx*by - dy*bx)/det;
+	 u = (dx*ay - dy*ax)/det;
+	 if (s < -1e-6 || s > 1+1e-6 || u < -1e-6 || u > 1+1e-6) continue;
+	 add_crossing(t, i, k, s*a->num_dat, u*b->num_dat, first, parent, junction, &tie_size);
+      }
+
+   /* number the nodes */
+   t->num_nodes = 0;
+   for (k=0; k<num_stations; k++) t->nodes[k] = -1;
+   for (k=0; k<num_stations; k++)
+      if (junction[k]) {
+	 int r = topo_find(parent, k);
+	 if (t->nodes[r] < 0) t->nodes[r] = t->num_nodes++;
+	 t->nodes[k] = t->nodes[r];
+      }
+
+   /*
+    * Every line must meet the others at least twice, or it could
+    * turn freely, and all lines must be connected. Count the lines
+    * at each node, and join the lines that meet there or at a tie.
+    */
+   refs = calloc(t->num_nodes, sizeof(int));
+   node_line = malloc(t->num_nodes*sizeof(int));
+   line_set = malloc(t->num_lines*sizeof(int));
+   if (!refs || !node_line || !line_set) topo_out_of_memory(t);
+   for (i=0; i<t->num_lines; i++) line_set[i] = i;
+   for (k=0; k<t->num_nodes; k++) node_line[k] = -1;
+   for (i=0; i<t->num_lines; i++)
+      for (j=0; j<=t->line[i].num_dat; j++) {
+	 int nd = t->line[i].node[j];
+	 if (nd < 0) continue;
+	 refs[nd]++;
+	 if (node_line[nd] < 0)
+	    node_line[nd] = i;
+	 else
+	    line_set[topo_find(line_set, i)] = topo_find(line_set, node_line[nd]);
+      }
+   for (m=0; m<t->num_ties; m++) {
+      const struct topo_tie *tie = &t->tie[m];
+      int c;
+      for (c=0; c<2; c++) {
+	 const struct topo_line *l = &t->line[tie->line[c]];
+	 refs[l->node[tie->j[c]]]++;
+	 if (tie->f[c] > 0) refs[l->node[tie->j[c]+1]]++;
+      }
+      line_set[topo_find(line_set, tie->line[0])] = topo_find(line_set, tie->line[1]);
+   }
+   for (i=0; i<t->num_lines; i++) {
+      const struct topo_line *l = &t->line[i];
+      int shared = 0;
+      for (j=0; j<=l->num_dat; j++)
+	 if (l->node[j] >= 0 && refs[l->node[j]] > 1) shared++;
+      if (shared < 2) {
+	 fprintf(stderr, "Error: line %s meets the other lines in fewer than two points\n",
+		 l->name);
+	 fail(t->p);
+      }
+      if (topo_find(line_set, i) != topo_find(line_set, 0)) {
+	 fprintf(stderr, "Error: line %s is not connected to line %s\n",
+		 l->name, t->line[0].name);
+	 fail(t->p);
+      }
+   }
+   free(refs);
+   free(node_line);
+   free(line_set);
+   free(junction);
+   free(parent);
+   free(first);
+
+   report(t->p, "Network of %d lines, %d stations, %d nodes and %d ties between stations.\n",
+	  t->num_lines, num_stations, t->num_nodes, t->num_ties);
+   return;
+}
+
+/* Sum of Moody column 3 over the steps s+1 to e of network line l */
+double topo_steps(const struct topo_line *l, int s, int e) {
+   double sum = 0.0;
+   int j;
+   for (j=s+1; j<=e; j++) sum += l->ws[2][j];
+   return sum;
+}
+
+/*
+ * Observations on the unknowns: the node heights, then the offset of
+ * each line. A chain from node s to node e of line i over k steps
+ * gives x[e] - x[s] - k*offset = the sum of its steps, of weight 1/k.
+ */
+void topology_observations(struct topology *t) {
+   int i, j, s, m, n=t->num_ties;
+   struct topo_obs *o;
+
+   for (i=0; i<t->num_lines; i++)
+      for (j=1; j<=t->line[i].num_dat; j++)
+	 if (t->line[i].node[j] >= 0) n++;
+   free(t->obs);
+   if (!(t->obs = malloc(n*sizeof(struct topo_obs)))) topo_out_of_memory(t);
+
+   o = t->obs;
+   for (i=0; i<t->num_lines; i++) {
+      const struct topo_line *l = &t->line[i];
+      for (s=0, j=1; j<=l->num_dat; j++)
+	 if (l->node[j] >= 0) {
+	    o->n = 3;
+	    o->var[0] = l->node[j];
+	    o->coef[0] = 1.0;
+	    o->var[1] = l->node[s];
+	    o->coef[1] = -1.0;
+	    o->var[2] = t->num_nodes+i;
+	    o->coef[2] = -(j-s);
+	    o->rhs = topo_steps(l, s, j);
+	    o->w = 1.0/(j-s);
+	    o++;
+	    s = j;
+	 }
+   }
+   for (m=0; m<t->num_ties; m++, o++) {
+      const struct topo_tie *tie = &t->tie[m];
+      int c;
+      o->n = 0;
+      for (c=0; c<2; c++) {
+	 const struct topo_line *l = &t->line[tie->line[c]];
+	 double sign = c ? -1.0 : 1.0;
+	 o->var[o->n] = l->node[tie->j[c]];
+	 o->coef[o->n++] = sign*(1-tie->f[c]);
+	 if (tie->f[c] > 0) {
+	    o->var[o->n] = l->node[tie->j[c]+1];
+	    o->coef[o->n++] = sign*tie->f[c];
+	 }
+      }
+      o->rhs = 0.0;
+      o->w = 1.0;
+   }
+   t->num_obs = n;
+   return;
+}
+
+/* y = (A^T W A) x for the observations of the network */
+void topo_normal_product(const struct topology *t, const double *x, double *y, int n) {
+   int m, k;
+   memset(y, 0, n*sizeof(double));
+   for (m=0; m<t->num_obs; m++) {
+      const struct topo_obs *o = &t->obs[m];
+      double v = 0.0;
+      for (k=0; k<o->n; k++) v += o->coef[k]*x[o->var[k]];
+      v *= o->w;
+      for (k=0; k<o->n; k++) y[o->var[k]] += o->coef[k]*v;
+   }
+   return;
+}
+
+/*
+ * Solve the normal equations by conjugate gradients, preconditioned
+ * by their diagonal. The heights of the nodes are only known up to a
+ * plane, but the equations are consistent, so starting from zero the
+ * iteration converges to one of the solutions.
+ */
+void topo_solve(struct topology *t, double *x, int n) {
+   double *b, *r, *z, *d, *q, *diag;
+   double rz, bnorm = 0.0, rnorm;
+   int m, k;
+
+   b = calloc((size_t)6*n, sizeof(double));
+   if (!b) topo_out_of_memory(t);
+   r = b+n;
+   z = r+n;
+   d = z+n;
+   q = d+n;
+   diag = q+n;
+
+   for (m=0; m<t->num_obs; m++) {
+      const struct topo_obs *o = &t->obs[m];
+      for (k=0; k<o->n; k++) {
+	 b[o->var[k]] += o->w*o->coef[k]*o->rhs;
+	 diag[o->var[k]] += o->w*o->coef[k]*o->coef[k];
+      }
+   }
+   for (k=0; k<n; k++) {
+      x[k] = 0.0;
+      r[k] = b[k];
+      z[k] = d[k] = r[k]/diag[k];
+      bnorm += b[k]*b[k];
+   }
+   for (rz=0.0, k=0; k<n; k++) rz += r[k]*z[k];
+
+   for (t->iterations=0; t->iterations < 10*n+100; t->iterations++) {
+      double dq = 0.0, alpha, rz_new = 0.0;
+      for (rnorm=0.0, k=0; k<n; k++) rnorm += r[k]*r[k];
+      if (rnorm <= 1e-24*bnorm || rz <= 0.0) break;
+      topo_normal_product(t, d, q, n);
+      for (k=0; k<n; k++) dq += d[k]*q[k];
+      if (dq <= 0.0) break;
+      alpha = rz/dq;
+      for (k=0; k<n; k++) {
+	 x[k] += alpha*d[k];
+	 r[k] -= alpha*q[k];
+	 z[k] = r[k]/diag[k];
+	 rz_new += r[k]*z[k];
+      }
+      for (k=0; k<n; k++) d[k] = z[k] + (rz_new/rz)*d[k];
+      rz = rz_new;
+   }
+   free(b);
+   return;
+}
+
+/* Solve the 3 by 3 system a x = rhs by Cramer's rule */
+void solve3(double a[3][3], const double *rhs, double *x) {
+   double det = a[0][0]*(a[1][1]*a[2][2]-a[1][2]*a[2][1])
+      - a[0][1]*(a[1][0]*a[2][2]-a[1][2]*a[2][0])
+      + a[0][2]*(a[1][0]*a[2][1]-a[1][1]*a[2][0]);
+   int r, c;
+   for (c=0; c<3; c++) {
+      double m[3][3];
+      memcpy(m, a, sizeof(m));
+      for (r=0; r<3; r++) m[r][c] = rhs[r];
+      x[c] = (m[0][0]*(m[1][1]*m[2][2]-m[1][2]*m[2][1])
+	      - m[0][1]*(m[1][0]*m[2][2]-m[1][2]*m[2][0])
+	      + m[0][2]*(m[1][0]*m[2][1]-m[1][1]*m[2][0]))/det;
+   }
+   return;
+}
+
+/*
+ * Adjust the network: solve for the node heights and line offsets,
+ * fill in the stations of every chain and their residuals, and refer
+ * the heights to the least-squares plane through all stations
+ */
+void adjust_topology(struct topology *t) {
+   struct moody_plate *p = t->p;
+   double scale = arcsec*p->out_spacing, sum2 = 0.0;
+   double a[3][3], rhs[3], plane[3];
+   int n = t->num_nodes+t->num_lines, steps = 0, i, j, s, r, c;
+   real lowest = 0.0, highest = 0.0;
+   double *x = malloc(n*sizeof(double));
+
+   if (!x) topo_out_of_memory(t);
+   topology_observations(t);
+   topo_solve(t, x, n);
+
+   t->max_residual = 0.0;
+   memset(a, 0, sizeof(a));
+   memset(rhs, 0, sizeof(rhs));
+   for (i=0; i<t->num_lines; i++) {
+      struct topo_line *l = &t->line[i];
+      double off = x[t->num_nodes+i];
+      l->ws[TOPO_HEIGHT][0] = x[l->node[0]];
+      for (s=0, j=1; j<=l->num_dat; j++)
+	 if (l->node[j] >= 0) {
+	    double xs = x[l->node[s]], xe = x[l->node[j]];
+	    double v = (xe-xs-(j-s)*off-topo_steps(l, s, j))/(j-s);
+	    double h = xs;
+	    int m;
+	    for (m=s+1; m<=j; m++) {
+	       h += off+l->ws[2][m]+v;
+	       l->ws[TOPO_HEIGHT][m] = m<j ? h : xe;
+	       l->ws[TOPO_RESIDUAL][m] = v*scale;
+	    }
+	    if (fabs(v*scale) > t->max_residual) t->max_residual = fabs(v*scale);
+	    sum2 += (j-s)*v*v;
+	    steps += j-s;
+	    s = j;
+	 }
+
+      /* normal equations of the plane h = plane[0] + plane[1]*x + plane[2]*y */
+      for (j=0; j<=l->num_dat; j++) {
+	 float px, py;
+	 double basis[3];
+	 station_position(l, j, &px, &py);
+	 basis[0] = 1.0;
+	 basis[1] = px;
+	 basis[2] = py;
+	 for (r=0; r<3; r++) {
+	    for (c=0; c<3; c++) a[r][c] += basis[r]*basis[c];
+	    rhs[r] += basis[r]*l->ws[TOPO_HEIGHT][j];
+	 }
+      }
+   }
+   free(x);
+   t->rms_residual = sqrt(sum2/steps)*scale;
+
+   solve3(a, rhs, plane);
+
+   for (i=0; i<t->num_lines; i++) {
+      struct topo_line *l = &t->line[i];
+      for (j=0; j<=l->num_dat; j++) {
+	 float px, py, h;
+	 station_position(l, j, &px, &py);
+	 h = l->ws[TOPO_HEIGHT][j] -= plane[0] + plane[1]*px + plane[2]*py;
+	 if ((i==0 && j==0) || h < lowest) lowest = h;
+	 if ((i==0 && j==0) || h > highest) highest = h;
+      }
+   }
+   for (i=0; i<t->num_lines; i++) {
+      struct topo_line *l = &t->line[i];
+      for (j=0; j<=l->num_dat; j++)
+	 l->ws[TOPO_BASE][j] = (l->ws[TOPO_HEIGHT][j]-lowest)*scale;
+   }
+   t->flatness = (highest-lowest)*scale;
+
+   report(p, "Least-squares adjustment of the network, %d iterations: residuals of\n"
+	  "the steps between stations %4.2f %s RMS, %4.2f %s at most.\n",
+	  t->iterations,
+	  (p->metric ? 1.0 : 10.0)*t->rms_residual, p->metric ? "microns" : "micro-inches",
+	  (p->metric ? 1.0 : 10.0)*t->max_residual, p->metric ? "microns" : "micro-inches");
+   report(p, "The highest point is %.2f %s above the lowest one.\n",
+	  (p->metric ? 1.0 : 10.0)*t->flatness, p->metric ? "microns" : "micro-inches");
+   return;
+}
+
+/* printing assumes fixed character width and avoids tabs */
+void print_topology_table(struct topology *t, int which_line) {
+   const struct topo_line *l = &t->line[which_line];
+   int j;
+
+   report(t->p, "\nTABLE %s from (%.1f, %.1f) to (%.1f, %.1f)\n",
+	  l->name, l->x0, l->y0, l->x1, l->y1);
+   report(t->p,
+	  "   1       2       3       4       5       6       7       8       9   \n"
+	  "-----------------------------------------------------------------------\n"
+	  "Station  Auto-   Angle  Sum of     x       y     Delta   Delta   Resid-\n"
+	  " Num-    Corr    Displ   Displ                   Plane    Base     ual \n"
+	  " ber    ArcSec  ArcSec  ArcSec                  ArcSec %s\n"
+	  "-----------------------------------------------------------------------\n",
+	  t->p->metric ? "  micron  micron" : " 10^-5in 10^-5in");
+   for (j=0; j<=l->num_dat; j++) {
+      float px, py;
+      station_position(l, j, &px, &py);
+      report(t->p, "%6d%8.1f%8.1f%8.1f%8.1f%8.1f%8.1f%8.1f%8.2f\n",
+	     (int)l->ws[0][j], l->ws[1][j], l->ws[2][j], l->ws[3][j], px, py,
+	     l->ws[TOPO_HEIGHT][j], l->ws[TOPO_BASE][j], l->ws[TOPO_RESIDUAL][j]);
+   }
+   return;
+}
+
+/* Names of the columns of a network line in machine-readable output */
+const char *topo_column_names[TOPO_COLUMNS]={
+   "station", "auto_corr", "angle_displ", "sum_displ",
+   "delta_plane_arcsec", "delta_base_height", "residual"
+};
+
+void write_topology_csv(struct topology *t) {
+   FILE *fp = t->p->out;
+   char num[32];
+   int i, j, c;
+
+   fprintf(fp, "line,x,y");
+   for (c=0; c<TOPO_COLUMNS; c++) fprintf(fp, ",%s", topo_column_names[c]);
+   fprintf(fp, "\n");
+   for (i=0; i<t->num_lines; i++) {
+      const struct topo_line *l = &t->line[i];
+      for (j=0; j<=l->num_dat; j++) {
+	 float px, py;
+	 station_position(l, j, &px, &py);
+	 fprintf(fp, "%s,%s", l->name, format_exact(num, px));
+	 fprintf(fp, ",%s,%d", format_exact(num, py), (int)l->ws[0][j]);
+	 for (c=1; c<TOPO_COLUMNS; c++) fprintf(fp, ",%s", format_real(num, l->ws[c][j]));
+	 fprintf(fp, "\n");
+      }
+   }
+   fprintf(fp, "\nquantity,value\n");
+   fprintf(fp, "units,%s\n", t->p->metric ? "mm" : "inch");
+   fprintf(fp, "foot_spacing,%s\n", format_exact(num, t->p->foot_spacing));
+   fprintf(fp, "height_unit,%s\n", t->p->metric ? "micron" : "1e-5 inch");
+   fprintf(fp, "flatness,%s\n", format_exact(num, t->flatness));
+   fprintf(fp, "rms_residual,%s\n", format_exact(num, t->rms_residual));
+   fprintf(fp, "max_residual,%s\n", format_exact(num, t->max_residual));
+   return;
+}
+
+void write_topology_json(struct topology *t) {
+   FILE *fp = t->p->out;
+   char num[32];
+   int i, j, c;
+
+   fprintf(fp, "{\n  \"units\": \"%s\",\n  \"foot_spacing\": %s,\n"
+	   "  \"height_unit\": \"%s\",\n  \"lines\": [\n",
+	   t->p->metric ? "mm" : "inch", format_exact(num, t->p->foot_spacing),
+	   t->p->metric ? "micron" : "1e-5 inch");
+   for (i=0; i<t->num_lines; i++) {
+      const struct topo_line *l = &t->line[i];
+      fprintf(fp, "    {\"name\": \"%s\", \"stations\": %d, ", l->name, l->num_dat);
+      fprintf(fp, "\"from\": [%s, ", format_exact(num, l->x0));
+      fprintf(fp, "%s], ", format_exact(num, l->y0));
+      fprintf(fp, "\"to\": [%s, ", format_exact(num, l->x1));
+      fprintf(fp, "%s]", format_exact(num, l->y1));
+      for (c=0; c<TOPO_COLUMNS; c++) {
+	 fprintf(fp, ",\n      \"%s\": [", topo_column_names[c]);
+	 for (j=0; j<=l->num_dat; j++)
+	    fprintf(fp, "%s%s", j ? "," : "", format_real(num, l->ws[c][j]));
+	 fprintf(fp, "]");
+      }
+      fprintf(fp, "}%s\n", i<t->num_lines-1 ? "," : "");
+   }
+   fprintf(fp, "  ],\n  \"summary\": {\n");
+   fprintf(fp, "    \"flatness\": %s,\n", format_exact(num, t->flatness));
+   fprintf(fp, "    \"rms_residual\": %s,\n", format_exact(num, t->rms_residual));
+   fprintf(fp, "    \"max_residual\": %s,\n", format_exact(num, t->max_residual));
+   fprintf(fp, "    \"nodes\": %d,\n    \"ties\": %d,\n    \"iterations\": %d\n  }\n}\n",
+	   t->num_nodes, t->num_ties, t->iterations);
+   return;
+}
+
+/*
+ * Packed binary record, little-endian like write_binary():
+ *   bytes  0-7   magic "MOODYNET"
+ *   bytes  8-11  format version, 1
+ *   bytes 12-15  units, 1 for metric, 0 for imperial
+ *   bytes 16-19  foot spacing, float
+ *   bytes 20-23  number of lines
+ *   bytes 24-35  flatness, RMS and largest residual, floats
+ * followed, for each line, by its number of stations, the positions
+ * x0, y0, x1, y1 of its ends as floats, and its TOPO_COLUMNS columns of
+ * num_dat+1 floats each.
+ */
+void write_topology_binary(struct topology *t) {
+   unsigned char b[36];
+   int i, j, c;
+
+   memset(b, 0, sizeof(b));
+   memcpy(b, "MOODYNET", 8);
+   put_le32(b+8, 1);
+   put_le32(b+12, t->p->metric);
+   put_le_float(b+16, t->p->foot_spacing);
+   put_le32(b+20, t->num_lines);
+   put_le_float(b+24, t->flatness);
+   put_le_float(b+28, t->rms_residual);
+   put_le_float(b+32, t->max_residual);
+   fwrite(b, 1, sizeof(b), t->p->out);
+   for (i=0; i<t->num_lines; i++) {
+      const struct topo_line *l = &t->line[i];
+      put_le32(b, l->num_dat);
+      put_le_float(b+4, l->x0);
+      put_le_float(b+8, l->y0);
+      put_le_float(b+12, l->x1);
+      put_le_float(b+16, l->y1);
+      fwrite(b, 1, 20, t->p->out);
+      for (c=0; c<TOPO_COLUMNS; c++)
+	 for (j=0; j<=l->num_dat; j++) {
+	    put_le_float(b, l->ws[c][j]);
+	    fwrite(b, 1, 4, t->p->out);
+	 }
+   }
+   return;
+}
+
+/* A surface plot of the network lines, as output_gnuplot() does for the Union Jack */
+void output_topology_gnuplot(struct topology *t) {
+   struct moody_plate *p = t->p;
+   const char *prefix = p->prefix ? p->prefix : "";
+   char path[MAX_PATHLEN];
+   const char *fname;
+   FILE *fp;
+   int i, j;
+
+   fname=plate_path(p, path, "gnuplot.cmd");
+   if (!(fp=fopen(fname, "w"))) {
+      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+      fail(p);
+   }
+   fprintf(fp,
+	   "# The following command file can be used with gnuplot to produce\n"
+	   "# a 3-dimensional plot of the surface plate. The associated data\n"
+	   "# file is called \"%sgnuplot.dat\" and can be found in this directory.\n"
+	   "#\n"
+	   "# On typical Unix/Linux/Mac systems, invoke gnuplot with:\n"
+	   "# gnuplot -c %sgnuplot.cmd\n"
+	   "\n"
+	   "set term X11 enhanced\n"
+	   "set xyplane at 0\n"
+	   "set zrange [0:%d]\n"
+	   "set zlabel \"%s\"\n"
+	   "set key off\n"
+	   "splot \"%sgnuplot.dat\" using 1:2:3 with lines\n"
+	   "pause -1\n",
+	   prefix, prefix, (int)(1.0+t->flatness),
+	   p->metric ? "height\\nin\\nmicrons" : "height\\nin\\ntens of\\nmicroinch",
+	   prefix);
+   fclose(fp);
+
+   fname=plate_path(p, path, "gnuplot.dat");
+   if (!(fp=fopen(fname, "w"))) {
+      fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+      fail(p);
+   }
+   fprintf(fp,
+	   "# This is a data file for use with gnuplot.\n"
+	   "# The corresponding command file in this directory\n"
+	   "# is called \"%sgnuplot.cmd\". Together these can be\n"
+	   "# used to generate a 3-d plot of the surface plate height.\n"
+	   "\n\n",
+	   prefix);
+   for (i=0; i<t->num_lines; i++) {
+      const struct topo_line *l = &t->line[i];
+      fprintf(fp, "# %s\n", l->name);
+      for (j=0; j<=l->num_dat; j++) {
+	 float px, py;
+	 station_position(l, j, &px, &py);
+	 fprintf(fp, "%f %f %f\n", px, py, l->ws[TOPO_BASE][j]);
+      }
+      fprintf(fp, "\n\n");
+   }
+   fclose(fp);
+   return;
+}
+
+/* Adjust the network described by topology file fname, in the current directory */
+int run_network(const char *fname, const struct moody_options *o) {
+   struct topology t;
+   int i;
+
+   memset(&t, 0, sizeof(t));
+   if (!(t.p = new_plate(NULL, NULL))) {
+      fprintf(stderr, "Error: out of memory\n");
+      return EXIT_FAILURE;
+   }
+   set_output(t.p, o, stdout);
+
+   read_topology(&t, fname);
+   build_topology(&t);
+   adjust_topology(&t);
+
+   if (t.p->report)
+      for (i=0; i<t.num_lines; i++) print_topology_table(&t, i);
+   if (t.p->out) {
+      switch (t.p->format) {
+      case OUTPUT_CSV: write_topology_csv(&t); break;
+      case OUTPUT_JSON: write_topology_json(&t); break;
+      case OUTPUT_BINARY: write_topology_binary(&t); break;
+      default:
+	 fprintf(t.p->out, "flatness %.2f %s, residuals %.2f %s RMS\n",
+		 (t.p->metric ? 1.0 : 10.0)*t.flatness,
+		 t.p->metric ? "microns" : "micro-inches",
+		 (t.p->metric ? 1.0 : 10.0)*t.rms_residual,
+		 t.p->metric ? "microns" : "micro-inches");
+	 break;
+      }
+   }
+   output_topology_gnuplot(&t);
+
+   free_topology(&t);
+   free_plate(t.p);
+   return 0;
+}
+
+/*
+ * Synthetic plates, with a known surface, for testing and for the
+ * benchmark. The plate is 4 by 3 units with diagonals of 5, measured
+ * in 4k steps along its East-West lines, 3k along its North-South
+ * lines and 5k along its diagonals, so that every line is a whole
+ * number of steps of the foot spacing. Its surface, in microns, is
+ *   bow*(1-r^2) + twist*(2u-1)*(2v-1) + lapping ripples
+ * with u from West (0) to East (1), v from South (0) to North (1), and
+ * r the distance from the center relative to that of the corners. The
+ * ripples are SYNTH_RIPPLES random plane waves whose RMS is lapping.
+ * Each reading is the slope of the surface over its step, in arc
+ * seconds, plus an alignment offset for each line and Gaussian noise.
+ */
+#define SYNTH_RIPPLES 16
+#define SYNTH_FOOT 50.0  /* foot spacing, mm */
+#define SYNTH_TWO_PI 6.283185307179586
+
+struct synth {
+   /* steps along the East-West lines, rounded to a multiple of 4 */
+   int stations;
+   /* surface in microns, and noise of the readings in arc seconds */
+   double bow, twist, lapping, sigma;
+   unsigned long long seed;
+   /* wave numbers and phases of the ripples, see synth_init() */
+   double ku[SYNTH_RIPPLES], kv[SYNTH_RIPPLES], phase[SYNTH_RIPPLES];
+};
+
+/* Ends (u0, v0) and (u1, v1) of the eight lines, in the order of filenames[] */
+const float synth_ends[8][4]={
+   {0.0, 1.0, 1.0, 0.0}, {1.0, 1.0, 0.0, 0.0},
+   {1.0, 1.0, 0.0, 1.0}, {1.0, 1.0, 1.0, 0.0},
+   {1.0, 0.0, 0.0, 0.0}, {0.0, 1.0, 0.0, 0.0},
+   {1.0, 0.5, 0.0, 0.5}, {0.5, 1.0, 0.5, 0.0}
+};
+
+/* Draw the ripples of surface s from its seed */
+void synth_init(struct synth *s) {
+   struct rng r;
+   int k;
+   rng_seed(&r, s->seed, 0);
+   for (k=0; k<SYNTH_RIPPLES; k++) {
+      s->ku[k] = SYNTH_TWO_PI*(12.0*rng_uniform(&r)-6.0);
+      s->kv[k] = SYNTH_TWO_PI*(12.0*rng_uniform(&r)-6.0);
+      s->phase[k] = SYNTH_TWO_PI*rng_uniform(&r);
+   }
+   return;
+}
+
+/* Height of surface s at (u,v), in microns */
+double synth_height(const struct synth *s, double u, double v) {
+   double x = 4.0*u-2.0, y = 3.0*v-1.5;
+   double h = s->bow*(1.0-(x*x+y*y)/6.25) + s->twist*(2.0*u-1.0)*(2.0*v-1.0);
+   double ripples = 0.0;
+   int k;
+   if (s->lapping != 0.0) {
+      for (k=0; k<SYNTH_RIPPLES; k++) ripples += cos(s->ku[k]*u + s->kv[k]*v + s->phase[k]);
+      h += s->lapping*sqrt(2.0/SYNTH_RIPPLES)*ripples;
+   }
+   return h;
+}
+
+/* Number of steps of line which_sheet */
+int synth_steps(const struct synth *s, int which_sheet) {
+   int k = s->stations/4 > 1 ? s->stations/4 : 1;
+   if (which_sheet < 2) return 5*k;
+   return which_sheet%2 == 0 ? 4*k : 3*k;
+}
+
+/* Position (u,v) of station j of line which_sheet, with n steps */
+void synth_position(int which_sheet, int j, int n, double *u, double *v) {
+   const float *e = synth_ends[which_sheet];
+   *u = e[0] + (e[2]-e[0])*(double)j/n;
+   *v = e[1] + (e[3]-e[1])*(double)j/n;
+   return;
+}
+
+/* Fill in the units and the readings of plate p, measuring surface s */
+void synth_plate(struct moody_plate *p, const struct synth *s) {
+   struct rng r;
+   double scale, u, v, h, prev;
+   int i, j, n;
+
+   p->metric = 1;
+   p->foot_spacing = SYNTH_FOOT;
+   p->out_spacing = SYNTH_FOOT*1000.0;
+   scale = arcsec*p->out_spacing;
+   rng_seed(&r, s->seed, 1);
+   for (i=0; i<8; i++) {
+      n = synth_steps(s, i);
+      if (reserve_input(p, i, n)) {
+	 fprintf(stderr, "Error: out of memory for a synthetic plate\n");
+	 fail(p);
+      }
+      synth_position(i, 0, n, &u, &v);
+      prev = synth_height(s, u, v);
+      for (j=1; j<=n; j++) {
+	 synth_position(i, j, n, &u, &v);
+	 h = synth_height(s, u, v);
+	 p->input[i][j-1] = 10.0 + 2*i + (h-prev)/scale + s->sigma*rng_gauss(&r);
+	 prev = h;
+      }
+      p->num_dat[i] = n;
+   }
+   return;
+}
+
+/*
+ * Error of column 8 of plate p against the surface s it measured: the
+ * RMS and the largest difference at the stations, once the plane that
+ * fits the differences best is taken off, because the heights are only
+ * defined up to a plane
+ */
+void synth_error(struct moody_plate *p, const struct synth *s, double *rms, double *largest) {
+   double a[3][3], rhs[3], plane[3], u, v, d, sum2 = 0.0;
+   int i, j, r, c, n = 0;
+
+   memset(a, 0, sizeof(a));
+   memset(rhs, 0, sizeof(rhs));
+   for (i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++) {
+	 double basis[3];
+	 synth_position(i, j, p->num_dat[i], &u, &v);
+	 d = p->ws[i][7][j] - synth_height(s, u, v);
+	 basis[0] = 1.0;
+	 basis[1] = u;
+	 basis[2] = v;
+	 for (r=0; r<3; r++) {
+	    for (c=0; c<3; c++) a[r][c] += basis[r]*basis[c];
+	    rhs[r] += basis[r]*d;
+	 }
+      }
+   solve3(a, rhs, plane);
+
+   *largest = 0.0;
+   for (i=0; i<8; i++)
+      for (j=0; j<=p->num_dat[i]; j++, n++) {
+	 synth_position(i, j, p->num_dat[i], &u, &v);
+	 d = p->ws[i][7][j] - synth_height(s, u, v) - (plane[0] + plane[1]*u + plane[2]*v);
+	 sum2 += d*d;
+	 if (fabs(d) > *largest) *largest = fabs(d);
+      }
+   *rms = sqrt(sum2/n);
+   return;
+}
+
+/* Write the input of plate p as Config.txt and the eight data files, in its directory */
+void write_plate_files(struct moody_plate *p) {
+   char path[MAX_PATHLEN], num[32];
+   const char *fname;
+   FILE *fp;
+   int i, j;
+
+   for (i=-1; i<8; i++) {
+      fname = plate_path(p, path, i<0 ? "Config.txt" : filenames[i]);
+      if (!(fp=fopen(fname, "w"))) {
+	 fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+	 fail(p);
+      }
+      if (i<0)
+	 fprintf(fp, "# Synthetic plate, see moody -G\n%c %s\n",
+		 p->metric ? 'M' : 'I', format_exact(num, p->foot_spacing));
+      else
+	 for (j=0; j<p->num_dat[i]; j++)
+	    fprintf(fp, "%s\n", format_exact(num, p->input[i][j]));
+      if (ferror(fp) | fclose(fp)) {
+	 fprintf(stderr, "Error: unable to write output file %s\n", fname);
+	 fail(p);
+      }
+   }
+   report(p, "Wrote Config.txt and the eight data files in %s\n", p->dir ? p->dir : ".");
+   return;
+}
+
+/*
+ * Generate a plate measuring surface s, into directory out (created if
+ * it does not exist yet), or into bundle file out if its name ends in
+ * .mpb (binary) or .mpt (text), reporting as set by the options o
+ */
+int run_generate(const char *out, const struct synth *s, const struct moody_options *o) {
+   struct moody_plate *p = new_plate(NULL, o->format==OUTPUT_TEXT && !o->quiet ? stdout : NULL);
+   size_t len = strlen(out);
+
+   if (!p) {
+      fprintf(stderr, "Error: out of memory\n");
+      return EXIT_FAILURE;
+   }
+   synth_plate(p, s);
+   if (len>=4 && (!strcmp(out+len-4, ".mpb") || !strcmp(out+len-4, ".mpt")))
+      write_bundle(p, out);
+   else {
+      /* if this fails, so does writing the files, which reports it */
+      mkdir(out, 0777);
+      p->dir = out;
+      write_plate_files(p);
+   }
+   free_plate(p);
+   return EXIT_SUCCESS;
+}
+
+/*
+ * Benchmark. Every cell of the sweep times the stages of the pipeline
+ * on M plates with N steps along their East-West lines, all read from
+ * the same synthetic plate files bench.*.txt in the current directory,
+ * and reports their throughput in stations per second of CPU time.
+ * The plates are processed stage by stage, BENCH_CHUNK stations at a
+ * time, so that each timed interval is long enough for clock().
+ */
+#define BENCH_STAGES 7
+#define BENCH_CHUNK (1<<20)
+/* cells of the sweep with more than this many steps (N times M) are skipped */
+#define BENCH_BUDGET 100000
+
+const char *bench_stages[BENCH_STAGES]={
+   "read", "cols1-4", "cols5-6", "cols7-8", "batched", "tables", "gnuplot"
+};
+
+double cpu_seconds(void) {
+   return (double)clock()/CLOCKS_PER_SEC;
+}
+
+/* Time the stages on m copies of a plate measuring surface s, and print a row */
+void bench_cell(const struct synth *s, int m) {
+   struct moody_plate *gen = new_plate(NULL, NULL), **q;
+   double t[BENCH_STAGES], rms = 0.0, largest = 0.0, t0;
+   char path[MAX_PATHLEN];
+   int total = 0, chunk, done, n, i, k;
+   FILE *scratch = tmpfile();
+
+   if (!gen || !scratch) {
+      fprintf(stderr, "Error: unable to set up the benchmark\n");
+      exit(EXIT_FAILURE);
+   }
+   gen->prefix = "bench.";
+   synth_plate(gen, s);
+   write_plate_files(gen);
+   for (i=0; i<8; i++) total += gen->num_dat[i]+1;
+   chunk = BENCH_CHUNK/total;
+   if (chunk > m) chunk = m;
+   if (chunk < 1) chunk = 1;
+   if (!(q = malloc(chunk*sizeof(*q)))) {
+      fprintf(stderr, "Error: out of memory\n");
+      exit(EXIT_FAILURE);
+   }
+   memset(t, 0, sizeof(t));
+
+   for (done=0; done<m; done+=n) {
+      n = m-done < chunk ? m-done : chunk;
+
+      t0 = cpu_seconds();
+      for (k=0; k<n; k++) {
+	 if (!(q[k] = new_plate(NULL, NULL))) {
+	    fprintf(stderr, "Error: out of memory\n");
+	    exit(EXIT_FAILURE);
+	 }
+	 q[k]->prefix = "bench.";
+	 read_plate(q[k]);
+      }
+      t[0] += cpu_seconds()-t0;
+
+      t0 = cpu_seconds();
+      for (k=0; k<n; k++) {
+	 alloc_worksheets(q[k]);
+	 for (i=0; i<8; i++) first_four_columns(q[k], i);
+      }
+      t[1] += cpu_seconds()-t0;
+
+      t0 = cpu_seconds();
+      for (k=0; k<n; k++) correction_columns(q[k]);
+      t[2] += cpu_seconds()-t0;
+
+      t0 = cpu_seconds();
+      for (k=0; k<n; k++) q[k]->flatness = height_columns(q[k]);
+      t[3] += cpu_seconds()-t0;
+
+      if (done == 0) synth_error(q[0], s, &rms, &largest);
+
+      t0 = cpu_seconds();
+      for (k=0; k<n; k+=MOODY_LANES)
+	 if (correct_plates(q+k, n-k < MOODY_LANES ? n-k : MOODY_LANES)) {
+	    fprintf(stderr, "Error: out of memory\n");
+	    exit(EXIT_FAILURE);
+	 }
+      t[4] += cpu_seconds()-t0;
+
+      rewind(scratch);
+      t0 = cpu_seconds();
+      for (k=0; k<n; k++) {
+	 q[k]->report = scratch;
+	 for (i=0; i<8; i++) print_table(q[k], i);
+	 q[k]->report = NULL;
+      }
+      fflush(scratch);
+      t[5] += cpu_seconds()-t0;
+
+      t0 = cpu_seconds();
+      for (k=0; k<n; k++) output_gnuplot(q[k], q[k]->flatness);
+      t[6] += cpu_seconds()-t0;
+
+      for (k=0; k<n; k++) free_plate(q[k]);
+   }
+
+   printf("%7d %6d %8d", synth_steps(s, 2), m, total);
+   for (i=0; i<BENCH_STAGES; i++)
+      if (t[i] > 0.0)
+	 printf(" %8.2f", 1e-6*total*m/t[i]);
+      else
+	 printf(" %8s", "-");
+   printf(" %9.2e %9.2e\n", rms, largest);
+   fflush(stdout);
+
+   for (i=-1; i<8; i++) remove(plate_path(gen, path, i<0 ? "Config.txt" : filenames[i]));
+   remove(plate_path(gen, path, "gnuplot.dat"));
+   remove(plate_path(gen, path, "gnuplot.cmd"));
+   fclose(scratch);
+   free(q);
+   free_plate(gen);
+   return;
+}
+
+/*
+ * Run the benchmark over N from 10 to 100,000 steps and M from 1 to
+ * 10,000 plates, or only N = stations and M = plates where they are
+ * given (nonzero)
+ */
+int run_bench(struct synth *s, int plates) {
+   const int sweep_n[5]={10, 100, 1000, 10000, 100000};
+   const int sweep_m[5]={1, 10, 100, 1000, 10000};
+   int stations = s->stations, a, b, i;
+
+   printf("Throughput of each stage in millions of stations per second of CPU\n"
+	  "time, and error of column 8 against the surface in microns\n"
+	  "(RMS and largest), for M plates with N steps on the East-West lines\n");
+   printf("%7s %6s %8s", "N", "M", "stations");
+   for (i=0; i<BENCH_STAGES; i++) printf(" %8s", bench_stages[i]);
+   printf(" %9s %9s\n", "rms", "largest");
+   for (a=0; a<5; a++)
+      for (b=0; b<5; b++) {
+	 int n = stations ? stations : sweep_n[a];
+	 int m = plates ? plates : sweep_m[b];
+	 if ((stations && a) || (plates && b)) continue;
+	 if (!(stations && plates) && (double)n*m > BENCH_BUDGET) continue;
+	 s->stations = n;
+	 bench_cell(s, m);
+      }
+   s->stations = stations;
+   return EXIT_SUCCESS;
+}
+
+/*
+ * The library interface, declared in moody.h. A plate is computed from
+ * readings in the caller's arrays, through the same stages as the
+ * program, but with no report or results stream and no gnuplot files,
+ * so nothing is read, written or printed: the plate is silent, so not
+ * even error messages, and errors come back as the status. In the
+ * float builds the worksheet columns are the caller's buffers
+ * themselves; the double build computes in its own worksheets and
+ * rounds them into those.
+ */
+int moody_api_version(void) {
+   return MOODY_API_VERSION;
+}
+
+size_t moody_sheet_size(int which_line, int num_dat) {
+   if (which_line < 0 || which_line > 7 || num_dat < 0) return 0;
+   return (size_t)num_columns(which_line)*(num_dat+1);
+}
+
+int moody_compute(int metric, float foot_spacing, int options, const int num_dat[8],
+		  const float *const readings[8], float *const sheets[8],
+		  struct moody_summary *summary) {
+   struct moody_plate *p;
+   jmp_buf env;
+   int i, c, j;
+
+   if ((metric != 0 && metric != 1) || !(foot_spacing > 0) || (options & ~MOODY_LEAST_SQUARES) ||
+       !num_dat || !readings || !sheets)
+      return MOODY_EINVAL;
+   /* as read_angles() requires */
+   for (i=0; i<8; i++)
+      if (num_dat[i] < 3 || !readings[i] || !sheets[i]) return MOODY_EINVAL;
+   if (!(p = new_plate(NULL, NULL))) return MOODY_ENOMEM;
+   p->foot_spacing = foot_spacing;
+   set_units(p, metric ? 'M' : 'I', "");
+   p->least_squares = options & MOODY_LEAST_SQUARES;
+   p->no_plot = 1;
+   /* errors come back as the status only */
+   p->silent = 1;
+   memcpy(p->num_dat, num_dat, sizeof(p->num_dat));
+   p->fail_jmp = &env;
+   if (setjmp(env)) {
+      free_plate(p);
+      return MOODY_ENOMEM;
+   }
+
+#if MOODY_PRECISION == MOODY_DOUBLE
+   layout_worksheets(p);
+#else
+   for (i=0; i<8; i++) {
+      memset(sheets[i], 0, moody_sheet_size(i, num_dat[i])*sizeof(float));
+      for (c=0; c<9; c++)
+	 p->ws[i][c] = c < num_columns(i) ? sheets[i] + (size_t)c*(num_dat[i]+1) : NULL;
+   }
+#endif
+   for (i=0; i<8; i++)
+      for (j=0; j<num_dat[i]; j++) p->ws[i][1][j+1] = readings[i][j];
+   do_consistency_checks(p);
+   correct_lines(p);
+   finish_plate(p);
+#if MOODY_PRECISION == MOODY_DOUBLE
+   for (i=0; i<8; i++)
+      for (c=0; c<num_columns(i); c++)
+	 for (j=0; j<=num_dat[i]; j++) sheets[i][(size_t)c*(num_dat[i]+1)+j] = (float)p->ws[i][c][j];
+#endif
+
+   if (summary) {
+      summary->flatness = p->flatness;
+      summary->center[0] = p->center[0];
+      summary->center[1] = p->center[1];
+      summary->warnings = p->warnings;
+      summary->rms_residual = p->rms_residual;
+      summary->max_residual = p->max_residual;
+   }
+   free_plate(p);
+   return MOODY_OK;
+}
+#endif /* MOODY_MCU */
+
+/*
+ * The fixed-point profile: the stages of correct_lines() and
+ * height_columns() for one plate, in integers only, and with a single
+ * value per station in place of the nine worksheet columns. Every line
+ * is computed in place in its buffer: the readings become column 4,
+ * column 4 becomes column 6 (6a on the center lines) and column 6 at
+ * last column 8, so a plate of 8 lines of 128 stations takes 4 kB.
+ * All values are Q23.8, 1/256 of an arc second or of the output unit.
+ * With readings, stations and foot spacing within the MOODY_FIXED_MAX_
+ * limits no sum can overflow 32 bits, the products of the conversion
+ * to heights are taken in 64. The divisions by the number of steps of
+ * a line are done once per line, see fixed_ramp().
+ */
+
+/* x/2, rounded to the nearest, halves away from zero */
+moody_fixed fixed_half(int32_t x) {
+   return x >= 0 ? (x+1)/2 : -((1-x)/2);
+}
+
+/* mid_value(), of the values h[0] to h[ndat] of a line */
+moody_fixed fixed_mid_value(const moody_fixed *h, int ndat) {
+   if (ndat % 2 == 0)
+      return h[ndat/2];
+   return fixed_half(h[(ndat-1)/2] + h[(ndat+1)/2]);
+}
+
+/*
+ * first_four_columns(): turn the ndat readings h[0] to h[ndat-1] into
+ * Moody column 4, the sum of the angular differences, at h[0] to
+ * h[ndat]
+ */
+void fixed_first_four_columns(moody_fixed *h, int ndat) {
+   moody_fixed first = h[0], next = h[0], sum = 0;
+   int j;
+
+   h[0] = 0;
+   for (j=1; j<=ndat; j++) {
+      moody_fixed reading = next;
+      if (j < ndat) next = h[j];
+      sum += reading - first;
+      h[j] = sum;
+   }
+   return;
+}
+
+/*
+ * Add base + rise*j/ndat, rounded to the nearest, to h[j] for j=0 to
+ * ndat: a straight line from base to base+rise, as columns 5 of Moody.
+ * The quotient and remainder are carried from one station to the next,
+ * as in Bresenham's line drawing, so there is a single division.
+ */
+void fixed_ramp(moody_fixed *h, int ndat, moody_fixed base, moody_fixed rise) {
+   /* rise = step*ndat + extra, with 0 <= extra < ndat */
+   int32_t step = rise/ndat, extra = rise%ndat;
+   /* base+rise*j/ndat+1/2 = base+q+r/ndat, with 0 <= r < ndat */
+   int32_t q = 0, r = ndat/2;
+   int j;
+
+   if (extra < 0) {
+      extra += ndat;
+      step--;
+   }
+   for (j=0; j<=ndat; j++) {
+      h[j] += base + q;
+      q += step;
+      r += extra;
+      if (r >= ndat) {
+	 r -= ndat;
+	 q++;
+      }
+   }
+   return;
+}
+
+/* diagonal_correction(): column 6 of a diagonal, from its column 4 */
+void fixed_diagonal_correction(moody_fixed *h, int ndat) {
+   moody_fixed total = h[ndat];
+   fixed_ramp(h, ndat, fixed_half(total) - fixed_mid_value(h, ndat), -total);
+   return;
+}
+
+/*
+ * shift_lines() for a perimeter or center line, whose ends are already
+ * known to be at heights start and end: column 6, from its column 4.
+ * Unlike the float code, which adds up the correction factor of the
+ * line station by station, this reaches end exactly.
+ */
+void fixed_shift_lines(moody_fixed *h, int ndat, moody_fixed start, moody_fixed end) {
+   fixed_ramp(h, ndat, start, end - h[ndat] - start);
+   return;
+}
+
+/*
+ * One arc second, in radians, times the output unit (microns per mm,
+ * or 1/100,000 inch per inch) and times 2^32
+ */
+#define FIXED_ARCSEC_METRIC 20822589LL
+#define FIXED_ARCSEC_IMPERIAL 2082258905LL
+/* fractional bits of the factor from column 6 to heights */
+#define FIXED_SCALE_BITS 20
+
+/* x/2^bits, rounded to the nearest, halves away from zero */
+int64_t fixed_shift(int64_t x, int bits) {
+   int64_t half = (int64_t)1 << (bits-1);
+   return x >= 0 ? (x+half) >> bits : -((half-x) >> bits);
+}
+
+/* The difference x of values in column 6, as a height, with the factor of fixed_scale() */
+moody_fixed fixed_height(int64_t x, int64_t scale) {
+   return (moody_fixed)fixed_shift(x*scale, FIXED_SCALE_BITS);
+}
+
+/* arcsec*out_spacing in Q43.20, for a foot spacing in mm (metric) or in inches */
+int64_t fixed_scale(int metric, moody_fixed foot_spacing) {
+   int64_t unit = metric ? FIXED_ARCSEC_METRIC : FIXED_ARCSEC_IMPERIAL;
+   return fixed_shift(foot_spacing*unit, 32 + MOODY_FIXED_BITS - FIXED_SCALE_BITS);
+}
+
+/* The MOODY_WARN_ flags of the station counts, as do_consistency_checks() raises them */
+int fixed_warnings(const int num_dat[8]) {
+   int i, warnings = 0;
+
+   if (num_dat[0] != num_dat[1]) warnings |= MOODY_WARN_DIAGONALS;
+   for (i=0; i<2; i++)
+      if (num_dat[2+i] != num_dat[4+i] || num_dat[4+i] != num_dat[6+i])
+	 warnings |= i ? MOODY_WARN_LINES_NS : MOODY_WARN_LINES_EW;
+   /* |sqrt(x^2+y^2) - z| > 1.5, without the square root */
+   for (i=0; i<2; i++) {
+      long x = num_dat[2*i+2], y = num_dat[2*i+3], z = num_dat[i];
+      long d = 4*(x*x+y*y);
+      if (d > (2*z+3)*(2*z+3) || (2*z > 3 && d < (2*z-3)*(2*z-3)))
+	 warnings |= i ? MOODY_WARN_PYTHAGORAS_NE_SW : MOODY_WARN_PYTHAGORAS_NW_SE;
+   }
+   return warnings;
+}
+
+int moody_fixed_compute(int metric, moody_fixed foot_spacing, const int num_dat[8],
+			moody_fixed *const lines[8], struct moody_fixed_summary *summary) {
+   /* corners at the start and end of lines NE_NW, NE_SE, SE_SW, NW_SW, as in copy_corners() */
+   const int start[4] = {MOODY_NE_SW, MOODY_NE_SW, MOODY_NW_SE, MOODY_NW_SE};
+   const int start_end[4] = {0, 0, 1, 0};
+   const int end[4] = {MOODY_NW_SE, MOODY_NW_SE, MOODY_NE_SW, MOODY_NE_SW};
+   const int end_end[4] = {0, 1, 1, 1};
+   moody_fixed corner[2][2], lowest, highest, center[2];
+   int64_t scale;
+   int i, j, k, warnings;
+
+   if ((metric != 0 && metric != 1) || foot_spacing <= 0 ||
+       foot_spacing > MOODY_FIXED_MAX_SPACING*MOODY_FIXED_ONE || !num_dat || !lines)
+      return MOODY_EINVAL;
+   for (i=0; i<8; i++) {
+      if (num_dat[i] < 3 || num_dat[i] > MOODY_FIXED_MAX_STATIONS || !lines[i]) return MOODY_EINVAL;
+      for (j=0; j<num_dat[i]; j++)
+	 if (lines[i][j] < -MOODY_FIXED_MAX_READING*MOODY_FIXED_ONE ||
+	     lines[i][j] > MOODY_FIXED_MAX_READING*MOODY_FIXED_ONE)
+	    return MOODY_EINVAL;
+   }
+   warnings = fixed_warnings(num_dat);
+
+   for (i=0; i<8; i++) fixed_first_four_columns(lines[i], num_dat[i]);
+   /* the diagonals, and the corners at their two ends */
+   for (i=0; i<2; i++) {
+      fixed_diagonal_correction(lines[i], num_dat[i]);
+      corner[i][0] = lines[i][0];
+      corner[i][1] = lines[i][num_dat[i]];
+   }
+   /* the perimeter lines, between two corners */
+   for (i=2; i<6; i++)
+      fixed_shift_lines(lines[i], num_dat[i], corner[start[i-2]][start_end[i-2]],
+			corner[end[i-2]][end_end[i-2]]);
+   /* the center lines, between the middles of two perimeter lines, and column 6a */
+   for (i=6; i<8; i++) {
+      int from = i == MOODY_E_W ? MOODY_NE_SE : MOODY_NE_NW;
+      int to = i == MOODY_E_W ? MOODY_NW_SW : MOODY_SE_SW;
+      fixed_shift_lines(lines[i], num_dat[i], fixed_mid_value(lines[from], num_dat[from]),
+			fixed_mid_value(lines[to], num_dat[to]));
+      center[i-6] = fixed_mid_value(lines[i], num_dat[i]);
+      for (j=0; j<=num_dat[i]; j++) lines[i][j] -= center[i-6];
+   }
+
+   /* height_columns(): column 8, above the lowest point */
+   lowest = highest = lines[0][0];
+   for (i=0; i<8; i++)
+      for (j=0; j<=num_dat[i]; j++) {
+	 if (lines[i][j] < lowest) lowest = lines[i][j];
+	 if (lines[i][j] > highest) highest = lines[i][j];
+      }
+   scale = fixed_scale(metric, foot_spacing);
+   for (i=0; i<8; i++)
+      for (j=0; j<=num_dat[i]; j++) lines[i][j] = fixed_height((int64_t)lines[i][j] - lowest, scale);
+
+   /* Moody's limit of 100 micro-inch = 2.54 microns on the center heights */
+   for (k=0; k<2; k++) {
+      int64_t h = fixed_height(center[k], scale);
+      if (h < 0) h = -h;
+      if (metric ? 100*h > 254*MOODY_FIXED_ONE : h > 10*MOODY_FIXED_ONE) warnings |= MOODY_WARN_CENTER;
+      if (summary) summary->center[k] = fixed_height(center[k], scale);
+   }
+   if (summary) {
+      summary->flatness = fixed_height((int64_t)highest - lowest, scale);
+      summary->warnings = warnings;
+   }
+   return MOODY_OK;
+}
+
+#ifndef MOODY_LIBRARY
+void print_usage(const char *prog) {
+   fprintf(stderr,
+	   "Usage: %s\n"
+	   "   Process the plate in the current directory.\n"
+	   "Usage: %s [-j N] [-m manifest] [dir ...]\n"
+	   "   Batch mode: process the plate in each listed directory and\n"
+	   "   write its tables to moody.txt in that directory. Plate bundle\n"
+	   "   files can be listed instead of directories.\n"
+	   "   -m manifest  also read plate directories from this file,\n"
+	   "                one per line\n"
+	   "   -j N         use N worker threads (default: one per core)\n",
+	   prog, prog);
+   fprintf(stderr,
+	   "Options for all modes:\n"
+	   "   -f, --format F  write the results as F: text (Moody's tables,\n"
+	   "                   the default), csv, json or binary\n"
+	   "   -q, --quiet     skip the tables and commentary; with text\n"
+	   "                   output only print a one-line summary\n"
+	   "   -g N            also interpolate a height map over the whole\n"
+	   "                   plate, N points along its longer side\n"
+	   "   --zone          also compute the minimum-zone flatness (ISO 1101)\n"
+	   "                   and that from the least-squares plane, over the\n"
+	   "                   stations, or the height map with -g\n"
+	   "   --diagnose      rank the lines by how much of the closure error\n"
+	   "                   each explains, and flag readings that stand out\n"
+	   "   --plot P        write the gnuplot data as text (the default) or\n"
+	   "                   in gnuplot's binary formats\n"
+	   "   --image I       also render the plate to surface.png or\n"
+	   "                   surface.svg, for I png or svg, without gnuplot\n"
+	   "   --mesh M        also write the height map (of -g, or one point\n"
+	   "                   per foot) as triangle meshes for 3D viewers,\n"
+	   "                   surface_lod0.glb, surface_lod1.glb and so on\n"
+	   "                   at ever lower detail, for M gltf, or .ply for ply\n"
+	   "   --exaggerate X  multiply the heights of the meshes by X (by\n"
+	   "                   default so that the relief is a tenth of the plate)\n"
+	   "   --contours C    also write a map of the lines of equal height and\n"
+	   "                   of the high spots to contours.svg or .json, for\n"
+	   "                   C svg or json, every --contour-step S microns or\n"
+	   "                   micro-inches (about ten lines), and above\n"
+	   "                   --high-spot H (80%% of the flatness)\n"
+	   "   -l, --least-squares  adjust all eight lines together by least\n"
+	   "                   squares instead of Moody's corrections, and\n"
+	   "                   report the residual of every station\n"
+	   "   -u N            Monte Carlo uncertainty: repeat the computation\n"
+	   "                   for N perturbed copies of the readings, on all\n"
+	   "                   cores (or -j N threads)\n"
+	   "   --sigma S       noise of the readings, S arc seconds (0.1), or\n"
+	   "                   \"samples\" for the standard error of each reading\n"
+	   "   --foot-sigma T  noise of the foot spacing, in mm or inches (0)\n"
+	   "   --seed N        seed of the random numbers (1)\n"
+	   "   --reduce R      reduce several samples per station (all on one\n"
+	   "                   line, or after a line \"station\") to a reading by\n"
+	   "                   their mean (the default), median, or clip: the\n"
+	   "                   mean of those within --clip K (3) standard\n"
+	   "                   deviations\n"
+	   "   --samples N     take every N values of a data file as one station\n"
+	   "   --timings       print the time taken by each stage and counters\n"
+	   "                   of what was read and written, on standard error;\n"
+	   "                   in batch mode their percentiles over the plates\n"
+	   "   --stats file    write the timings and counters of each plate, and\n"
+	   "                   in batch mode their percentiles, to file (- for\n"
+	   "                   standard output) as one line of JSON each\n"
+	   "   --cache dir     keep the results of every plate in directory dir,\n"
+	   "                   and take them from there when the readings, units\n"
+	   "                   and options are the same as before\n"
+	   "   --incremental   keep the readings in moody.state, and only read\n"
+	   "                   the data files that have changed since the\n"
+	   "                   last run again\n"
+	   "   --history file  append the results to the calibration history\n"
+	   "                   in file, and report the change of every station\n"
+	   "                   since the previous calibration of the plate\n"
+	   "   --plate-id ID   record the plate as ID (in batch mode: its\n"
+	   "                   directory or bundle name)\n"
+	   "   --date D        record the calibration as of D, yyyy-mm-dd\n"
+	   "                   (default: today)\n");
+   fprintf(stderr,
+	   "Usage: %s -n topology\n"
+	   "   Network mode: adjust a plate measured along any set of straight\n"
+	   "   lines, listed in the topology file with the positions of their\n"
+	   "   ends, by least squares. The readings of line L are in L.txt.\n"
+	   "Usage: %s -s\n"
+	   "   Streaming mode: read readings tagged with their line, such as\n"
+	   "   \"NW_SE 6.5\", from standard input, and update the worksheets\n"
+	   "   as they arrive. \"NW_SE end\" marks line NW_SE as complete, and\n"
+	   "   \"NW_SE redo\" starts it over, keeping the lines it does not affect.\n"
+	   "   With --device D [--baud B] the lines are read from instrument D,\n"
+	   "   such as a serial port, by a thread of their own, until the plate\n"
+	   "   is done. Needs a build with MOODY_THREADS.\n"
+	   "Usage: %s -w bundle [dir]\n"
+	   "   Write the plate in dir (default: the current directory), or in\n"
+	   "   a bundle file, as a single bundle file: binary if its name\n"
+	   "   ends in .mpb, text otherwise.\n"
+	   "Usage: %s -G out [--stations N] [--bow A] [--twist T] [--lapping L]\n"
+	   "   Generate a synthetic plate measuring a known surface (A, T and L\n"
+	   "   in microns, default 1, 0 and 0), with N steps (16) along its\n"
+	   "   East-West lines, and readings with noise --sigma S (0.1), into\n"
+	   "   directory out (created if need be), or bundle out if it ends in\n"
+	   "   .mpb or .mpt.\n"
+	   "Usage: %s --bench [--stations N] [--plates M] [surface options]\n"
+	   "   Time every stage of the pipeline on synthetic plates, from 10 to\n"
+	   "   100000 steps and from 1 to 10000 plates, or only N and M.\n"
+	   "Usage: %s --serve address [-j N] [--plot-dir D] [--max-request B]\n"
+	   "       [options]\n"
+	   "   Server mode: listen on a Unix socket (an address containing a\n"
+	   "   \"/\") or a TCP [host:]port (loopback without a host) for\n"
+	   "   \"PLATE n [prefix]\" requests, each followed by a bundle of n\n"
+	   "   bytes, and answer \"OK m\" and the m bytes of its results, or\n"
+	   "   \"FAILED 0\", using N worker threads. The gnuplot files of a\n"
+	   "   request with a prefix go to directory D. Bundles may be up to\n"
+	   "   B bytes (default: 16 MiB). Needs a build with MOODY_THREADS.\n"
+	   "Usage: %s --history file --list [--plate-id ID]\n"
+	   "   List the calibrations in the history file, or those of plate ID.\n"
+	   "Usage: %s --history file --diff --plate-id ID [--date D]\n"
+	   "   Report the change of plate ID from the calibration before the\n"
+	   "   latest one (up to date D) to that one.\n",
+	   prog, prog, prog, prog, prog, prog, prog, prog);
+   return;
+}
+
+int main(int argc, char *argv[]) {
+   struct moody_options o;
+   char **dirs=NULL;
+   int num_dirs=0;
+   int batch=0;
+   int stream=0;
+   const char *bundle_out=NULL;
+   const char *topology=NULL;
+   const char *generate=NULL;
+   const char *serve=NULL, *plot_dir=NULL;
+   unsigned long max_request=0;
+   int history_query=0;
+   int bench=0, plates=0;
+   struct synth synth;
+   int i;
+
+   memset(&o, 0, sizeof(o));
+   o.format = OUTPUT_TEXT;
+   o.mc_sigma = 0.1;
+   o.clip = 3.0;
+   o.mc_seed = 1;
+   memset(&synth, 0, sizeof(synth));
+   synth.bow = 1.0;
+
+   for (i=1; i<argc; i++) {
+      if (!strcmp(argv[i], "-s")) {
+	 stream=1;
+      } else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quiet")) {
+	 o.quiet=1;
+      } else if ((!strcmp(argv[i], "-f") || !strcmp(argv[i], "--format")) && i+1<argc) {
+	 const char *formats[4]={"text", "csv", "json", "binary"};
+	 for (o.format=0; o.format<4 && strcmp(argv[i+1], formats[o.format]); o.format++);
+	 if (o.format==4) {
+	    print_usage(argv[0]);
+	    return EXIT_FAILURE;
+	 }
+	 i++;
+      } else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--least-squares")) {
+	 o.least_squares=1;
+      } else if (!strcmp(argv[i], "-u") && i+1<argc) {
+	 o.mc_trials=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "--sigma") && i+1<argc) {
+	 /* negative for the standard errors of the samples */
+	 o.mc_sigma = strcmp(argv[++i], "samples") ? atof(argv[i]) : -1.0;
+      } else if (!strcmp(argv[i], "--reduce") && i+1<argc) {
+	 const char *methods[3]={"mean", "median", "clip"};
+	 for (o.reduce=0; o.reduce<3 && strcmp(argv[i+1], methods[o.reduce]); o.reduce++);
+	 if (o.reduce==3) {
+	    print_usage(argv[0]);
+	    return EXIT_FAILURE;
+	 }
+	 i++;
+      } else if (!strcmp(argv[i], "--clip") && i+1<argc) {
+	 o.clip=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--samples") && i+1<argc) {
+	 o.samples=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "--foot-sigma") && i+1<argc) {
+	 o.mc_foot_sigma=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--seed") && i+1<argc) {
+	 o.mc_seed=strtoull(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "-g") && i+1<argc) {
+	 o.grid_size=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "-n") && i+1<argc) {
+	 topology=argv[++i];
+      } else if (!strcmp(argv[i], "-w") && i+1<argc) {
+	 bundle_out=argv[++i];
+      } else if (!strcmp(argv[i], "--timings")) {
+	 o.timings=1;
+      } else if (!strcmp(argv[i], "--stats") && i+1<argc) {
+	 const char *fname = argv[++i];
+	 if (!(o.stats = strcmp(fname, "-") ? fopen(fname, "w") : stdout)) {
+	    fprintf(stderr, "Error: unable to open/write output file %s\n", fname);
+	    return EXIT_FAILURE;
+	 }
+      } else if (!strcmp(argv[i], "--zone")) {
+	 o.zone=1;
+      } else if (!strcmp(argv[i], "--diagnose")) {
+	 o.diagnose=1;
+      } else if (!strcmp(argv[i], "--incremental")) {
+	 o.incremental=1;
+      } else if (!strcmp(argv[i], "--plot") && i+1<argc) {
+	 const char *plots[2]={"text", "binary"};
+	 for (o.plot_format=0; o.plot_format<2 && strcmp(argv[i+1], plots[o.plot_format]); o.plot_format++);
+	 if (o.plot_format==2) {
+	    print_usage(argv[0]);
+	    return EXIT_FAILURE;
+	 }
+	 i++;
+      } else if (!strcmp(argv[i], "--image") && i+1<argc) {
+	 const char *images[3]={"none", "png", "svg"};
+	 for (o.image=0; o.image<3 && strcmp(argv[i+1], images[o.image]); o.image++);
+	 if (o.image==3) {
+	    print_usage(argv[0]);
+	    return EXIT_FAILURE;
+	 }
+	 i++;
+      } else if (!strcmp(argv[i], "--mesh") && i+1<argc) {
+	 const char *meshes[3]={"none", "gltf", "ply"};
+	 for (o.mesh=0; o.mesh<3 && strcmp(argv[i+1], meshes[o.mesh]); o.mesh++);
+	 if (o.mesh==3) {
+	    print_usage(argv[0]);
+	    return EXIT_FAILURE;
+	 }
+	 i++;
+      } else if (!strcmp(argv[i], "--exaggerate") && i+1<argc) {
+	 o.exaggerate=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--contours") && i+1<argc) {
+	 const char *maps[3]={"none", "svg", "json"};
+	 for (o.contours=0; o.contours<3 && strcmp(argv[i+1], maps[o.contours]); o.contours++);
+	 if (o.contours==3) {
+	    print_usage(argv[0]);
+	    return EXIT_FAILURE;
+	 }
+	 i++;
+      } else if (!strcmp(argv[i], "--contour-step") && i+1<argc) {
+	 o.contour_step=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--high-spot") && i+1<argc) {
+	 o.high_spot=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--cache") && i+1<argc) {
+	 o.cache=argv[++i];
+      } else if (!strcmp(argv[i], "--history") && i+1<argc) {
+	 o.history=argv[++i];
+      } else if (!strcmp(argv[i], "--plate-id") && i+1<argc) {
+	 o.plate_id=argv[++i];
+      } else if (!strcmp(argv[i], "--date") && i+1<argc) {
+	 if (parse_date(argv[++i], &o.date)) {
+	    fprintf(stderr, "Error: date %s is not of the form yyyy-mm-dd\n", argv[i]);
+	    return EXIT_FAILURE;
+	 }
+      } else if (!strcmp(argv[i], "--list")) {
+	 history_query=1;
+      } else if (!strcmp(argv[i], "--diff")) {
+	 history_query=2;
+      } else if (!strcmp(argv[i], "-G") && i+1<argc) {
+	 generate=argv[++i];
+      } else if (!strcmp(argv[i], "--bench")) {
+	 bench=1;
+      } else if (!strcmp(argv[i], "--device") && i+1<argc) {
+	 o.device=argv[++i];
+      } else if (!strcmp(argv[i], "--baud") && i+1<argc) {
+	 o.baud=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "--serve") && i+1<argc) {
+	 serve=argv[++i];
+      } else if (!strcmp(argv[i], "--plot-dir") && i+1<argc) {
+	 plot_dir=argv[++i];
+      } else if (!strcmp(argv[i], "--max-request") && i+1<argc) {
+	 max_request=strtoul(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "--stations") && i+1<argc) {
+	 synth.stations=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "--plates") && i+1<argc) {
+	 plates=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "--bow") && i+1<argc) {
+	 synth.bow=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--twist") && i+1<argc) {
+	 synth.twist=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "--lapping") && i+1<argc) {
+	 synth.lapping=atof(argv[++i]);
+      } else if (!strcmp(argv[i], "-j") && i+1<argc) {
+	 o.num_workers=o.mc_workers=atoi(argv[++i]);
+      } else if (!strcmp(argv[i], "-m") && i+1<argc) {
+	 read_manifest(argv[++i], &dirs, &num_dirs);
+	 batch=1;
+      } else if (argv[i][0]=='-') {
+	 print_usage(argv[0]);
+	 return EXIT_FAILURE;
+      } else {
+	 if (!(dirs = realloc(dirs, (num_dirs+1)*sizeof(char *)))) {
+	    fprintf(stderr, "Error: out of memory\n");
+	    return EXIT_FAILURE;
+	 }
+	 dirs[num_dirs++] = argv[i];
+	 batch=1;
+      }
+   }
+
+   if (history_query) {
+      if (!o.history || (history_query==2 && !o.plate_id)) {
+	 print_usage(argv[0]);
+	 return EXIT_FAILURE;
+      }
+      return run_history(o.history, o.plate_id, o.date, history_query==2);
+   }
+   if (o.history && !o.plate_id && !batch) {
+      fprintf(stderr, "Error: --history needs the --plate-id of the plate\n");
+      return EXIT_FAILURE;
+   }
+   if (!o.date) o.date = today();
+
+   if (serve) {
+#ifdef MOODY_THREADS
+      return run_server(serve, plot_dir, max_request, &o);
+#else
+      (void)plot_dir;
+      (void)max_request;
+      fprintf(stderr, "Error: server mode needs a build with MOODY_THREADS\n");
+      return EXIT_FAILURE;
+#endif
+   }
+
+   /* Print out license information, unless it would be in the way */
+   if (o.format==OUTPUT_TEXT && !o.quiet)
+      print_license();
+
+   synth.sigma = o.mc_sigma < 0 ? 0.1 : o.mc_sigma;
+   synth.seed = o.mc_seed;
+   synth_init(&synth);
+   if (bench)
+      return run_bench(&synth, plates);
+   if (generate) {
+      if (!synth.stations) synth.stations = 16;
+      return run_generate(generate, &synth, &o);
+   }
+   if (stream)
+      return run_stream(&o);
+   if (topology)
+      return run_network(topology, &o);
+   if (bundle_out) {
+      if (num_dirs > 1) {
+	 print_usage(argv[0]);
+	 return EXIT_FAILURE;
+      }
+      return convert_plate(num_dirs ? dirs[0] : NULL, bundle_out);
+   }
+   if (!batch) {
+      struct moody_plate *p = new_plate(NULL, NULL);
+      if (!p) {
+	 fprintf(stderr, "Error: out of memory\n");
+	 return EXIT_FAILURE;
+      }
+      set_output(p, &o, stdout);
+      moody_pipeline(p);
+      if (o.timings) print_stats(".", &p->stats);
+      if (o.stats) write_stats_record(o.stats, ".", 0, &p->stats);
+      free_plate(p);
+      return 0;
+   }
+   if (num_dirs == 0) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+   }
+   return run_batch(dirs, num_dirs, &o);
+}
+#endif
@@ -0,0 +1,153 @@
+/*
+ * libmoody: the computation of moody.c as a library.
+ *
+ * Copyright Bruce Allen, 2018-2024
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * The readings of the eight lines are passed in the caller's arrays,
+ * and the worksheets are computed into the caller's buffers, without
+ * reading or writing any file and without printing anything. Build the
+ * library from the same source as the program, with
+ *   cc -O2 -shared -fPIC -fvisibility=hidden -DMOODY_LIBRARY -o libmoody.so moody.c -lm
+ * which leaves out main() and exports only the functions below.
+ *
+ * The interface only uses int, float, size_t and int32_t, and is
+ * stable: later versions add functions and increase MOODY_API_VERSION,
+ * but do not change these.
+ *
+ * For a microcontroller, the fixed-point moody_fixed_compute() builds
+ * on its own, without any C library, with
+ *   cc -O2 -ffreestanding -DMOODY_MCU -c moody.c
+ */
+#ifndef MOODY_H
+#define MOODY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(MOODY_LIBRARY)
+#define MOODY_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define MOODY_API __attribute__((visibility("default")))
+#else
+#define MOODY_API
+#endif
+
+#define MOODY_API_VERSION 2
+
+/*
+ * The eight lines, in the order of their data files (NW_SE.txt and so
+ * on): the two diagonals, the four perimeter lines and the two center
+ * lines
+ */
+#define MOODY_NW_SE 0
+#define MOODY_NE_SW 1
+#define MOODY_NE_NW 2
+#define MOODY_NE_SE 3
+#define MOODY_SE_SW 4
+#define MOODY_NW_SW 5
+#define MOODY_E_W 6
+#define MOODY_N_S 7
+
+/* Options of moody_compute(): adjust all eight lines by least squares, like -l */
+#define MOODY_LEAST_SQUARES 1
+
+/* Return values of moody_compute() */
+#define MOODY_OK 0
+#define MOODY_EINVAL (-1)  /* invalid arguments */
+#define MOODY_ENOMEM (-2)  /* out of memory, or the adjustment is singular */
+
+/*
+ * Warnings raised by the checks of a plate, as the bit flags also
+ * written as "warnings" in the CSV and JSON output
+ */
+#define MOODY_WARN_DIAGONALS 1         /* the diagonals differ in length */
+#define MOODY_WARN_LINES_EW 2          /* so do the East-West lines */
+#define MOODY_WARN_LINES_NS 4          /* or the North-South lines */
+#define MOODY_WARN_PYTHAGORAS_NW_SE 8  /* a diagonal does not fit the sides */
+#define MOODY_WARN_PYTHAGORAS_NE_SW 16
+#define MOODY_WARN_CENTER 32           /* "The job must be done over!" */
+
+/*
+ * The summary of a plate: the height of its highest point above the
+ * lowest one and the computed heights at the middle of the two center
+ * lines, in microns for a metric plate or 1/100,000 inch otherwise;
+ * the MOODY_WARN_ flags raised; and with MOODY_LEAST_SQUARES the RMS
+ * and largest residual (zero otherwise)
+ */
+struct moody_summary {
+   float flatness;
+   float center[2];
+   int warnings;
+   float rms_residual, max_residual;
+};
+
+/* MOODY_API_VERSION of the library, which may be newer than this header */
+MOODY_API int moody_api_version(void);
+
+/*
+ * Number of floats in the worksheet of line which_line, with num_dat
+ * readings, as moody_compute() fills it in
+ */
+MOODY_API size_t moody_sheet_size(int which_line, int num_dat);
+
+/*
+ * Compute a plate whose line i has num_dat[i] (at least 3) readings,
+ * in arc seconds, at readings[i]. metric is 1 if foot_spacing is in
+ * mm, 0 if it is in inches; options is 0 or MOODY_LEAST_SQUARES.
+ * sheets[i] must have room for moody_sheet_size(i, num_dat[i]) floats,
+ * and receives the columns of Moody's worksheet of line i one after
+ * the other, num_dat[i]+1 stations each: columns 1 to 8, and for the
+ * center lines column 6a as a ninth column. Column 8 is the height
+ * in the units of the summary, which is stored in *summary unless it
+ * is NULL. Returns MOODY_OK, or one of the errors above.
+ */
+MOODY_API int moody_compute(int metric, float foot_spacing, int options, const int num_dat[8],
+			    const float *const readings[8], float *const sheets[8],
+			    struct moody_summary *summary);
+
+/*
+ * Fixed point (since version 2): values in Q23.8, 1/256 of an arc
+ * second, of a mm or inch, or of a micron or 1/100,000 inch. Readings
+ * must be within MOODY_FIXED_MAX_READING arc seconds, lines have at
+ * most MOODY_FIXED_MAX_STATIONS readings, and the foot spacing is at
+ * most MOODY_FIXED_MAX_SPACING mm or inches.
+ */
+typedef int32_t moody_fixed;
+#define MOODY_FIXED_BITS 8
+#define MOODY_FIXED_ONE (1 << MOODY_FIXED_BITS)
+#define MOODY_FIXED_MAX_READING 500
+#define MOODY_FIXED_MAX_STATIONS 512
+#define MOODY_FIXED_MAX_SPACING 1000
+
+/* As struct moody_summary, in Q23.8 */
+struct moody_fixed_summary {
+   moody_fixed flatness;
+   moody_fixed center[2];
+   int warnings;
+};
+
+/*
+ * Compute a plate as moody_compute() does without MOODY_LEAST_SQUARES,
+ * in integers and in place: lines[i] has room for num_dat[i]+1 values
+ * and holds the num_dat[i] readings of line i, which are replaced by
+ * the heights of its stations above the lowest point of the plate
+ * (Moody column 8). Uses no memory besides these buffers and a few
+ * words of stack. Returns MOODY_OK or MOODY_EINVAL.
+ */
+MOODY_API int moody_fixed_compute(int metric, moody_fixed foot_spacing, const int num_dat[8],
+				  moody_fixed *const lines[8], struct moody_fixed_summary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+"""
+Python binding of libmoody, the computation of moody.c as a library
+(see moody.h), through ctypes. Build the library next to this file with
+
+    cc -O2 -shared -fPIC -fvisibility=hidden -DMOODY_LIBRARY -o libmoody.so moody.c -lm
+
+or set LIBMOODY to its path. Then
+
+    import moody
+    sheets, summary = moody.compute(readings, metric=0, foot_spacing=4.0)
+
+where readings holds the eight lines, in the order of moody.LINES, as
+NumPy arrays or any other buffers of arc seconds. Contiguous float32
+buffers are passed to the library as they are, and the worksheets are
+computed straight into the buffers that are returned (or those given
+as out), so nothing is copied either way.
+"""
+
+import array
+import ctypes
+import os
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+__all__ = ["LINES", "LEAST_SQUARES", "WARNINGS", "MoodyError", "compute"]
+
+# The eight lines, in the order of their data files and of moody.h
+LINES = ("NW_SE", "NE_SW", "NE_NW", "NE_SE", "SE_SW", "NW_SW", "E_W", "N_S")
+
+LEAST_SQUARES = 1
+
+# The MOODY_WARN_ flags of the summary
+WARNINGS = {
+    1: "diagonals have different numbers of stations",
+    2: "lines NE_NW, SE_SW and E_W have different numbers of stations",
+    4: "lines NE_SE, NW_SW and N_S have different numbers of stations",
+    8: "NE_NW, NE_SE and NW_SE station counts deviate from Pythagoras",
+    16: "SE_SW, NW_SW and NE_SW station counts deviate from Pythagoras",
+    32: "center line heights exceed Moody's limit of 2.54 microns",
+}
+
+_API_VERSION = 1
+_EINVAL = -1
+_ENOMEM = -2
+
+
+class MoodyError(Exception):
+    pass
+
+
+class _Summary(ctypes.Structure):
+    _fields_ = [("flatness", ctypes.c_float),
+                ("center", ctypes.c_float * 2),
+                ("warnings", ctypes.c_int),
+                ("rms_residual", ctypes.c_float),
+                ("max_residual", ctypes.c_float)]
+
+
+def _load():
+    path = os.environ.get("LIBMOODY")
+    if not path:
+        name = "moody.dll" if os.name == "nt" else "libmoody.so"
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), name)
+    lib = ctypes.CDLL(path)
+    lib.moody_api_version.restype = ctypes.c_int
+    lib.moody_api_version.argtypes = []
+    if lib.moody_api_version() < _API_VERSION:
+        raise MoodyError("%s is older than this binding" % path)
+    lib.moody_sheet_size.restype = ctypes.c_size_t
+    lib.moody_sheet_size.argtypes = [ctypes.c_int, ctypes.c_int]
+    lib.moody_compute.restype = ctypes.c_int
+    lib.moody_compute.argtypes = [ctypes.c_int, ctypes.c_float, ctypes.c_int,
+                                  ctypes.POINTER(ctypes.c_int),
+                                  ctypes.POINTER(ctypes.c_void_p),
+                                  ctypes.POINTER(ctypes.c_void_p),
+                                  ctypes.POINTER(_Summary)]
+    return lib
+
+
+_lib = None
+
+
+def _library():
+    global _lib
+    if _lib is None:
+        _lib = _load()
+    return _lib
+
+
+def _floats(buf, writable):
+    """
+    The address and length of buf as contiguous float32, and the object
+    that owns that memory. Only a buffer of another type, or not
+    contiguous, is copied, and only for reading.
+    """
+    if numpy is not None and isinstance(buf, numpy.ndarray):
+        if buf.dtype == numpy.float32 and buf.flags.c_contiguous and (buf.flags.writeable or not writable):
+            return buf.ctypes.data, buf.size, buf
+        if writable:
+            raise MoodyError("out must be C-contiguous writable float32 arrays")
+        buf = numpy.ascontiguousarray(buf, dtype=numpy.float32)
+        return buf.ctypes.data, buf.size, buf
+    try:
+        view = memoryview(buf)
+    except TypeError:
+        view = None
+    if view is not None and view.format == "f" and view.c_contiguous and not view.readonly:
+        n = view.nbytes // 4
+        return ctypes.addressof((ctypes.c_float * n).from_buffer(view)), n, view
+    if writable:
+        raise MoodyError("out must be contiguous writable float32 buffers")
+    buf = array.array("f", buf)
+    return buf.buffer_info()[0], len(buf), buf
+
+
+def _sheet(columns, stations):
+    if numpy is not None:
+        return numpy.zeros((columns, stations), dtype=numpy.float32)
+    return array.array("f", bytes(4 * columns * stations))
+
+
+def compute(readings, metric, foot_spacing, least_squares=False, out=None):
+    """
+    Compute the plate whose eight lines, in the order of LINES, have the
+    given readings in arc seconds, at least 3 each. metric is true if
+    foot_spacing is in mm, false if it is in inches; with least_squares
+    the lines are adjusted together as with -l.
+
+    Returns (sheets, summary). sheets[i] holds Moody's worksheet of line
+    i, as a (columns, stations) float32 array with NumPy (else a flat
+    array.array of the columns one after the other): columns 1 to 8,
+    and column 6a as a ninth for the center lines, over num_dat+1
+    stations. Column 8 is the height, in microns for a metric plate or
+    1/100,000 inch otherwise. out, if given, is eight such buffers to
+    fill instead. summary is a dict of the flatness, the two center
+    heights, the warnings (a list of WARNINGS texts) and the residuals.
+    """
+    lib = _library()
+    if len(readings) != 8:
+        raise MoodyError("a plate has eight lines, not %d" % len(readings))
+    inputs = [_floats(r, False) for r in readings]
+    num_dat = (ctypes.c_int * 8)(*[n for _, n, _ in inputs])
+    if out is None:
+        out = [_sheet(9 if i > 5 else 8, num_dat[i] + 1) for i in range(8)]
+    if len(out) != 8:
+        raise MoodyError("out must have eight buffers, not %d" % len(out))
+    outputs = [_floats(o, True) for o in out]
+    for i, (_, n, _) in enumerate(outputs):
+        if n < lib.moody_sheet_size(i, num_dat[i]):
+            raise MoodyError("out[%d] has room for %d values, not %d"
+                             % (i, n, lib.moody_sheet_size(i, num_dat[i])))
+
+    summary = _Summary()
+    ret = lib.moody_compute(1 if metric else 0, foot_spacing, LEAST_SQUARES if least_squares else 0,
+                            num_dat,
+                            (ctypes.c_void_p * 8)(*[a for a, _, _ in inputs]),
+                            (ctypes.c_void_p * 8)(*[a for a, _, _ in outputs]),
+                            ctypes.byref(summary))
+    if ret == _EINVAL:
+        raise MoodyError("invalid plate: every line needs at least 3 readings, and a positive foot spacing")
+    if ret == _ENOMEM:
+        raise MemoryError("libmoody is out of memory, or the adjustment is singular")
+    return out, {
+        "flatness": summary.flatness,
+        "center": (summary.center[0], summary.center[1]),
+        "warnings": [text for flag, text in sorted(WARNINGS.items()) if summary.warnings & flag],
+        "rms_residual": summary.rms_residual,
+        "max_residual": summary.max_residual,
+    }